@@ -123,6 +123,12 @@ unsigned nb_output_dumped = 0;
 
 static BenchmarkTimeStamps current_time;
 AVIOContext *progress_avio = NULL;
+AVIOContext *stats_json_avio = NULL;
+AVIOContext *stats_events_avio = NULL;
+
+// -stats_events is written to from the main and the muxing threads
+static pthread_mutex_t stats_events_lock = PTHREAD_MUTEX_INITIALIZER;
+static int64_t stats_events_start;
 
 InputFile   **input_files   = NULL;
 int        nb_input_files   = 0;
@@ -369,6 +375,22 @@ static void ffmpeg_cleanup(int ret)
     for (i = 0; i < nb_input_files; i++)
         ifile_close(&input_files[i]);
 
+    seg_uninit();
+
+    if (stats_json_avio) {
+        if ((ret = avio_closep(&stats_json_avio)) < 0)
+            av_log(NULL, AV_LOG_ERROR,
+                   "Error closing stats JSON, loss of information possible: %s\n",
+                   av_err2str(ret));
+    }
+
+    if (stats_events_avio) {
+        if ((ret = avio_closep(&stats_events_avio)) < 0)
+            av_log(NULL, AV_LOG_ERROR,
+                   "Error closing stats events, loss of information possible: %s\n",
+                   av_err2str(ret));
+    }
+
     if (vstats_file) {
         if (fclose(vstats_file))
             av_log(NULL, AV_LOG_ERROR,
@@ -489,10 +511,287 @@ void update_benchmark(const char *fmt, ...)
     }
 }
 
+void stage_start(StageStats *s)
+{
+    if (stats_json_avio)
+        atomic_store(&s->start, av_gettime_relative());
+}
+
+void stage_end(StageStats *s)
+{
+    if (stats_json_avio)
+        atomic_store(&s->end, av_gettime_relative());
+}
+
+int64_t stage_wait_start(void)
+{
+    return stats_json_avio ? av_gettime_relative() : 0;
+}
+
+void stage_wait_end(atomic_int_least64_t *wait, int64_t start)
+{
+    if (start)
+        atomic_fetch_add(wait, av_gettime_relative() - start);
+}
+
+void latency_update(LatencyStats *l, int64_t wallclock)
+{
+    int64_t latency;
+
+    if (!stats_json_avio || !wallclock)
+        return;
+
+    latency = av_gettime_relative() - wallclock;
+
+    // only updated from the muxing thread
+    atomic_fetch_add(&l->nb,  1);
+    atomic_fetch_add(&l->sum, latency);
+    if (latency > atomic_load(&l->max))
+        atomic_store(&l->max, latency);
+}
+
+static void print_depth_hist_json(AVBPrint *bp, const char *key,
+                                  const TQDepthHist *hist)
+{
+    av_bprintf(bp, ",\"%s\":[", key);
+    for (int i = 0; i < TQ_DEPTH_HIST_SIZE; i++)
+        av_bprintf(bp, "%s%"PRIu64, i ? "," : "", (uint64_t)atomic_load(&hist->count[i]));
+    av_bprint_chars(bp, ']', 1);
+}
+
+static void print_stage_json(AVBPrint *bp, int *nb_stages, const char *type,
+                             const char *name, const StageStats *s,
+                             int64_t cur_time)
+{
+    int64_t start = atomic_load(&s->start);
+    int64_t end   = atomic_load(&s->end);
+    int64_t wait_in  = atomic_load(&s->wait_in);
+    int64_t wait_out = atomic_load(&s->wait_out);
+    int64_t wall;
+
+    // no thread was run for this stage
+    if (!start)
+        return;
+
+    // cur_time may have been taken before the thread started
+    wall = FFMAX((end ? end : cur_time) - start, 0);
+
+    av_bprintf(bp, "%s{\"type\":\"%s\",\"name\":\"%s\",\"running\":%d,"
+               "\"wall_us\":%"PRId64",\"busy_us\":%"PRId64","
+               "\"wait_in_us\":%"PRId64",\"wait_out_us\":%"PRId64,
+               (*nb_stages)++ ? "," : "", type, name, !end,
+               wall, FFMAX(wall - wait_in - wait_out, 0), wait_in, wait_out);
+    print_depth_hist_json(bp, "depth_in",  &s->depth_in);
+    print_depth_hist_json(bp, "depth_out", &s->depth_out);
+    av_bprint_chars(bp, '}', 1);
+}
+
+/* Write a line of JSON with the time spent by each thread, the depths of the
+ * queues between them and the latency of each output stream. */
+static void print_stats_json(int64_t timer_start, int64_t cur_time)
+{
+    AVBPrint bp;
+    char name[64];
+    int nb = 0;
+
+    av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
+
+    av_bprintf(&bp, "{\"time_us\":%"PRId64",\"stages\":[", cur_time - timer_start);
+
+    for (int i = 0; i < nb_input_files; i++) {
+        InputFile *f = input_files[i];
+
+        snprintf(name, sizeof(name), "in#%d", f->index);
+        print_stage_json(&bp, &nb, "demux", name, &f->stage, cur_time);
+
+        for (int j = 0; j < f->nb_streams; j++) {
+            InputStream *ist = f->streams[j];
+            snprintf(name, sizeof(name), "in#%d:%d", f->index, ist->index);
+            print_stage_json(&bp, &nb, "decode", name, &ist->stage, cur_time);
+        }
+    }
+
+    for (int i = 0; i < nb_filtergraphs; i++) {
+        snprintf(name, sizeof(name), "fg#%d", i);
+        print_stage_json(&bp, &nb, "filter", name, &filtergraphs[i]->stage, cur_time);
+    }
+
+    for (int i = 0; i < nb_output_files; i++) {
+        OutputFile *of = output_files[i];
+
+        for (int j = 0; j < of->nb_streams; j++) {
+            OutputStream *ost = of->streams[j];
+            snprintf(name, sizeof(name), "out#%d:%d", of->index, ost->index);
+            print_stage_json(&bp, &nb, "encode", name, &ost->stage, cur_time);
+        }
+
+        snprintf(name, sizeof(name), "out#%d", of->index);
+        print_stage_json(&bp, &nb, "mux", name, &of->stage, cur_time);
+    }
+
+    av_bprintf(&bp, "],\"sync_queues\":[");
+    nb = 0;
+    for (int i = 0; i < nb_output_files; i++) {
+        OutputFile *of = output_files[i];
+
+        av_bprintf(&bp, "%s{\"name\":\"out#%d\"", nb++ ? "," : "", of->index);
+        print_depth_hist_json(&bp, "encode_depth", &of->sq_encode_depth);
+        print_depth_hist_json(&bp, "mux_depth",    &of->sq_mux_depth);
+        av_bprint_chars(&bp, '}', 1);
+    }
+
+    av_bprintf(&bp, "],\"latency\":[");
+    nb = 0;
+    for (OutputStream *ost = ost_iter(NULL); ost; ost = ost_iter(ost)) {
+        uint64_t frames = atomic_load(&ost->latency.nb);
+
+        av_bprintf(&bp, "%s{\"name\":\"out#%d:%d\",\"frames\":%"PRIu64","
+                   "\"avg_us\":%"PRId64",\"max_us\":%"PRId64"}",
+                   nb++ ? "," : "", ost->file_index, ost->index, frames,
+                   frames ? (int64_t)(atomic_load(&ost->latency.sum) / frames) : 0,
+                   (int64_t)atomic_load(&ost->latency.max));
+    }
+
+    av_bprintf(&bp, "]}\n");
+
+    if (av_bprint_is_complete(&bp)) {
+        avio_write(stats_json_avio, bp.str, bp.len);
+        avio_flush(stats_json_avio);
+    }
+    av_bprint_finalize(&bp, NULL);
+}
+
+static void stats_event_write(AVBPrint *bp)
+{
+    if (!av_bprint_is_complete(bp))
+        return;
+
+    pthread_mutex_lock(&stats_events_lock);
+    avio_write(stats_events_avio, bp->str, bp->len);
+    avio_flush(stats_events_avio);
+    pthread_mutex_unlock(&stats_events_lock);
+}
+
+void stats_event_keyframe(const OutputStream *ost, const AVPacket *pkt)
+{
+    AVBPrint bp;
+
+    av_bprint_init(&bp, 0, AV_BPRINT_SIZE_AUTOMATIC);
+    av_bprintf(&bp, "{\"event\":\"keyframe\",\"time_us\":%"PRId64","
+               "\"stream\":\"out#%d:%d\",\"pts_us\":",
+               av_gettime_relative() - stats_events_start,
+               ost->file_index, ost->index);
+    if (pkt->pts == AV_NOPTS_VALUE)
+        av_bprintf(&bp, "null");
+    else
+        av_bprintf(&bp, "%"PRId64, av_rescale_q(pkt->pts, pkt->time_base, AV_TIME_BASE_Q));
+    av_bprintf(&bp, ",\"size\":%d,\"packets\":%"PRIu64",\"keyframes\":%"PRIu64"}\n",
+               pkt->size, (uint64_t)atomic_load(&ost->packets_written),
+               (uint64_t)atomic_load(&ost->keyframes_written));
+
+    stats_event_write(&bp);
+    av_bprint_finalize(&bp, NULL);
+}
+
+static void print_queue_depth_event(AVBPrint *bp, int *nb, const char *name,
+                                    const TQDepthHist *hist)
+{
+    av_bprintf(bp, "%s{\"name\":\"%s\",\"depth\":%zu}", (*nb)++ ? "," : "",
+               name, (size_t)atomic_load(&hist->cur));
+}
+
+/* Write a progress event, with the counters that print_report() shows and
+ * those of each output stream, as well as the current depth of the queues
+ * between the threads. */
+static void print_progress_event(int is_last_report, int64_t elapsed,
+                                 int64_t total_size, int64_t pts)
+{
+    uint64_t frames = 0, dup = 0, drop = 0;
+    int have_video = 0;
+    char name[64];
+    AVBPrint bp;
+    int nb = 0;
+
+    av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
+
+    av_bprintf(&bp, "{\"event\":\"%s\",\"time_us\":%"PRId64",\"streams\":[",
+               is_last_report ? "end" : "progress", elapsed);
+    for (OutputStream *ost = ost_iter(NULL); ost; ost = ost_iter(ost)) {
+        uint64_t packets = atomic_load(&ost->packets_written);
+
+        if (!have_video && ost->type == AVMEDIA_TYPE_VIDEO) {
+            frames = packets;
+            dup    = atomic_load(&ost->nb_frames_dup);
+            drop   = atomic_load(&ost->nb_frames_drop) +
+                     (is_last_report ? atomic_load(&ost->last_dropped) : 0);
+            have_video = 1;
+        }
+
+        av_bprintf(&bp, "%s{\"name\":\"out#%d:%d\",\"type\":\"%s\",\"packets\":%"PRIu64,
+                   nb++ ? "," : "", ost->file_index, ost->index,
+                   av_get_media_type_string(ost->type), packets);
+        if (ost->type == AVMEDIA_TYPE_VIDEO)
+            av_bprintf(&bp, ",\"keyframes\":%"PRIu64",\"q\":%d",
+                       (uint64_t)atomic_load(&ost->keyframes_written),
+                       ost->enc ? atomic_load(&ost->quality) / FF_QP2LAMBDA : -1);
+        av_bprint_chars(&bp, '}', 1);
+    }
+
+    av_bprintf(&bp, "],\"frames\":%"PRIu64",\"fps\":%.2f,\"dup\":%"PRIu64
+               ",\"drop\":%"PRIu64",\"size\":%"PRId64,
+               frames, elapsed > 0 ? frames * (double)AV_TIME_BASE / elapsed : 0.0,
+               dup, drop, total_size);
+    if (pts != AV_NOPTS_VALUE && pts > 0)
+        av_bprintf(&bp, ",\"out_time_us\":%"PRId64",\"bitrate\":%"PRId64",\"speed\":%.3f",
+                   pts, total_size >= 0 ? av_rescale(total_size, 8 * AV_TIME_BASE, pts) : -1,
+                   elapsed > 0 ? (double)pts / elapsed : 0.0);
+
+    av_bprintf(&bp, ",\"queues\":[");
+    nb = 0;
+    for (int i = 0; i < nb_input_files; i++) {
+        InputFile *f = input_files[i];
+
+        snprintf(name, sizeof(name), "in#%d", f->index);
+        print_queue_depth_event(&bp, &nb, name, &f->stage.depth_out);
+
+        for (int j = 0; j < f->nb_streams; j++) {
+            InputStream *ist = f->streams[j];
+
+            if (!ist->decoding_needed)
+                continue;
+            snprintf(name, sizeof(name), "in#%d:%d", f->index, ist->index);
+            print_queue_depth_event(&bp, &nb, name, &ist->stage.depth_in);
+        }
+    }
+    for (int i = 0; i < nb_filtergraphs; i++) {
+        snprintf(name, sizeof(name), "fg#%d", i);
+        print_queue_depth_event(&bp, &nb, name, &filtergraphs[i]->stage.depth_in);
+    }
+    for (int i = 0; i < nb_output_files; i++) {
+        OutputFile *of = output_files[i];
+
+        for (int j = 0; j < of->nb_streams; j++) {
+            OutputStream *ost = of->streams[j];
+
+            if (!ost->enc_ctx)
+                continue;
+            snprintf(name, sizeof(name), "out#%d:%d", of->index, ost->index);
+            print_queue_depth_event(&bp, &nb, name, &ost->stage.depth_in);
+        }
+
+        snprintf(name, sizeof(name), "out#%d", of->index);
+        print_queue_depth_event(&bp, &nb, name, &of->stage.depth_in);
+    }
+    av_bprintf(&bp, "]}\n");
+
+    stats_event_write(&bp);
+    av_bprint_finalize(&bp, NULL);
+}
+
 void close_output_stream(OutputStream *ost)
 {
     OutputFile *of = output_files[ost->file_index];
-    ost->finished |= ENCODER_FINISHED;
+    atomic_fetch_or(&ost->finished, ENCODER_FINISHED);
 
     if (ost->sq_idx_encode >= 0)
         sq_send(of->sq_encode, ost->sq_idx_encode, SQFRAME(NULL));
@@ -505,7 +804,7 @@ static void print_report(int is_last_report, int64_t timer_start, int64_t cur_ti
     int vid;
     double bitrate;
     double speed;
-    int64_t pts = AV_NOPTS_VALUE;
+    int64_t pts = AV_NOPTS_VALUE, last_mux_dts;
     static int64_t last_time = -1;
     static int first_report = 1;
     uint64_t nb_frames_dup = 0, nb_frames_drop = 0;
@@ -515,7 +814,8 @@ static void print_report(int is_last_report, int64_t timer_start, int64_t cur_ti
     int ret;
     float t;
 
-    if (!print_stats && !is_last_report && !progress_avio)
+    if (!print_stats && !is_last_report && !progress_avio && !stats_json_avio &&
+        !stats_events_avio)
         return;
 
     if (!is_last_report) {
@@ -534,7 +834,7 @@ static void print_report(int is_last_report, int64_t timer_start, int64_t cur_ti
     av_bprint_init(&buf, 0, AV_BPRINT_SIZE_AUTOMATIC);
     av_bprint_init(&buf_script, 0, AV_BPRINT_SIZE_AUTOMATIC);
     for (OutputStream *ost = ost_iter(NULL); ost; ost = ost_iter(ost)) {
-        const float q = ost->enc ? ost->quality / (float) FF_QP2LAMBDA : -1;
+        const float q = ost->enc ? atomic_load(&ost->quality) / (float) FF_QP2LAMBDA : -1;
 
         if (vid && ost->type == AVMEDIA_TYPE_VIDEO) {
             av_bprintf(&buf, "q=%2.1f ", q);
@@ -555,15 +855,16 @@ static void print_report(int is_last_report, int64_t timer_start, int64_t cur_ti
             if (is_last_report)
                 av_bprintf(&buf, "L");
 
-            nb_frames_dup  = ost->nb_frames_dup;
-            nb_frames_drop = ost->nb_frames_drop;
+            nb_frames_dup  = atomic_load(&ost->nb_frames_dup);
+            nb_frames_drop = atomic_load(&ost->nb_frames_drop);
 
             vid = 1;
         }
         /* compute min output value */
-        if (ost->last_mux_dts != AV_NOPTS_VALUE) {
-            if (pts == AV_NOPTS_VALUE || ost->last_mux_dts > pts)
-                pts = ost->last_mux_dts;
+        last_mux_dts = atomic_load(&ost->last_mux_dts);
+        if (last_mux_dts != AV_NOPTS_VALUE) {
+            if (pts == AV_NOPTS_VALUE || last_mux_dts > pts)
+                pts = last_mux_dts;
             if (copy_ts) {
                 if (copy_ts_first_pts == AV_NOPTS_VALUE && pts > 1)
                     copy_ts_first_pts = pts;
@@ -573,7 +874,20 @@ static void print_report(int is_last_report, int64_t timer_start, int64_t cur_ti
         }
 
         if (is_last_report)
-            nb_frames_drop += ost->last_dropped;
+            nb_frames_drop += atomic_load(&ost->last_dropped);
+    }
+
+    if (stats_events_avio)
+        print_progress_event(is_last_report, cur_time - timer_start, total_size, pts);
+    if (stats_json_avio)
+        print_stats_json(timer_start, cur_time);
+
+    // nothing else wants the human-readable report
+    if (!print_stats && !is_last_report && !progress_avio) {
+        av_bprint_finalize(&buf, NULL);
+        av_bprint_finalize(&buf_script, NULL);
+        first_report = 0;
+        return;
     }
 
     us    = FFABS64U(pts) % AV_TIME_BASE;
@@ -945,28 +1259,41 @@ static int choose_output(OutputStream **post)
 {
     int64_t opts_min = INT64_MAX;
     OutputStream *ost_min = NULL;
+    int waiting = 0;
 
     for (OutputStream *ost = ost_iter(NULL); ost; ost = ost_iter(ost)) {
-        int64_t opts;
+        int64_t opts, last_pts = AV_NOPTS_VALUE;
+        int finished = atomic_load(&ost->finished);
+
+        if (ost->filter)
+            last_pts = atomic_load(&ost->filter->last_pts);
 
-        if (ost->filter && ost->filter->last_pts != AV_NOPTS_VALUE) {
-            opts = ost->filter->last_pts;
+        if (last_pts != AV_NOPTS_VALUE) {
+            opts = last_pts;
         } else {
-            opts = ost->last_mux_dts == AV_NOPTS_VALUE ?
-                   INT64_MIN : ost->last_mux_dts;
+            opts = atomic_load(&ost->last_mux_dts);
+            if (opts == AV_NOPTS_VALUE)
+                opts = INT64_MIN;
+        }
+
+        // the filtering thread is still working on this stream, but there
+        // is nothing we can do for it here
+        if (ost->inputs_done && !finished) {
+            waiting = 1;
+            continue;
         }
 
-        if (!ost->initialized && !ost->inputs_done && !ost->finished) {
+        if (!atomic_load(&ost->initialized) && !finished) {
             ost_min = ost;
             break;
         }
-        if (!ost->finished && opts < opts_min) {
+        if (!finished && opts < opts_min) {
             opts_min = opts;
             ost_min  = ost;
         }
     }
     if (!ost_min)
-        return AVERROR_EOF;
+        return waiting ? AVERROR(EAGAIN) : AVERROR_EOF;
     *post = ost_min;
     return ost_min->unavailable ? AVERROR(EAGAIN) : 0;
 }
@@ -985,7 +1312,7 @@ static void set_tty_echo(int on)
 
 static int check_keyboard_interaction(int64_t cur_time)
 {
-    int i, ret, key;
+    int i, key;
     static int64_t last_time;
     if (received_nb_signals)
         return AVERROR_EXIT;
@@ -1018,23 +1345,9 @@ static int check_keyboard_interaction(int64_t cur_time)
             (n = sscanf(buf, "%63[^ ] %lf %255[^ ] %255[^\n]", target, &time, command, arg)) >= 3) {
             av_log(NULL, AV_LOG_DEBUG, "Processing command target:%s time:%f command:%s arg:%s",
                    target, time, command, arg);
-            for (i = 0; i < nb_filtergraphs; i++) {
-                FilterGraph *fg = filtergraphs[i];
-                if (fg->graph) {
-                    if (time < 0) {
-                        ret = avfilter_graph_send_command(fg->graph, target, command, arg, buf, sizeof(buf),
-                                                          key == 'c' ? AVFILTER_CMD_FLAG_ONE : 0);
-                        fprintf(stderr, "Command reply for stream %d: ret:%d res:\n%s", i, ret, buf);
-                    } else if (key == 'c') {
-                        fprintf(stderr, "Queuing commands only on filters supporting the specific command is unsupported\n");
-                        ret = AVERROR_PATCHWELCOME;
-                    } else {
-                        ret = avfilter_graph_queue_command(fg->graph, target, command, arg, 0, time);
-                        if (ret < 0)
-                            fprintf(stderr, "Queuing command failed with error %s\n", av_err2str(ret));
-                    }
-                }
-            }
+            for (i = 0; i < nb_filtergraphs; i++)
+                fg_send_command(filtergraphs[i], time, target, command, arg,
+                                key == 'C');
         } else {
             av_log(NULL, AV_LOG_ERROR,
                    "Parse error, at least 3 arguments were expected, "
@@ -1175,18 +1488,7 @@ static int transcode_step(OutputStream *ost)
         return 0;
     }
 
-    if (ret < 0)
-        return ret == AVERROR_EOF ? 0 : ret;
-
-    // process_input() above might have caused output to become available
-    // in multiple filtergraphs, so we process all of them
-    for (int i = 0; i < nb_filtergraphs; i++) {
-        ret = reap_filters(filtergraphs[i], 0);
-        if (ret < 0)
-            return ret;
-    }
-
-    return 0;
+    return ret == AVERROR_EOF ? 0 : ret;
 }
 
 /*
@@ -1194,7 +1496,7 @@ static int transcode_step(OutputStream *ost)
  */
 static int transcode(int *err_rate_exceeded)
 {
-    int ret = 0, i;
+    int ret = 0, i, abort_request = 0;
     InputStream *ist;
     int64_t timer_start;
 
@@ -1203,11 +1505,18 @@ static int transcode(int *err_rate_exceeded)
     *err_rate_exceeded = 0;
     atomic_store(&transcode_init_done, 1);
 
+    for (i = 0; i < nb_filtergraphs; i++) {
+        ret = fg_thread_start(filtergraphs[i]);
+        if (ret < 0)
+            return ret;
+    }
+
     if (stdin_interaction) {
         av_log(NULL, AV_LOG_INFO, "Press [q] to stop, [?] for help\n");
     }
 
     timer_start = av_gettime_relative();
+    stats_events_start = timer_start;
 
     while (!received_sigterm) {
         OutputStream *ost;
@@ -1215,8 +1524,10 @@ static int transcode(int *err_rate_exceeded)
 
         /* if 'q' pressed, exits */
         if (stdin_interaction)
-            if (check_keyboard_interaction(cur_time) < 0)
+            if (check_keyboard_interaction(cur_time) < 0) {
+                abort_request = 1;
                 break;
+            }
 
         ret = choose_output(&ost);
         if (ret == AVERROR(EAGAIN)) {
@@ -1232,6 +1543,7 @@ static int transcode(int *err_rate_exceeded)
         ret = transcode_step(ost);
         if (ret < 0 && ret != AVERROR_EOF) {
             av_log(NULL, AV_LOG_ERROR, "Error while filtering: %s\n", av_err2str(ret));
+            abort_request = 1;
             break;
         }
 
@@ -1257,6 +1569,13 @@ static int transcode(int *err_rate_exceeded)
         } else if (err_rate)
             av_log(ist, AV_LOG_VERBOSE, "Decode error rate %g\n", err_rate);
     }
+
+    /* wait for the filtergraphs to drain, unless we are exiting early */
+    for (i = 0; i < nb_filtergraphs; i++) {
+        int err = fg_thread_stop(filtergraphs[i], abort_request || received_sigterm);
+        ret = err_merge(ret, err);
+    }
+
     ret = err_merge(ret, enc_flush());
 
     term_exit();
@@ -1356,6 +1675,8 @@ int main(int argc, char **argv)
 
     current_time = ti = get_benchmark_time_stamps();
     ret = transcode(&err_rate_exceeded);
+    if (ret >= 0 && !received_nb_signals)
+        ret = seg_concat();
     if (ret >= 0 && do_benchmark) {
         int64_t utime, stime, rtime;
         current_time = get_benchmark_time_stamps();
@@ -28,6 +28,7 @@
 
 #include "cmdutils.h"
 #include "sync_queue.h"
+#include "thread_queue.h"
 
 #include "libavformat/avformat.h"
 #include "libavformat/avio.h"
@@ -103,8 +104,32 @@ typedef struct DemuxPktData {
     // estimated dts in AV_TIME_BASE_Q,
     // to be used when real dts is missing
     int64_t dts_est;
+    // wallclock time the packet was demuxed at, only set with -stats_json
+    int64_t wallclock;
 } DemuxPktData;
 
+/* Time accounting for a processing thread, reported with -stats_json.
+ * Everything that is not waiting on a queue counts as busy. */
+typedef struct StageStats {
+    // wallclock time the thread started/finished at, 0 if it has not
+    atomic_int_least64_t start;
+    atomic_int_least64_t end;
+    // time spent waiting for input and for the next stage to accept output
+    atomic_int_least64_t wait_in;
+    atomic_int_least64_t wait_out;
+
+    // depth of the queues the thread receives from and sends to
+    TQDepthHist          depth_in;
+    TQDepthHist          depth_out;
+} StageStats;
+
+// latency from demuxing to muxing, reported with -stats_json
+typedef struct LatencyStats {
+    atomic_uint_least64_t nb;
+    atomic_int_least64_t  sum;
+    atomic_int_least64_t  max;
+} LatencyStats;
+
 typedef struct OptionsContext {
     OptionGroup *g;
 
@@ -139,8 +164,11 @@ typedef struct OptionsContext {
     double readrate_initial_burst;
     int accurate_seek;
     int thread_queue_size;
+    int64_t thread_queue_data_limit;
+    int64_t thread_queue_duration_limit;
     int input_sync_ref;
     int find_stream_info;
+    const char *probe_cache;
 
     SpecifierOpt *ts_scale;
     int        nb_ts_scale;
@@ -166,6 +194,8 @@ typedef struct OptionsContext {
     int       nb_attachments;
 
     int chapters_input_file;
+    /* with -parallel_segments, the only input file to map streams from */
+    int seg_input;
 
     int64_t recording_time;
     int64_t stop_time;
@@ -296,8 +326,9 @@ typedef struct OutputFilter {
 
     enum AVMediaType     type;
 
-    /* pts of the last frame received from this filter, in AV_TIME_BASE_Q */
-    int64_t last_pts;
+    /* pts of the last frame received from this filter, in AV_TIME_BASE_Q;
+     * written by the filtering thread */
+    atomic_int_least64_t last_pts;
 } OutputFilter;
 
 typedef struct FilterGraph {
@@ -310,6 +341,9 @@ typedef struct FilterGraph {
     int          nb_inputs;
     OutputFilter **outputs;
     int         nb_outputs;
+
+    // filtering thread
+    StageStats     stage;
 } FilterGraph;
 
 typedef struct Decoder Decoder;
@@ -380,6 +414,9 @@ typedef struct InputStream {
     uint64_t frames_decoded;
     uint64_t samples_decoded;
     uint64_t decode_errors;
+
+    // decoding thread
+    StageStats stage;
 } InputStream;
 
 typedef struct LastFrameDuration {
@@ -421,6 +458,9 @@ typedef struct InputFile {
      * the last frame duration back to the demuxer thread */
     AVThreadMessageQueue *audio_duration_queue;
     int                   audio_duration_queue_size;
+
+    // demuxing thread
+    StageStats stage;
 } InputFile;
 
 enum forced_keyframes_const {
@@ -521,7 +561,7 @@ typedef struct OutputStream {
 
     AVStream *st;            /* stream in the output file */
     /* dts of the last packet sent to the muxing queue, in AV_TIME_BASE_Q */
-    int64_t last_mux_dts;
+    atomic_int_least64_t last_mux_dts;
 
     // the timebase of the packets sent to the muxer
     AVRational mux_timebase;
@@ -530,9 +570,10 @@ typedef struct OutputStream {
     Encoder *enc;
     AVCodecContext *enc_ctx;
 
-    uint64_t nb_frames_dup;
-    uint64_t nb_frames_drop;
-    int64_t last_dropped;
+    /* written by the encoding thread, read by print_report() */
+    atomic_uint_least64_t nb_frames_dup;
+    atomic_uint_least64_t nb_frames_drop;
+    atomic_int last_dropped;
 
     /* video only */
     AVRational frame_rate;
@@ -570,14 +611,18 @@ typedef struct OutputStream {
     AVDictionary *sws_dict;
     AVDictionary *swr_opts;
     char *apad;
-    OSTFinished finished;        /* no more packets should be written for this stream */
+    /* no more packets should be written for this stream, a combination of
+     * OSTFinished flags; may be set from the filtering and encoding threads */
+    atomic_int finished;
     int unavailable;                     /* true if the steram is unavailable (possibly temporarily) */
 
     // init_output_stream() has been called for this stream
     // The encoder and the bitstream filters have been initialized and the stream
     // parameters are set in the AVStream.
-    int initialized;
+    atomic_int initialized;
 
+    // the main thread has nothing more to send to the filtergraph feeding
+    // this stream, it only waits for the graph to finish
     int inputs_done;
 
     const char *attachment_filename;
@@ -587,12 +632,18 @@ typedef struct OutputStream {
     /* stats */
     // number of packets send to the muxer
     atomic_uint_least64_t packets_written;
+    // number of video keyframes sent to the muxer
+    atomic_uint_least64_t keyframes_written;
     // number of frames/samples sent to the encoder
     uint64_t frames_encoded;
     uint64_t samples_encoded;
+    // number of packet buffers that could not be taken from the pools
+    // reused with AV_CODEC_CAP_DR1 encoders; packets of other encoders
+    // are allocated by libavcodec and not counted
+    atomic_uint_least64_t pool_misses;
 
-    /* packet quality factor */
-    int quality;
+    /* packet quality factor, read by print_report() */
+    atomic_int quality;
 
     int sq_idx_encode;
     int sq_idx_mux;
@@ -600,6 +651,10 @@ typedef struct OutputStream {
     EncStats enc_stats_pre;
     EncStats enc_stats_post;
 
+    // encoding thread
+    StageStats   stage;
+    LatencyStats latency;
+
     /*
      * bool on whether this stream should be utilized for splitting
      * subtitles utilizing fix_sub_duration at random access points.
@@ -625,6 +680,11 @@ typedef struct OutputFile {
 
     int shortest;
     int bitexact;
+
+    // muxing thread
+    StageStats  stage;
+    TQDepthHist sq_encode_depth;
+    TQDepthHist sq_mux_depth;
 } OutputFile;
 
 // optionally attached as opaque_ref to decoded AVFrames
@@ -640,6 +700,9 @@ typedef struct FrameData {
     AVRational frame_rate_filter;
 
     int        bits_per_raw_sample;
+
+    // wallclock time the source packet was demuxed at, 0 if unknown
+    int64_t    wallclock_demux;
 } FrameData;
 
 extern InputFile   **input_files;
@@ -673,6 +736,8 @@ extern int print_stats;
 extern int64_t stats_period;
 extern int stdin_interaction;
 extern AVIOContext *progress_avio;
+extern AVIOContext *stats_json_avio;
+extern AVIOContext *stats_events_avio;
 extern float max_error_rate;
 
 extern char *filter_nbthreads;
@@ -692,6 +757,8 @@ extern int copy_unknown_streams;
 
 extern int recast_media;
 
+extern int parallel_segments;
+
 extern FILE *vstats_file;
 
 #if FFMPEG_OPT_PSNR
@@ -755,6 +822,9 @@ void fg_free(FilterGraph **pfg);
 /**
  * Perform a step of transcoding for the specified filter graph.
  *
+ * For graphs running in their own thread this only picks the input the
+ * thread last asked for, otherwise the graph is run on the calling thread.
+ *
  * @param[in]  graph     filter graph to consider
  * @param[out] best_ist  input stream where a frame would allow to continue
  * @return  0 for success, <0 for error
@@ -762,12 +832,30 @@ void fg_free(FilterGraph **pfg);
 int fg_transcode_step(FilterGraph *graph, InputStream **best_ist);
 
 /**
- * Get and encode new output from specified filtergraph, without causing
- * activity.
+ * Start the filtering thread for a filtergraph. Must be called once the graph
+ * is bound to all its outputs, before any frames are sent to it. Graphs with
+ * outputs that need to stay in sync with subtitle decoding keep running on
+ * the main thread.
+ */
+int fg_thread_start(FilterGraph *fg);
+
+/**
+ * Send EOF on all inputs that are not finished yet and wait for the
+ * filtering thread to terminate.
  *
- * @return  0 for success, <0 for severe errors
+ * @param abort_request make the thread return as soon as possible, discarding any
+ *                      data still buffered in the graph
+ * @return the error the thread failed with, 0 otherwise
  */
-int reap_filters(FilterGraph *fg, int flush);
+int fg_thread_stop(FilterGraph *fg, int abort_request);
+
+/**
+ * Send a command to all the filters in a filtergraph matching target, see
+ * avfilter_graph_send_command(). A negative time sends the command
+ * immediately, otherwise it is queued for the given time.
+ */
+void fg_send_command(FilterGraph *fg, double time, const char *target,
+                     const char *command, const char *arg, int all_filters);
 
 int ffmpeg_parse_options(int argc, char **argv);
 
@@ -839,6 +927,29 @@ int64_t of_filesize(OutputFile *of);
 int ifile_open(const OptionsContext *o, const char *filename);
 void ifile_close(InputFile **f);
 
+/**
+ * Split the input into up to parallel_segments segments starting at
+ * keyframes, to be transcoded in parallel into temporary files and then
+ * concatenated into the output with seg_concat().
+ *
+ * @return the number of segments or a negative error code
+ */
+int  seg_init(const char *in_url, const AVInputFormat *ifmt,
+              const AVDictionary *in_opts, const char *url);
+/**
+ * Set the format and the options of the output the segments are
+ * concatenated into.
+ */
+int  seg_set_output(const AVOutputFormat *ofmt, const AVDictionary *opts);
+/**
+ * Get the input -ss and -to options of a segment and the url of its
+ * temporary output file.
+ */
+void seg_get(int idx, int64_t *start_time, int64_t *stop_time, const char **url);
+int  seg_concat(void);
+/* also removes the temporary files */
+void seg_uninit(void);
+
 /**
  * Get next input packet from the demuxer.
  *
@@ -872,6 +983,19 @@ int trigger_fix_sub_duration_heartbeat(OutputStream *ost, const AVPacket *pkt);
 int fix_sub_duration_heartbeat(InputStream *ist, int64_t signal_pts);
 void update_benchmark(const char *fmt, ...);
 
+/* Per-stage statistics for -stats_json; they do nothing without it.
+ * stage_wait_start() returns a timestamp to pass to stage_wait_end(),
+ * which adds the time elapsed since to *wait. */
+void    stage_start(StageStats *s);
+void    stage_end(StageStats *s);
+int64_t stage_wait_start(void);
+void    stage_wait_end(atomic_int_least64_t *wait, int64_t start);
+void    latency_update(LatencyStats *l, int64_t wallclock);
+
+/* Push a keyframe event to -stats_events, called by the muxing threads for
+ * each video keyframe, before it is sent to the muxer. */
+void stats_event_keyframe(const OutputStream *ost, const AVPacket *pkt);
+
 /**
  * Merge two return codes - return one of the error codes if at least one of
  * them was negative, 0 otherwise.
@@ -942,4 +1066,20 @@ static inline void frame_move(void *dst, void *src)
     av_frame_move_ref(dst, src);
 }
 
+/* maximum number of packets the demuxing and muxing thread queues grow to */
+#define THREAD_QUEUE_MAX_PACKETS 1024
+
+static inline size_t pkt_data_size(void *obj)
+{
+    const AVPacket *pkt = obj;
+    return pkt->size;
+}
+
+static inline int64_t pkt_duration_us(void *obj)
+{
+    const AVPacket *pkt = obj;
+    return pkt->time_base.num > 0 && pkt->duration > 0 ?
+           av_rescale_q(pkt->duration, pkt->time_base, AV_TIME_BASE_Q) : 0;
+}
+
 #endif /* FFTOOLS_FFMPEG_H */
@@ -470,10 +470,21 @@ int fix_sub_duration_heartbeat(InputStream *ist, int64_t signal_pts)
     return process_subtitle(ist, d->sub_heartbeat);
 }
 
+static int send_frame_out(InputStream *ist, AVFrame *frame)
+{
+    Decoder *d = ist->decoder;
+    int64_t wait_start = stage_wait_start();
+    int ret;
+
+    ret = tq_send(d->queue_out, 0, frame);
+    stage_wait_end(&ist->stage.wait_out, wait_start);
+
+    return ret;
+}
+
 static int transcode_subtitles(InputStream *ist, const AVPacket *pkt,
                                AVFrame *frame)
 {
-    Decoder          *d = ist->decoder;
     AVPacket *flush_pkt = NULL;
     AVSubtitle subtitle;
     int got_output;
@@ -514,7 +525,7 @@ static int transcode_subtitles(InputStream *ist, const AVPacket *pkt,
     frame->width  = ist->dec_ctx->width;
     frame->height = ist->dec_ctx->height;
 
-    ret = tq_send(d->queue_out, 0, frame);
+    ret = send_frame_out(ist, frame);
     if (ret < 0)
         av_frame_unref(frame);
 
@@ -538,7 +549,6 @@ static int send_filter_eof(InputStream *ist)
 
 static int packet_decode(InputStream *ist, const AVPacket *pkt, AVFrame *frame)
 {
-    Decoder *d = ist->decoder;
     AVCodecContext *dec = ist->dec_ctx;
     const char *type_desc = av_get_media_type_string(dec->codec_type);
     int ret;
@@ -575,6 +585,7 @@ static int packet_decode(InputStream *ist, const AVPacket *pkt, AVFrame *frame)
 
     while (1) {
         FrameData *fd;
+        int64_t demux_wallclock = 0;
 
         av_frame_unref(frame);
 
@@ -606,7 +617,13 @@ static int packet_decode(InputStream *ist, const AVPacket *pkt, AVFrame *frame)
         }
 
 
-        av_assert0(!frame->opaque_ref);
+        // with -stats_json, the decoder passes through the demuxer
+        // packet data to get the wallclock time the frame was demuxed at
+        if (frame->opaque_ref) {
+            demux_wallclock = ((DemuxPktData*)frame->opaque_ref->data)->wallclock;
+            av_buffer_unref(&frame->opaque_ref);
+        }
+
         fd      = frame_data(frame);
         if (!fd) {
             av_frame_unref(frame);
@@ -616,6 +633,7 @@ static int packet_decode(InputStream *ist, const AVPacket *pkt, AVFrame *frame)
         fd->dec.tb                  = dec->pkt_timebase;
         fd->dec.frame_num           = dec->frame_num - 1;
         fd->bits_per_raw_sample     = dec->bits_per_raw_sample;
+        fd->wallclock_demux         = demux_wallclock;
 
         frame->time_base = dec->pkt_timebase;
 
@@ -635,7 +653,7 @@ static int packet_decode(InputStream *ist, const AVPacket *pkt, AVFrame *frame)
 
         ist->frames_decoded++;
 
-        ret = tq_send(d->queue_out, 0, frame);
+        ret = send_frame_out(ist, frame);
         if (ret < 0)
             return ret;
     }
@@ -690,10 +708,14 @@ static void *decoder_thread(void *arg)
 
     dec_thread_set_name(ist);
 
+    stage_start(&ist->stage);
+
     while (!input_status) {
         int dummy, flush_buffers;
+        int64_t wait_start = stage_wait_start();
 
         input_status = tq_receive(d->queue_in, &dummy, dt.pkt);
+        stage_wait_end(&ist->stage.wait_in, wait_start);
         flush_buffers = input_status >= 0 && !dt.pkt->buf;
         if (!dt.pkt->buf)
             av_log(ist, AV_LOG_VERBOSE, "Decoder thread received %s packet\n",
@@ -731,7 +753,7 @@ static void *decoder_thread(void *arg)
         }
 
         // signal to the consumer thread that the entire packet was processed
-        ret = tq_send(d->queue_out, 0, dt.frame);
+        ret = send_frame_out(ist, dt.frame);
         if (ret < 0) {
             if (ret != AVERROR_EOF)
                 av_log(ist, AV_LOG_ERROR, "Error communicating with the main thread\n");
@@ -744,6 +766,8 @@ static void *decoder_thread(void *arg)
         ret = 0;
 
 finish:
+    stage_end(&ist->stage);
+
     tq_receive_finish(d->queue_in,  0);
     tq_send_finish   (d->queue_out, 0);
 
@@ -858,6 +882,11 @@ static int dec_thread_start(InputStream *ist)
         goto fail;
     }
 
+    if (stats_json_avio || stats_events_avio) {
+        tq_set_depth_hist(d->queue_in,  &ist->stage.depth_in);
+        tq_set_depth_hist(d->queue_out, &ist->stage.depth_out);
+    }
+
     ret = pthread_create(&d->thread, NULL, decoder_thread, ist);
     if (ret) {
         ret = AVERROR(ret);
@@ -1089,6 +1118,12 @@ int dec_open(InputStream *ist)
     ist->dec_ctx->opaque                = ist;
     ist->dec_ctx->get_format            = get_format;
 
+    if (stats_json_avio) {
+        ret = av_dict_set(&ist->decoder_opts, "flags", "+copy_opaque", AV_DICT_MULTIKEY);
+        if (ret < 0)
+            return ret;
+    }
+
     if (ist->dec_ctx->codec_id == AV_CODEC_ID_DVB_SUBTITLE &&
        (ist->decoding_needed & DECODING_FOR_OST)) {
         av_dict_set(&ist->decoder_opts, "compute_edt", "1", AV_DICT_DONT_OVERWRITE);
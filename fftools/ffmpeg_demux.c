@@ -20,6 +20,9 @@
 #include <stdint.h>
 
 #include "ffmpeg.h"
+#include "objpool.h"
+#include "probe_cache.h"
+#include "thread_queue.h"
 
 #include "libavutil/avassert.h"
 #include "libavutil/avstring.h"
@@ -109,18 +112,26 @@ typedef struct Demuxer {
 
     double readrate_initial_burst;
 
-    AVThreadMessageQueue *in_thread_queue;
+    ThreadQueue          *queue;
     int                   thread_queue_size;
+    int64_t               thread_queue_data_limit;
+    int64_t               thread_queue_duration_limit;
     pthread_t             thread;
     int                   non_blocking;
+    // error the demuxing thread terminated with, valid once the queue is finished
+    int                   thread_ret;
+    AVPacket             *pkt_recv;
 
     int                   read_started;
 } Demuxer;
 
-typedef struct DemuxMsg {
-    AVPacket *pkt;
-    int looping;
-} DemuxMsg;
+/* streams of the queue from the demuxing thread */
+enum {
+    DEMUX_QUEUE_PACKETS,
+    // an empty packet is sent here when the input loops
+    DEMUX_QUEUE_LOOP,
+    DEMUX_QUEUE_NB,
+};
 
 static DemuxStream *ds_from_ist(InputStream *ist)
 {
@@ -367,7 +378,7 @@ static int ist_dts_update(DemuxStream *ds, AVPacket *pkt)
     }
 
     av_assert0(!pkt->opaque_ref);
-    if (ds->streamcopy_needed) {
+    if (ds->streamcopy_needed || stats_json_avio) {
         DemuxPktData *pd;
 
         pkt->opaque_ref = av_buffer_allocz(sizeof(*pd));
@@ -376,6 +387,8 @@ static int ist_dts_update(DemuxStream *ds, AVPacket *pkt)
         pd = (DemuxPktData*)pkt->opaque_ref->data;
 
         pd->dts_est = ds->dts;
+        if (stats_json_avio)
+            pd->wallclock = av_gettime_relative();
     }
 
     return 0;
@@ -456,26 +469,17 @@ static int ts_fixup(Demuxer *d, AVPacket *pkt)
     return 0;
 }
 
-// process an input packet into a message to send to the consumer thread
-// src is always cleared by this function
-static int input_packet_process(Demuxer *d, DemuxMsg *msg, AVPacket *src)
+// process an input packet before sending it to the consumer thread
+static int input_packet_process(Demuxer *d, AVPacket *pkt)
 {
     InputFile     *f = &d->f;
-    InputStream *ist = f->streams[src->stream_index];
+    InputStream *ist = f->streams[pkt->stream_index];
     DemuxStream  *ds = ds_from_ist(ist);
-    AVPacket *pkt;
     int ret = 0;
 
-    pkt = av_packet_alloc();
-    if (!pkt) {
-        av_packet_unref(src);
-        return AVERROR(ENOMEM);
-    }
-    av_packet_move_ref(pkt, src);
-
     ret = ts_fixup(d, pkt);
     if (ret < 0)
-        goto fail;
+        return ret;
 
     ds->data_size += pkt->size;
     ds->nb_packets++;
@@ -493,10 +497,8 @@ static int input_packet_process(Demuxer *d, DemuxMsg *msg, AVPacket *src)
                 continue;
 
             dst_data = av_packet_new_side_data(pkt, src_sd->type, src_sd->size);
-            if (!dst_data) {
-                ret = AVERROR(ENOMEM);
-                goto fail;
-            }
+            if (!dst_data)
+                return AVERROR(ENOMEM);
 
             memcpy(dst_data, src_sd->data, src_sd->size);
         }
@@ -513,13 +515,7 @@ static int input_packet_process(Demuxer *d, DemuxMsg *msg, AVPacket *src)
                av_ts2timestr(input_files[ist->file_index]->ts_offset, &AV_TIME_BASE_Q));
     }
 
-    msg->pkt = pkt;
-    pkt      = NULL;
-
-fail:
-    av_packet_free(&pkt);
-
-    return ret;
+    return 0;
 }
 
 static void readrate_sleep(Demuxer *d)
@@ -569,7 +565,7 @@ static void *input_thread(void *arg)
     Demuxer   *d = arg;
     InputFile *f = &d->f;
     AVPacket *pkt;
-    unsigned flags = d->non_blocking ? AV_THREAD_MESSAGE_NONBLOCK : 0;
+    int non_blocking = d->non_blocking;
     int ret = 0;
 
     pkt = av_packet_alloc();
@@ -584,8 +580,10 @@ static void *input_thread(void *arg)
 
     d->wallclock_start = av_gettime_relative();
 
+    stage_start(&f->stage);
+
     while (1) {
-        DemuxMsg msg = { NULL };
+        int64_t wait_start;
 
         ret = av_read_frame(f->ctx, pkt);
 
@@ -596,8 +594,9 @@ static void *input_thread(void *arg)
         if (ret < 0) {
             if (d->loop) {
                 /* signal looping to the consumer thread */
-                msg.looping = 1;
-                ret = av_thread_message_queue_send(d->in_thread_queue, &msg, 0);
+                wait_start = stage_wait_start();
+                ret = tq_send(d->queue, DEMUX_QUEUE_LOOP, pkt);
+                stage_wait_end(&f->stage.wait_out, wait_start);
                 if (ret >= 0)
                     ret = seek_to_start(d);
                 if (ret >= 0)
@@ -640,35 +639,44 @@ static void *input_thread(void *arg)
             }
         }
 
-        ret = input_packet_process(d, &msg, pkt);
-        if (ret < 0)
+        ret = input_packet_process(d, pkt);
+        if (ret < 0) {
+            av_packet_unref(pkt);
             break;
+        }
 
         if (f->readrate)
             readrate_sleep(d);
 
-        ret = av_thread_message_queue_send(d->in_thread_queue, &msg, flags);
-        if (flags && ret == AVERROR(EAGAIN)) {
-            flags = 0;
-            ret = av_thread_message_queue_send(d->in_thread_queue, &msg, flags);
+        wait_start = stage_wait_start();
+        ret = non_blocking ? tq_send_nonblock(d->queue, DEMUX_QUEUE_PACKETS, pkt) :
+                             tq_send(d->queue, DEMUX_QUEUE_PACKETS, pkt);
+        if (non_blocking && ret == AVERROR(EAGAIN)) {
+            non_blocking = 0;
+            ret = tq_send(d->queue, DEMUX_QUEUE_PACKETS, pkt);
             av_log(f, AV_LOG_WARNING,
                    "Thread message queue blocking; consider raising the "
                    "thread_queue_size option (current value: %d)\n",
                    d->thread_queue_size);
         }
+        stage_wait_end(&f->stage.wait_out, wait_start);
         if (ret < 0) {
             if (ret != AVERROR_EOF)
                 av_log(f, AV_LOG_ERROR,
                        "Unable to send packet to main thread: %s\n",
                        av_err2str(ret));
-            av_packet_free(&msg.pkt);
+            av_packet_unref(pkt);
             break;
         }
     }
 
 finish:
+    stage_end(&f->stage);
+
     av_assert0(ret < 0);
-    av_thread_message_queue_set_err_recv(d->in_thread_queue, ret);
+    d->thread_ret = ret;
+    for (int i = 0; i < DEMUX_QUEUE_NB; i++)
+        tq_send_finish(d->queue, i);
 
     av_packet_free(&pkt);
 
@@ -680,16 +688,15 @@ finish:
 static void thread_stop(Demuxer *d)
 {
     InputFile *f = &d->f;
-    DemuxMsg msg;
 
-    if (!d->in_thread_queue)
+    if (!d->queue)
         return;
-    av_thread_message_queue_set_err_send(d->in_thread_queue, AVERROR_EOF);
-    while (av_thread_message_queue_recv(d->in_thread_queue, &msg, 0) >= 0)
-        av_packet_free(&msg.pkt);
+
+    for (int i = 0; i < DEMUX_QUEUE_NB; i++)
+        tq_receive_finish(d->queue, i);
 
     pthread_join(d->thread, NULL);
-    av_thread_message_queue_free(&d->in_thread_queue);
+    tq_free(&d->queue);
     av_thread_message_queue_free(&f->audio_duration_queue);
 }
 
@@ -697,6 +704,7 @@ static int thread_start(Demuxer *d)
 {
     int ret;
     InputFile *f = &d->f;
+    ObjPool *op;
 
     if (d->thread_queue_size <= 0)
         d->thread_queue_size = (nb_input_files > 1 ? 8 : 1);
@@ -705,10 +713,25 @@ static int thread_start(Demuxer *d)
         (f->ctx->pb ? !f->ctx->pb->seekable :
          strcmp(f->ctx->iformat->name, "lavfi")))
         d->non_blocking = 1;
-    ret = av_thread_message_queue_alloc(&d->in_thread_queue,
-                                        d->thread_queue_size, sizeof(DemuxMsg));
+
+    op = objpool_alloc_packets();
+    if (!op)
+        return AVERROR(ENOMEM);
+
+    d->queue = tq_alloc(DEMUX_QUEUE_NB, d->thread_queue_size, op, pkt_move);
+    if (!d->queue) {
+        objpool_free(&op);
+        return AVERROR(ENOMEM);
+    }
+
+    ret = tq_set_limits(d->queue, THREAD_QUEUE_MAX_PACKETS,
+                        d->thread_queue_data_limit, d->thread_queue_duration_limit,
+                        pkt_data_size, pkt_duration_us);
     if (ret < 0)
-        return ret;
+        goto fail;
+
+    if (stats_json_avio || stats_events_avio)
+        tq_set_depth_hist(d->queue, &f->stage.depth_out);
 
     if (d->loop) {
         int nb_audio_dec = 0;
@@ -738,31 +761,41 @@ static int thread_start(Demuxer *d)
 
     return 0;
 fail:
-    av_thread_message_queue_free(&d->in_thread_queue);
+    tq_free(&d->queue);
     return ret;
 }
 
 int ifile_get_packet(InputFile *f, AVPacket **pkt)
 {
     Demuxer *d = demuxer_from_ifile(f);
-    DemuxMsg msg;
-    int ret;
+    int stream_idx, ret;
 
-    if (!d->in_thread_queue) {
+    if (!d->queue) {
         ret = thread_start(d);
         if (ret < 0)
             return ret;
     }
 
-    ret = av_thread_message_queue_recv(d->in_thread_queue, &msg,
-                                       d->non_blocking ?
-                                       AV_THREAD_MESSAGE_NONBLOCK : 0);
+    do {
+        ret = d->non_blocking ?
+              tq_receive_nonblock(d->queue, &stream_idx, d->pkt_recv) :
+              tq_receive         (d->queue, &stream_idx, d->pkt_recv);
+    } while (ret == AVERROR_EOF && stream_idx >= 0);
+
+    if (ret == AVERROR_EOF)
+        return d->thread_ret;
     if (ret < 0)
         return ret;
-    if (msg.looping)
+    if (stream_idx == DEMUX_QUEUE_LOOP)
         return 1;
 
-    *pkt = msg.pkt;
+    *pkt = av_packet_alloc();
+    if (!*pkt) {
+        av_packet_unref(d->pkt_recv);
+        return AVERROR(ENOMEM);
+    }
+    av_packet_move_ref(*pkt, d->pkt_recv);
+
     return 0;
 }
 
@@ -845,6 +878,8 @@ void ifile_close(InputFile **pf)
 
     avformat_close_input(&f->ctx);
 
+    av_packet_free(&d->pkt_recv);
+
     av_freep(pf);
 }
 
@@ -1378,6 +1413,7 @@ int ifile_open(const OptionsContext *o, const char *filename)
     char *subtitle_codec_name = NULL;
     char *    data_codec_name = NULL;
     int scan_all_pmts_set = 0;
+    int use_probe_cache, cached = 0;
 
     int64_t start_time     = o->start_time;
     int64_t start_time_eof = o->start_time_eof;
@@ -1525,7 +1561,18 @@ int ifile_open(const OptionsContext *o, const char *filename)
             return ret;
     }
 
-    if (o->find_stream_info) {
+    // the streams that the demuxer only creates while reading packets would
+    // be missing without avformat_find_stream_info()
+    use_probe_cache = o->find_stream_info && o->probe_cache &&
+                      !(ic->ctx_flags & AVFMTCTX_NOHEADER);
+    if (use_probe_cache) {
+        ret = probe_cache_load(o->probe_cache, ic);
+        if (ret < 0)
+            return ret;
+        cached = ret;
+    }
+
+    if (o->find_stream_info && !cached) {
         AVDictionary **opts;
         int orig_nb_streams = ic->nb_streams;
 
@@ -1547,7 +1594,8 @@ int ifile_open(const OptionsContext *o, const char *filename)
                 avformat_close_input(&ic);
                 return ret;
             }
-        }
+        } else if (use_probe_cache)
+            probe_cache_store(o->probe_cache, ic);
     }
 
     if (start_time != AV_NOPTS_VALUE && start_time_eof != AV_NOPTS_VALUE) {
@@ -1637,7 +1685,13 @@ int ifile_open(const OptionsContext *o, const char *filename)
                "since neither -readrate nor -re were given\n");
     }
 
-    d->thread_queue_size = o->thread_queue_size;
+    d->thread_queue_size           = o->thread_queue_size;
+    d->thread_queue_data_limit     = o->thread_queue_data_limit;
+    d->thread_queue_duration_limit = o->thread_queue_duration_limit;
+
+    d->pkt_recv = av_packet_alloc();
+    if (!d->pkt_recv)
+        return AVERROR(ENOMEM);
 
     /* Add all the streams from the given input file to the demuxer */
     for (int i = 0; i < ic->nb_streams; i++) {
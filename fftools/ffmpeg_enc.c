@@ -20,6 +20,8 @@
 #include <stdint.h>
 
 #include "ffmpeg.h"
+#include "objpool.h"
+#include "thread_queue.h"
 
 #include "libavutil/avassert.h"
 #include "libavutil/avstring.h"
@@ -32,6 +34,7 @@
 #include "libavutil/log.h"
 #include "libavutil/pixdesc.h"
 #include "libavutil/rational.h"
+#include "libavutil/thread.h"
 #include "libavutil/timestamp.h"
 
 #include "libavcodec/avcodec.h"
@@ -41,6 +44,11 @@
 
 #include "libavformat/avformat.h"
 
+// packets from encoders that support custom buffers are allocated from pools
+// of buffers of 2^PKT_POOL_MIN_LOG2 to 2^(PKT_POOL_MIN_LOG2+PKT_POOL_NB-1) bytes
+#define PKT_POOL_MIN_LOG2 10
+#define PKT_POOL_NB       17
+
 struct Encoder {
     /* predicted pts of the next frame to be encoded */
     int64_t next_pts;
@@ -58,6 +66,8 @@ struct Encoder {
     // packet for receiving encoded output
     AVPacket *pkt;
 
+    AVBufferPool *pkt_pools[PKT_POOL_NB];
+
     // combined size of all the packets received from the encoder
     uint64_t data_size;
 
@@ -67,8 +77,39 @@ struct Encoder {
     uint64_t dup_warning;
 
     int opened;
+
+    // audio and video are encoded in a separate thread, which receives
+    // frames through this queue; NULL when encoding on the calling thread
+    ThreadQueue *queue;
+    pthread_t    thread;
+    // frame for sending to the encoding thread
+    AVFrame     *send_frame;
+    // frame for receiving in the encoding thread
+    AVFrame     *thread_frame;
+    // return code of the encoding thread, set once it has been joined
+    int          thread_ret;
 };
 
+// stats files may be shared between streams and written to from the
+// encoding and muxing threads
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int enc_thread_stop(Encoder *e)
+{
+    void *ret;
+
+    if (!e->queue)
+        return e->thread_ret;
+
+    tq_send_finish(e->queue, 0);
+    pthread_join(e->thread, &ret);
+
+    tq_free(&e->queue);
+
+    e->thread_ret = (int)(intptr_t)ret;
+    return e->thread_ret;
+}
+
 void enc_free(Encoder **penc)
 {
     Encoder *enc = *penc;
@@ -76,11 +117,18 @@ void enc_free(Encoder **penc)
     if (!enc)
         return;
 
+    enc_thread_stop(enc);
+
     av_frame_free(&enc->last_frame);
     av_frame_free(&enc->sq_frame);
+    av_frame_free(&enc->send_frame);
+    av_frame_free(&enc->thread_frame);
 
     av_packet_free(&enc->pkt);
 
+    for (int i = 0; i < FF_ARRAY_ELEMS(enc->pkt_pools); i++)
+        av_buffer_pool_uninit(&enc->pkt_pools[i]);
+
     av_freep(penc);
 }
 
@@ -114,6 +162,55 @@ fail:
     return AVERROR(ENOMEM);
 }
 
+static int enc_thread_start(OutputStream *ost);
+
+static AVBufferRef *pkt_pool_alloc(void *opaque, size_t size)
+{
+    OutputStream *ost = opaque;
+
+    atomic_fetch_add(&ost->pool_misses, 1);
+    return av_buffer_alloc(size);
+}
+
+// may be called from the threads of the encoder
+static int get_encode_buffer(AVCodecContext *enc_ctx, AVPacket *pkt, int flags)
+{
+    OutputStream *ost = enc_ctx->opaque;
+    Encoder        *e = ost->enc;
+    size_t       size = (size_t)pkt->size + AV_INPUT_BUFFER_PADDING_SIZE;
+    int           idx = FFMAX(av_log2(size - 1) + 1 - PKT_POOL_MIN_LOG2, 0);
+
+    if (idx >= FF_ARRAY_ELEMS(e->pkt_pools)) {
+        atomic_fetch_add(&ost->pool_misses, 1);
+        return avcodec_default_get_encode_buffer(enc_ctx, pkt, flags);
+    }
+
+    pkt->buf = av_buffer_pool_get(e->pkt_pools[idx]);
+    if (!pkt->buf)
+        return AVERROR(ENOMEM);
+    pkt->data = pkt->buf->data;
+    memset(pkt->data + pkt->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+    return 0;
+}
+
+static int pkt_pools_init(OutputStream *ost)
+{
+    Encoder *e = ost->enc;
+
+    for (int i = 0; i < FF_ARRAY_ELEMS(e->pkt_pools); i++) {
+        e->pkt_pools[i] = av_buffer_pool_init2(1 << (PKT_POOL_MIN_LOG2 + i), ost,
+                                               pkt_pool_alloc, NULL);
+        if (!e->pkt_pools[i])
+            return AVERROR(ENOMEM);
+    }
+
+    ost->enc_ctx->opaque            = ost;
+    ost->enc_ctx->get_encode_buffer = get_encode_buffer;
+
+    return 0;
+}
+
 static int hw_device_setup_for_encode(OutputStream *ost, AVBufferRef *frames_ref)
 {
     const AVCodecHWConfig *config;
@@ -386,6 +483,12 @@ int enc_open(OutputStream *ost, AVFrame *frame)
         return ret;
     }
 
+    if (enc->capabilities & AV_CODEC_CAP_DR1) {
+        ret = pkt_pools_init(ost);
+        if (ret < 0)
+            return ret;
+    }
+
     if ((ret = avcodec_open2(ost->enc_ctx, enc, &ost->encoder_opts)) < 0) {
         if (ret != AVERROR_EXPERIMENTAL)
             av_log(ost, AV_LOG_ERROR, "Error while opening encoder - maybe "
@@ -469,6 +572,15 @@ int enc_open(OutputStream *ost, AVFrame *frame)
     if (ret < 0)
         return ret;
 
+    // the subtitle heartbeat must be processed synchronously with decoding,
+    // so such streams are encoded on the calling thread
+    if ((enc->type == AVMEDIA_TYPE_VIDEO || enc->type == AVMEDIA_TYPE_AUDIO) &&
+        !ost->fix_sub_duration_heartbeat) {
+        ret = enc_thread_start(ost);
+        if (ret < 0)
+            return ret;
+    }
+
     return 0;
 }
 
@@ -497,7 +609,7 @@ int enc_subtitle(OutputFile *of, OutputStream *ost, const AVSubtitle *sub)
         av_log(ost, AV_LOG_ERROR, "Subtitle packets must have a pts\n");
         return exit_on_error ? AVERROR(EINVAL) : 0;
     }
-    if (ost->finished ||
+    if (atomic_load(&ost->finished) ||
         (of->start_time != AV_NOPTS_VALUE && sub->pts < of->start_time))
         return 0;
 
@@ -570,9 +682,9 @@ int enc_subtitle(OutputFile *of, OutputStream *ost, const AVSubtitle *sub)
     return 0;
 }
 
-void enc_stats_write(OutputStream *ost, EncStats *es,
-                     const AVFrame *frame, const AVPacket *pkt,
-                     uint64_t frame_num)
+static void stats_write(OutputStream *ost, EncStats *es,
+                        const AVFrame *frame, const AVPacket *pkt,
+                        uint64_t frame_num)
 {
     Encoder      *e = ost->enc;
     AVIOContext *io = es->io;
@@ -637,6 +749,15 @@ void enc_stats_write(OutputStream *ost, EncStats *es,
     avio_flush(io);
 }
 
+void enc_stats_write(OutputStream *ost, EncStats *es,
+                     const AVFrame *frame, const AVPacket *pkt,
+                     uint64_t frame_num)
+{
+    pthread_mutex_lock(&stats_lock);
+    stats_write(ost, es, frame, pkt, frame_num);
+    pthread_mutex_unlock(&stats_lock);
+}
+
 static inline double psnr(double d)
 {
     return -10.0 * log10(d);
@@ -652,9 +773,11 @@ static int update_video_stats(OutputStream *ost, const AVPacket *pkt, int write_
     int64_t frame_number;
     double ti1, bitrate, avg_bitrate;
     double psnr_val = -1;
+    int quality, ret;
 
-    ost->quality   = sd ? AV_RL32(sd) : -1;
+    quality        = sd ? AV_RL32(sd) : -1;
     pict_type      = sd ? sd[4] : AV_PICTURE_TYPE_NONE;
+    atomic_store(&ost->quality, quality);
 
     if ((enc->flags & AV_CODEC_FLAG_PSNR) && sd && sd[5]) {
         // FIXME the scaling assumes 8bit
@@ -666,22 +789,27 @@ static int update_video_stats(OutputStream *ost, const AVPacket *pkt, int write_
     if (!write_vstats)
         return 0;
 
+    // the vstats file is shared by all the video streams
+    pthread_mutex_lock(&stats_lock);
+
     /* this is executed just the first time update_video_stats is called */
     if (!vstats_file) {
         vstats_file = fopen(vstats_filename, "w");
         if (!vstats_file) {
+            ret = AVERROR(errno);
             perror("fopen");
-            return AVERROR(errno);
+            pthread_mutex_unlock(&stats_lock);
+            return ret;
         }
     }
 
     frame_number = e->packets_encoded;
     if (vstats_version <= 1) {
         fprintf(vstats_file, "frame= %5"PRId64" q= %2.1f ", frame_number,
-                ost->quality / (float)FF_QP2LAMBDA);
+                quality / (float)FF_QP2LAMBDA);
     } else  {
         fprintf(vstats_file, "out= %2d st= %2d frame= %5"PRId64" q= %2.1f ", ost->file_index, ost->index, frame_number,
-                ost->quality / (float)FF_QP2LAMBDA);
+                quality / (float)FF_QP2LAMBDA);
     }
 
     if (psnr_val >= 0)
@@ -699,6 +827,8 @@ static int update_video_stats(OutputStream *ost, const AVPacket *pkt, int write_
            (double)e->data_size / 1024, ti1, bitrate, avg_bitrate);
     fprintf(vstats_file, "type= %c\n", av_get_picture_type_char(pict_type));
 
+    pthread_mutex_unlock(&stats_lock);
+
     return 0;
 }
 
@@ -803,6 +933,112 @@ static int encode_frame(OutputFile *of, OutputStream *ost, AVFrame *frame)
     av_assert0(0);
 }
 
+static void *encoder_thread(void *arg)
+{
+    OutputStream *ost = arg;
+    OutputFile    *of = output_files[ost->file_index];
+    Encoder        *e = ost->enc;
+    char name[16];
+    int ret = 0;
+
+    snprintf(name, sizeof(name), "enc%d:%d:%s", ost->file_index, ost->index,
+             ost->enc_ctx->codec->name);
+    ff_thread_setname(name);
+
+    stage_start(&ost->stage);
+
+    while (1) {
+        int stream_idx;
+        int64_t wait_start = stage_wait_start();
+
+        ret = tq_receive(e->queue, &stream_idx, e->thread_frame);
+        stage_wait_end(&ost->stage.wait_in, wait_start);
+        if (stream_idx < 0)
+            break;
+
+        // EOF from the queue flushes the encoder
+        ret = encode_frame(of, ost, ret < 0 ? NULL : e->thread_frame);
+        av_frame_unref(e->thread_frame);
+        if (ret < 0)
+            break;
+    }
+
+    tq_receive_finish(e->queue, 0);
+
+    stage_end(&ost->stage);
+
+    return (void*)(intptr_t)ret;
+}
+
+static int enc_thread_start(OutputStream *ost)
+{
+    Encoder *e = ost->enc;
+    ObjPool *op;
+    int ret;
+
+    e->send_frame   = av_frame_alloc();
+    e->thread_frame = av_frame_alloc();
+    if (!e->send_frame || !e->thread_frame)
+        return AVERROR(ENOMEM);
+
+    op = objpool_alloc_frames();
+    if (!op)
+        return AVERROR(ENOMEM);
+
+    e->queue = tq_alloc(1, 8, op, frame_move);
+    if (!e->queue) {
+        objpool_free(&op);
+        return AVERROR(ENOMEM);
+    }
+
+    if (stats_json_avio || stats_events_avio)
+        tq_set_depth_hist(e->queue, &ost->stage.depth_in);
+
+    ret = pthread_create(&e->thread, NULL, encoder_thread, ost);
+    if (ret) {
+        tq_free(&e->queue);
+        return AVERROR(ret);
+    }
+
+    return 0;
+}
+
+/* Encode a frame, in the encoding thread if there is one. A NULL frame
+ * flushes the encoder and waits for the thread to finish. Same return
+ * values as encode_frame(), except that errors from the encoding thread
+ * are only reported once it terminates. */
+static int enc_thread_submit(OutputFile *of, OutputStream *ost, AVFrame *frame)
+{
+    Encoder *e = ost->enc;
+    int ret;
+
+    if (!e->queue)
+        return e->thread_ret < 0 ? e->thread_ret : encode_frame(of, ost, frame);
+
+    if (frame) {
+        int64_t wait_start;
+
+        ret = av_frame_ref(e->send_frame, frame);
+        if (ret < 0)
+            return ret;
+
+        wait_start = stage_wait_start();
+        ret = tq_send(e->queue, 0, e->send_frame);
+        // frames are sent to the encoder by the filtering thread
+        if (ost->filter)
+            stage_wait_end(&ost->filter->graph->stage.wait_out, wait_start);
+        if (ret >= 0)
+            return 0;
+
+        av_frame_unref(e->send_frame);
+        // the thread terminated, collect its return code below
+        if (ret != AVERROR_EOF)
+            return ret;
+    }
+
+    return enc_thread_stop(e);
+}
+
 static int submit_encode_frame(OutputFile *of, OutputStream *ost,
                                AVFrame *frame)
 {
@@ -810,7 +1046,7 @@ static int submit_encode_frame(OutputFile *of, OutputStream *ost,
     int ret;
 
     if (ost->sq_idx_encode < 0)
-        return encode_frame(of, ost, frame);
+        return enc_thread_submit(of, ost, frame);
 
     if (frame) {
         ret = av_frame_ref(e->sq_frame, frame);
@@ -839,7 +1075,7 @@ static int submit_encode_frame(OutputFile *of, OutputStream *ost,
             return (ret == AVERROR(EAGAIN)) ? 0 : ret;
         }
 
-        ret = encode_frame(of, ost, enc_frame);
+        ret = enc_thread_submit(of, ost, enc_frame);
         if (enc_frame)
             av_frame_unref(enc_frame);
         if (ret < 0) {
@@ -1076,6 +1312,7 @@ static int do_video_out(OutputFile *of, OutputStream *ost, AVFrame *frame)
     AVCodecContext *enc = ost->enc_ctx;
     int64_t nb_frames, nb_frames_prev, i;
     double duration = 0;
+    int last_dropped;
 
     if (frame) {
         FrameData *fd = frame_data(frame);
@@ -1090,27 +1327,32 @@ static int do_video_out(OutputFile *of, OutputStream *ost, AVFrame *frame)
     video_sync_process(of, ost, frame, duration,
                        &nb_frames, &nb_frames_prev);
 
-    if (nb_frames_prev == 0 && ost->last_dropped) {
-        ost->nb_frames_drop++;
+    last_dropped = atomic_load(&ost->last_dropped);
+    if (nb_frames_prev == 0 && last_dropped) {
+        atomic_fetch_add(&ost->nb_frames_drop, 1);
         av_log(ost, AV_LOG_VERBOSE,
                "*** dropping frame %"PRId64" at ts %"PRId64"\n",
                e->vsync_frame_number, e->last_frame->pts);
     }
-    if (nb_frames > (nb_frames_prev && ost->last_dropped) + (nb_frames > nb_frames_prev)) {
+    if (nb_frames > (nb_frames_prev && last_dropped) + (nb_frames > nb_frames_prev)) {
+        uint64_t nb_dup = nb_frames - (nb_frames_prev && last_dropped) - (nb_frames > nb_frames_prev);
+        uint64_t nb_frames_dup;
+
         if (nb_frames > dts_error_threshold * 30) {
             av_log(ost, AV_LOG_ERROR, "%"PRId64" frame duplication too large, skipping\n", nb_frames - 1);
-            ost->nb_frames_drop++;
+            atomic_fetch_add(&ost->nb_frames_drop, 1);
             return 0;
         }
-        ost->nb_frames_dup += nb_frames - (nb_frames_prev && ost->last_dropped) - (nb_frames > nb_frames_prev);
+        nb_frames_dup = atomic_fetch_add(&ost->nb_frames_dup, nb_dup) + nb_dup;
         av_log(ost, AV_LOG_VERBOSE, "*** %"PRId64" dup!\n", nb_frames - 1);
-        if (ost->nb_frames_dup > e->dup_warning) {
+        if (nb_frames_dup > e->dup_warning) {
             av_log(ost, AV_LOG_WARNING, "More than %"PRIu64" frames duplicated\n", e->dup_warning);
             e->dup_warning *= 10;
         }
     }
-    ost->last_dropped = nb_frames == nb_frames_prev && frame;
-    ost->kf.dropped_keyframe = ost->last_dropped && frame && (frame->flags & AV_FRAME_FLAG_KEY);
+    last_dropped = nb_frames == nb_frames_prev && frame;
+    atomic_store(&ost->last_dropped, last_dropped);
+    ost->kf.dropped_keyframe = last_dropped && frame && (frame->flags & AV_FRAME_FLAG_KEY);
 
     /* duplicates frame if needed */
     for (i = 0; i < nb_frames; i++) {
@@ -1164,7 +1406,7 @@ int enc_frame(OutputStream *ost, AVFrame *frame)
 
 int enc_flush(void)
 {
-    int ret;
+    int ret = 0;
 
     for (OutputStream *ost = ost_iter(NULL); ost; ost = ost_iter(ost)) {
         OutputFile      *of = output_files[ost->file_index];
@@ -1176,15 +1418,17 @@ int enc_flush(void)
         Encoder          *e = ost->enc;
         AVCodecContext *enc = ost->enc_ctx;
         OutputFile      *of = output_files[ost->file_index];
+        int err;
 
         if (!enc || !e->opened ||
             (enc->codec_type != AVMEDIA_TYPE_VIDEO && enc->codec_type != AVMEDIA_TYPE_AUDIO))
             continue;
 
-        ret = submit_encode_frame(of, ost, NULL);
-        if (ret != AVERROR_EOF)
-            return ret;
+        // keep going on errors, so that all the encoding threads terminate
+        err = submit_encode_frame(of, ost, NULL);
+        if (err != AVERROR_EOF)
+            ret = err_merge(ret, err);
     }
 
-    return 0;
+    return ret;
 }
@@ -21,6 +21,8 @@
 #include <stdint.h>
 
 #include "ffmpeg.h"
+#include "objpool.h"
+#include "thread_queue.h"
 
 #include "libavfilter/avfilter.h"
 #include "libavfilter/buffersink.h"
@@ -36,8 +38,26 @@
 #include "libavutil/pixfmt.h"
 #include "libavutil/imgutils.h"
 #include "libavutil/samplefmt.h"
+#include "libavutil/thread.h"
 #include "libavutil/timestamp.h"
 
+// Frames without data sent to the filtering thread carry one of these in
+// AVFrame.opaque, to signal events other than new input.
+enum FrameOpaque {
+    FRAME_OPAQUE_SUB_HEARTBEAT = 1,
+    FRAME_OPAQUE_EOF,
+    FRAME_OPAQUE_SEND_COMMAND,
+};
+
+typedef struct FilterCommand {
+    char *target;
+    char *command;
+    char *arg;
+
+    double time;
+    int    all_filters;
+} FilterCommand;
+
 typedef struct FilterGraphPriv {
     FilterGraph fg;
 
@@ -54,6 +74,24 @@ typedef struct FilterGraphPriv {
 
     // frame for temporarily holding output from the filtergraph
     AVFrame *frame;
+
+    // frame for sending input and messages to the graph, main thread only
+    AVFrame *frame_send;
+    // the filtering thread has terminated, main thread only
+    int thread_done;
+
+    // queue feeding the filtering thread, with one stream for each input
+    // and one for commands; NULL when the graph runs on the main thread
+    ThreadQueue *queue;
+    pthread_t    thread;
+    // frame for receiving input in the filtering thread
+    AVFrame     *frame_recv;
+    // error the filtering thread failed with
+    int          thread_ret;
+    // index of the input the filtering thread wants data on next, or -1
+    atomic_int   best_input;
+    // make the filtering thread terminate as soon as possible
+    atomic_int   abort_request;
 } FilterGraphPriv;
 
 static FilterGraphPriv *fgp_from_fg(FilterGraph *fg)
@@ -73,6 +111,9 @@ typedef struct InputFilterPriv {
 
     InputStream *ist;
 
+    // index of this input in the filtergraph
+    int index;
+
     // used to hold submitted input
     AVFrame *frame;
 
@@ -87,6 +128,8 @@ typedef struct InputFilterPriv {
     enum AVMediaType type_src;
 
     int eof;
+    // nothing more will be sent on this input, main thread only
+    int eof_sent;
 
     // parameters configured for this input
     int format;
@@ -557,7 +600,7 @@ static OutputFilter *ofilter_alloc(FilterGraph *fg)
     ofilter           = &ofp->ofilter;
     ofilter->graph    = fg;
     ofp->format       = -1;
-    ofilter->last_pts = AV_NOPTS_VALUE;
+    atomic_init(&ofilter->last_pts, AV_NOPTS_VALUE);
 
     return ofilter;
 }
@@ -727,6 +770,8 @@ static InputFilter *ifilter_alloc(FilterGraph *fg)
     ifilter         = &ifp->ifilter;
     ifilter->graph  = fg;
 
+    ifp->index = fg->nb_inputs - 1;
+
     ifp->frame = av_frame_alloc();
     if (!ifp->frame)
         return NULL;
@@ -750,6 +795,8 @@ void fg_free(FilterGraph **pfg)
         return;
     fgp = fgp_from_fg(fg);
 
+    fg_thread_stop(fg, 1);
+
     avfilter_graph_free(&fg->graph);
     for (int j = 0; j < fg->nb_inputs; j++) {
         InputFilter *ifilter = fg->inputs[j];
@@ -786,6 +833,8 @@ void fg_free(FilterGraph **pfg)
     av_freep(&fgp->graph_desc);
 
     av_frame_free(&fgp->frame);
+    av_frame_free(&fgp->frame_send);
+    av_frame_free(&fgp->frame_recv);
 
     av_freep(pfg);
 }
@@ -828,8 +877,10 @@ int fg_create(FilterGraph **pfg, char *graph_desc)
 
     snprintf(fgp->log_name, sizeof(fgp->log_name), "fc#%d", fg->index);
 
-    fgp->frame = av_frame_alloc();
-    if (!fgp->frame)
+    fgp->frame      = av_frame_alloc();
+    fgp->frame_send = av_frame_alloc();
+    fgp->frame_recv = av_frame_alloc();
+    if (!fgp->frame || !fgp->frame_send || !fgp->frame_recv)
         return AVERROR(ENOMEM);
 
     /* this graph is only used for determining the kinds of inputs
@@ -1741,7 +1792,13 @@ int filtergraph_is_simple(const FilterGraph *fg)
     return fgp->is_simple;
 }
 
-int reap_filters(FilterGraph *fg, int flush)
+/**
+ * Get and encode new output from the filtergraph, without causing
+ * activity.
+ *
+ * @return  0 for success, <0 for severe errors
+ */
+static int reap_filters(FilterGraph *fg, int flush)
 {
     FilterGraphPriv    *fgp = fgp_from_fg(fg);
     AVFrame *filtered_frame = fgp->frame;
@@ -1776,15 +1833,15 @@ int reap_filters(FilterGraph *fg, int flush)
 
                 break;
             }
-            if (ost->finished) {
+            if (atomic_load(&ost->finished)) {
                 av_frame_unref(filtered_frame);
                 continue;
             }
 
             if (filtered_frame->pts != AV_NOPTS_VALUE) {
                 AVRational tb = av_buffersink_get_time_base(filter);
-                ost->filter->last_pts = av_rescale_q(filtered_frame->pts, tb,
-                                                     AV_TIME_BASE_Q);
+                atomic_store(&ost->filter->last_pts,
+                             av_rescale_q(filtered_frame->pts, tb, AV_TIME_BASE_Q));
                 filtered_frame->time_base = tb;
 
                 if (debug_ts)
@@ -1820,7 +1877,7 @@ int reap_filters(FilterGraph *fg, int flush)
     return 0;
 }
 
-void ifilter_sub2video_heartbeat(InputFilter *ifilter, int64_t pts, AVRational tb)
+static void sub2video_heartbeat(InputFilter *ifilter, int64_t pts, AVRational tb)
 {
     InputFilterPriv *ifp = ifp_from_ifilter(ifilter);
     int64_t pts2;
@@ -1846,11 +1903,15 @@ void ifilter_sub2video_heartbeat(InputFilter *ifilter, int64_t pts, AVRational t
         sub2video_push_ref(ifp, pts2);
 }
 
-int ifilter_sub2video(InputFilter *ifilter, const AVFrame *frame)
+static int sub2video_frame(InputFilter *ifilter, const AVFrame *frame)
 {
     InputFilterPriv *ifp = ifp_from_ifilter(ifilter);
     int ret;
 
+    // sub2video inputs only get EOF through here
+    if (!frame)
+        ifp->eof = 1;
+
     if (ifilter->graph->graph) {
         if (!frame) {
             if (ifp->sub2video.end_pts < INT64_MAX)
@@ -1879,7 +1940,7 @@ int ifilter_sub2video(InputFilter *ifilter, const AVFrame *frame)
     return 0;
 }
 
-int ifilter_send_eof(InputFilter *ifilter, int64_t pts, AVRational tb)
+static int send_eof(InputFilter *ifilter, int64_t pts, AVRational tb)
 {
     InputFilterPriv *ifp = ifp_from_ifilter(ifilter);
     int ret;
@@ -1927,7 +1988,7 @@ int ifilter_send_eof(InputFilter *ifilter, int64_t pts, AVRational tb)
     return 0;
 }
 
-int ifilter_send_frame(InputFilter *ifilter, AVFrame *frame, int keep_reference)
+static int send_frame(InputFilter *ifilter, AVFrame *frame)
 {
     InputFilterPriv *ifp = ifp_from_ifilter(ifilter);
     FilterGraph *fg = ifilter->graph;
@@ -1995,12 +2056,7 @@ int ifilter_send_frame(InputFilter *ifilter, AVFrame *frame, int keep_reference)
         }
     }
 
-    if (keep_reference) {
-        ret = av_frame_ref(ifp->frame, frame);
-        if (ret < 0)
-            return ret;
-    } else
-        av_frame_move_ref(ifp->frame, frame);
+    av_frame_move_ref(ifp->frame, frame);
     frame = ifp->frame;
 
     frame->pts       = av_rescale_q(frame->pts,      frame->time_base, ifp->time_base);
@@ -2024,94 +2080,556 @@ int ifilter_send_frame(InputFilter *ifilter, AVFrame *frame, int keep_reference)
     return 0;
 }
 
-int fg_transcode_step(FilterGraph *graph, InputStream **best_ist)
+static void filter_command_free(void *opaque, uint8_t *data)
 {
-    FilterGraphPriv *fgp = fgp_from_fg(graph);
-    int i, ret;
-    int nb_requests, nb_requests_max = 0;
-    InputStream *ist;
+    FilterCommand *fc = (FilterCommand*)data;
 
-    if (!graph->graph) {
-        for (int i = 0; i < graph->nb_inputs; i++) {
-            InputFilter *ifilter = graph->inputs[i];
-            InputFilterPriv *ifp = ifp_from_ifilter(ifilter);
-            if (ifp->format < 0 && !ifp->eof) {
-                *best_ist = ifp->ist;
-                return 0;
-            }
+    av_freep(&fc->target);
+    av_freep(&fc->command);
+    av_freep(&fc->arg);
+
+    av_free(data);
+}
+
+static void send_command(FilterGraph *fg, const FilterCommand *fc)
+{
+    int ret;
+
+    if (!fg->graph)
+        return;
+
+    if (fc->time < 0) {
+        char response[4096];
+        ret = avfilter_graph_send_command(fg->graph, fc->target, fc->command,
+                                          fc->arg, response, sizeof(response),
+                                          fc->all_filters ? 0 : AVFILTER_CMD_FLAG_ONE);
+        fprintf(stderr, "Command reply for stream %d: ret:%d res:\n%s",
+                fg->index, ret, response);
+    } else if (!fc->all_filters) {
+        fprintf(stderr, "Queuing commands only on filters supporting the specific command is unsupported\n");
+    } else {
+        ret = avfilter_graph_queue_command(fg->graph, fc->target, fc->command,
+                                           fc->arg, 0, fc->time);
+        if (ret < 0)
+            fprintf(stderr, "Queuing command failed with error %s\n", av_err2str(ret));
+    }
+}
+
+/* Process a frame or a message sent to the input idx of the filtergraph,
+ * idx == nb_inputs is used for commands. */
+static int process_input(FilterGraph *fg, int idx, AVFrame *frame)
+{
+    InputFilter *ifilter = idx < fg->nb_inputs ? fg->inputs[idx] : NULL;
+    InputFilterPriv  *ifp = ifilter ? ifp_from_ifilter(ifilter) : NULL;
+    int ret;
+
+    if (!frame->buf[0]) {
+        switch ((intptr_t)frame->opaque) {
+        case FRAME_OPAQUE_SEND_COMMAND:
+            send_command(fg, (const FilterCommand*)frame->opaque_ref->data);
+            return 0;
+        case FRAME_OPAQUE_SUB_HEARTBEAT:
+            sub2video_heartbeat(ifilter, frame->pts, frame->time_base);
+            return 0;
+        case FRAME_OPAQUE_EOF:
+            if (ifp->type_src == AVMEDIA_TYPE_SUBTITLE)
+                ret = sub2video_frame(ifilter, NULL);
+            else
+                ret = send_eof(ifilter, frame->pts, frame->time_base);
+            return ret == AVERROR_EOF ? 0 : ret;
+        }
+        av_assert0(0);
+    }
+
+    if (ifp->type_src == AVMEDIA_TYPE_SUBTITLE)
+        ret = sub2video_frame(ifilter, frame);
+    else
+        ret = send_frame(ifilter, frame);
+
+    return ret == AVERROR_EOF ? 0 : ret;
+}
+
+/* Pick the input on which the graph needs data to make progress, or -1. */
+static int choose_input(FilterGraph *fg)
+{
+    int nb_requests, nb_requests_max = 0, best = -1;
+
+    for (int i = 0; i < fg->nb_inputs; i++) {
+        InputFilterPriv *ifp = ifp_from_ifilter(fg->inputs[i]);
+
+        if (ifp->eof)
+            continue;
+
+        // an unconfigured graph needs the parameters of all its inputs
+        if (!fg->graph) {
+            if (ifp->format < 0)
+                return i;
+            continue;
+        }
+
+        nb_requests = av_buffersrc_get_nb_failed_requests(ifp->filter);
+        if (nb_requests > nb_requests_max) {
+            nb_requests_max = nb_requests;
+            best            = i;
         }
+    }
 
-        // graph not configured, but all inputs are either initialized or EOF
-        for (int i = 0; i < graph->nb_outputs; i++)
-            graph->outputs[i]->ost->inputs_done = 1;
+    return best;
+}
 
+static int outputs_finished(FilterGraph *fg)
+{
+    for (int i = 0; i < fg->nb_outputs; i++)
+        if (!atomic_load(&fg->outputs[i]->ost->finished))
+            return 0;
+    return 1;
+}
+
+/* Called when the graph reached EOF, encode what is left in the sinks. */
+static int flush_outputs(FilterGraph *fg)
+{
+    FilterGraphPriv *fgp = fgp_from_fg(fg);
+    int ret;
+
+    if (!fg->graph)
         return 0;
+
+    reap_filters(fg, 1);
+
+    for (int i = 0; i < fg->nb_outputs; i++) {
+        OutputFilter *ofilter = fg->outputs[i];
+        OutputFilterPriv *ofp = ofp_from_ofilter(ofilter);
+
+        // we are finished and no frames were ever seen at this output,
+        // at least initialize the encoder with a dummy frame
+        if (!ofp->got_frame) {
+            AVFrame *frame = fgp->frame;
+
+            frame->time_base   = ofp->time_base;
+            frame->format      = ofp->format;
+
+            frame->width               = ofp->width;
+            frame->height              = ofp->height;
+            frame->sample_aspect_ratio = ofp->sample_aspect_ratio;
+
+            frame->sample_rate = ofp->sample_rate;
+            if (ofp->ch_layout.nb_channels) {
+                ret = av_channel_layout_copy(&frame->ch_layout, &ofp->ch_layout);
+                if (ret < 0)
+                    return ret;
+            }
+
+            av_assert0(!frame->buf[0]);
+
+            av_log(ofilter->ost, AV_LOG_WARNING,
+                   "No filtered frames for output stream, trying to "
+                   "initialize anyway.\n");
+
+            enc_open(ofilter->ost, frame);
+            av_frame_unref(frame);
+        }
     }
 
-    *best_ist = NULL;
-    ret = avfilter_graph_request_oldest(graph->graph);
-    if (ret >= 0)
-        return reap_filters(graph, 0);
+    return 0;
+}
 
-    if (ret == AVERROR_EOF) {
-        reap_filters(graph, 1);
-        for (int i = 0; i < graph->nb_outputs; i++) {
-            OutputFilter *ofilter = graph->outputs[i];
-            OutputFilterPriv *ofp = ofp_from_ofilter(ofilter);
-
-            // we are finished and no frames were ever seen at this output,
-            // at least initialize the encoder with a dummy frame
-            if (!ofp->got_frame) {
-                AVFrame *frame = fgp->frame;
-
-                frame->time_base   = ofp->time_base;
-                frame->format      = ofp->format;
-
-                frame->width               = ofp->width;
-                frame->height              = ofp->height;
-                frame->sample_aspect_ratio = ofp->sample_aspect_ratio;
-
-                frame->sample_rate = ofp->sample_rate;
-                if (ofp->ch_layout.nb_channels) {
-                    ret = av_channel_layout_copy(&frame->ch_layout, &ofp->ch_layout);
-                    if (ret < 0)
-                        return ret;
-                }
+/* Run the graph until it needs more input, then publish the input it wants.
+ * Graphs without inputs are only run for a single step, so that the thread
+ * can check for commands in between.
+ *
+ * @return 0 when more input is needed, 1 when a graph without inputs cannot
+ *         make progress until a command is sent to it, AVERROR_EOF when no
+ *         more output will be produced, another negative error code on
+ *         failure
+ */
+static int read_frames(FilterGraph *fg)
+{
+    FilterGraphPriv *fgp = fgp_from_fg(fg);
+    int ret;
 
-                av_assert0(!frame->buf[0]);
+    while (fg->graph && !atomic_load(&fgp->abort_request)) {
+        ret = reap_filters(fg, 0);
+        if (ret < 0)
+            return ret;
 
-                av_log(ofilter->ost, AV_LOG_WARNING,
-                       "No filtered frames for output stream, trying to "
-                       "initialize anyway.\n");
+        if (outputs_finished(fg))
+            return AVERROR_EOF;
 
-                enc_open(ofilter->ost, frame);
+        ret = avfilter_graph_request_oldest(fg->graph);
+        if (ret == AVERROR(EAGAIN)) {
+            // only commands are ever sent to a graph without inputs, and its
+            // filters waiting on other threads are woken up by the graph
+            // itself, so nothing but a command can change its state
+            if (!fg->nb_inputs)
+                return 1;
+            break;
+        } else if (ret < 0)
+            return ret;
+
+        if (!fg->nb_inputs)
+            return reap_filters(fg, 0);
+    }
+
+    atomic_store(&fgp->best_input, choose_input(fg));
+
+    return 0;
+}
+
+static void *filter_thread(void *arg)
+{
+    FilterGraph    *fg = arg;
+    FilterGraphPriv *fgp = fgp_from_fg(fg);
+    AVFrame      *frame = fgp->frame_recv;
+    int input_open = 1, stalled = 0, ret = 0;
+
+    ff_thread_setname(fgp->log_name);
+
+    stage_start(&fg->stage);
+
+    while (!atomic_load(&fgp->abort_request)) {
+        int idx;
+
+        if (input_open) {
+            int64_t wait_start = stage_wait_start();
+
+            // graphs without inputs must keep running while waiting for
+            // commands, unless they cannot do anything before the next one
+            ret = fg->nb_inputs || stalled ?
+                  tq_receive         (fgp->queue, &idx, frame) :
+                  tq_receive_nonblock(fgp->queue, &idx, frame);
+            stage_wait_end(&fg->stage.wait_in, wait_start);
+            if (ret == AVERROR_EOF && idx < 0) {
+                // everything was sent; a graph with inputs must have reached
+                // EOF by now, unless it was never configured
+                input_open = 0;
+                ret = AVERROR_EOF;
+                if (fg->nb_inputs)
+                    break;
+            } else if (ret >= 0) {
+                ret = process_input(fg, idx, frame);
                 av_frame_unref(frame);
+                if (ret < 0)
+                    break;
             }
+        }
 
-            close_output_stream(ofilter->ost);
+        ret = read_frames(fg);
+        if (ret < 0)
+            break;
+        stalled = ret;
+
+        // no command will ever come to get it going again
+        if (stalled && !input_open) {
+            ret = AVERROR_EOF;
+            break;
         }
-        return 0;
     }
-    if (ret != AVERROR(EAGAIN))
+
+    if (ret == AVERROR_EOF) {
+        ret = atomic_load(&fgp->abort_request) ? 0 : flush_outputs(fg);
+    } else if (ret < 0) {
+        av_log(fg, AV_LOG_ERROR, "Error while filtering: %s\n", av_err2str(ret));
+        fgp->thread_ret = ret;
+    }
+
+    for (int i = 0; i < fg->nb_outputs; i++)
+        close_output_stream(fg->outputs[i]->ost);
+
+    for (int i = 0; i <= fg->nb_inputs; i++)
+        tq_receive_finish(fgp->queue, i);
+
+    stage_end(&fg->stage);
+
+    return (void*)(intptr_t)ret;
+}
+
+/* Send a frame or a message on input idx, to the filtering thread or
+ * directly to the graph if it runs on this thread; the frame is always
+ * consumed. */
+static int fg_send(FilterGraph *fg, int idx, AVFrame *frame)
+{
+    FilterGraphPriv *fgp = fgp_from_fg(fg);
+    int ret;
+
+    if (!fgp->queue) {
+        ret = process_input(fg, idx, frame);
+        av_frame_unref(frame);
+        if (ret < 0)
+            return ret;
+
+        return reap_filters(fg, 0);
+    }
+
+    if (fgp->thread_done) {
+        av_frame_unref(frame);
+        return fgp->thread_ret < 0 ? fgp->thread_ret : AVERROR_EOF;
+    }
+
+    ret = tq_send(fgp->queue, idx, frame);
+    if (ret < 0) {
+        av_frame_unref(frame);
+        if (ret == AVERROR_EOF) {
+            // the filtering thread has terminated
+            fgp->thread_done = 1;
+            if (fgp->thread_ret < 0)
+                ret = fgp->thread_ret;
+        }
         return ret;
+    }
 
-    for (i = 0; i < graph->nb_inputs; i++) {
-        InputFilter *ifilter = graph->inputs[i];
-        InputFilterPriv *ifp = ifp_from_ifilter(ifilter);
+    return 0;
+}
 
-        ist = ifp->ist;
-        if (input_files[ist->file_index]->eagain || ifp->eof)
-            continue;
-        nb_requests = av_buffersrc_get_nb_failed_requests(ifp->filter);
-        if (nb_requests > nb_requests_max) {
-            nb_requests_max = nb_requests;
-            *best_ist = ist;
+/* Nothing more will be sent on this input. */
+static void input_finished(InputFilter *ifilter)
+{
+    InputFilterPriv *ifp = ifp_from_ifilter(ifilter);
+    FilterGraph      *fg = ifilter->graph;
+    FilterGraphPriv *fgp = fgp_from_fg(fg);
+
+    ifp->eof_sent = 1;
+
+    if (!fgp->queue)
+        return;
+
+    tq_send_finish(fgp->queue, ifp->index);
+
+    for (int i = 0; i < fg->nb_inputs; i++)
+        if (!ifp_from_ifilter(fg->inputs[i])->eof_sent)
+            return;
+
+    // only the filtering thread can make progress on the outputs now
+    for (int i = 0; i < fg->nb_outputs; i++)
+        fg->outputs[i]->ost->inputs_done = 1;
+}
+
+int ifilter_send_frame(InputFilter *ifilter, AVFrame *frame, int keep_reference)
+{
+    InputFilterPriv *ifp = ifp_from_ifilter(ifilter);
+    FilterGraphPriv *fgp = fgp_from_fg(ifilter->graph);
+    int ret;
+
+    if (keep_reference) {
+        ret = av_frame_ref(fgp->frame_send, frame);
+        if (ret < 0)
+            return ret;
+    } else
+        av_frame_move_ref(fgp->frame_send, frame);
+
+    return fg_send(ifilter->graph, ifp->index, fgp->frame_send);
+}
+
+int ifilter_send_eof(InputFilter *ifilter, int64_t pts, AVRational tb)
+{
+    InputFilterPriv *ifp = ifp_from_ifilter(ifilter);
+    FilterGraphPriv *fgp = fgp_from_fg(ifilter->graph);
+    AVFrame       *frame = fgp->frame_send;
+    int ret;
+
+    if (ifp->eof_sent)
+        return 0;
+
+    frame->pts       = pts;
+    frame->time_base = tb;
+    frame->opaque    = (void*)(intptr_t)FRAME_OPAQUE_EOF;
+
+    ret = fg_send(ifilter->graph, ifp->index, frame);
+    input_finished(ifilter);
+
+    return ret == AVERROR_EOF ? 0 : ret;
+}
+
+int ifilter_sub2video(InputFilter *ifilter, const AVFrame *frame)
+{
+    InputFilterPriv *ifp = ifp_from_ifilter(ifilter);
+    FilterGraphPriv *fgp = fgp_from_fg(ifilter->graph);
+    int ret;
+
+    if (ifp->eof_sent)
+        return 0;
+
+    if (frame) {
+        ret = av_frame_ref(fgp->frame_send, frame);
+        if (ret < 0)
+            return ret;
+    } else {
+        fgp->frame_send->opaque = (void*)(intptr_t)FRAME_OPAQUE_EOF;
+    }
+
+    ret = fg_send(ifilter->graph, ifp->index, fgp->frame_send);
+    if (!frame)
+        input_finished(ifilter);
+
+    return ret == AVERROR_EOF ? 0 : ret;
+}
+
+void ifilter_sub2video_heartbeat(InputFilter *ifilter, int64_t pts, AVRational tb)
+{
+    InputFilterPriv *ifp = ifp_from_ifilter(ifilter);
+    FilterGraphPriv *fgp = fgp_from_fg(ifilter->graph);
+    AVFrame       *frame = fgp->frame_send;
+
+    if (ifp->eof_sent)
+        return;
+
+    frame->pts       = pts;
+    frame->time_base = tb;
+    frame->opaque    = (void*)(intptr_t)FRAME_OPAQUE_SUB_HEARTBEAT;
+
+    fg_send(ifilter->graph, ifp->index, frame);
+}
+
+void fg_send_command(FilterGraph *fg, double time, const char *target,
+                     const char *command, const char *arg, int all_filters)
+{
+    FilterGraphPriv *fgp = fgp_from_fg(fg);
+    AVFrame       *frame = fgp->frame_send;
+    FilterCommand *fc;
+
+    fc = av_mallocz(sizeof(*fc));
+    if (!fc)
+        return;
+
+    frame->opaque_ref = av_buffer_create((uint8_t*)fc, sizeof(*fc),
+                                         filter_command_free, NULL, 0);
+    if (!frame->opaque_ref) {
+        av_freep(&fc);
+        return;
+    }
+
+    fc->target  = av_strdup(target);
+    fc->command = av_strdup(command);
+    fc->arg     = av_strdup(arg);
+    if (!fc->target || !fc->command || !fc->arg) {
+        av_frame_unref(frame);
+        return;
+    }
+
+    fc->time        = time;
+    fc->all_filters = all_filters;
+
+    frame->opaque = (void*)(intptr_t)FRAME_OPAQUE_SEND_COMMAND;
+
+    fg_send(fg, fg->nb_inputs, frame);
+}
+
+int fg_transcode_step(FilterGraph *graph, InputStream **best_ist)
+{
+    FilterGraphPriv *fgp = fgp_from_fg(graph);
+    InputFilterPriv *ifp;
+    int idx, ret;
+
+    *best_ist = NULL;
+
+    if (fgp->queue) {
+        if (fgp->thread_done && fgp->thread_ret < 0)
+            return fgp->thread_ret;
+
+        idx = atomic_load(&fgp->best_input);
+    } else {
+        // the graph runs on this thread
+        if (graph->graph) {
+            ret = avfilter_graph_request_oldest(graph->graph);
+            if (ret >= 0)
+                return reap_filters(graph, 0);
+
+            if (ret == AVERROR_EOF) {
+                ret = flush_outputs(graph);
+                for (int i = 0; i < graph->nb_outputs; i++)
+                    close_output_stream(graph->outputs[i]->ost);
+                return ret;
+            }
+            if (ret != AVERROR(EAGAIN))
+                return ret;
         }
+
+        idx = choose_input(graph);
     }
 
-    if (!*best_ist)
-        for (i = 0; i < graph->nb_outputs; i++)
-            graph->outputs[i]->ost->unavailable = 1;
+    if (idx >= 0) {
+        ifp = ifp_from_ifilter(graph->inputs[idx]);
+        if (!ifp->eof_sent && !input_files[ifp->ist->file_index]->eagain) {
+            *best_ist = ifp->ist;
+            return 0;
+        }
+    }
+
+    // the preferred input is not available; a filtering thread may not have
+    // noticed its EOF yet, so let it have data on any other input
+    for (int i = 0; fgp->queue && i < graph->nb_inputs; i++) {
+        ifp = ifp_from_ifilter(graph->inputs[i]);
+        if (!ifp->eof_sent && !input_files[ifp->ist->file_index]->eagain) {
+            *best_ist = ifp->ist;
+            return 0;
+        }
+    }
+
+    for (int i = 0; i < graph->nb_outputs; i++)
+        graph->outputs[i]->ost->unavailable = 1;
 
     return 0;
 }
+
+int fg_thread_start(FilterGraph *fg)
+{
+    FilterGraphPriv *fgp = fgp_from_fg(fg);
+    ObjPool *op;
+    int ret;
+
+    // the subtitle heartbeat is processed synchronously with decoding, so
+    // graphs feeding such streams stay on the main thread
+    for (int i = 0; i < fg->nb_outputs; i++)
+        if (fg->outputs[i]->ost->fix_sub_duration_heartbeat)
+            return 0;
+
+    op = objpool_alloc_frames();
+    if (!op)
+        return AVERROR(ENOMEM);
+
+    fgp->queue = tq_alloc(fg->nb_inputs + 1, 8, op, frame_move);
+    if (!fgp->queue) {
+        objpool_free(&op);
+        return AVERROR(ENOMEM);
+    }
+
+    atomic_init(&fgp->best_input, fg->nb_inputs ? 0 : -1);
+    atomic_init(&fgp->abort_request, 0);
+
+    if (stats_json_avio || stats_events_avio)
+        tq_set_depth_hist(fgp->queue, &fg->stage.depth_in);
+
+    ret = pthread_create(&fgp->thread, NULL, filter_thread, fg);
+    if (ret) {
+        tq_free(&fgp->queue);
+        return AVERROR(ret);
+    }
+
+    if (!fg->nb_inputs) {
+        for (int i = 0; i < fg->nb_outputs; i++)
+            fg->outputs[i]->ost->inputs_done = 1;
+    }
+
+    return 0;
+}
+
+int fg_thread_stop(FilterGraph *fg, int abort_request)
+{
+    FilterGraphPriv *fgp = fgp_from_fg(fg);
+    void *ret;
+
+    if (!fgp->queue)
+        return 0;
+
+    if (abort_request)
+        atomic_store(&fgp->abort_request, 1);
+
+    for (int i = 0; i < fg->nb_inputs; i++)
+        ifilter_send_eof(fg->inputs[i], AV_NOPTS_VALUE, AV_TIME_BASE_Q);
+    tq_send_finish(fgp->queue, fg->nb_inputs);
+
+    pthread_join(fgp->thread, &ret);
+
+    tq_free(&fgp->queue);
+
+    return (int)(intptr_t)ret;
+}
@@ -40,6 +40,12 @@
 
 int want_sdp = 1;
 
+/* Streams are initialized and packets submitted from the encoding threads,
+ * this protects the state that is shared between the streams before the
+ * muxer is started: the muxing queues, which streams are initialized and
+ * the muxing timebases, which may change when the muxer starts. */
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static Muxer *mux_from_of(OutputFile *of)
 {
     return (Muxer*)of;
@@ -137,6 +143,21 @@ static int write_packet(Muxer *mux, OutputStream *ost, AVPacket *pkt)
     if (ms->stats.io)
         enc_stats_write(ost, &ms->stats, NULL, pkt, frame_num);
 
+    if (ost->type == AVMEDIA_TYPE_VIDEO && (pkt->flags & AV_PKT_FLAG_KEY)) {
+        atomic_fetch_add(&ost->keyframes_written, 1);
+        if (stats_events_avio)
+            stats_event_keyframe(ost, pkt);
+    }
+
+    if (stats_json_avio && pkt->opaque_ref) {
+        // encoded packets carry the data of the frame they were encoded from,
+        // streamcopied ones the data attached by the demuxer
+        int64_t wallclock = ost->enc_ctx ?
+            ((FrameData*)pkt->opaque_ref->data)->wallclock_demux :
+            ((DemuxPktData*)pkt->opaque_ref->data)->wallclock;
+        latency_update(&ost->latency, wallclock);
+    }
+
     ret = av_interleaved_write_frame(s, pkt);
     if (ret < 0) {
         av_log(ost, AV_LOG_ERROR,
@@ -208,11 +229,15 @@ static void *muxer_thread(void *arg)
 
     thread_set_name(of);
 
+    stage_start(&of->stage);
+
     while (1) {
         OutputStream *ost;
         int stream_idx, stream_eof = 0;
+        int64_t wait_start = stage_wait_start();
 
         ret = tq_receive(mux->tq, &stream_idx, pkt);
+        stage_wait_end(&of->stage.wait_in, wait_start);
         if (stream_idx < 0) {
             av_log(mux, AV_LOG_VERBOSE, "All streams finished\n");
             ret = 0;
@@ -237,6 +262,8 @@ static void *muxer_thread(void *arg)
     }
 
 finish:
+    stage_end(&of->stage);
+
     av_packet_free(&pkt);
 
     for (unsigned int i = 0; i < mux->fc->nb_streams; i++)
@@ -251,10 +278,14 @@ static int thread_submit_packet(Muxer *mux, OutputStream *ost, AVPacket *pkt)
 {
     int ret = 0;
 
-    if (!pkt || ost->finished & MUXER_FINISHED)
+    int64_t wait_start;
+
+    if (!pkt || atomic_load(&ost->finished) & MUXER_FINISHED)
         goto finish;
 
+    wait_start = stage_wait_start();
     ret = tq_send(mux->tq, ost->index, pkt);
+    stage_wait_end(&ost->stage.wait_out, wait_start);
     if (ret < 0)
         goto finish;
 
@@ -264,7 +295,7 @@ finish:
     if (pkt)
         av_packet_unref(pkt);
 
-    ost->finished |= MUXER_FINISHED;
+    atomic_fetch_or(&ost->finished, MUXER_FINISHED);
     tq_send_finish(mux->tq, ost->index);
     return ret == AVERROR_EOF ? 0 : ret;
 }
@@ -315,21 +346,36 @@ static int submit_packet(Muxer *mux, AVPacket *pkt, OutputStream *ost)
 {
     int ret;
 
+    pthread_mutex_lock(&init_lock);
+
     if (mux->tq) {
+        pthread_mutex_unlock(&init_lock);
         return thread_submit_packet(mux, ost, pkt);
-    } else {
-        /* the muxer is not initialized yet, buffer the packet */
-        ret = queue_packet(ost, pkt);
-        if (ret < 0) {
-            if (pkt)
-                av_packet_unref(pkt);
-            return ret;
-        }
+    }
+
+    /* the muxer is not initialized yet, buffer the packet */
+    ret = queue_packet(ost, pkt);
+    pthread_mutex_unlock(&init_lock);
+    if (ret < 0) {
+        if (pkt)
+            av_packet_unref(pkt);
+        return ret;
     }
 
     return 0;
 }
 
+static AVRational get_mux_timebase(OutputStream *ost)
+{
+    AVRational tb;
+
+    pthread_mutex_lock(&init_lock);
+    tb = ost->mux_timebase;
+    pthread_mutex_unlock(&init_lock);
+
+    return tb;
+}
+
 int of_output_packet(OutputFile *of, OutputStream *ost, AVPacket *pkt)
 {
     Muxer *mux = mux_from_of(of);
@@ -338,12 +384,15 @@ int of_output_packet(OutputFile *of, OutputStream *ost, AVPacket *pkt)
     int ret = 0;
 
     if (pkt && pkt->dts != AV_NOPTS_VALUE)
-        ost->last_mux_dts = av_rescale_q(pkt->dts, pkt->time_base, AV_TIME_BASE_Q);
+        atomic_store(&ost->last_mux_dts,
+                     av_rescale_q(pkt->dts, pkt->time_base, AV_TIME_BASE_Q));
 
     /* rescale timestamps to the muxing timebase */
     if (pkt) {
-        av_packet_rescale_ts(pkt, pkt->time_base, ost->mux_timebase);
-        pkt->time_base = ost->mux_timebase;
+        AVRational tb = get_mux_timebase(ost);
+
+        av_packet_rescale_ts(pkt, pkt->time_base, tb);
+        pkt->time_base = tb;
     }
 
     /* apply the output bitstream filters */
@@ -391,8 +440,9 @@ int of_streamcopy(OutputStream *ost, const AVPacket *pkt, int64_t dts)
 {
     OutputFile *of = output_files[ost->file_index];
     MuxStream  *ms = ms_from_ost(ost);
+    AVRational mux_tb = get_mux_timebase(ost);
     int64_t start_time = (of->start_time == AV_NOPTS_VALUE) ? 0 : of->start_time;
-    int64_t ost_tb_start_time = av_rescale_q(start_time, AV_TIME_BASE_Q, ost->mux_timebase);
+    int64_t ost_tb_start_time = av_rescale_q(start_time, AV_TIME_BASE_Q, mux_tb);
     AVPacket *opkt = ms->pkt;
     int ret;
 
@@ -425,7 +475,7 @@ int of_streamcopy(OutputStream *ost, const AVPacket *pkt, int64_t dts)
     if (ret < 0)
         return ret;
 
-    opkt->time_base = ost->mux_timebase;
+    opkt->time_base = mux_tb;
 
     if (pkt->pts != AV_NOPTS_VALUE)
         opkt->pts = av_rescale_q(pkt->pts, pkt->time_base, opkt->time_base) - ost_tb_start_time;
@@ -485,6 +535,7 @@ static int thread_stop(Muxer *mux)
 
 static int thread_start(Muxer *mux)
 {
+    OutputFile      *of = &mux->of;
     AVFormatContext *fc = mux->fc;
     ObjPool *op;
     int ret;
@@ -499,6 +550,27 @@ static int thread_start(Muxer *mux)
         return AVERROR(ENOMEM);
     }
 
+    // let the queue absorb the bursts of packets of one stream while another
+    // stream is lagging; with a single stream, keep the lock-free queue
+    if (fc->nb_streams > 1) {
+        ret = tq_set_limits(mux->tq, THREAD_QUEUE_MAX_PACKETS,
+                            mux->thread_queue_data_limit,
+                            mux->thread_queue_duration_limit,
+                            pkt_data_size, pkt_duration_us);
+        if (ret < 0) {
+            tq_free(&mux->tq);
+            return ret;
+        }
+    }
+
+    if (stats_json_avio || stats_events_avio) {
+        tq_set_depth_hist(mux->tq, &of->stage.depth_in);
+        if (of->sq_encode)
+            sq_set_depth_hist(of->sq_encode, &of->sq_encode_depth);
+        if (mux->sq_mux)
+            sq_set_depth_hist(mux->sq_mux, &of->sq_mux_depth);
+    }
+
     ret = pthread_create(&mux->thread, NULL, muxer_thread, (void*)mux);
     if (ret) {
         tq_free(&mux->tq);
@@ -593,7 +665,7 @@ int mux_check_init(Muxer *mux)
 
     for (i = 0; i < fc->nb_streams; i++) {
         OutputStream *ost = of->streams[i];
-        if (!ost->initialized)
+        if (!atomic_load(&ost->initialized))
             return 0;
     }
 
@@ -684,9 +756,14 @@ int of_stream_init(OutputFile *of, OutputStream *ost)
                                          ost->st->time_base);
     }
 
-    ost->initialized = 1;
+    pthread_mutex_lock(&init_lock);
+
+    atomic_store(&ost->initialized, 1);
+    ret = mux_check_init(mux);
 
-    return mux_check_init(mux);
+    pthread_mutex_unlock(&init_lock);
+
+    return ret;
 }
 
 static int check_written(OutputFile *of)
@@ -766,6 +843,13 @@ static void mux_final_stats(Muxer *mux)
                    ost->frames_encoded);
             if (type == AVMEDIA_TYPE_AUDIO)
                 av_log(of, AV_LOG_VERBOSE, " (%"PRIu64" samples)", ost->samples_encoded);
+            // packets of encoders without DR1 are not taken from pools
+            if (ost->enc_ctx->codec->capabilities & AV_CODEC_CAP_DR1 ||
+                (type == AVMEDIA_TYPE_AUDIO && ost->sq_idx_encode >= 0))
+                av_log(of, AV_LOG_VERBOSE, "; %"PRIu64" buffer pool misses",
+                       atomic_load(&ost->pool_misses) +
+                       (ost->sq_idx_encode >= 0 ?
+                        sq_pool_misses(of->sq_encode, ost->sq_idx_encode) : 0));
             av_log(of, AV_LOG_VERBOSE, "; ");
         }
 
@@ -924,6 +1008,10 @@ void of_close(OutputFile **pof)
         return;
     mux = mux_from_of(of);
 
+    // the encoding threads may still be sending packets to the muxer
+    for (int i = 0; i < of->nb_streams; i++)
+        enc_free(&of->streams[i]->enc);
+
     thread_stop(mux);
 
     sq_free(&of->sq_encode);
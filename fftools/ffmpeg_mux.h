@@ -100,6 +100,9 @@ typedef struct Muxer {
     AVDictionary *opts;
 
     int thread_queue_size;
+    /* limits for the growth of the thread queue, see tq_set_limits() */
+    int64_t thread_queue_data_limit;
+    int64_t thread_queue_duration_limit;
 
     /* filesize limit expressed in bytes */
     int64_t limit_filesize;
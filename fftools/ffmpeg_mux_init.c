@@ -919,7 +919,7 @@ static int new_stream_audio(Muxer *mux, const OptionsContext *o,
 static int new_stream_attachment(Muxer *mux, const OptionsContext *o,
                                  OutputStream *ost)
 {
-    ost->finished    = 1;
+    atomic_store(&ost->finished, ENCODER_FINISHED);
     return 0;
 }
 
@@ -1395,7 +1395,7 @@ static int ost_add(Muxer *mux, const OptionsContext *o, enum AVMediaType type,
     if (ost->enc_ctx && av_get_exact_bits_per_sample(ost->enc_ctx->codec_id) == 24)
         av_dict_set(&ost->swr_opts, "output_sample_bits", "24", 0);
 
-    ost->last_mux_dts = AV_NOPTS_VALUE;
+    atomic_init(&ost->last_mux_dts, AV_NOPTS_VALUE);
 
     MATCH_PER_STREAM_OPT(copy_initial_nonkeyframes, i,
                          ms->copy_initial_nonkeyframes, oc, st);
@@ -1473,6 +1473,10 @@ static int map_auto_video(Muxer *mux, const OptionsContext *o)
         InputFile *ifile = input_files[j];
         InputStream *file_best_ist = NULL;
         int file_best_score = 0;
+
+        if (o->seg_input >= 0 && j != o->seg_input)
+            continue;
+
         for (int i = 0; i < ifile->nb_streams; i++) {
             InputStream *ist = ifile->streams[i];
             int score;
@@ -1524,6 +1528,10 @@ static int map_auto_audio(Muxer *mux, const OptionsContext *o)
         InputFile *ifile = input_files[j];
         InputStream *file_best_ist = NULL;
         int file_best_score = 0;
+
+        if (o->seg_input >= 0 && j != o->seg_input)
+            continue;
+
         for (int i = 0; i < ifile->nb_streams; i++) {
             InputStream *ist = ifile->streams[i];
             int score;
@@ -1565,7 +1573,8 @@ static int map_auto_subtitle(Muxer *mux, const OptionsContext *o)
         return 0;
 
     for (InputStream *ist = ist_iter(NULL); ist; ist = ist_iter(ist))
-        if (ist->st->codecpar->codec_type == AVMEDIA_TYPE_SUBTITLE) {
+        if (ist->st->codecpar->codec_type == AVMEDIA_TYPE_SUBTITLE &&
+            (o->seg_input < 0 || ist->file_index == o->seg_input)) {
             AVCodecDescriptor const *input_descriptor =
                 avcodec_descriptor_get(ist->st->codecpar->codec_id);
             AVCodecDescriptor const *output_descriptor = NULL;
@@ -1603,7 +1612,8 @@ static int map_auto_data(Muxer *mux, const OptionsContext *o)
         return 0;
 
     for (InputStream *ist = ist_iter(NULL); ist; ist = ist_iter(ist)) {
-        if (ist->user_set_discard == AVDISCARD_ALL)
+        if (ist->user_set_discard == AVDISCARD_ALL ||
+            (o->seg_input >= 0 && ist->file_index != o->seg_input))
             continue;
         if (ist->st->codecpar->codec_type == AVMEDIA_TYPE_DATA &&
             ist->st->codecpar->codec_id == codec_id) {
@@ -1653,7 +1663,10 @@ loop_end:
         if (ret < 0)
             return ret;
     } else {
-        ist = input_files[map->file_index]->streams[map->stream_index];
+        // all the inputs of parallel segments are the same file
+        int file_index = o->seg_input >= 0 ? o->seg_input : map->file_index;
+
+        ist = input_files[file_index]->streams[map->stream_index];
         if (ist->user_set_discard == AVDISCARD_ALL) {
             av_log(mux, AV_LOG_FATAL, "Stream #%d:%d is disabled and cannot be mapped.\n",
                    map->file_index, map->stream_index);
@@ -2647,6 +2660,8 @@ int of_open(const OptionsContext *o, const char *filename)
     of->shortest       = o->shortest;
 
     mux->thread_queue_size = o->thread_queue_size > 0 ? o->thread_queue_size : 8;
+    mux->thread_queue_data_limit     = o->thread_queue_data_limit;
+    mux->thread_queue_duration_limit = o->thread_queue_duration_limit;
     mux->limit_filesize    = o->limit_filesize;
     av_dict_copy(&mux->opts, o->g->format_opts, 0);
 
@@ -31,6 +31,7 @@
 #include "cmdutils.h"
 #include "opt_common.h"
 #include "sync_queue.h"
+#include "thread_queue.h"
 
 #include "libavformat/avformat.h"
 
@@ -97,6 +98,7 @@ int do_psnr            = 0;
 int ignore_unknown_streams = 0;
 int copy_unknown_streams = 0;
 int recast_media = 0;
+int parallel_segments = 0;
 
 static void uninit_options(OptionsContext *o)
 {
@@ -146,9 +148,12 @@ static void init_options(OptionsContext *o)
     o->chapters_input_file = INT_MAX;
     o->accurate_seek  = 1;
     o->thread_queue_size = -1;
+    o->thread_queue_data_limit     = 8 << 20;
+    o->thread_queue_duration_limit = 2 * AV_TIME_BASE;
     o->input_sync_ref = -1;
     o->find_stream_info = 1;
     o->shortest_buf_duration = 10.f;
+    o->seg_input = -1;
 }
 
 static int show_hwaccels(void *optctx, const char *opt, const char *arg)
@@ -342,6 +347,18 @@ static int opt_stats_period(void *optctx, const char *opt, const char *arg)
     return 0;
 }
 
+static int opt_max_queue_memory(void *optctx, const char *opt, const char *arg)
+{
+    double max_bytes;
+    int ret = parse_number(opt, arg, OPT_INT64, 0, SIZE_MAX, &max_bytes);
+    if (ret < 0)
+        return ret;
+
+    tq_set_memory_limit(max_bytes);
+
+    return 0;
+}
+
 static int opt_audio_codec(void *optctx, const char *opt, const char *arg)
 {
     OptionsContext *o = optctx;
@@ -1294,6 +1311,141 @@ static int open_files(OptionGroupList *l, const char *inout,
     return 0;
 }
 
+/* Open an input file and an output file for each of the segments the input
+ * is split into with -parallel_segments. */
+static int open_segments(OptionParseContext *octx)
+{
+    OptionGroupList *il = &octx->groups[GROUP_INFILE];
+    OptionGroupList *ol = &octx->groups[GROUP_OUTFILE];
+    OptionGroup *ig, *og;
+    OptionsContext o;
+    const AVInputFormat  *ifmt = NULL;
+    const AVOutputFormat *ofmt = NULL;
+    AVDictionary *in_opts = NULL;
+    int nb_segments, ret;
+
+    if (il->nb_groups != 1 || ol->nb_groups != 1 || nb_filtergraphs) {
+        av_log(NULL, AV_LOG_FATAL, "-parallel_segments requires exactly one "
+               "input file, one output file and no complex filtergraphs.\n");
+        return AVERROR(EINVAL);
+    }
+    if (copy_ts) {
+        av_log(NULL, AV_LOG_FATAL, "-parallel_segments cannot be used with "
+               "-copyts.\n");
+        return AVERROR(EINVAL);
+    }
+    ig = &il->groups[0];
+    og = &ol->groups[0];
+
+    init_options(&o);
+    o.g = ig;
+    ret = parse_optgroup(&o, ig);
+    if (ret >= 0 && (o.start_time != AV_NOPTS_VALUE || o.start_time_eof != AV_NOPTS_VALUE ||
+                     o.recording_time != INT64_MAX || o.stop_time != INT64_MAX || o.loop)) {
+        av_log(NULL, AV_LOG_FATAL, "-parallel_segments cannot be used with "
+               "-ss, -sseof, -t, -to or -stream_loop on the input.\n");
+        ret = AVERROR(EINVAL);
+    }
+    if (ret >= 0 && o.format && !(ifmt = av_find_input_format(o.format))) {
+        av_log(NULL, AV_LOG_FATAL, "Unknown input format: '%s'\n", o.format);
+        ret = AVERROR(EINVAL);
+    }
+    uninit_options(&o);
+    if (ret < 0)
+        return ret;
+
+    nb_segments = seg_init(ig->arg, ifmt, ig->format_opts, og->arg);
+    if (nb_segments < 0)
+        return nb_segments;
+
+    // opening an input consumes the format options
+    ret = av_dict_copy(&in_opts, ig->format_opts, 0);
+    if (ret < 0)
+        return ret;
+
+    for (int i = 0; i < nb_segments; i++) {
+        const char *url;
+
+        init_options(&o);
+        o.g = ig;
+
+        av_dict_free(&ig->format_opts);
+        ret = av_dict_copy(&ig->format_opts, in_opts, 0);
+        if (ret >= 0)
+            ret = parse_optgroup(&o, ig);
+        if (ret >= 0) {
+            seg_get(i, &o.start_time, &o.stop_time, &url);
+            ret = ifile_open(&o, ig->arg);
+        }
+        uninit_options(&o);
+        if (ret < 0)
+            goto fail;
+    }
+
+    init_options(&o);
+    o.g = og;
+    ret = parse_optgroup(&o, og);
+    if (ret >= 0 && (o.start_time != AV_NOPTS_VALUE ||
+                     o.recording_time != INT64_MAX || o.stop_time != INT64_MAX)) {
+        av_log(NULL, AV_LOG_FATAL, "-parallel_segments cannot be used with "
+               "-ss, -t or -to on the output.\n");
+        ret = AVERROR(EINVAL);
+    }
+    if (ret >= 0) {
+        ofmt = o.format ? av_guess_format(o.format, NULL, NULL) :
+                          av_guess_format(NULL, og->arg, NULL);
+        if (!ofmt) {
+            av_log(NULL, AV_LOG_FATAL, "Unable to choose an output format "
+                   "for '%s'\n", og->arg);
+            ret = AVERROR(EINVAL);
+        }
+    }
+    uninit_options(&o);
+    if (ret < 0)
+        goto fail;
+
+    ret = seg_set_output(ofmt, og->format_opts);
+    if (ret < 0)
+        goto fail;
+
+    ret = assert_file_overwrite(og->arg);
+    if (ret < 0)
+        goto fail;
+
+    for (int i = 0; i < nb_segments; i++) {
+        int64_t start_time, stop_time;
+        const char *url;
+
+        init_options(&o);
+        o.g = og;
+
+        ret = parse_optgroup(&o, og);
+        if (ret >= 0) {
+            seg_get(i, &start_time, &stop_time, &url);
+
+            // the segments are written in the format of the output
+            av_freep(&o.format);
+            o.format = av_strdup(ofmt->name);
+            if (!o.format)
+                ret = AVERROR(ENOMEM);
+
+            o.seg_input = i;
+            // all the chapters are taken from the first segment
+            if (i)
+                o.chapters_input_file = -1;
+        }
+        if (ret >= 0)
+            ret = of_open(&o, url);
+        uninit_options(&o);
+        if (ret < 0)
+            goto fail;
+    }
+
+fail:
+    av_dict_free(&in_opts);
+    return ret;
+}
+
 int ffmpeg_parse_options(int argc, char **argv)
 {
     OptionParseContext octx;
@@ -1320,25 +1472,33 @@ int ffmpeg_parse_options(int argc, char **argv)
     /* configure terminal and setup signal handlers */
     term_init();
 
-    /* open input files */
-    ret = open_files(&octx.groups[GROUP_INFILE], "input", ifile_open);
-    if (ret < 0) {
-        errmsg = "opening input files";
-        goto fail;
-    }
+    if (parallel_segments > 1) {
+        ret = open_segments(&octx);
+        if (ret < 0) {
+            errmsg = "opening the segments";
+            goto fail;
+        }
+    } else {
+        /* open input files */
+        ret = open_files(&octx.groups[GROUP_INFILE], "input", ifile_open);
+        if (ret < 0) {
+            errmsg = "opening input files";
+            goto fail;
+        }
 
-    /* create the complex filtergraphs */
-    ret = init_complex_filters();
-    if (ret < 0) {
-        errmsg = "initializing complex filters";
-        goto fail;
-    }
+        /* create the complex filtergraphs */
+        ret = init_complex_filters();
+        if (ret < 0) {
+            errmsg = "initializing complex filters";
+            goto fail;
+        }
 
-    /* open output files */
-    ret = open_files(&octx.groups[GROUP_OUTFILE], "output", of_open);
-    if (ret < 0) {
-        errmsg = "opening output files";
-        goto fail;
+        /* open output files */
+        ret = open_files(&octx.groups[GROUP_OUTFILE], "output", of_open);
+        if (ret < 0) {
+            errmsg = "opening output files";
+            goto fail;
+        }
     }
 
     correct_input_start_times();
@@ -1360,21 +1520,33 @@ fail:
     return ret;
 }
 
-static int opt_progress(void *optctx, const char *opt, const char *arg)
+/* Open the URL a report is written to, "-" meaning stdout. */
+static int open_report_url(AVIOContext **avio, const char *url, const char *what)
 {
-    AVIOContext *avio = NULL;
     int ret;
 
-    if (!strcmp(arg, "-"))
-        arg = "pipe:";
-    ret = avio_open2(&avio, arg, AVIO_FLAG_WRITE, &int_cb, NULL);
-    if (ret < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Failed to open progress URL \"%s\": %s\n",
-               arg, av_err2str(ret));
-        return ret;
-    }
-    progress_avio = avio;
-    return 0;
+    if (!strcmp(url, "-"))
+        url = "pipe:";
+    ret = avio_open2(avio, url, AVIO_FLAG_WRITE, &int_cb, NULL);
+    if (ret < 0)
+        av_log(NULL, AV_LOG_ERROR, "Failed to open %s URL \"%s\": %s\n",
+               what, url, av_err2str(ret));
+    return ret;
+}
+
+static int opt_progress(void *optctx, const char *opt, const char *arg)
+{
+    return open_report_url(&progress_avio, arg, "progress");
+}
+
+static int opt_stats_json(void *optctx, const char *opt, const char *arg)
+{
+    return open_report_url(&stats_json_avio, arg, "stats JSON");
+}
+
+static int opt_stats_events(void *optctx, const char *opt, const char *arg)
+{
+    return open_report_url(&stats_events_avio, arg, "stats events");
 }
 
 int opt_timelimit(void *optctx, const char *opt, const char *arg)
@@ -1498,6 +1670,10 @@ const OptionDef options[] = {
       "add timings for each task" },
     { "progress",       HAS_ARG | OPT_EXPERT,                        { .func_arg = opt_progress },
       "write program-readable progress information", "url" },
+    { "stats_json",     HAS_ARG | OPT_EXPERT,                        { .func_arg = opt_stats_json },
+      "write per-thread timing, queue depth and latency statistics as JSON", "url" },
+    { "stats_events",   HAS_ARG | OPT_EXPERT,                        { .func_arg = opt_stats_events },
+      "write progress reports and keyframe events as JSON lines", "url" },
     { "stdin",          OPT_BOOL | OPT_EXPERT,                       { &stdin_interaction },
       "enable or disable interaction on standard input" },
     { "timelimit",      HAS_ARG | OPT_EXPERT,                        { .func_arg = opt_timelimit },
@@ -1581,6 +1757,8 @@ const OptionDef options[] = {
         "create a complex filtergraph", "graph_description" },
     { "filter_complex_threads", HAS_ARG | OPT_INT,                   { &filter_complex_nbthreads },
         "number of threads for -filter_complex" },
+    { "parallel_segments", HAS_ARG | OPT_INT | OPT_EXPERT,           { &parallel_segments },
+        "split the input at keyframes and transcode that many segments in parallel", "number" },
     { "lavfi",          HAS_ARG | OPT_EXPERT,                        { .func_arg = opt_filter_complex },
         "create a complex filtergraph", "graph_description" },
     { "filter_complex_script", HAS_ARG | OPT_EXPERT,                 { .func_arg = opt_filter_complex_script },
@@ -1612,8 +1790,18 @@ const OptionDef options[] = {
     { "thread_queue_size", HAS_ARG | OPT_INT | OPT_OFFSET | OPT_EXPERT | OPT_INPUT | OPT_OUTPUT,
                                                                      { .off = OFFSET(thread_queue_size) },
         "set the maximum number of queued packets from the demuxer" },
+    { "thread_queue_data_limit", HAS_ARG | OPT_INT64 | OPT_OFFSET | OPT_EXPERT | OPT_INPUT | OPT_OUTPUT,
+                                                                     { .off = OFFSET(thread_queue_data_limit) },
+        "set the size of queued packets above which the demuxing/muxing queue stops growing", "bytes" },
+    { "thread_queue_duration_limit", HAS_ARG | OPT_TIME | OPT_OFFSET | OPT_EXPERT | OPT_INPUT | OPT_OUTPUT,
+                                                                     { .off = OFFSET(thread_queue_duration_limit) },
+        "set the duration of queued packets above which the demuxing/muxing queue stops growing", "duration" },
+    { "max_queue_memory", HAS_ARG | OPT_EXPERT,                      { .func_arg = opt_max_queue_memory },
+        "set the size of the packets in all the demuxing/muxing queues above which they stop growing", "bytes" },
     { "find_stream_info", OPT_BOOL | OPT_INPUT | OPT_EXPERT | OPT_OFFSET, { .off = OFFSET(find_stream_info) },
         "read and decode the streams to fill missing information with heuristics" },
+    { "probe_cache",    OPT_STRING | HAS_ARG | OPT_INPUT | OPT_EXPERT | OPT_OFFSET, { .off = OFFSET(probe_cache) },
+        "reuse the stream information found in earlier runs, stored in the given directory", "directory" },
     { "bits_per_raw_sample", OPT_INT | HAS_ARG | OPT_EXPERT | OPT_SPEC | OPT_OUTPUT,
         { .off = OFFSET(bits_per_raw_sample) },
         "set the number of bits per raw sample", "number" },
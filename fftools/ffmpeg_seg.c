@@ -0,0 +1,618 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Parallel segment transcoding: the input is split at keyframes of its main
+ * stream into -parallel_segments parts, each of which is transcoded by its
+ * own input file/output file pair into a temporary file in the output
+ * format. Once they are all done, the packets of the temporary files are
+ * concatenated into the actual output.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "ffmpeg.h"
+
+#include "libavutil/avstring.h"
+#include "libavutil/fifo.h"
+#include "libavutil/log.h"
+#include "libavutil/mem.h"
+#include "libavutil/timestamp.h"
+
+#include "libavcodec/packet.h"
+
+#include "libavformat/avformat.h"
+#include "libavformat/avio.h"
+
+typedef struct Segment {
+    // input timestamp the segment starts at, in AV_TIME_BASE
+    int64_t start;
+    char   *url;
+} Segment;
+
+static Segment *segments;
+static int   nb_segments;
+// start of the input, which the input options are relative to
+static int64_t input_start;
+
+static char                 *out_url;
+static const AVOutputFormat *out_format;
+static AVDictionary         *out_opts;
+
+/* The stream the input is split at and the segments are aligned on. */
+static int ref_stream(AVFormatContext *ic)
+{
+    int idx = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (idx < 0)
+        idx = av_find_best_stream(ic, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    return idx;
+}
+
+/* Find the timestamp of the keyframe of the given stream the demuxer seeks to
+ * for target, which it looks up in its index when it has one. */
+static int find_split(AVFormatContext *ic, int st_idx, int64_t target,
+                      int64_t *split)
+{
+    AVStream *st = ic->streams[st_idx];
+    int64_t ts = av_rescale_q(target, AV_TIME_BASE_Q, st->time_base);
+    AVPacket *pkt;
+    int ret;
+
+    ret = avformat_seek_file(ic, st_idx, INT64_MIN, ts, ts, 0);
+    if (ret < 0)
+        return ret;
+
+    pkt = av_packet_alloc();
+    if (!pkt)
+        return AVERROR(ENOMEM);
+
+    // index entries may be decoding timestamps, use those of the packet
+    while ((ret = av_read_frame(ic, pkt)) >= 0) {
+        int found = pkt->stream_index == st_idx && pkt->pts != AV_NOPTS_VALUE &&
+                    (pkt->flags & AV_PKT_FLAG_KEY);
+
+        if (found)
+            *split = av_rescale_q_rnd(pkt->pts, st->time_base, AV_TIME_BASE_Q,
+                                      AV_ROUND_UP | AV_ROUND_PASS_MINMAX);
+        av_packet_unref(pkt);
+        if (found)
+            break;
+    }
+
+    av_packet_free(&pkt);
+    return ret == AVERROR_EOF ? 0 : ret;
+}
+
+int seg_init(const char *in_url, const AVInputFormat *ifmt,
+             const AVDictionary *in_opts, const char *url)
+{
+    AVFormatContext *ic = NULL;
+    AVDictionary *o = NULL;
+    const char *proto_name = avio_find_protocol_name(url);
+    int st_idx, ret;
+
+    if (!proto_name || strcmp(proto_name, "file")) {
+        av_log(NULL, AV_LOG_ERROR, "Parallel segments can only be written "
+               "to files\n");
+        return AVERROR(EINVAL);
+    }
+    av_dict_copy(&o, in_opts, 0);
+    ret = avformat_open_input(&ic, in_url, ifmt, &o);
+    av_dict_free(&o);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Error opening input %s: %s\n",
+               in_url, av_err2str(ret));
+        return ret;
+    }
+
+    ret = avformat_find_stream_info(ic, NULL);
+    if (ret < 0)
+        goto finish;
+
+    if (ic->duration == AV_NOPTS_VALUE || ic->duration <= 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot split input %s of unknown duration "
+               "into segments\n", in_url);
+        ret = AVERROR(EINVAL);
+        goto finish;
+    }
+    input_start = ic->start_time == AV_NOPTS_VALUE ? 0 : ic->start_time;
+
+    // split at the keyframes of the video, otherwise at any audio packet
+    st_idx = ref_stream(ic);
+    if (st_idx < 0) {
+        av_log(NULL, AV_LOG_ERROR, "No stream to split input %s at\n", in_url);
+        ret = AVERROR(EINVAL);
+        goto finish;
+    }
+
+    segments = av_calloc(parallel_segments, sizeof(*segments));
+    if (!segments) {
+        ret = AVERROR(ENOMEM);
+        goto finish;
+    }
+    // the input -to is applied to each stream relative to its first frame,
+    // so all the segments must start at a frame of the splitting stream
+    segments[0].start = input_start;
+    if (ic->streams[st_idx]->start_time != AV_NOPTS_VALUE)
+        segments[0].start = av_rescale_q_rnd(ic->streams[st_idx]->start_time,
+                                             ic->streams[st_idx]->time_base,
+                                             AV_TIME_BASE_Q,
+                                             AV_ROUND_UP | AV_ROUND_PASS_MINMAX);
+    nb_segments = 1;
+
+    for (int i = 1; i < parallel_segments; i++) {
+        int64_t target = input_start + av_rescale(ic->duration, i, parallel_segments);
+        int64_t split  = AV_NOPTS_VALUE;
+
+        ret = find_split(ic, st_idx, target, &split);
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Error looking for a keyframe near %s "
+                   "in input %s: %s\n", av_ts2timestr(target, &AV_TIME_BASE_Q),
+                   in_url, av_err2str(ret));
+            goto finish;
+        }
+
+        // there are fewer keyframes than segments
+        if (split == AV_NOPTS_VALUE || split <= segments[nb_segments - 1].start)
+            continue;
+
+        segments[nb_segments++].start = split;
+    }
+
+    for (int i = 0; i < nb_segments; i++) {
+        segments[i].url = av_asprintf("%s.seg%d.tmp", url, i);
+        if (!segments[i].url) {
+            ret = AVERROR(ENOMEM);
+            goto finish;
+        }
+        av_log(NULL, AV_LOG_VERBOSE, "Segment %d starts at %s, written to %s\n",
+               i, av_ts2timestr(segments[i].start, &AV_TIME_BASE_Q),
+               segments[i].url);
+    }
+
+    out_url = av_strdup(url);
+    if (!out_url) {
+        ret = AVERROR(ENOMEM);
+        goto finish;
+    }
+
+    if (nb_segments < parallel_segments)
+        av_log(NULL, AV_LOG_WARNING, "Only found keyframes to split input %s "
+               "into %d segments\n", in_url, nb_segments);
+
+    ret = nb_segments;
+finish:
+    avformat_close_input(&ic);
+    return ret;
+}
+
+int seg_set_output(const AVOutputFormat *ofmt, const AVDictionary *opts)
+{
+    if (ofmt->flags & (AVFMT_NOFILE | AVFMT_NOTIMESTAMPS)) {
+        av_log(NULL, AV_LOG_ERROR, "Parallel segments are not supported with "
+               "the %s format\n", ofmt->name);
+        return AVERROR(EINVAL);
+    }
+
+    out_format = ofmt;
+    return av_dict_copy(&out_opts, opts, 0);
+}
+
+void seg_get(int idx, int64_t *start_time, int64_t *stop_time, const char **url)
+{
+    const Segment *seg = &segments[idx];
+
+    *start_time = seg->start - input_start;
+    *stop_time  = idx < nb_segments - 1 ? seg[1].start - input_start : INT64_MAX;
+    *url        = seg->url;
+}
+
+static int copy_chapters(AVFormatContext *oc, const AVFormatContext *ic)
+{
+    AVChapter **tmp;
+
+    if (!ic->nb_chapters)
+        return 0;
+
+    tmp = av_realloc_array(oc->chapters, ic->nb_chapters, sizeof(*oc->chapters));
+    if (!tmp)
+        return AVERROR(ENOMEM);
+    oc->chapters = tmp;
+
+    for (int i = 0; i < ic->nb_chapters; i++) {
+        const AVChapter *in_ch = ic->chapters[i];
+        AVChapter      *out_ch = av_mallocz(sizeof(*out_ch));
+
+        if (!out_ch)
+            return AVERROR(ENOMEM);
+        oc->chapters[oc->nb_chapters++] = out_ch;
+
+        out_ch->id        = in_ch->id;
+        out_ch->time_base = in_ch->time_base;
+        out_ch->start     = in_ch->start;
+        out_ch->end       = in_ch->end;
+        av_dict_copy(&out_ch->metadata, in_ch->metadata, 0);
+    }
+
+    return 0;
+}
+
+/* Create the output streams from those of the first segment and open the
+ * output. */
+static int output_open(AVFormatContext *oc, const AVFormatContext *ic)
+{
+    AVDictionary *opts = NULL;
+    int ret;
+
+    for (int i = 0; i < ic->nb_streams; i++) {
+        const AVStream *ist = ic->streams[i];
+        AVStream       *ost = avformat_new_stream(oc, NULL);
+
+        if (!ost)
+            return AVERROR(ENOMEM);
+
+        ret = avcodec_parameters_copy(ost->codecpar, ist->codecpar);
+        if (ret < 0)
+            return ret;
+
+        // let the muxer choose the tag when it does not know this one
+        if (oc->oformat->codec_tag &&
+            av_codec_get_id(oc->oformat->codec_tag,
+                            ost->codecpar->codec_tag) != ost->codecpar->codec_id)
+            ost->codecpar->codec_tag = 0;
+
+        ost->time_base           = ist->time_base;
+        ost->avg_frame_rate      = ist->avg_frame_rate;
+        ost->r_frame_rate        = ist->r_frame_rate;
+        ost->sample_aspect_ratio = ist->sample_aspect_ratio;
+        ost->disposition         = ist->disposition;
+
+        ret = av_dict_copy(&ost->metadata, ist->metadata, 0);
+        if (ret < 0)
+            return ret;
+
+        for (int j = 0; j < ist->nb_side_data; j++) {
+            const AVPacketSideData *sd_src = &ist->side_data[j];
+            uint8_t *dst_data;
+
+            dst_data = av_stream_new_side_data(ost, sd_src->type, sd_src->size);
+            if (!dst_data)
+                return AVERROR(ENOMEM);
+            memcpy(dst_data, sd_src->data, sd_src->size);
+        }
+    }
+
+    ret = av_dict_copy(&oc->metadata, ic->metadata, 0);
+    if (ret < 0)
+        return ret;
+
+    ret = copy_chapters(oc, ic);
+    if (ret < 0)
+        return ret;
+
+    if (!(oc->oformat->flags & AVFMT_NOFILE)) {
+        ret = avio_open2(&oc->pb, out_url, AVIO_FLAG_WRITE, &int_cb, NULL);
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Error opening output %s: %s\n",
+                   out_url, av_err2str(ret));
+            return ret;
+        }
+    }
+
+    ret = av_dict_copy(&opts, out_opts, 0);
+    if (ret >= 0)
+        ret = avformat_write_header(oc, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Error writing the header of output %s: %s\n",
+               out_url, av_err2str(ret));
+        return ret;
+    }
+
+    return 0;
+}
+
+static int segment_check(const AVFormatContext *oc, const AVFormatContext *ic,
+                         const char *url)
+{
+    if (ic->nb_streams != oc->nb_streams) {
+        av_log(NULL, AV_LOG_ERROR, "Segment %s has %u streams instead of %u\n",
+               url, ic->nb_streams, oc->nb_streams);
+        return AVERROR_BUG;
+    }
+
+    for (int i = 0; i < ic->nb_streams; i++) {
+        const AVCodecParameters *ipar = ic->streams[i]->codecpar;
+        const AVCodecParameters *opar = oc->streams[i]->codecpar;
+
+        if (ipar->codec_id != opar->codec_id) {
+            av_log(NULL, AV_LOG_ERROR, "Stream #%d of segment %s uses a "
+                   "different codec\n", i, url);
+            return AVERROR_BUG;
+        }
+        if (ipar->extradata_size != opar->extradata_size ||
+            (ipar->extradata_size &&
+             memcmp(ipar->extradata, opar->extradata, ipar->extradata_size)))
+            av_log(NULL, AV_LOG_WARNING, "Stream #%d of segment %s has "
+                   "different extradata, the output may not play "
+                   "correctly\n", i, url);
+    }
+
+    return 0;
+}
+
+typedef struct SegStream {
+    // dts of the last packet written
+    int64_t last_dts;
+    // end of the packets written, in presentation order
+    int64_t end;
+    // a packet of the current segment was written
+    int     started;
+} SegStream;
+
+/* State carried across the segments while concatenating them. */
+typedef struct SegConcat {
+    AVFormatContext *oc;
+    AVPacket        *pkt;
+    AVFifo          *queue;
+
+    SegStream       *streams;
+    // first timestamp the first segment outputs for its reference stream,
+    // which the following segments are aligned to
+    int64_t          zero;
+    AVRational       zero_tb;
+} SegConcat;
+
+static int packet_write(SegConcat *c, const AVFormatContext *ic, AVPacket *pkt,
+                        int64_t first, AVRational first_tb, int64_t delta,
+                        int64_t cut)
+{
+    const AVStream *ist = ic->streams[pkt->stream_index];
+    const AVStream *ost = c->oc->streams[pkt->stream_index];
+    SegStream      *st  = &c->streams[pkt->stream_index];
+    int64_t off = av_rescale_q(c->zero, c->zero_tb, ist->time_base) +
+                  av_rescale_q(delta, AV_TIME_BASE_Q, ist->time_base) -
+                  av_rescale_q(first, first_tb, ist->time_base);
+    int ret;
+
+    if (pkt->pts != AV_NOPTS_VALUE)
+        pkt->pts += off;
+    if (pkt->dts != AV_NOPTS_VALUE)
+        pkt->dts += off;
+
+    // packets lying mostly before the cut, like the encoder priming, cover
+    // the previous segment
+    if (cut != AV_NOPTS_VALUE && pkt->pts != AV_NOPTS_VALUE &&
+        av_compare_ts(pkt->pts + pkt->duration / 2, ist->time_base,
+                      cut, c->zero_tb) < 0) {
+        av_log(NULL, AV_LOG_VERBOSE, "Dropping packet of stream #%d before "
+               "the start of the segment at pts %s\n", pkt->stream_index,
+               av_ts2str(pkt->pts));
+        av_packet_unref(pkt);
+        return 0;
+    }
+
+    av_packet_rescale_ts(pkt, ist->time_base, ost->time_base);
+    pkt->pos = -1;
+
+    // the last frame of the previous segment may reach past the cut, like a
+    // padded audio frame; skip the packets of this segment it mostly covers
+    if (!st->started && st->end != AV_NOPTS_VALUE &&
+        pkt->pts != AV_NOPTS_VALUE && pkt->pts + pkt->duration / 2 < st->end) {
+        av_log(NULL, AV_LOG_VERBOSE, "Dropping packet of stream #%d "
+               "overlapping the previous segment at pts %s\n",
+               pkt->stream_index, av_ts2str(pkt->pts));
+        av_packet_unref(pkt);
+        return 0;
+    }
+
+    // the demuxer may not know the decoding timestamps of the first packets
+    // of a segment with reordering, continue those of the previous segment
+    if (pkt->dts == AV_NOPTS_VALUE && st->last_dts != AV_NOPTS_VALUE) {
+        pkt->dts = st->last_dts + FFMAX(pkt->duration, 1);
+        if (pkt->pts != AV_NOPTS_VALUE)
+            pkt->dts = FFMIN(pkt->dts, pkt->pts);
+    }
+
+    if (pkt->dts != AV_NOPTS_VALUE) {
+        if (st->last_dts != AV_NOPTS_VALUE && pkt->dts <= st->last_dts) {
+            av_log(NULL, AV_LOG_VERBOSE, "Dropping packet of stream #%d "
+                   "overlapping the previous segment at dts %s\n",
+                   pkt->stream_index, av_ts2str(pkt->dts));
+            av_packet_unref(pkt);
+            return 0;
+        }
+        st->last_dts = pkt->dts;
+    }
+    if (pkt->pts != AV_NOPTS_VALUE &&
+        (st->end == AV_NOPTS_VALUE || pkt->pts + pkt->duration > st->end))
+        st->end = pkt->pts + pkt->duration;
+    st->started = 1;
+
+    ret = av_interleaved_write_frame(c->oc, pkt);
+    if (ret < 0)
+        av_log(NULL, AV_LOG_ERROR, "Error writing a packet to output %s: "
+               "%s\n", out_url, av_err2str(ret));
+    return ret;
+}
+
+static int segment_write(SegConcat *c, int idx)
+{
+    const Segment *seg = &segments[idx];
+    AVFormatContext *ic = NULL;
+    AVPacket *pkt = c->pkt, *queued;
+    int64_t first = AV_NOPTS_VALUE, delta, cut = AV_NOPTS_VALUE;
+    AVRational first_tb = AV_TIME_BASE_Q;
+    int ref, found, ret;
+
+    ret = avformat_open_input(&ic, seg->url, NULL, NULL);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Error opening segment %s: %s\n",
+               seg->url, av_err2str(ret));
+        return ret;
+    }
+
+    ret = avformat_find_stream_info(ic, NULL);
+    if (ret < 0)
+        goto finish;
+
+    ret = idx ? segment_check(c->oc, ic, seg->url) : output_open(c->oc, ic);
+    if (ret < 0)
+        goto finish;
+
+    if (!c->streams) {
+        c->streams = av_malloc_array(c->oc->nb_streams, sizeof(*c->streams));
+        if (!c->streams) {
+            ret = AVERROR(ENOMEM);
+            goto finish;
+        }
+        for (int i = 0; i < c->oc->nb_streams; i++) {
+            c->streams[i].last_dts = AV_NOPTS_VALUE;
+            c->streams[i].end      = AV_NOPTS_VALUE;
+        }
+    }
+    for (int i = 0; i < c->oc->nb_streams; i++)
+        c->streams[i].started = 0;
+
+    // each segment was encoded as starting from 0, which its muxer may have
+    // shifted, e.g. by the encoder delay; align the first timestamp it
+    // outputs for the reference stream, so queue the packets preceding it
+    ref = ref_stream(ic);
+    while ((ret = av_read_frame(ic, pkt)) >= 0) {
+        if (pkt->stream_index == ref && pkt->pts != AV_NOPTS_VALUE) {
+            first    = pkt->pts;
+            first_tb = ic->streams[ref]->time_base;
+            break;
+        }
+
+        queued = av_packet_alloc();
+        if (!queued) {
+            ret = AVERROR(ENOMEM);
+            goto finish;
+        }
+        av_packet_move_ref(queued, pkt);
+        ret = av_fifo_write(c->queue, &queued, 1);
+        if (ret < 0) {
+            av_packet_free(&queued);
+            goto finish;
+        }
+    }
+    if (ret < 0 && ret != AVERROR_EOF)
+        goto finish;
+    found = first != AV_NOPTS_VALUE;
+    if (!found)
+        first = 0;
+
+    delta = seg->start - segments[0].start;
+    if (!idx) {
+        c->zero    = first;
+        c->zero_tb = first_tb;
+    } else
+        cut = c->zero + av_rescale_q(delta, AV_TIME_BASE_Q, c->zero_tb);
+
+    while (av_fifo_read(c->queue, &queued, 1) >= 0) {
+        ret = packet_write(c, ic, queued, first, first_tb, delta, cut);
+        av_packet_free(&queued);
+        if (ret < 0)
+            goto finish;
+    }
+
+    // the packet the first timestamp was taken from
+    if (found) {
+        ret = packet_write(c, ic, pkt, first, first_tb, delta, cut);
+        if (ret < 0)
+            goto finish;
+    }
+
+    while ((ret = av_read_frame(ic, pkt)) >= 0) {
+        ret = packet_write(c, ic, pkt, first, first_tb, delta, cut);
+        if (ret < 0)
+            goto finish;
+    }
+    if (ret == AVERROR_EOF)
+        ret = 0;
+
+finish:
+    while (av_fifo_read(c->queue, &queued, 1) >= 0)
+        av_packet_free(&queued);
+    av_packet_unref(pkt);
+    avformat_close_input(&ic);
+    return ret;
+}
+
+int seg_concat(void)
+{
+    SegConcat c = { 0 };
+    int ret;
+
+    if (!nb_segments)
+        return 0;
+
+    av_log(NULL, AV_LOG_INFO, "Concatenating %d segments into %s\n",
+           nb_segments, out_url);
+
+    ret = avformat_alloc_output_context2(&c.oc, out_format, NULL, out_url);
+    if (ret < 0)
+        return ret;
+
+    c.pkt   = av_packet_alloc();
+    c.queue = av_fifo_alloc2(8, sizeof(AVPacket*), AV_FIFO_FLAG_AUTO_GROW);
+    if (!c.pkt || !c.queue) {
+        ret = AVERROR(ENOMEM);
+        goto finish;
+    }
+
+    for (int i = 0; i < nb_segments; i++) {
+        ret = segment_write(&c, i);
+        if (ret < 0)
+            goto finish;
+    }
+
+    ret = av_write_trailer(c.oc);
+    if (ret < 0)
+        av_log(NULL, AV_LOG_ERROR, "Error writing the trailer of output %s: "
+               "%s\n", out_url, av_err2str(ret));
+
+finish:
+    av_freep(&c.streams);
+    av_fifo_freep2(&c.queue);
+    av_packet_free(&c.pkt);
+    if (!(c.oc->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&c.oc->pb);
+    avformat_free_context(c.oc);
+    return ret;
+}
+
+void seg_uninit(void)
+{
+    for (int i = 0; i < nb_segments; i++) {
+        const char *path = segments[i].url;
+
+        if (path) {
+            av_strstart(path, "file:", &path);
+            remove(path);
+        }
+        av_freep(&segments[i].url);
+    }
+    av_freep(&segments);
+    nb_segments = 0;
+
+    av_freep(&out_url);
+    av_dict_free(&out_opts);
+}
@@ -0,0 +1,439 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "probe_cache.h"
+
+#include "libavutil/avstring.h"
+#include "libavutil/bprint.h"
+#include "libavutil/channel_layout.h"
+#include "libavutil/dict.h"
+#include "libavutil/error.h"
+#include "libavutil/md5.h"
+#include "libavutil/mem.h"
+#include "libavutil/opt.h"
+#include "libavutil/random_seed.h"
+
+#include "libavcodec/codec_par.h"
+
+#include "libavformat/avio.h"
+
+/* bump whenever the set or meaning of the fields below changes */
+#define PROBE_CACHE_VERSION 2
+
+typedef struct ParField {
+    const char *name;
+    size_t      offset;
+    int         is_int64;
+} ParField;
+
+#define PAR_INT(x)   { #x, offsetof(AVCodecParameters, x), 0 }
+#define PAR_INT64(x) { #x, offsetof(AVCodecParameters, x), 1 }
+
+static const ParField par_fields[] = {
+    PAR_INT(codec_type),
+    PAR_INT(codec_id),
+    PAR_INT(codec_tag),
+    PAR_INT(format),
+    PAR_INT64(bit_rate),
+    PAR_INT(bits_per_coded_sample),
+    PAR_INT(bits_per_raw_sample),
+    PAR_INT(profile),
+    PAR_INT(level),
+    PAR_INT(width),
+    PAR_INT(height),
+    PAR_INT(field_order),
+    PAR_INT(color_range),
+    PAR_INT(color_primaries),
+    PAR_INT(color_trc),
+    PAR_INT(color_space),
+    PAR_INT(chroma_location),
+    PAR_INT(video_delay),
+    PAR_INT(sample_rate),
+    PAR_INT(block_align),
+    PAR_INT(frame_size),
+    PAR_INT(initial_padding),
+    PAR_INT(trailing_padding),
+    PAR_INT(seek_preroll),
+};
+
+typedef struct CachedStream {
+    AVCodecParameters *par;
+    AVRational         r_frame_rate;
+    AVRational         avg_frame_rate;
+    int64_t            start_time;
+    int64_t            duration;
+} CachedStream;
+
+/* Name of the cache entry of an input, NULL if it cannot be cached. */
+static char *entry_path(const char *dir, const AVFormatContext *ic)
+{
+    const char *proto = avio_find_protocol_name(ic->url);
+    const char *path  = ic->url;
+    char *opts = NULL, *priv_opts = NULL;
+    uint8_t md5[16];
+    char hex[2 * sizeof(md5) + 1];
+    struct stat st;
+    AVBPrint key;
+    int ret;
+
+    // only local files have a modification time to tell when they changed
+    if (!proto || strcmp(proto, "file") || !ic->iformat)
+        return NULL;
+    av_strstart(path, "file:", &path);
+    if (stat(path, &st) < 0)
+        return NULL;
+
+    // the options of the demuxer, probesize and analyzeduration among them,
+    // change the streams that are found
+    ret = av_opt_serialize((void*)ic, AV_OPT_FLAG_DECODING_PARAM,
+                           AV_OPT_SERIALIZE_SKIP_DEFAULTS, &opts, '=', ':');
+    if (ret >= 0 && ic->iformat->priv_class)
+        ret = av_opt_serialize(ic->priv_data, AV_OPT_FLAG_DECODING_PARAM,
+                               AV_OPT_SERIALIZE_SKIP_DEFAULTS, &priv_opts, '=', ':');
+    if (ret < 0) {
+        av_freep(&opts);
+        return NULL;
+    }
+
+    av_bprint_init(&key, 0, AV_BPRINT_SIZE_UNLIMITED);
+    av_bprintf(&key, "%d\n%s\n%s\n%"PRId64"\n%"PRId64"\n%"PRId64"\n%"PRId64"\n%s\n%s",
+               PROBE_CACHE_VERSION, path, ic->iformat->name,
+               (int64_t)st.st_dev, (int64_t)st.st_ino,
+               (int64_t)st.st_size, (int64_t)st.st_mtime,
+               opts, priv_opts ? priv_opts : "");
+    av_freep(&opts);
+    av_freep(&priv_opts);
+    if (!av_bprint_is_complete(&key)) {
+        av_bprint_finalize(&key, NULL);
+        return NULL;
+    }
+    av_md5_sum(md5, key.str, key.len);
+    av_bprint_finalize(&key, NULL);
+
+    for (int i = 0; i < sizeof(md5); i++)
+        snprintf(hex + 2 * i, 3, "%02x", md5[i]);
+
+    return av_asprintf("%s/%s.probe", dir, hex);
+}
+
+static int get_int64(const AVDictionary *d, const char *key, int64_t *val)
+{
+    const AVDictionaryEntry *e = av_dict_get(d, key, NULL, AV_DICT_MATCH_CASE);
+    char *end;
+
+    if (!e)
+        return AVERROR_INVALIDDATA;
+    *val = strtoll(e->value, &end, 10);
+    return *end ? AVERROR_INVALIDDATA : 0;
+}
+
+static int get_rational(const AVDictionary *d, const char *key, AVRational *val)
+{
+    const AVDictionaryEntry *e = av_dict_get(d, key, NULL, AV_DICT_MATCH_CASE);
+    char dummy;
+
+    if (!e || sscanf(e->value, "%d/%d%c", &val->num, &val->den, &dummy) != 2)
+        return AVERROR_INVALIDDATA;
+    return 0;
+}
+
+static int parse_stream(const AVDictionary *d, CachedStream *cs)
+{
+    AVCodecParameters *par = cs->par;
+    const AVDictionaryEntry *e;
+    uint64_t ch_mask;
+    int64_t val;
+    int ch_order, nb_channels, ret;
+    char dummy;
+
+    for (int i = 0; i < FF_ARRAY_ELEMS(par_fields); i++) {
+        const ParField *f = &par_fields[i];
+
+        ret = get_int64(d, f->name, &val);
+        if (ret < 0)
+            return ret;
+
+        if (f->is_int64)
+            *(int64_t*)((uint8_t*)par + f->offset) = val;
+        else if (val >= INT_MIN && val <= UINT_MAX)
+            *(int*)((uint8_t*)par + f->offset) = val;
+        else
+            return AVERROR_INVALIDDATA;
+    }
+
+    if ((ret = get_rational(d, "sample_aspect_ratio", &par->sample_aspect_ratio)) < 0 ||
+        (ret = get_rational(d, "r_frame_rate",   &cs->r_frame_rate))   < 0 ||
+        (ret = get_rational(d, "avg_frame_rate", &cs->avg_frame_rate)) < 0 ||
+        (ret = get_int64(d, "start_time", &cs->start_time)) < 0 ||
+        (ret = get_int64(d, "duration",   &cs->duration))   < 0)
+        return ret;
+
+    e = av_dict_get(d, "ch_layout", NULL, AV_DICT_MATCH_CASE);
+    if (!e || sscanf(e->value, "%d:%d:%"SCNu64"%c",
+                     &ch_order, &nb_channels, &ch_mask, &dummy) != 3 ||
+        (ch_order != AV_CHANNEL_ORDER_UNSPEC && ch_order != AV_CHANNEL_ORDER_NATIVE &&
+         ch_order != AV_CHANNEL_ORDER_AMBISONIC) || nb_channels < 0)
+        return AVERROR_INVALIDDATA;
+    par->ch_layout.order       = ch_order;
+    par->ch_layout.nb_channels = nb_channels;
+    par->ch_layout.u.mask      = ch_order == AV_CHANNEL_ORDER_NATIVE ? ch_mask : 0;
+
+    e = av_dict_get(d, "extradata", NULL, AV_DICT_MATCH_CASE);
+    if (!e)
+        return AVERROR_INVALIDDATA;
+    if (strcmp(e->value, "-")) {
+        size_t len = strlen(e->value);
+
+        if (len & 1)
+            return AVERROR_INVALIDDATA;
+        par->extradata = av_mallocz(len / 2 + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (!par->extradata)
+            return AVERROR(ENOMEM);
+        par->extradata_size = len / 2;
+        for (int i = 0; i < par->extradata_size; i++) {
+            unsigned byte;
+            if (sscanf(e->value + 2 * i, "%2x", &byte) != 1)
+                return AVERROR_INVALIDDATA;
+            par->extradata[i] = byte;
+        }
+    }
+
+    return 0;
+}
+
+int probe_cache_load(const char *dir, AVFormatContext *ic)
+{
+    CachedStream *streams = NULL;
+    AVIOContext *pb = NULL;
+    AVDictionary *d = NULL;
+    char *path, *line, *next;
+    int64_t start_time, duration, bit_rate;
+    unsigned nb_streams = 0;
+    AVBPrint buf;
+    int ret;
+
+    path = entry_path(dir, ic);
+    if (!path)
+        return 0;
+
+    av_bprint_init(&buf, 0, AV_BPRINT_SIZE_UNLIMITED);
+
+    ret = avio_open(&pb, path, AVIO_FLAG_READ);
+    if (ret < 0) {
+        ret = 0;
+        goto finish;
+    }
+    ret = avio_read_to_bprint(pb, &buf, SIZE_MAX);
+    avio_closep(&pb);
+    if (ret < 0)
+        goto invalid;
+    if (!av_bprint_is_complete(&buf)) {
+        ret = AVERROR(ENOMEM);
+        goto finish;
+    }
+
+    /* the first line describes the container, every other one a stream */
+    for (line = buf.str; *line; line = next) {
+        next = line + strcspn(line, "\n");
+        if (*next)
+            *next++ = 0;
+
+        av_dict_free(&d);
+        ret = av_dict_parse_string(&d, line, "=", " ", 0);
+        if (ret < 0)
+            goto invalid;
+
+        if (line == buf.str) {
+            int64_t val;
+
+            if (get_int64(d, "version", &val) < 0 || val != PROBE_CACHE_VERSION ||
+                get_int64(d, "nb_streams", &val) < 0 || val != ic->nb_streams ||
+                get_int64(d, "start_time", &start_time) < 0 ||
+                get_int64(d, "duration",   &duration)   < 0 ||
+                get_int64(d, "bit_rate",   &bit_rate)   < 0)
+                goto invalid;
+
+            streams = av_calloc(ic->nb_streams, sizeof(*streams));
+            if (!streams) {
+                ret = AVERROR(ENOMEM);
+                goto finish;
+            }
+            continue;
+        }
+
+        if (nb_streams >= ic->nb_streams)
+            goto invalid;
+
+        streams[nb_streams].par = avcodec_parameters_alloc();
+        if (!streams[nb_streams].par) {
+            ret = AVERROR(ENOMEM);
+            goto finish;
+        }
+        ret = parse_stream(d, &streams[nb_streams++]);
+        if (ret == AVERROR(ENOMEM))
+            goto finish;
+        else if (ret < 0)
+            goto invalid;
+    }
+    if (!streams || nb_streams != ic->nb_streams)
+        goto invalid;
+
+    /* the demuxer must have created the same streams as when the entry was
+     * stored, otherwise the file is not what it was */
+    for (unsigned i = 0; i < ic->nb_streams; i++) {
+        const AVCodecParameters *par = ic->streams[i]->codecpar;
+        const AVCodecParameters *cached = streams[i].par;
+
+        if (par->codec_type != cached->codec_type ||
+            (par->codec_id != AV_CODEC_ID_NONE && par->codec_id != cached->codec_id))
+            goto invalid;
+    }
+
+    for (unsigned i = 0; i < ic->nb_streams; i++) {
+        AVStream *st = ic->streams[i];
+
+        ret = avcodec_parameters_copy(st->codecpar, streams[i].par);
+        if (ret < 0)
+            goto finish;
+        st->r_frame_rate   = streams[i].r_frame_rate;
+        st->avg_frame_rate = streams[i].avg_frame_rate;
+        st->start_time     = streams[i].start_time;
+        st->duration       = streams[i].duration;
+    }
+    ic->start_time = start_time;
+    ic->duration   = duration;
+    ic->bit_rate   = bit_rate;
+
+    av_log(NULL, AV_LOG_VERBOSE, "Using cached stream parameters for '%s'\n", ic->url);
+    ret = 1;
+    goto finish;
+
+invalid:
+    av_log(NULL, AV_LOG_WARNING, "Ignoring invalid or stale probe cache entry '%s'\n", path);
+    ret = 0;
+finish:
+    if (streams) {
+        for (unsigned i = 0; i < ic->nb_streams; i++)
+            avcodec_parameters_free(&streams[i].par);
+        av_freep(&streams);
+    }
+    av_dict_free(&d);
+    av_bprint_finalize(&buf, NULL);
+    av_freep(&path);
+    return ret;
+}
+
+static int write_stream(AVBPrint *bp, const AVStream *st)
+{
+    const AVCodecParameters *par = st->codecpar;
+
+    // custom channel maps are not worth a syntax of their own
+    if (par->ch_layout.order == AV_CHANNEL_ORDER_CUSTOM ||
+        (par->ch_layout.order == AV_CHANNEL_ORDER_AMBISONIC && par->ch_layout.u.map))
+        return AVERROR(ENOSYS);
+
+    for (int i = 0; i < FF_ARRAY_ELEMS(par_fields); i++) {
+        const ParField *f = &par_fields[i];
+        const uint8_t *p = (const uint8_t*)par + f->offset;
+
+        av_bprintf(bp, "%s=%"PRId64" ", f->name,
+                   f->is_int64 ? *(const int64_t*)p : (int64_t)*(const int*)p);
+    }
+
+    av_bprintf(bp, "sample_aspect_ratio=%d/%d r_frame_rate=%d/%d avg_frame_rate=%d/%d "
+               "start_time=%"PRId64" duration=%"PRId64" ch_layout=%d:%d:%"PRIu64" extradata=",
+               par->sample_aspect_ratio.num, par->sample_aspect_ratio.den,
+               st->r_frame_rate.num, st->r_frame_rate.den,
+               st->avg_frame_rate.num, st->avg_frame_rate.den,
+               st->start_time, st->duration,
+               par->ch_layout.order, par->ch_layout.nb_channels,
+               par->ch_layout.order == AV_CHANNEL_ORDER_NATIVE ? par->ch_layout.u.mask : 0);
+    if (par->extradata_size > 0) {
+        for (int i = 0; i < par->extradata_size; i++)
+            av_bprintf(bp, "%02x", par->extradata[i]);
+    } else
+        av_bprintf(bp, "-");
+    av_bprintf(bp, "\n");
+
+    return 0;
+}
+
+int probe_cache_store(const char *dir, const AVFormatContext *ic)
+{
+    AVIOContext *pb = NULL;
+    char *path, *tmp = NULL;
+    AVBPrint bp;
+    int ret;
+
+    path = entry_path(dir, ic);
+    if (!path)
+        return 0;
+
+    av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
+    av_bprintf(&bp, "version=%d nb_streams=%u start_time=%"PRId64" duration=%"PRId64
+               " bit_rate=%"PRId64"\n", PROBE_CACHE_VERSION, ic->nb_streams,
+               ic->start_time, ic->duration, ic->bit_rate);
+    for (unsigned i = 0; i < ic->nb_streams; i++) {
+        ret = write_stream(&bp, ic->streams[i]);
+        if (ret < 0) {
+            ret = 0;
+            goto finish;
+        }
+    }
+    if (!av_bprint_is_complete(&bp)) {
+        ret = AVERROR(ENOMEM);
+        goto finish;
+    }
+
+    /* write to a temporary file first, so that concurrent readers never see
+     * a partial entry */
+    tmp = av_asprintf("%s.%08"PRIx32".tmp", path, av_get_random_seed());
+    if (!tmp) {
+        ret = AVERROR(ENOMEM);
+        goto finish;
+    }
+    ret = avio_open(&pb, tmp, AVIO_FLAG_WRITE);
+    if (ret < 0)
+        goto finish;
+    avio_write(pb, bp.str, bp.len);
+    ret = avio_closep(&pb);
+    if (ret >= 0 && rename(tmp, path) < 0)
+        ret = AVERROR(errno);
+    if (ret < 0)
+        remove(tmp);
+
+finish:
+    if (ret < 0)
+        av_log(NULL, AV_LOG_WARNING, "Could not store the probe cache entry '%s': %s\n",
+               path, av_err2str(ret));
+    av_bprint_finalize(&bp, NULL);
+    av_freep(&tmp);
+    av_freep(&path);
+    return ret;
+}
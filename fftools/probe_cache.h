@@ -0,0 +1,51 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef FFTOOLS_PROBE_CACHE_H
+#define FFTOOLS_PROBE_CACHE_H
+
+#include "libavformat/avformat.h"
+
+/*
+ * Cache of the stream parameters found by avformat_find_stream_info() for
+ * local files, stored in a directory with one small text file per input,
+ * named after a hash of the path, format, size and modification time of the
+ * input, and of the options of the demuxer.
+ *
+ * Inputs whose demuxer creates streams while reading packets
+ * (AVFMTCTX_NOHEADER set after avformat_open_input()) must not use the
+ * cache, those streams would be missing if avformat_find_stream_info() was
+ * not called.
+ */
+
+/**
+ * Set the parameters of the streams of an opened input from the cache.
+ *
+ * @return 1 if they were found in the cache, in which case
+ *         avformat_find_stream_info() does not need to be called, 0 if not,
+ *         a negative error code on failure
+ */
+int probe_cache_load(const char *dir, AVFormatContext *ic);
+
+/**
+ * Store the parameters of the streams of an input, once
+ * avformat_find_stream_info() found them, in the cache.
+ */
+int probe_cache_store(const char *dir, const AVFormatContext *ic);
+
+#endif // FFTOOLS_PROBE_CACHE_H
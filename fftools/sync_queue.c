@@ -20,6 +20,7 @@
 #include <string.h>
 
 #include "libavutil/avassert.h"
+#include "libavutil/buffer.h"
 #include "libavutil/channel_layout.h"
 #include "libavutil/cpu.h"
 #include "libavutil/error.h"
@@ -27,6 +28,7 @@
 #include "libavutil/mathematics.h"
 #include "libavutil/mem.h"
 #include "libavutil/samplefmt.h"
+#include "libavutil/thread.h"
 #include "libavutil/timestamp.h"
 
 #include "objpool.h"
@@ -83,6 +85,11 @@ typedef struct SyncQueueStream {
     uint64_t         samples_sent;
     uint64_t         frames_max;
     int              frame_samples;
+
+    /* buffers for the audio frames assembled from several input frames */
+    AVBufferPool    *sample_pool;
+    size_t           sample_pool_size;
+    uint64_t         pool_misses;
 } SyncQueueStream;
 
 struct SyncQueue {
@@ -110,6 +117,12 @@ struct SyncQueue {
     int have_limiting;
 
     uintptr_t align_mask;
+
+    TQDepthHist *depth_hist;
+
+    // streams of one queue may be fed from different threads
+    pthread_mutex_t lock;
+    int             lock_initialized;
 };
 
 static void frame_move(const SyncQueue *sq, SyncQueueFrame dst,
@@ -340,7 +353,8 @@ static int overflow_heartbeat(SyncQueue *sq, int stream_idx)
     return 1;
 }
 
-int sq_send(SyncQueue *sq, unsigned int stream_idx, SyncQueueFrame frame)
+static int send_internal(SyncQueue *sq, unsigned int stream_idx,
+                         SyncQueueFrame frame)
 {
     SyncQueueStream *st;
     SyncQueueFrame dst;
@@ -388,6 +402,13 @@ int sq_send(SyncQueue *sq, unsigned int stream_idx, SyncQueueFrame frame)
 
     stream_update_ts(sq, stream_idx, ts);
 
+    if (sq->depth_hist) {
+        size_t depth = 0;
+        for (unsigned int i = 0; i < sq->nb_streams; i++)
+            depth += av_fifo_can_read(sq->streams[i].fifo);
+        tq_depth_hist_add(sq->depth_hist, depth);
+    }
+
     st->samples_queued += nb_samples;
     st->samples_sent   += nb_samples;
 
@@ -406,6 +427,17 @@ int sq_send(SyncQueue *sq, unsigned int stream_idx, SyncQueueFrame frame)
     return 0;
 }
 
+int sq_send(SyncQueue *sq, unsigned int stream_idx, SyncQueueFrame frame)
+{
+    int ret;
+
+    pthread_mutex_lock(&sq->lock);
+    ret = send_internal(sq, stream_idx, frame);
+    pthread_mutex_unlock(&sq->lock);
+
+    return ret;
+}
+
 static void offset_audio(AVFrame *f, int nb_samples)
 {
     const int planar = av_sample_fmt_is_planar(f->format);
@@ -445,6 +477,53 @@ static int frame_is_aligned(const SyncQueue *sq, const AVFrame *frame)
     return 0;
 }
 
+static AVBufferRef *sample_pool_alloc(void *opaque, size_t size)
+{
+    SyncQueueStream *st = opaque;
+
+    st->pool_misses++;
+    return av_buffer_alloc(size);
+}
+
+/* Same as av_frame_get_buffer(), except that the data comes from a pool
+ * when the frame has few enough planes. */
+static int get_samples_buffer(SyncQueue *sq, SyncQueueStream *st, AVFrame *dst)
+{
+    const int planar = av_sample_fmt_is_planar(dst->format);
+    const int planes = planar ? dst->ch_layout.nb_channels : 1;
+    int ret;
+
+    if (planes > AV_NUM_DATA_POINTERS) {
+        st->pool_misses += planes;
+        return av_frame_get_buffer(dst, 0);
+    }
+
+    ret = av_samples_get_buffer_size(&dst->linesize[0], dst->ch_layout.nb_channels,
+                                     dst->nb_samples, dst->format, sq->align_mask + 1);
+    if (ret < 0)
+        return ret;
+
+    if (!st->sample_pool || st->sample_pool_size < dst->linesize[0]) {
+        av_buffer_pool_uninit(&st->sample_pool);
+        // the streams are not reallocated once frames are received
+        st->sample_pool = av_buffer_pool_init2(dst->linesize[0], st,
+                                               sample_pool_alloc, NULL);
+        if (!st->sample_pool)
+            return AVERROR(ENOMEM);
+        st->sample_pool_size = dst->linesize[0];
+    }
+
+    dst->extended_data = dst->data;
+    for (int i = 0; i < planes; i++) {
+        dst->buf[i] = av_buffer_pool_get(st->sample_pool);
+        if (!dst->buf[i])
+            return AVERROR(ENOMEM);
+        dst->data[i] = dst->buf[i]->data;
+    }
+
+    return 0;
+}
+
 static int receive_samples(SyncQueue *sq, SyncQueueStream *st,
                            AVFrame *dst, int nb_samples)
 {
@@ -470,7 +549,7 @@ static int receive_samples(SyncQueue *sq, SyncQueueStream *st,
         goto finish;
     }
 
-    // otherwise allocate a new frame and copy the data
+    // otherwise get a new buffer and copy the data
     ret = av_channel_layout_copy(&dst->ch_layout, &src.f->ch_layout);
     if (ret < 0)
         return ret;
@@ -478,7 +557,7 @@ static int receive_samples(SyncQueue *sq, SyncQueueStream *st,
     dst->format     = src.f->format;
     dst->nb_samples = nb_samples;
 
-    ret = av_frame_get_buffer(dst, 0);
+    ret = get_samples_buffer(sq, st, dst);
     if (ret < 0)
         goto fail;
 
@@ -504,6 +583,8 @@ static int receive_samples(SyncQueue *sq, SyncQueueStream *st,
             av_frame_unref(src.f);
             objpool_release(sq->pool, (void**)&src);
             av_fifo_drain2(st->fifo, 1);
+            if (sq->depth_hist)
+                tq_depth_hist_remove(sq->depth_hist, 1);
         }
         st->samples_queued -= to_copy;
 
@@ -563,6 +644,8 @@ static int receive_for_stream(SyncQueue *sq, unsigned int stream_idx,
                 frame_move(sq, frame, peek);
                 objpool_release(sq->pool, (void**)&peek);
                 av_fifo_drain2(st->fifo, 1);
+                if (sq->depth_hist)
+                    tq_depth_hist_remove(sq->depth_hist, 1);
                 av_assert0(st->samples_queued >= frame_samples(sq, frame));
                 st->samples_queued -= frame_samples(sq, frame);
             }
@@ -607,13 +690,19 @@ static int receive_internal(SyncQueue *sq, int stream_idx, SyncQueueFrame frame)
 
 int sq_receive(SyncQueue *sq, int stream_idx, SyncQueueFrame frame)
 {
-    int ret = receive_internal(sq, stream_idx, frame);
+    int ret;
+
+    pthread_mutex_lock(&sq->lock);
+
+    ret = receive_internal(sq, stream_idx, frame);
 
     /* try again if the queue overflowed and triggered a fake heartbeat
      * for lagging streams */
     if (ret == AVERROR(EAGAIN) && overflow_heartbeat(sq, stream_idx))
         ret = receive_internal(sq, stream_idx, frame);
 
+    pthread_mutex_unlock(&sq->lock);
+
     return ret;
 }
 
@@ -653,9 +742,13 @@ void sq_limit_frames(SyncQueue *sq, unsigned int stream_idx, uint64_t frames)
     av_assert0(stream_idx < sq->nb_streams);
     st = &sq->streams[stream_idx];
 
+    pthread_mutex_lock(&sq->lock);
+
     st->frames_max = frames;
     if (st->frames_sent >= st->frames_max)
         finish_stream(sq, stream_idx);
+
+    pthread_mutex_unlock(&sq->lock);
 }
 
 void sq_frame_samples(SyncQueue *sq, unsigned int stream_idx,
@@ -667,9 +760,13 @@ void sq_frame_samples(SyncQueue *sq, unsigned int stream_idx,
     av_assert0(stream_idx < sq->nb_streams);
     st = &sq->streams[stream_idx];
 
+    pthread_mutex_lock(&sq->lock);
+
     st->frame_samples = frame_samples;
 
     sq->align_mask = av_cpu_max_align() - 1;
+
+    pthread_mutex_unlock(&sq->lock);
 }
 
 SyncQueue *sq_alloc(enum SyncQueueType type, int64_t buf_size_us, void *logctx)
@@ -688,12 +785,35 @@ SyncQueue *sq_alloc(enum SyncQueueType type, int64_t buf_size_us, void *logctx)
 
     sq->pool = (type == SYNC_QUEUE_PACKETS) ? objpool_alloc_packets() :
                                               objpool_alloc_frames();
-    if (!sq->pool) {
-        av_freep(&sq);
-        return NULL;
-    }
+    if (!sq->pool)
+        goto fail;
+
+    if (pthread_mutex_init(&sq->lock, NULL))
+        goto fail;
+    sq->lock_initialized = 1;
 
     return sq;
+fail:
+    sq_free(&sq);
+    return NULL;
+}
+
+uint64_t sq_pool_misses(SyncQueue *sq, unsigned int stream_idx)
+{
+    uint64_t ret;
+
+    av_assert0(stream_idx < sq->nb_streams);
+
+    pthread_mutex_lock(&sq->lock);
+    ret = sq->streams[stream_idx].pool_misses;
+    pthread_mutex_unlock(&sq->lock);
+
+    return ret;
+}
+
+void sq_set_depth_hist(SyncQueue *sq, TQDepthHist *hist)
+{
+    sq->depth_hist = hist;
 }
 
 void sq_free(SyncQueue **psq)
@@ -705,15 +825,22 @@ void sq_free(SyncQueue **psq)
 
     for (unsigned int i = 0; i < sq->nb_streams; i++) {
         SyncQueueFrame frame;
-        while (av_fifo_read(sq->streams[i].fifo, &frame, 1) >= 0)
+        while (av_fifo_read(sq->streams[i].fifo, &frame, 1) >= 0) {
             objpool_release(sq->pool, (void**)&frame);
+            if (sq->depth_hist)
+                tq_depth_hist_remove(sq->depth_hist, 1);
+        }
 
         av_fifo_freep2(&sq->streams[i].fifo);
+        av_buffer_pool_uninit(&sq->streams[i].sample_pool);
     }
 
     av_freep(&sq->streams);
 
     objpool_free(&sq->pool);
 
+    if (sq->lock_initialized)
+        pthread_mutex_destroy(&sq->lock);
+
     av_freep(psq);
 }
@@ -25,6 +25,8 @@
 
 #include "libavutil/frame.h"
 
+#include "thread_queue.h"
+
 enum SyncQueueType {
     SYNC_QUEUE_PACKETS,
     SYNC_QUEUE_FRAMES,
@@ -53,6 +55,19 @@ typedef struct SyncQueue SyncQueue;
 SyncQueue *sq_alloc(enum SyncQueueType type, int64_t buf_size_us, void *logctx);
 void       sq_free(SyncQueue **sq);
 
+/**
+ * Return the number of buffers for audio frames of the given stream that had
+ * to be assembled from several frames and could not be taken from the pool
+ * of reused buffers.
+ */
+uint64_t sq_pool_misses(SyncQueue *sq, unsigned int stream_idx);
+
+/**
+ * Count the number of frames queued for all the streams after each
+ * sq_send() in hist, which must remain valid as long as the queue is used.
+ */
+void sq_set_depth_hist(SyncQueue *sq, TQDepthHist *hist);
+
 /**
  * Add a new stream to the sync queue.
  *
@@ -16,10 +16,12 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <stdatomic.h>
 #include <stdint.h>
 #include <string.h>
 
 #include "libavutil/avassert.h"
+#include "libavutil/common.h"
 #include "libavutil/error.h"
 #include "libavutil/fifo.h"
 #include "libavutil/intreadwrite.h"
@@ -37,8 +39,18 @@ enum {
 typedef struct FifoElem {
     void        *obj;
     unsigned int stream_idx;
+    size_t       size;
+    int64_t      duration;
 } FifoElem;
 
+/* combined size of the items held by all the queues of the process */
+static atomic_size_t total_queued_bytes;
+static size_t        memory_limit;
+
+/* number of times a side of a single-stream queue polls the ring before
+ * going to sleep on the condition variable */
+#define SPSC_SPIN_COUNT 64
+
 struct ThreadQueue {
     int              *finished;
     unsigned int    nb_streams;
@@ -48,8 +60,37 @@ struct ThreadQueue {
     ObjPool *obj_pool;
     void   (*obj_move)(void *dst, void *src);
 
+    /* the FIFO always has room for queue_size items, it grows up to
+     * max_items within the limits set by tq_set_limits() */
+    size_t    queue_size;
+    size_t    max_items;
+    size_t    max_bytes;
+    int64_t   max_duration;
+    size_t  (*obj_size)(void *obj);
+    int64_t (*obj_duration)(void *obj);
+
+    size_t    queued_bytes;
+    int64_t   queued_duration;
+
+    TQDepthHist *depth_hist;
+
     pthread_mutex_t lock;
     pthread_cond_t  cond;
+
+    /* Queues with a single stream have a single producer and a single
+     * consumer, so they use a lock-free ring of preallocated objects
+     * instead of the FIFO; the lock and condition variable are then only
+     * used to sleep when the ring stays full or empty for a while. */
+    int                 spsc;
+    void              **ring;
+    size_t              ring_size;
+    /* total number of items written/read, only modified by the
+     * producer/consumer respectively */
+    atomic_size_t       ring_write;
+    atomic_size_t       ring_read;
+    atomic_int          spsc_finished;
+    /* number of threads sleeping, or about to sleep, on cond */
+    atomic_int          nb_waiters;
 };
 
 void tq_free(ThreadQueue **ptq)
@@ -61,11 +102,24 @@ void tq_free(ThreadQueue **ptq)
 
     if (tq->fifo) {
         FifoElem elem;
-        while (av_fifo_read(tq->fifo, &elem, 1) >= 0)
+        while (av_fifo_read(tq->fifo, &elem, 1) >= 0) {
+            atomic_fetch_sub(&total_queued_bytes, elem.size);
             objpool_release(tq->obj_pool, &elem.obj);
+            if (tq->depth_hist)
+                tq_depth_hist_remove(tq->depth_hist, 1);
+        }
     }
     av_fifo_freep2(&tq->fifo);
 
+    if (tq->ring) {
+        if (tq->depth_hist)
+            tq_depth_hist_remove(tq->depth_hist, atomic_load(&tq->ring_write) -
+                                                 atomic_load(&tq->ring_read));
+        for (size_t i = 0; i < tq->ring_size; i++)
+            objpool_release(tq->obj_pool, &tq->ring[i]);
+    }
+    av_freep(&tq->ring);
+
     objpool_free(&tq->obj_pool);
 
     av_freep(&tq->finished);
@@ -104,20 +158,233 @@ ThreadQueue *tq_alloc(unsigned int nb_streams, size_t queue_size,
         goto fail;
     tq->nb_streams = nb_streams;
 
-    tq->fifo = av_fifo_alloc2(queue_size, sizeof(FifoElem), 0);
-    if (!tq->fifo)
-        goto fail;
-
     tq->obj_pool = obj_pool;
     tq->obj_move = obj_move;
 
+    tq->queue_size = queue_size;
+    tq->max_items  = queue_size;
+
+    if (nb_streams == 1) {
+        tq->spsc = 1;
+
+        tq->ring = av_calloc(queue_size, sizeof(*tq->ring));
+        if (!tq->ring)
+            goto fail;
+        tq->ring_size = queue_size;
+
+        for (size_t i = 0; i < queue_size; i++) {
+            ret = objpool_get(tq->obj_pool, &tq->ring[i]);
+            if (ret < 0)
+                goto fail;
+        }
+
+        atomic_init(&tq->ring_write,    0);
+        atomic_init(&tq->ring_read,     0);
+        atomic_init(&tq->spsc_finished, 0);
+        atomic_init(&tq->nb_waiters,    0);
+    } else {
+        tq->fifo = av_fifo_alloc2(queue_size, sizeof(FifoElem), 0);
+        if (!tq->fifo)
+            goto fail;
+    }
+
     return tq;
 fail:
     tq_free(&tq);
     return NULL;
 }
 
-int tq_send(ThreadQueue *tq, unsigned int stream_idx, void *data)
+int tq_set_limits(ThreadQueue *tq, size_t max_items, size_t max_bytes,
+                  int64_t max_duration, size_t (*obj_size)(void *obj),
+                  int64_t (*obj_duration)(void *obj))
+{
+    if (tq->spsc) {
+        // the ring cannot grow, switch to the FIFO
+        av_assert0(!atomic_load(&tq->ring_write));
+
+        tq->fifo = av_fifo_alloc2(tq->queue_size, sizeof(FifoElem), 0);
+        if (!tq->fifo)
+            return AVERROR(ENOMEM);
+
+        for (size_t i = 0; i < tq->ring_size; i++)
+            objpool_release(tq->obj_pool, &tq->ring[i]);
+        av_freep(&tq->ring);
+
+        tq->spsc = 0;
+    }
+
+    tq->max_items    = FFMAX(max_items, tq->queue_size);
+    tq->max_bytes    = max_bytes;
+    tq->max_duration = max_duration;
+    tq->obj_size     = obj_size;
+    tq->obj_duration = obj_duration;
+
+    return 0;
+}
+
+void tq_set_memory_limit(size_t max_bytes)
+{
+    memory_limit = max_bytes;
+}
+
+void tq_set_depth_hist(ThreadQueue *tq, TQDepthHist *hist)
+{
+    tq->depth_hist = hist;
+}
+
+void tq_depth_hist_add(TQDepthHist *hist, size_t depth)
+{
+    int idx = depth ? FFMIN(av_log2(depth), TQ_DEPTH_HIST_SIZE - 1) : 0;
+    atomic_fetch_add_explicit(&hist->count[idx], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->cur, 1, memory_order_relaxed);
+}
+
+void tq_depth_hist_remove(TQDepthHist *hist, size_t nb_items)
+{
+    atomic_fetch_sub_explicit(&hist->cur, nb_items, memory_order_relaxed);
+}
+
+/* Wake up the other side of a single-stream queue, if it is sleeping. */
+static void spsc_wake(ThreadQueue *tq)
+{
+    if (!atomic_load(&tq->nb_waiters))
+        return;
+
+    pthread_mutex_lock(&tq->lock);
+    pthread_cond_broadcast(&tq->cond);
+    pthread_mutex_unlock(&tq->lock);
+}
+
+/* Wait until ready() returns nonzero, polling for a while before sleeping.
+ * The waker updates its state before checking nb_waiters, and we increment
+ * nb_waiters before checking the state under the lock, so that a wakeup
+ * cannot be missed. */
+static void spsc_wait(ThreadQueue *tq, int (*ready)(ThreadQueue *tq))
+{
+    for (int i = 0; i < SPSC_SPIN_COUNT; i++)
+        if (ready(tq))
+            return;
+
+    pthread_mutex_lock(&tq->lock);
+    atomic_fetch_add(&tq->nb_waiters, 1);
+    while (!ready(tq))
+        pthread_cond_wait(&tq->cond, &tq->lock);
+    atomic_fetch_sub(&tq->nb_waiters, 1);
+    pthread_mutex_unlock(&tq->lock);
+}
+
+static int spsc_can_send(ThreadQueue *tq)
+{
+    return (atomic_load(&tq->spsc_finished) & FINISHED_RECV) ||
+           atomic_load(&tq->ring_write) - atomic_load(&tq->ring_read) < tq->ring_size;
+}
+
+static int spsc_can_receive(ThreadQueue *tq)
+{
+    return (atomic_load(&tq->spsc_finished) & FINISHED_SEND) ||
+           atomic_load(&tq->ring_write) != atomic_load(&tq->ring_read);
+}
+
+static int spsc_send(ThreadQueue *tq, void *data, int nonblock)
+{
+    size_t pos;
+
+    if (atomic_load(&tq->spsc_finished) & FINISHED_SEND)
+        return AVERROR(EINVAL);
+
+    if (nonblock) {
+        if (!spsc_can_send(tq))
+            return AVERROR(EAGAIN);
+    } else
+        spsc_wait(tq, spsc_can_send);
+
+    if (atomic_load(&tq->spsc_finished) & FINISHED_RECV) {
+        atomic_fetch_or(&tq->spsc_finished, FINISHED_SEND);
+        spsc_wake(tq);
+        return AVERROR_EOF;
+    }
+
+    pos = atomic_load(&tq->ring_write);
+    tq->obj_move(tq->ring[pos % tq->ring_size], data);
+
+    // count the item before the consumer can see it and uncount it
+    if (tq->depth_hist)
+        tq_depth_hist_add(tq->depth_hist, pos + 1 - atomic_load(&tq->ring_read));
+
+    atomic_store(&tq->ring_write, pos + 1);
+
+    spsc_wake(tq);
+
+    return 0;
+}
+
+static int spsc_receive(ThreadQueue *tq, int *stream_idx, void *data,
+                        int nonblock)
+{
+    size_t pos;
+    int finished;
+
+    if (nonblock) {
+        if (!spsc_can_receive(tq))
+            return AVERROR(EAGAIN);
+    } else
+        spsc_wait(tq, spsc_can_receive);
+
+    // the producer marks the stream finished after writing its last item,
+    // so the ring must be checked after the flags
+    finished = atomic_load(&tq->spsc_finished);
+
+    pos = atomic_load(&tq->ring_read);
+    if (pos != atomic_load(&tq->ring_write)) {
+        void *obj = tq->ring[pos % tq->ring_size];
+
+        tq->obj_move(data, obj);
+        atomic_store(&tq->ring_read, pos + 1);
+        if (tq->depth_hist)
+            tq_depth_hist_remove(tq->depth_hist, 1);
+        spsc_wake(tq);
+
+        *stream_idx = 0;
+        return 0;
+    }
+
+    av_assert0(finished & FINISHED_SEND);
+
+    /* return EOF to the consumer at most once */
+    if (!(atomic_fetch_or(&tq->spsc_finished, FINISHED_RECV) & FINISHED_RECV)) {
+        spsc_wake(tq);
+        *stream_idx = 0;
+    }
+
+    return AVERROR_EOF;
+}
+
+static void spsc_finish(ThreadQueue *tq, int flag)
+{
+    atomic_fetch_or(&tq->spsc_finished, flag);
+    spsc_wake(tq);
+}
+
+/* Check whether an item can be added to the FIFO, growing it if needed. */
+static int can_write_locked(ThreadQueue *tq)
+{
+    size_t nb_items = av_fifo_can_read(tq->fifo);
+
+    if (nb_items < tq->queue_size)
+        return 1;
+
+    if (nb_items >= tq->max_items                                         ||
+        (tq->max_bytes    && tq->queued_bytes    >= tq->max_bytes)        ||
+        (tq->max_duration && tq->queued_duration >= tq->max_duration)     ||
+        (memory_limit && atomic_load(&total_queued_bytes) >= memory_limit))
+        return 0;
+
+    return av_fifo_can_write(tq->fifo) ||
+           av_fifo_grow2(tq->fifo, FFMIN(nb_items, tq->max_items - nb_items)) >= 0;
+}
+
+static int send_internal(ThreadQueue *tq, unsigned int stream_idx, void *data,
+                         int nonblock)
 {
     int *finished;
     int ret;
@@ -125,6 +392,9 @@ int tq_send(ThreadQueue *tq, unsigned int stream_idx, void *data)
     av_assert0(stream_idx < tq->nb_streams);
     finished = &tq->finished[stream_idx];
 
+    if (tq->spsc)
+        return spsc_send(tq, data, nonblock);
+
     pthread_mutex_lock(&tq->lock);
 
     if (*finished & FINISHED_SEND) {
@@ -132,8 +402,13 @@ int tq_send(ThreadQueue *tq, unsigned int stream_idx, void *data)
         goto finish;
     }
 
-    while (!(*finished & FINISHED_RECV) && !av_fifo_can_write(tq->fifo))
+    while (!(*finished & FINISHED_RECV) && !can_write_locked(tq)) {
+        if (nonblock) {
+            ret = AVERROR(EAGAIN);
+            goto finish;
+        }
         pthread_cond_wait(&tq->cond, &tq->lock);
+    }
 
     if (*finished & FINISHED_RECV) {
         ret = AVERROR_EOF;
@@ -145,10 +420,22 @@ int tq_send(ThreadQueue *tq, unsigned int stream_idx, void *data)
         if (ret < 0)
             goto finish;
 
+        if (tq->obj_size)
+            elem.size = tq->obj_size(data);
+        if (tq->obj_duration)
+            elem.duration = tq->obj_duration(data);
+
         tq->obj_move(elem.obj, data);
 
         ret = av_fifo_write(tq->fifo, &elem, 1);
         av_assert0(ret >= 0);
+
+        tq->queued_bytes    += elem.size;
+        tq->queued_duration += elem.duration;
+        atomic_fetch_add(&total_queued_bytes, elem.size);
+
+        if (tq->depth_hist)
+            tq_depth_hist_add(tq->depth_hist, av_fifo_can_read(tq->fifo));
         pthread_cond_broadcast(&tq->cond);
     }
 
@@ -158,6 +445,16 @@ finish:
     return ret;
 }
 
+int tq_send(ThreadQueue *tq, unsigned int stream_idx, void *data)
+{
+    return send_internal(tq, stream_idx, data, 0);
+}
+
+int tq_send_nonblock(ThreadQueue *tq, unsigned int stream_idx, void *data)
+{
+    return send_internal(tq, stream_idx, data, 1);
+}
+
 static int receive_locked(ThreadQueue *tq, int *stream_idx,
                           void *data)
 {
@@ -168,6 +465,24 @@ static int receive_locked(ThreadQueue *tq, int *stream_idx,
         tq->obj_move(data, elem.obj);
         objpool_release(tq->obj_pool, &elem.obj);
         *stream_idx = elem.stream_idx;
+
+        tq->queued_bytes    -= elem.size;
+        tq->queued_duration -= elem.duration;
+        atomic_fetch_sub(&total_queued_bytes, elem.size);
+
+        if (tq->depth_hist)
+            tq_depth_hist_remove(tq->depth_hist, 1);
+
+        /* give the memory back once a burst has been absorbed */
+        if (!av_fifo_can_read(tq->fifo) &&
+            av_fifo_can_write(tq->fifo) > tq->queue_size) {
+            AVFifo *fifo = av_fifo_alloc2(tq->queue_size, sizeof(FifoElem), 0);
+            if (fifo) {
+                av_fifo_freep2(&tq->fifo);
+                tq->fifo = fifo;
+            }
+        }
+
         return 0;
     }
 
@@ -194,6 +509,9 @@ int tq_receive(ThreadQueue *tq, int *stream_idx, void *data)
 
     *stream_idx = -1;
 
+    if (tq->spsc)
+        return spsc_receive(tq, stream_idx, data, 0);
+
     pthread_mutex_lock(&tq->lock);
 
     while (1) {
@@ -214,10 +532,35 @@ int tq_receive(ThreadQueue *tq, int *stream_idx, void *data)
     return ret;
 }
 
+int tq_receive_nonblock(ThreadQueue *tq, int *stream_idx, void *data)
+{
+    int ret;
+
+    *stream_idx = -1;
+
+    if (tq->spsc)
+        return spsc_receive(tq, stream_idx, data, 1);
+
+    pthread_mutex_lock(&tq->lock);
+
+    ret = receive_locked(tq, stream_idx, data);
+    if (ret == 0)
+        pthread_cond_broadcast(&tq->cond);
+
+    pthread_mutex_unlock(&tq->lock);
+
+    return ret;
+}
+
 void tq_send_finish(ThreadQueue *tq, unsigned int stream_idx)
 {
     av_assert0(stream_idx < tq->nb_streams);
 
+    if (tq->spsc) {
+        spsc_finish(tq, FINISHED_SEND);
+        return;
+    }
+
     pthread_mutex_lock(&tq->lock);
 
     /* mark the stream as send-finished;
@@ -233,6 +576,11 @@ void tq_receive_finish(ThreadQueue *tq, unsigned int stream_idx)
 {
     av_assert0(stream_idx < tq->nb_streams);
 
+    if (tq->spsc) {
+        spsc_finish(tq, FINISHED_RECV);
+        return;
+    }
+
     pthread_mutex_lock(&tq->lock);
 
     /* mark the stream as recv-finished;
@@ -19,12 +19,44 @@
 #ifndef FFTOOLS_THREAD_QUEUE_H
 #define FFTOOLS_THREAD_QUEUE_H
 
+#include <stdatomic.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "objpool.h"
 
 typedef struct ThreadQueue ThreadQueue;
 
+#define TQ_DEPTH_HIST_SIZE 12
+
+/**
+ * Histogram of the depth of a queue: entry i counts the items after the
+ * sending of which the queue held between 2^i and 2^(i+1)-1 items, the last
+ * entry also counts all the larger depths.
+ */
+typedef struct TQDepthHist {
+    atomic_uint_least64_t count[TQ_DEPTH_HIST_SIZE];
+    // number of items the queue currently holds
+    atomic_size_t         cur;
+} TQDepthHist;
+
+/**
+ * Count the number of items the queue holds after each send in hist.
+ * hist must remain valid as long as the queue is used.
+ */
+void tq_set_depth_hist(ThreadQueue *tq, TQDepthHist *hist);
+
+/**
+ * Record that an item was sent to a queue, after which the queue holds
+ * depth items.
+ */
+void tq_depth_hist_add(TQDepthHist *hist, size_t depth);
+
+/**
+ * Record that nb_items items were removed from a queue.
+ */
+void tq_depth_hist_remove(TQDepthHist *hist, size_t nb_items);
+
 /**
  * Allocate a queue for sending data between threads.
  *
@@ -35,11 +67,42 @@ typedef struct ThreadQueue ThreadQueue;
  * @param obj_pool object pool that will be used to allocate items stored in the
  *                 queue; the pool becomes owned by the queue
  * @param callback that moves the contents between two data pointers
+ *
+ * A queue with a single stream is lock-free; it must then be sent to by at
+ * most one thread at a time and received from by at most one thread at a
+ * time.
  */
 ThreadQueue *tq_alloc(unsigned int nb_streams, size_t queue_size,
                       ObjPool *obj_pool, void (*obj_move)(void *dst, void *src));
 void         tq_free(ThreadQueue **tq);
 
+/**
+ * Allow the queue to grow beyond queue_size items to absorb bursts.
+ *
+ * Once it holds queue_size items, the queue keeps accepting more until it
+ * holds max_items, or its items take max_bytes or last max_duration in
+ * total, or the items in all the queues of the process take the limit set
+ * with tq_set_memory_limit(). It shrinks back to queue_size items when
+ * drained. Must be called before anything is sent; the queue then always
+ * uses locking, even with a single stream.
+ *
+ * @param max_bytes    0 for no limit
+ * @param max_duration in AV_TIME_BASE units, 0 for no limit
+ * @param obj_size     returns the size in bytes of an item, may be NULL
+ * @param obj_duration returns the duration of an item in AV_TIME_BASE units,
+ *                     may be NULL
+ */
+int tq_set_limits(ThreadQueue *tq, size_t max_items, size_t max_bytes,
+                  int64_t max_duration, size_t (*obj_size)(void *obj),
+                  int64_t (*obj_duration)(void *obj));
+
+/**
+ * Set the combined size in bytes of the items in all the queues, beyond
+ * which queues stop growing; 0 means no limit. Queues never hold fewer
+ * than their queue_size items because of this limit.
+ */
+void tq_set_memory_limit(size_t max_bytes);
+
 /**
  * Send an item for the given stream to the queue.
  *
@@ -53,6 +116,11 @@ void         tq_free(ThreadQueue **tq);
  * - AVERROR_EOF the receiving side has marked the given stream as finished
  */
 int tq_send(ThreadQueue *tq, unsigned int stream_idx, void *data);
+/**
+ * Same as tq_send(), except that AVERROR(EAGAIN) is returned instead of
+ * blocking when the queue is full and cannot grow any further.
+ */
+int tq_send_nonblock(ThreadQueue *tq, unsigned int stream_idx, void *data);
 /**
  * Mark the given stream finished from the sending side.
  */
@@ -73,6 +141,11 @@ void tq_send_finish(ThreadQueue *tq, unsigned int stream_idx);
  *   for each stream. When *stream_idx is -1, all streams are done.
  */
 int tq_receive(ThreadQueue *tq, int *stream_idx, void *data);
+/**
+ * Same as tq_receive(), except that AVERROR(EAGAIN) is returned instead of
+ * blocking when no item is available.
+ */
+int tq_receive_nonblock(ThreadQueue *tq, int *stream_idx, void *data);
 /**
  * Mark the given stream finished from the receiving side.
  */
@@ -0,0 +1,48 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libavutil/attributes.h"
+#include "libavutil/cpu.h"
+#include "libavutil/aarch64/cpu.h"
+#include "libavcodec/cavsdsp.h"
+
+#include "config.h"
+
+void ff_cavs_filter_lv_neon(uint8_t *pix, ptrdiff_t stride, int alpha, int beta,
+                            int tc, int bs1, int bs2);
+void ff_cavs_filter_lh_neon(uint8_t *pix, ptrdiff_t stride, int alpha, int beta,
+                            int tc, int bs1, int bs2);
+void ff_cavs_filter_cv_neon(uint8_t *pix, ptrdiff_t stride, int alpha, int beta,
+                            int tc, int bs1, int bs2);
+void ff_cavs_filter_ch_neon(uint8_t *pix, ptrdiff_t stride, int alpha, int beta,
+                            int tc, int bs1, int bs2);
+
+av_cold void ff_cavsdsp_init_aarch64(CAVSDSPContext *c)
+{
+    int cpu_flags = av_get_cpu_flags();
+
+    if (have_neon(cpu_flags)) {
+        c->cavs_filter_lv = ff_cavs_filter_lv_neon;
+        c->cavs_filter_lh = ff_cavs_filter_lh_neon;
+        c->cavs_filter_cv = ff_cavs_filter_cv_neon;
+        c->cavs_filter_ch = ff_cavs_filter_ch_neon;
+    }
+}
@@ -23,6 +23,7 @@
 #include "avs2.h"
 #include "get_bits.h"
 #include "parser.h"
+#include "startcode.h"
 
 static int avs2_find_frame_end(ParseContext *pc, const uint8_t *buf, int buf_size)
 {
@@ -32,7 +33,7 @@ static int avs2_find_frame_end(ParseContext *pc, const uint8_t *buf, int buf_siz
 
     if (!pic_found) {
         for (; cur < buf_size; ++cur) {
-            state = (state << 8) | buf[cur];
+            cur = avpriv_find_start_code(buf + cur, buf + buf_size, &state) - buf - 1;
             if ((state & 0xFFFFFF00) == 0x100 && AVS2_ISPIC(buf[cur])) {
                 cur++;
                 pic_found = 1;
@@ -45,7 +46,7 @@ static int avs2_find_frame_end(ParseContext *pc, const uint8_t *buf, int buf_siz
         if (!buf_size)
             return END_NOT_FOUND;
         for (; cur < buf_size; cur++) {
-            state = (state << 8) | buf[cur];
+            cur = avpriv_find_start_code(buf + cur, buf + buf_size, &state) - buf - 1;
             if ((state & 0xFFFFFF00) == 0x100 && AVS2_ISUNIT(buf[cur])) {
                 pc->frame_start_found = 0;
                 pc->state = -1;
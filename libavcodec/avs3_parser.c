@@ -23,7 +23,25 @@
 
 #include "avs3.h"
 #include "get_bits.h"
+#include "golomb.h"
 #include "parser.h"
+#include "startcode.h"
+
+typedef struct AVS3ParseContext {
+    ParseContext pc;
+
+    /* sequence header fields needed to parse picture headers */
+    int got_seq_header;
+    int library_picture_enable;
+    int temporal_id_enable;
+    int low_delay;
+
+    /* decode order tracking, used to derive timestamps */
+    int last_doi;                ///< decode_order_index of the last picture, -1 if none
+    int64_t doi_base;            ///< decode order of decode_order_index 0 in the current cycle
+    int64_t ref_order;           ///< decode order of the picture ref_dts belongs to
+    int64_t ref_dts;             ///< last DTS known from the container or derived at start
+} AVS3ParseContext;
 
 static int avs3_find_frame_end(ParseContext *pc, const uint8_t *buf, int buf_size)
 {
@@ -33,8 +51,8 @@ static int avs3_find_frame_end(ParseContext *pc, const uint8_t *buf, int buf_siz
 
     if (!pic_found) {
         for (; cur < buf_size; ++cur) {
-            state = (state << 8) | buf[cur];
-            if (AVS3_ISPIC(buf[cur])){
+            cur = avpriv_find_start_code(buf + cur, buf + buf_size, &state) - buf - 1;
+            if ((state & 0xFFFFFF00) == 0x100 && AVS3_ISPIC(buf[cur])) {
                 cur++;
                 pic_found = 1;
                 break;
@@ -46,7 +64,7 @@ static int avs3_find_frame_end(ParseContext *pc, const uint8_t *buf, int buf_siz
         if (!buf_size)
             return END_NOT_FOUND;
         for (; cur < buf_size; ++cur) {
-            state = (state << 8) | buf[cur];
+            cur = avpriv_find_start_code(buf + cur, buf + buf_size, &state) - buf - 1;
             if ((state & 0xFFFFFF00) == 0x100 && AVS3_ISUNIT(state & 0xFF)) {
                 pc->frame_start_found = 0;
                 pc->state = -1;
@@ -61,9 +79,84 @@ static int avs3_find_frame_end(ParseContext *pc, const uint8_t *buf, int buf_siz
     return END_NOT_FOUND;
 }
 
+/**
+ * Derive the timestamps of a picture from its position in decode order
+ * and its picture_output_delay, which is the distance between decoding
+ * and output in frames. They are only set if the container provided none;
+ * the decode order is counted from the last picture that had a DTS, or
+ * from the first picture so that it is output at 0. The picture type is
+ * refined from the same fields, so that it always agrees with the timestamps.
+ */
+static void parse_avs3_pic_header(AVCodecParserContext *s, AVS3ParseContext *p,
+                                  const uint8_t *buf, int buf_size, int intra,
+                                  AVCodecContext *avctx)
+{
+    GetBitContext gb;
+    AVRational frame_time;
+    int doi, output_delay = 0;
+    int64_t decode_order;
+
+    if (!p->got_seq_header || init_get_bits8(&gb, buf, buf_size) < 0)
+        return;
+
+    if (intra) {
+        // Skip bits: bbv_delay(32)
+        skip_bits_long(&gb, 32);
+        if (get_bits1(&gb))     // time_code_flag
+            skip_bits(&gb, 24); // time_code
+    } else {
+        int pic_code_type;
+        // Skip bits: random_access_decodable_flag(1)
+        //            bbv_delay(32)
+        skip_bits_long(&gb, 33);
+        pic_code_type = get_bits(&gb, 2);
+        s->pict_type  = pic_code_type == 2 ? AV_PICTURE_TYPE_B : AV_PICTURE_TYPE_P;
+    }
+    doi = get_bits(&gb, 8);
+    if (intra && p->library_picture_enable)
+        get_ue_golomb_long(&gb); // library_picture_index
+    if (p->temporal_id_enable)
+        skip_bits(&gb, 3);       // temporal_id
+    if (!p->low_delay)
+        output_delay = get_ue_golomb_long(&gb);
+    if (get_bits_left(&gb) < 0 || output_delay > 255)
+        return;
+
+    if (avctx->framerate.num <= 0 || avctx->pkt_timebase.num <= 0)
+        return;
+    frame_time  = av_inv_q(avctx->framerate);
+    s->duration = av_rescale_q(1, frame_time, avctx->pkt_timebase);
+
+    /* decode_order_index counts modulo 256 */
+    if (p->last_doi >= 0 && doi <= p->last_doi)
+        p->doi_base += 256;
+    p->last_doi  = doi;
+    decode_order = p->doi_base + doi;
+
+    if (s->dts != AV_NOPTS_VALUE) {
+        p->ref_order = decode_order;
+        p->ref_dts   = s->dts;
+    } else if (p->ref_dts == AV_NOPTS_VALUE) {
+        p->ref_order = decode_order;
+        p->ref_dts   = av_rescale_q(-output_delay, frame_time, avctx->pkt_timebase);
+    }
+
+    if (s->pts == AV_NOPTS_VALUE) {
+        if (s->dts == AV_NOPTS_VALUE)
+            s->dts = p->ref_dts + av_rescale_q(decode_order - p->ref_order,
+                                               frame_time, avctx->pkt_timebase);
+        s->pts = s->dts + av_rescale_q(output_delay, frame_time,
+                                       avctx->pkt_timebase);
+    }
+}
+
 static void parse_avs3_nal_units(AVCodecParserContext *s, const uint8_t *buf,
                            int buf_size, AVCodecContext *avctx)
 {
+    AVS3ParseContext *p = s->priv_data;
+    const uint8_t *ptr = buf, *end = buf + buf_size;
+    uint32_t state = -1;
+
     if (buf_size < 5) {
         return;
     }
@@ -71,7 +164,7 @@ static void parse_avs3_nal_units(AVCodecParserContext *s, const uint8_t *buf,
     if (buf[0] == 0x0 && buf[1] == 0x0 && buf[2] == 0x1) {
         if (buf[3] == AVS3_SEQ_START_CODE) {
             GetBitContext gb;
-            int profile, ratecode, low_delay;
+            int profile, ratecode, low_delay, library_stream;
 
             init_get_bits8(&gb, buf + 4, buf_size - 4);
 
@@ -82,14 +175,21 @@ static void parse_avs3_nal_units(AVCodecParserContext *s, const uint8_t *buf,
             // Skip bits: level(8)
             //            progressive(1)
             //            field(1)
-            //            library(2)
-            //            resv(1)
+            skip_bits(&gb, 10);
+            library_stream = get_bits1(&gb);
+            p->library_picture_enable = 0;
+            if (!library_stream) {
+                p->library_picture_enable = get_bits1(&gb);
+                if (p->library_picture_enable)
+                    skip_bits1(&gb); // duplicate_sequence_header_flag
+            }
+            // Skip bits: resv(1)
             //            width(14)
             //            resv(1)
             //            height(14)
             //            chroma(2)
             //            sampe_precision(3)
-            skip_bits(&gb, 47);
+            skip_bits(&gb, 35);
 
             if (profile == AVS3_PROFILE_BASELINE_MAIN10) {
                 int sample_precision = get_bits(&gb, 3);
@@ -117,6 +217,10 @@ static void parse_avs3_nal_units(AVCodecParserContext *s, const uint8_t *buf,
             low_delay = get_bits(&gb, 1);
             avctx->has_b_frames = FFMAX(avctx->has_b_frames, !low_delay);
 
+            p->low_delay          = low_delay;
+            p->temporal_id_enable = get_bits1(&gb);
+            p->got_seq_header     = 1;
+
             avctx->framerate.num = ff_avs3_frame_rate_tab[ratecode].num;
             avctx->framerate.den = ff_avs3_frame_rate_tab[ratecode].den;
 
@@ -142,6 +246,17 @@ static void parse_avs3_nal_units(AVCodecParserContext *s, const uint8_t *buf,
             }
         }
     }
+
+    /* the picture may be preceded by a sequence header in the same packet */
+    while (ptr < end) {
+        ptr = avpriv_find_start_code(ptr, end, &state);
+        if ((state & 0xFFFFFF00) == 0x100 && AVS3_ISPIC(state & 0xFF)) {
+            parse_avs3_pic_header(s, p, ptr, end - ptr,
+                                  (state & 0xFF) == AVS3_INTRA_PIC_START_CODE,
+                                  avctx);
+            break;
+        }
+    }
 }
 
 
@@ -149,7 +264,8 @@ static int avs3_parse(AVCodecParserContext *s, AVCodecContext *avctx,
                       const uint8_t **poutbuf, int *poutbuf_size,
                       const uint8_t *buf, int buf_size)
 {
-    ParseContext *pc = s->priv_data;
+    AVS3ParseContext *p = s->priv_data;
+    ParseContext *pc = &p->pc;
     int next;
 
     if (s->flags & PARSER_FLAG_COMPLETE_FRAMES)  {
@@ -171,9 +287,19 @@ static int avs3_parse(AVCodecParserContext *s, AVCodecContext *avctx,
     return next;
 }
 
+static av_cold int avs3_parse_init(AVCodecParserContext *s)
+{
+    AVS3ParseContext *p = s->priv_data;
+
+    p->last_doi = -1;
+    p->ref_dts  = AV_NOPTS_VALUE;
+    return 0;
+}
+
 const AVCodecParser ff_avs3_parser = {
     .codec_ids      = { AV_CODEC_ID_AVS3 },
-    .priv_data_size = sizeof(ParseContext),
+    .priv_data_size = sizeof(AVS3ParseContext),
+    .parser_init    = avs3_parse_init,
     .parser_parse   = avs3_parse,
     .parser_close   = ff_parse_close,
 };
@@ -110,6 +110,10 @@ void ff_cavs_filter(AVSContext *h, enum cavs_mb mb_type)
     int qp_avg, alpha, beta, tc;
     int i;
 
+    /* nothing was reconstructed */
+    if (h->syntax_only)
+        return;
+
     /* save un-deblocked lines */
     h->topleft_border_y = h->top_border_y[h->mbx * 16 + 15];
     h->topleft_border_u = h->top_border_u[h->mbx * 10 + 8];
@@ -385,13 +389,14 @@ void ff_cavs_modify_mb_i(AVSContext *h, int *pred_mode_uv)
  *
  ****************************************************************************/
 
-static inline void mc_dir_part(AVSContext *h, AVFrame *pic, int chroma_height,
+static inline void mc_dir_part(AVSContext *h, AVSFrame *ref, int chroma_height,
                                int delta, int list, uint8_t *dest_y,
                                uint8_t *dest_cb, uint8_t *dest_cr,
                                int src_x_offset, int src_y_offset,
                                qpel_mc_func *qpix_op,
                                h264_chroma_mc_func chroma_op, cavs_vector *mv)
 {
+    AVFrame *pic         = ref->f;
     const int mx         = mv->x + src_x_offset * 8;
     const int my         = mv->y + src_y_offset * 8;
     const int luma_xy    = (mx & 3) + ((my & 3) << 2);
@@ -408,6 +413,11 @@ static inline void mc_dir_part(AVSContext *h, AVFrame *pic, int chroma_height,
 
     if (!pic->data[0])
         return;
+
+    /* wait until the rows needed by the interpolation filter are deblocked */
+    ff_thread_await_progress(&ref->tf,
+                             av_clip(full_my + 16 + 3, 0, pic_height - 1) >> 4, 0);
+
     if (mx & 7)
         extra_width  -= 3;
     if (my & 7)
@@ -472,7 +482,7 @@ static inline void mc_part_std(AVSContext *h, int chroma_height, int delta,
     y_offset += 8 * h->mby;
 
     if (mv->ref >= 0) {
-        AVFrame *ref = h->DPB[mv->ref].f;
+        AVSFrame *ref = &h->DPB[mv->ref];
         mc_dir_part(h, ref, chroma_height, delta, 0,
                     dest_y, dest_cb, dest_cr, x_offset, y_offset,
                     qpix_op, chroma_op, mv);
@@ -482,7 +492,7 @@ static inline void mc_part_std(AVSContext *h, int chroma_height, int delta,
     }
 
     if ((mv + MV_BWD_OFFS)->ref >= 0) {
-        AVFrame *ref = h->DPB[0].f;
+        AVSFrame *ref = &h->DPB[0];
         mc_dir_part(h, ref, chroma_height, delta, 1,
                     dest_y, dest_cb, dest_cr, x_offset, y_offset,
                     qpix_op, chroma_op, mv + MV_BWD_OFFS);
@@ -700,6 +710,8 @@ int ff_cavs_next_mb(AVSContext *h)
         for (i = 0; i <= 20; i += 4)
             h->mv[i] = un_mv;
         h->mbx = 0;
+        /* the deblocking of this row has finished the row above it */
+        ff_thread_report_progress(&h->cur.tf, h->mby - 1, 0);
         h->mby++;
         /* re-calculate sample pointers */
         h->cy = h->cur.f->data[0] + h->mby * 16 * h->l_stride;
@@ -749,12 +761,53 @@ int ff_cavs_init_pic(AVSContext *h)
  *
  ****************************************************************************/
 
-/**
- * some predictions require data from the top-neighbouring macroblock.
- * this data has to be stored for one complete row of macroblocks
- * and this storage space is allocated here
- */
-int ff_cavs_init_top_lines(AVSContext *h)
+void ff_cavs_unref_frame(AVSContext *h, AVSFrame *frame)
+{
+    ff_thread_release_ext_buffer(h->avctx, &frame->tf);
+    av_buffer_unref(&frame->col_mv_buf);
+    av_buffer_unref(&frame->col_type_buf);
+    av_buffer_unref(&frame->mb_info_buf);
+}
+
+int ff_cavs_replace_frame(AVSContext *h, AVSFrame *dst, const AVSFrame *src)
+{
+    int ret;
+
+    if (!src->f->buf[0]) {
+        ff_cavs_unref_frame(h, dst);
+        return 0;
+    }
+    ret = ff_thread_replace_frame(h->avctx, &dst->tf, &src->tf);
+    if (ret < 0)
+        return ret;
+    ret = av_buffer_replace(&dst->col_mv_buf, src->col_mv_buf);
+    if (ret < 0)
+        return ret;
+    ret = av_buffer_replace(&dst->col_type_buf, src->col_type_buf);
+    if (ret < 0)
+        return ret;
+    ret = av_buffer_replace(&dst->mb_info_buf, src->mb_info_buf);
+    if (ret < 0)
+        return ret;
+    dst->poc = src->poc;
+    dst->qp  = src->qp;
+    return 0;
+}
+
+static void free_top_lines(AVSContext *h)
+{
+    av_freep(&h->top_qp);
+    av_freep(&h->top_mv[0]);
+    av_freep(&h->top_mv[1]);
+    av_freep(&h->top_pred_Y);
+    av_freep(&h->top_border_y);
+    av_freep(&h->top_border_u);
+    av_freep(&h->top_border_v);
+    av_freep(&h->block);
+    av_freep(&h->edge_emu_buffer);
+}
+
+static int alloc_top_lines(AVSContext *h)
 {
     /* alloc top line of predictors */
     h->top_qp       = av_mallocz(h->mb_width);
@@ -764,27 +817,109 @@ int ff_cavs_init_top_lines(AVSContext *h)
     h->top_border_y = av_calloc(h->mb_width + 1,  16);
     h->top_border_u = av_calloc(h->mb_width,  10);
     h->top_border_v = av_calloc(h->mb_width,  10);
-
-    /* alloc space for co-located MVs and types */
-    h->col_mv        = av_calloc(h->mb_width * h->mb_height,
-                                 4 * sizeof(*h->col_mv));
-    h->col_type_base = av_mallocz(h->mb_width * h->mb_height);
-    h->block         = av_mallocz(64 * sizeof(int16_t));
+    h->block        = av_mallocz(64 * sizeof(int16_t));
 
     if (!h->top_qp || !h->top_mv[0] || !h->top_mv[1] || !h->top_pred_Y ||
         !h->top_border_y || !h->top_border_u || !h->top_border_v ||
-        !h->col_mv || !h->col_type_base || !h->block) {
-        av_freep(&h->top_qp);
-        av_freep(&h->top_mv[0]);
-        av_freep(&h->top_mv[1]);
-        av_freep(&h->top_pred_Y);
-        av_freep(&h->top_border_y);
-        av_freep(&h->top_border_u);
-        av_freep(&h->top_border_v);
-        av_freep(&h->col_mv);
-        av_freep(&h->col_type_base);
-        av_freep(&h->block);
+        !h->block) {
+        free_top_lines(h);
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+/**
+ * some predictions require data from the top-neighbouring macroblock.
+ * this data has to be stored for one complete row of macroblocks
+ * and this storage space is allocated here
+ */
+int ff_cavs_init_top_lines(AVSContext *h)
+{
+    int ret = alloc_top_lines(h);
+    if (ret < 0)
+        return ret;
+
+    /* pools for the per-picture co-located MVs and types */
+    h->col_mv_pool   = av_buffer_pool_init(h->mb_width * h->mb_height *
+                                           4 * sizeof(*h->col_mv),
+                                           av_buffer_allocz);
+    h->col_type_pool = av_buffer_pool_init(h->mb_width * h->mb_height,
+                                           av_buffer_allocz);
+    if (!h->col_mv_pool || !h->col_type_pool)
+        goto fail;
+
+    /* per-picture macroblock info, only kept if it is exported */
+    if (h->avctx->export_side_data & (AV_CODEC_EXPORT_DATA_MVS |
+                                      AV_CODEC_EXPORT_DATA_VIDEO_ENC_PARAMS)) {
+        h->mb_info_pool = av_buffer_pool_init(h->mb_width * h->mb_height *
+                                              sizeof(*h->mb_info),
+                                              av_buffer_allocz);
+        if (!h->mb_info_pool)
+            goto fail;
+    }
+    return 0;
+
+fail:
+    free_top_lines(h);
+    av_buffer_pool_uninit(&h->col_mv_pool);
+    av_buffer_pool_uninit(&h->col_type_pool);
+    av_buffer_pool_uninit(&h->mb_info_pool);
+    return AVERROR(ENOMEM);
+}
+
+/**
+ * Allocate one context per slice thread. Each of them gets its own copy
+ * of the macroblock row state, the picture state is copied into them by
+ * ff_cavs_update_slice_context().
+ */
+int ff_cavs_init_slice_contexts(AVSContext *h)
+{
+    int i, ret;
+
+    if (h->slice_ctx)
+        return 0;
+
+    h->slices    = av_calloc(h->mb_height, sizeof(*h->slices));
+    h->slice_ctx = av_calloc(h->avctx->thread_count, sizeof(*h->slice_ctx));
+    if (!h->slices || !h->slice_ctx)
         return AVERROR(ENOMEM);
+    h->nb_slice_ctx = h->avctx->thread_count;
+
+    for (i = 0; i < h->nb_slice_ctx; i++) {
+        AVSContext *sl = &h->slice_ctx[i];
+
+        sl->mb_width = h->mb_width;
+        if ((ret = alloc_top_lines(sl)) < 0)
+            return ret;
+    }
+    return 0;
+}
+
+int ff_cavs_update_slice_context(AVSContext *sl, const AVSContext *h)
+{
+    AVSContext tmp = *sl;
+
+    *sl = *h;
+
+    /* restore what is private to the slice context */
+    sl->top_qp          = tmp.top_qp;
+    sl->top_mv[0]       = tmp.top_mv[0];
+    sl->top_mv[1]       = tmp.top_mv[1];
+    sl->top_pred_Y      = tmp.top_pred_Y;
+    sl->top_border_y    = tmp.top_border_y;
+    sl->top_border_u    = tmp.top_border_u;
+    sl->top_border_v    = tmp.top_border_v;
+    sl->block           = tmp.block;
+    sl->edge_emu_buffer = tmp.edge_emu_buffer;
+    sl->slices          = NULL;
+    sl->slice_ctx       = NULL;
+    sl->nb_slice_ctx    = 0;
+
+    if (!sl->edge_emu_buffer) {
+        int alloc_size = FFALIGN(FFABS(h->cur.f->linesize[0]) + 32, 32);
+        sl->edge_emu_buffer = av_mallocz(alloc_size * 2 * 24);
+        if (!sl->edge_emu_buffer)
+            return AVERROR(ENOMEM);
     }
     return 0;
 }
@@ -809,6 +944,9 @@ av_cold int ff_cavs_init(AVCodecContext *avctx)
     h->DPB[1].f = av_frame_alloc();
     if (!h->cur.f || !h->DPB[0].f || !h->DPB[1].f)
         return AVERROR(ENOMEM);
+    h->cur.tf.f    = h->cur.f;
+    h->DPB[0].tf.f = h->DPB[0].f;
+    h->DPB[1].tf.f = h->DPB[1].f;
 
     h->luma_scan[0]                     = 0;
     h->luma_scan[1]                     = 8;
@@ -835,21 +973,23 @@ av_cold int ff_cavs_init(AVCodecContext *avctx)
 av_cold int ff_cavs_end(AVCodecContext *avctx)
 {
     AVSContext *h = avctx->priv_data;
+    int i;
 
+    ff_cavs_unref_frame(h, &h->cur);
+    ff_cavs_unref_frame(h, &h->DPB[0]);
+    ff_cavs_unref_frame(h, &h->DPB[1]);
     av_frame_free(&h->cur.f);
     av_frame_free(&h->DPB[0].f);
     av_frame_free(&h->DPB[1].f);
 
-    av_freep(&h->top_qp);
-    av_freep(&h->top_mv[0]);
-    av_freep(&h->top_mv[1]);
-    av_freep(&h->top_pred_Y);
-    av_freep(&h->top_border_y);
-    av_freep(&h->top_border_u);
-    av_freep(&h->top_border_v);
-    av_freep(&h->col_mv);
-    av_freep(&h->col_type_base);
-    av_freep(&h->block);
-    av_freep(&h->edge_emu_buffer);
+    free_top_lines(h);
+    av_buffer_pool_uninit(&h->col_mv_pool);
+    av_buffer_pool_uninit(&h->col_type_pool);
+    av_buffer_pool_uninit(&h->mb_info_pool);
+
+    for (i = 0; i < h->nb_slice_ctx; i++)
+        free_top_lines(&h->slice_ctx[i]);
+    av_freep(&h->slice_ctx);
+    av_freep(&h->slices);
     return 0;
 }
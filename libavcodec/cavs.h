@@ -25,6 +25,7 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "libavutil/buffer.h"
 #include "libavutil/frame.h"
 #include "libavutil/mem_internal.h"
 
@@ -33,6 +34,7 @@
 #include "blockdsp.h"
 #include "h264chroma.h"
 #include "get_bits.h"
+#include "threadframe.h"
 #include "videodsp.h"
 
 #define SLICE_MAX_START_CODE    0x000001af
@@ -161,12 +163,36 @@ struct dec_2dvlc {
   int8_t max_run;
 };
 
+/**
+ * macroblock data kept for exporting it as side data
+ */
+typedef struct AVSMBInfo {
+    cavs_vector mv[8]; ///< forward and backward MVs of the four 8x8 blocks
+    uint8_t type;      ///< enum cavs_mb, MB_INFO_INVALID if not decoded
+    uint8_t qp;
+} AVSMBInfo;
+
+/** type of the macroblocks that were not decoded, e.g. after an error */
+#define MB_INFO_INVALID 0xff
+
 typedef struct AVSFrame {
-    AVFrame *f;
+    ThreadFrame tf;
+    AVFrame *f;                ///< alias of tf.f
     int poc;
+    int qp;                    ///< picture QP
+    AVBufferRef *col_mv_buf;   ///< motion vectors, used as co-located MVs by B-frames
+    AVBufferRef *col_type_buf; ///< macroblock types, used as co-located types by B-frames
+    AVBufferRef *mb_info_buf;  ///< AVSMBInfo of all MBs, only if side data is exported
 } AVSFrame;
 
+typedef struct AVSSlice {
+    const uint8_t *buf; ///< start code prefix of the slice
+    int mby;            ///< first macroblock row of the slice
+    int ret;            ///< decoding result
+} AVSSlice;
+
 typedef struct AVSContext {
+    const AVClass *class;
     AVCodecContext *avctx;
     BlockDSPContext bdsp;
     H264ChromaContext h264chroma;
@@ -209,7 +235,7 @@ typedef struct AVSContext {
        the same is repeated for backward motion vectors */
     cavs_vector mv[2*4*3];
     cavs_vector *top_mv[2];
-    cavs_vector *col_mv;
+    cavs_vector *col_mv;       ///< points into col_mv_buf of cur (I/P) or DPB[0] (B)
 
     /** luma pred mode cache
        0:    --  B2  B3
@@ -234,7 +260,11 @@ typedef struct AVSContext {
 
     void (*intra_pred_l[8])(uint8_t *d, uint8_t *top, uint8_t *left, ptrdiff_t stride);
     void (*intra_pred_c[7])(uint8_t *d, uint8_t *top, uint8_t *left, ptrdiff_t stride);
-    uint8_t *col_type_base;
+    uint8_t *col_type_base;    ///< points into col_type_buf of cur (I/P) or DPB[0] (B)
+    AVBufferPool *col_mv_pool;
+    AVBufferPool *col_type_pool;
+    AVSMBInfo *mb_info;        ///< points into mb_info_buf of cur
+    AVBufferPool *mb_info_pool;
 
     /* scaling factors for MV prediction */
     int sym_factor;    ///< for scaling in symmetrical B block
@@ -245,6 +275,14 @@ typedef struct AVSContext {
 
     int got_keyframe;
     int16_t *block;
+
+    int syntax_only;   ///< only parse the bitstream, do not reconstruct pictures
+
+    /* slice threading */
+    struct AVSContext *slice_ctx; ///< one context per slice thread
+    int nb_slice_ctx;
+    AVSSlice *slices;             ///< slices of the current picture
+    int nb_slices;
 } AVSContext;
 
 extern const uint8_t     ff_cavs_chroma_qp[64];
@@ -274,10 +312,14 @@ void ff_cavs_modify_mb_i(AVSContext *h, int *pred_mode_uv);
 void ff_cavs_inter(AVSContext *h, enum cavs_mb mb_type);
 void ff_cavs_mv(AVSContext *h, enum cavs_mv_loc nP, enum cavs_mv_loc nC,
                 enum cavs_mv_pred mode, enum cavs_block size, int ref);
+void ff_cavs_unref_frame(AVSContext *h, AVSFrame *frame);
+int  ff_cavs_replace_frame(AVSContext *h, AVSFrame *dst, const AVSFrame *src);
 void ff_cavs_init_mb(AVSContext *h);
 int  ff_cavs_next_mb(AVSContext *h);
 int ff_cavs_init_pic(AVSContext *h);
 int ff_cavs_init_top_lines(AVSContext *h);
+int ff_cavs_init_slice_contexts(AVSContext *h);
+int ff_cavs_update_slice_context(AVSContext *sl, const AVSContext *h);
 int ff_cavs_init(AVCodecContext *avctx);
 int ff_cavs_end (AVCodecContext *avctx);
 
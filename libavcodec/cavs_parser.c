@@ -27,6 +27,7 @@
 
 #include "parser.h"
 #include "cavs.h"
+#include "startcode.h"
 
 
 /**
@@ -44,7 +45,7 @@ static int cavs_find_frame_end(ParseContext *pc, const uint8_t *buf,
     i=0;
     if(!pic_found){
         for(i=0; i<buf_size; i++){
-            state= (state<<8) | buf[i];
+            i = avpriv_find_start_code(buf + i, buf + buf_size, &state) - buf - 1;
             if(state == PIC_I_START_CODE || state == PIC_PB_START_CODE){
                 i++;
                 pic_found=1;
@@ -58,7 +59,7 @@ static int cavs_find_frame_end(ParseContext *pc, const uint8_t *buf,
         if (buf_size == 0)
             return 0;
         for(; i<buf_size; i++){
-            state= (state<<8) | buf[i];
+            i = avpriv_find_start_code(buf + i, buf + buf_size, &state) - buf - 1;
             if (state == PIC_I_START_CODE || state == PIC_PB_START_CODE ||
                     state == CAVS_START_CODE) {
                 pc->frame_start_found=0;
@@ -26,6 +26,9 @@
  */
 
 #include "libavutil/avassert.h"
+#include "libavutil/motion_vector.h"
+#include "libavutil/opt.h"
+#include "libavutil/video_enc_params.h"
 #include "avcodec.h"
 #include "get_bits.h"
 #include "golomb.h"
@@ -35,6 +38,8 @@
 #include "mathops.h"
 #include "mpeg12data.h"
 #include "startcode.h"
+#include "thread.h"
+#include "threadframe.h"
 
 static const uint8_t mv_scan[4] = {
     MV_FWD_X0, MV_FWD_X1,
@@ -464,6 +469,25 @@ static inline void store_mvs(AVSContext *h)
     h->col_mv[h->mbidx * 4 + 3] = h->mv[MV_FWD_X3];
 }
 
+/**
+ * keep the macroblock data that is exported as frame side data
+ */
+static inline void store_mb_info(AVSContext *h, enum cavs_mb mb_type)
+{
+    AVSMBInfo *info;
+    int block;
+
+    if (!h->mb_info)
+        return;
+    info = &h->mb_info[h->mbidx];
+    for (block = 0; block < 4; block++) {
+        info->mv[block]     = h->mv[mv_scan[block]];
+        info->mv[block + 4] = h->mv[mv_scan[block] + MV_BWD_OFFS];
+    }
+    info->type = mb_type;
+    info->qp   = h->qp;
+}
+
 static inline void mv_pred_direct(AVSContext *h, cavs_vector *pmv_fw,
                                   cavs_vector *col_mv)
 {
@@ -588,7 +612,8 @@ static int decode_residual_block(AVSContext *h, GetBitContext *gb,
     if ((ret = dequant(h, level_buf, run_buf, block, dequant_mul[qp],
                       dequant_shift[qp], i)) < 0)
         return ret;
-    h->cdsp.cavs_idct8_add(dst, block, stride);
+    if (!h->syntax_only)
+        h->cdsp.cavs_idct8_add(dst, block, stride);
     h->bdsp.clear_block(block);
     return 0;
 }
@@ -700,9 +725,11 @@ static int decode_mb_i(AVSContext *h, int cbp_code)
     /* luma intra prediction interleaved with residual decode/transform/add */
     for (block = 0; block < 4; block++) {
         d = h->cy + h->luma_scan[block];
-        ff_cavs_load_intra_pred_luma(h, top, &left, block);
-        h->intra_pred_l[h->pred_mode_Y[scan3x3[block]]]
-            (d, top, left, h->l_stride);
+        if (!h->syntax_only) {
+            ff_cavs_load_intra_pred_luma(h, top, &left, block);
+            h->intra_pred_l[h->pred_mode_Y[scan3x3[block]]]
+                (d, top, left, h->l_stride);
+        }
         if (h->cbp & (1<<block)) {
             ret = decode_residual_block(h, gb, intra_dec, 1, h->qp, d, h->l_stride);
             if (ret < 0)
@@ -711,17 +738,20 @@ static int decode_mb_i(AVSContext *h, int cbp_code)
     }
 
     /* chroma intra prediction */
-    ff_cavs_load_intra_pred_chroma(h);
-    h->intra_pred_c[pred_mode_uv](h->cu, &h->top_border_u[h->mbx * 10],
-                                  h->left_border_u, h->c_stride);
-    h->intra_pred_c[pred_mode_uv](h->cv, &h->top_border_v[h->mbx * 10],
-                                  h->left_border_v, h->c_stride);
+    if (!h->syntax_only) {
+        ff_cavs_load_intra_pred_chroma(h);
+        h->intra_pred_c[pred_mode_uv](h->cu, &h->top_border_u[h->mbx * 10],
+                                      h->left_border_u, h->c_stride);
+        h->intra_pred_c[pred_mode_uv](h->cv, &h->top_border_v[h->mbx * 10],
+                                      h->left_border_v, h->c_stride);
+    }
 
     ret = decode_residual_chroma(h);
     if (ret < 0)
         return ret;
     ff_cavs_filter(h, I_8X8);
     set_mv_intra(h);
+    store_mb_info(h, I_8X8);
     return 0;
 }
 
@@ -772,13 +802,15 @@ static void decode_mb_p(AVSContext *h, enum cavs_mb mb_type)
         ff_cavs_mv(h, MV_FWD_X2, MV_FWD_X1, MV_PRED_MEDIAN,   BLK_8X8, ref[2]);
         ff_cavs_mv(h, MV_FWD_X3, MV_FWD_X0, MV_PRED_MEDIAN,   BLK_8X8, ref[3]);
     }
-    ff_cavs_inter(h, mb_type);
+    if (!h->syntax_only)
+        ff_cavs_inter(h, mb_type);
     set_intra_mode_default(h);
     store_mvs(h);
     if (mb_type != P_SKIP)
         decode_residual_inter(h);
     ff_cavs_filter(h, mb_type);
     h->col_type_base[h->mbidx] = mb_type;
+    store_mb_info(h, mb_type);
 }
 
 static int decode_mb_b(AVSContext *h, enum cavs_mb mb_type)
@@ -794,6 +826,9 @@ static int decode_mb_b(AVSContext *h, enum cavs_mb mb_type)
     set_mvs(&h->mv[MV_FWD_X0], BLK_16X16);
     h->mv[MV_BWD_X0] = ff_cavs_dir_mv;
     set_mvs(&h->mv[MV_BWD_X0], BLK_16X16);
+    /* the co-located data of this row is final once the row is */
+    if (mb_type == B_SKIP || mb_type == B_DIRECT || mb_type == B_8X8)
+        ff_thread_await_progress(&h->DPB[0].tf, h->mby, 0);
     switch (mb_type) {
     case B_SKIP:
     case B_DIRECT:
@@ -909,11 +944,13 @@ static int decode_mb_b(AVSContext *h, enum cavs_mb mb_type)
                 ff_cavs_mv(h, MV_BWD_X1, MV_BWD_C2, MV_PRED_TOPRIGHT, BLK_8X16, 0);
         }
     }
-    ff_cavs_inter(h, mb_type);
+    if (!h->syntax_only)
+        ff_cavs_inter(h, mb_type);
     set_intra_mode_default(h);
     if (mb_type != B_SKIP)
         decode_residual_inter(h);
     ff_cavs_filter(h, mb_type);
+    store_mb_info(h, mb_type);
 
     return 0;
 }
@@ -981,18 +1018,201 @@ static inline int check_for_slice(AVSContext *h)
  *
  ****************************************************************************/
 
-static int decode_pic(AVSContext *h)
+/**
+ * Check whether a picture is dropped at the given discard level.
+ * B-pictures are never used as reference and every I-picture is a key
+ * picture in AVS.
+ */
+static int discard_pic(enum AVDiscard discard, enum AVPictureType pict_type)
+{
+    return discard >= AVDISCARD_ALL ||
+           (discard >= AVDISCARD_NONINTRA && pict_type != AV_PICTURE_TYPE_I) ||
+           (discard >= AVDISCARD_NONREF   && pict_type == AV_PICTURE_TYPE_B);
+}
+
+/**
+ * Turn the last decoded picture into a reference picture if it is an
+ * I- or P-picture and release it from cur.
+ * This is deferred until the next picture starts, as cur must not change
+ * once ff_thread_finish_setup() has been called.
+ */
+static void update_refs(AVSContext *h)
+{
+    if (h->cur.f->buf[0] && h->cur.f->pict_type != AV_PICTURE_TYPE_B) {
+        ff_cavs_unref_frame(h, &h->DPB[1]);
+        FFSWAP(AVSFrame, h->cur, h->DPB[1]);
+        FFSWAP(AVSFrame, h->DPB[0], h->DPB[1]);
+    }
+    ff_cavs_unref_frame(h, &h->cur);
+}
+
+/**
+ * decode macroblocks until the end of the picture or until mb_end is reached
+ */
+static int decode_mbs(AVSContext *h, int mb_end)
 {
     int ret;
     int skip_count    = -1;
     enum cavs_mb mb_type;
 
+    ret = 0;
+    if (h->cur.f->pict_type == AV_PICTURE_TYPE_I) {
+        do {
+            check_for_slice(h);
+            ret = decode_mb_i(h, 0);
+            if (ret < 0)
+                break;
+        } while (ff_cavs_next_mb(h) && h->mbidx < mb_end);
+    } else if (h->cur.f->pict_type == AV_PICTURE_TYPE_P) {
+        do {
+            if (check_for_slice(h))
+                skip_count = -1;
+            if (h->skip_mode_flag && (skip_count < 0)) {
+                if (get_bits_left(&h->gb) < 1) {
+                    ret = AVERROR_INVALIDDATA;
+                    break;
+                }
+                skip_count = get_ue_golomb(&h->gb);
+            }
+            if (h->skip_mode_flag && skip_count--) {
+                decode_mb_p(h, P_SKIP);
+            } else {
+                if (get_bits_left(&h->gb) < 1) {
+                    ret = AVERROR_INVALIDDATA;
+                    break;
+                }
+                mb_type = get_ue_golomb(&h->gb) + P_SKIP + h->skip_mode_flag;
+                if (mb_type > P_8X8)
+                    ret = decode_mb_i(h, mb_type - P_8X8 - 1);
+                else
+                    decode_mb_p(h, mb_type);
+            }
+            if (ret < 0)
+                break;
+        } while (ff_cavs_next_mb(h) && h->mbidx < mb_end);
+    } else { /* AV_PICTURE_TYPE_B */
+        do {
+            if (check_for_slice(h))
+                skip_count = -1;
+            if (h->skip_mode_flag && (skip_count < 0)) {
+                if (get_bits_left(&h->gb) < 1) {
+                    ret = AVERROR_INVALIDDATA;
+                    break;
+                }
+                skip_count = get_ue_golomb(&h->gb);
+            }
+            if (h->skip_mode_flag && skip_count--) {
+                ret = decode_mb_b(h, B_SKIP);
+            } else {
+                if (get_bits_left(&h->gb) < 1) {
+                    ret = AVERROR_INVALIDDATA;
+                    break;
+                }
+                mb_type = get_ue_golomb(&h->gb) + B_SKIP + h->skip_mode_flag;
+                if (mb_type > B_8X8)
+                    ret = decode_mb_i(h, mb_type - B_8X8 - 1);
+                else
+                    ret = decode_mb_b(h, mb_type);
+            }
+            if (ret < 0)
+                break;
+        } while (ff_cavs_next_mb(h) && h->mbidx < mb_end);
+    }
+    emms_c();
+    return ret;
+}
+/**
+ * Locate the slice start codes of the current picture.
+ * Slices can only be decoded in parallel if they are in increasing
+ * row order and the first one starts the picture data.
+ */
+static void find_slices(AVSContext *h)
+{
+    const uint8_t *pic_data = h->gb.buffer + ((get_bits_count(&h->gb) + 7) >> 3);
+    const uint8_t *buf      = pic_data;
+    const uint8_t *buf_end  = h->gb.buffer_end;
+    uint32_t stc = -1;
+    int nb_slices = 0;
+
+    h->nb_slices = 0;
+    for (;;) {
+        buf = avpriv_find_start_code(buf, buf_end, &stc);
+        if ((stc & 0xFFFFFF00) != 0x100 || stc > SLICE_MAX_START_CODE ||
+            buf == buf_end)
+            break;
+        if ((stc & 0xFF) >= h->mb_height ||
+            (nb_slices && (stc & 0xFF) <= h->slices[nb_slices - 1].mby))
+            return;
+        h->slices[nb_slices].buf = buf - 4;
+        h->slices[nb_slices].mby = stc & 0xFF;
+        nb_slices++;
+    }
+    /* allow for one stuffing byte in front of the first slice */
+    if (!nb_slices || h->slices[0].mby || h->slices[0].buf - pic_data > 1)
+        return;
+    h->nb_slices = nb_slices;
+}
+
+static int decode_slice_thread(AVCodecContext *avctx, void *arg,
+                               int jobnr, int threadnr)
+{
+    AVSContext *h     = avctx->priv_data;
+    AVSContext *sl    = &h->slice_ctx[threadnr];
+    AVSSlice   *slice = &h->slices[jobnr];
+    int mb_end = jobnr + 1 < h->nb_slices ?
+                 h->slices[jobnr + 1].mby * h->mb_width :
+                 h->mb_width * h->mb_height;
+
+    slice->ret = init_get_bits8(&sl->gb, slice->buf, h->gb.buffer_end - slice->buf);
+    if (slice->ret < 0)
+        return slice->ret;
+
+    ff_cavs_init_pic(sl);
+    sl->mby   = slice->mby;
+    sl->mbidx = sl->mby * sl->mb_width;
+    sl->cy    = sl->cur.f->data[0] + sl->mby * 16 * sl->l_stride;
+    sl->cu    = sl->cur.f->data[1] + sl->mby *  8 * sl->c_stride;
+    sl->cv    = sl->cur.f->data[2] + sl->mby *  8 * sl->c_stride;
+
+    slice->ret = decode_mbs(sl, mb_end);
+    return slice->ret;
+}
+
+/**
+ * Decode the slices of the current picture in parallel.
+ * Slices reset all prediction and the deblocking filter does not cross
+ * slice boundaries either, so slice threads write disjoint MB rows.
+ */
+static int decode_slices(AVSContext *h)
+{
+    int i, ret;
+
+    for (i = 0; i < h->nb_slice_ctx; i++)
+        if ((ret = ff_cavs_update_slice_context(&h->slice_ctx[i], h)) < 0)
+            return ret;
+
+    h->avctx->execute2(h->avctx, decode_slice_thread, NULL, NULL, h->nb_slices);
+
+    for (i = 0; i < h->nb_slices; i++)
+        if (h->slices[i].ret < 0)
+            return h->slices[i].ret;
+    return 0;
+}
+
+/**
+ * @return 0 if the picture was decoded, 1 if it was skipped because of
+ *         skip_frame, a negative error code otherwise
+ */
+static int decode_pic(AVSContext *h)
+{
+    int ret;
+
     if (!h->top_qp) {
         av_log(h->avctx, AV_LOG_ERROR, "No sequence header decoded yet\n");
         return AVERROR_INVALIDDATA;
     }
 
-    av_frame_unref(h->cur.f);
+    update_refs(h);
 
     skip_bits(&h->gb, 16);//bbv_dwlay
     if (h->stc == PIC_PB_START_CODE) {
@@ -1023,20 +1243,58 @@ static int decode_pic(AVSContext *h)
     if (get_bits_left(&h->gb) < 23)
         return AVERROR_INVALIDDATA;
 
-    ret = ff_get_buffer(h->avctx, h->cur.f, h->cur.f->pict_type == AV_PICTURE_TYPE_B ?
-                        0 : AV_GET_BUFFER_FLAG_REF);
+    /* skipped pictures are neither output nor used as reference */
+    if (discard_pic(h->avctx->skip_frame, h->cur.f->pict_type))
+        return 1;
+
+    ret = ff_thread_get_ext_buffer(h->avctx, &h->cur.tf,
+                                   h->cur.f->pict_type == AV_PICTURE_TYPE_B ?
+                                   0 : AV_GET_BUFFER_FLAG_REF);
     if (ret < 0)
         return ret;
 
+    if (h->cur.f->pict_type == AV_PICTURE_TYPE_B) {
+        if (!h->DPB[0].col_mv_buf) {
+            ret = AVERROR_INVALIDDATA;
+            goto fail;
+        }
+        h->col_mv        = (cavs_vector *)h->DPB[0].col_mv_buf->data;
+        h->col_type_base = h->DPB[0].col_type_buf->data;
+    } else {
+        h->cur.col_mv_buf   = av_buffer_pool_get(h->col_mv_pool);
+        h->cur.col_type_buf = av_buffer_pool_get(h->col_type_pool);
+        if (!h->cur.col_mv_buf || !h->cur.col_type_buf) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        h->col_mv        = (cavs_vector *)h->cur.col_mv_buf->data;
+        h->col_type_base = h->cur.col_type_buf->data;
+    }
+
+    h->mb_info = NULL;
+    if (h->mb_info_pool) {
+        h->cur.mb_info_buf = av_buffer_pool_get(h->mb_info_pool);
+        if (!h->cur.mb_info_buf) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        h->mb_info = (AVSMBInfo *)h->cur.mb_info_buf->data;
+        /* the pool reuses the buffers of previous pictures, this makes
+         * every type MB_INFO_INVALID and every MV unused */
+        memset(h->mb_info, 0xff, h->cur.mb_info_buf->size);
+    }
+
     if (!h->edge_emu_buffer) {
         int alloc_size = FFALIGN(FFABS(h->cur.f->linesize[0]) + 32, 32);
         h->edge_emu_buffer = av_mallocz(alloc_size * 2 * 24);
-        if (!h->edge_emu_buffer)
-            return AVERROR(ENOMEM);
+        if (!h->edge_emu_buffer) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
     }
 
     if ((ret = ff_cavs_init_pic(h)) < 0)
-        return ret;
+        goto fail;
     h->cur.poc = get_bits(&h->gb, 8) * 2;
 
     /* get temporal distances and MV scaling factors */
@@ -1052,7 +1310,8 @@ static int decode_pic(AVSContext *h)
         h->sym_factor = h->dist[0] * h->scale_den[1];
         if (FFABS(h->sym_factor) > 32768) {
             av_log(h->avctx, AV_LOG_ERROR, "sym_factor %d too large\n", h->sym_factor);
-            return AVERROR_INVALIDDATA;
+            ret = AVERROR_INVALIDDATA;
+            goto fail;
         }
     } else {
         h->direct_den[0] = h->dist[0] ? 16384 / h->dist[0] : 0;
@@ -1072,6 +1331,7 @@ static int decode_pic(AVSContext *h)
     h->pic_qp_fixed =
     h->qp_fixed = get_bits1(&h->gb);
     h->qp       = get_bits(&h->gb, 6);
+    h->cur.qp   = h->qp;
     if (h->cur.f->pict_type == AV_PICTURE_TYPE_I) {
         if (!h->progressive && !h->pic_structure)
             skip_bits1(&h->gb);//what is this?
@@ -1089,84 +1349,150 @@ static int decode_pic(AVSContext *h)
         if (   h->alpha_offset < -64 || h->alpha_offset > 64
             || h-> beta_offset < -64 || h-> beta_offset > 64) {
             h->alpha_offset = h->beta_offset  = 0;
-            return AVERROR_INVALIDDATA;
+            ret = AVERROR_INVALIDDATA;
+            goto fail;
         }
     } else {
         h->alpha_offset = h->beta_offset  = 0;
     }
+    if (discard_pic(h->avctx->skip_loop_filter, h->cur.f->pict_type))
+        h->loop_filter_disable = 1;
 
-    ret = 0;
-    if (h->cur.f->pict_type == AV_PICTURE_TYPE_I) {
-        do {
-            check_for_slice(h);
-            ret = decode_mb_i(h, 0);
-            if (ret < 0)
-                break;
-        } while (ff_cavs_next_mb(h));
-    } else if (h->cur.f->pict_type == AV_PICTURE_TYPE_P) {
-        do {
-            if (check_for_slice(h))
-                skip_count = -1;
-            if (h->skip_mode_flag && (skip_count < 0)) {
-                if (get_bits_left(&h->gb) < 1) {
-                    ret = AVERROR_INVALIDDATA;
-                    break;
-                }
-                skip_count = get_ue_golomb(&h->gb);
-            }
-            if (h->skip_mode_flag && skip_count--) {
-                decode_mb_p(h, P_SKIP);
-            } else {
-                if (get_bits_left(&h->gb) < 1) {
-                    ret = AVERROR_INVALIDDATA;
-                    break;
-                }
-                mb_type = get_ue_golomb(&h->gb) + P_SKIP + h->skip_mode_flag;
-                if (mb_type > P_8X8)
-                    ret = decode_mb_i(h, mb_type - P_8X8 - 1);
-                else
-                    decode_mb_p(h, mb_type);
-            }
-            if (ret < 0)
-                break;
-        } while (ff_cavs_next_mb(h));
-    } else { /* AV_PICTURE_TYPE_B */
-        do {
-            if (check_for_slice(h))
-                skip_count = -1;
-            if (h->skip_mode_flag && (skip_count < 0)) {
-                if (get_bits_left(&h->gb) < 1) {
-                    ret = AVERROR_INVALIDDATA;
-                    break;
-                }
-                skip_count = get_ue_golomb(&h->gb);
-            }
-            if (h->skip_mode_flag && skip_count--) {
-                ret = decode_mb_b(h, B_SKIP);
-            } else {
-                if (get_bits_left(&h->gb) < 1) {
-                    ret = AVERROR_INVALIDDATA;
-                    break;
-                }
-                mb_type = get_ue_golomb(&h->gb) + B_SKIP + h->skip_mode_flag;
-                if (mb_type > B_8X8)
-                    ret = decode_mb_i(h, mb_type - B_8X8 - 1);
-                else
-                    ret = decode_mb_b(h, mb_type);
-            }
-            if (ret < 0)
-                break;
-        } while (ff_cavs_next_mb(h));
-    }
-    emms_c();
-    if (ret >= 0 && h->cur.f->pict_type != AV_PICTURE_TYPE_B) {
-        av_frame_unref(h->DPB[1].f);
-        FFSWAP(AVSFrame, h->cur, h->DPB[1]);
-        FFSWAP(AVSFrame, h->DPB[0], h->DPB[1]);
+    ff_thread_finish_setup(h->avctx);
+
+    if (h->avctx->active_thread_type & FF_THREAD_SLICE) {
+        if ((ret = ff_cavs_init_slice_contexts(h)) < 0)
+            goto fail;
+        find_slices(h);
     }
+    if (h->nb_slices > 1)
+        ret = decode_slices(h);
+    else
+        ret = decode_mbs(h, h->mb_width * h->mb_height);
+    ff_thread_report_progress(&h->cur.tf, INT_MAX, 0);
+    /* with frame threading the next thread already uses this picture as
+     * reference, so it has to be kept even if it is damaged */
+    if (ret >= 0 || (h->avctx->active_thread_type & FF_THREAD_FRAME))
+        return ret;
+fail:
+    ff_cavs_unref_frame(h, &h->cur);
     return ret;
 }
 
+static int export_mvs(AVSContext *h, AVFrame *frame, const AVSMBInfo *info)
+{
+    const int nb_dirs = frame->pict_type == AV_PICTURE_TYPE_B ? 2 : 1;
+    const int nb_mb   = h->mb_width * h->mb_height;
+    AVFrameSideData *sd;
+    AVMotionVector *mvs;
+    int i, j, nb_mvs = 0;
+
+    for (i = 0; i < nb_mb; i++) {
+        if (info[i].type == MB_INFO_INVALID)
+            continue;
+        for (j = 0; j < 4 * nb_dirs; j++)
+            nb_mvs += info[i].mv[j].ref >= 0;
+    }
+    if (!nb_mvs)
+        return 0;
+
+    sd = av_frame_new_side_data(frame, AV_FRAME_DATA_MOTION_VECTORS,
+                                nb_mvs * sizeof(*mvs));
+    if (!sd)
+        return AVERROR(ENOMEM);
+    mvs = (AVMotionVector *)sd->data;
+
+    for (i = 0; i < nb_mb; i++) {
+        if (info[i].type == MB_INFO_INVALID)
+            continue;
+        for (j = 0; j < 4 * nb_dirs; j++) {
+            const cavs_vector *mv = &info[i].mv[j];
+            int dst_x = (i % h->mb_width) * 16 + 4 + 8 * (j & 1);
+            int dst_y = (i / h->mb_width) * 16 + 4 + 8 * ((j >> 1) & 1);
+
+            if (mv->ref < 0)
+                continue;
+            mvs->source       = j < 4 ? -1 : 1;
+            mvs->w            = 8;
+            mvs->h            = 8;
+            mvs->dst_x        = dst_x;
+            mvs->dst_y        = dst_y;
+            mvs->src_x        = dst_x + mv->x / 4;
+            mvs->src_y        = dst_y + mv->y / 4;
+            mvs->motion_x     = mv->x;
+            mvs->motion_y     = mv->y;
+            mvs->motion_scale = 4;
+            mvs->flags        = 0;
+            mvs++;
+        }
+    }
+    return 0;
+}
+
+static int export_enc_params(AVSContext *h, AVFrame *frame, const AVSFrame *pic,
+                             const AVSMBInfo *info)
+{
+    AVVideoEncParams *par;
+    unsigned int nb_mb = h->mb_width * h->mb_height;
+    unsigned int i, nb_blocks = 0;
+
+    for (i = 0; i < nb_mb; i++)
+        nb_blocks += info[i].type != MB_INFO_INVALID;
+
+    par = av_video_enc_params_create_side_data(frame, AV_VIDEO_ENC_PARAMS_CAVS, nb_blocks);
+    if (!par)
+        return AVERROR(ENOMEM);
+
+    par->qp = pic->qp;
+
+    for (i = 0, nb_blocks = 0; i < nb_mb; i++) {
+        AVVideoBlockParams *b;
+
+        if (info[i].type == MB_INFO_INVALID)
+            continue;
+        b = av_video_enc_params_block(par, nb_blocks++);
+
+        b->src_x = (i % h->mb_width) * 16;
+        b->src_y = (i / h->mb_width) * 16;
+        b->w     = 16;
+        b->h     = 16;
+
+        b->delta_qp = info[i].qp - par->qp;
+    }
+
+    return 0;
+}
+
+/**
+ * Attach the motion vectors and quantizers of pic to the output frame.
+ * The side data is added to the returned reference only, as pic->f may
+ * be in use by other threads already.
+ */
+static int export_side_data(AVSContext *h, AVFrame *frame, const AVSFrame *pic)
+{
+    const AVSMBInfo *info;
+    int ret;
+
+    if (!pic->mb_info_buf)
+        return 0;
+    info = (const AVSMBInfo *)pic->mb_info_buf->data;
+
+    /* a delayed reference picture may still be decoded by another thread */
+    ff_thread_await_progress(&pic->tf, INT_MAX, 0);
+
+    if (h->avctx->export_side_data & AV_CODEC_EXPORT_DATA_MVS) {
+        ret = export_mvs(h, frame, info);
+        if (ret < 0)
+            return ret;
+    }
+    if (h->avctx->export_side_data & AV_CODEC_EXPORT_DATA_VIDEO_ENC_PARAMS) {
+        ret = export_enc_params(h, frame, pic, info);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
 /*****************************************************************************
  *
  * headers and interface
@@ -1177,6 +1503,7 @@ static int decode_seq_header(AVSContext *h)
 {
     int frame_rate_code;
     int width, height;
+    int chroma_format, sample_precision;
     int ret;
 
     h->profile = get_bits(&h->gb, 8);
@@ -1199,8 +1526,18 @@ static int decode_seq_header(AVSContext *h)
         av_log(h->avctx, AV_LOG_ERROR, "Dimensions invalid\n");
         return AVERROR_INVALIDDATA;
     }
-    skip_bits(&h->gb, 2); //chroma format
-    skip_bits(&h->gb, 3); //sample_precision
+    chroma_format    = get_bits(&h->gb, 2);
+    sample_precision = get_bits(&h->gb, 3);
+    if (chroma_format != 1 && chroma_format != 2) {
+        av_log(h->avctx, AV_LOG_ERROR, "Invalid chroma format %d\n", chroma_format);
+        return AVERROR_INVALIDDATA;
+    }
+    if (chroma_format != 1 || sample_precision > 1) {
+        avpriv_report_missing_feature(h->avctx,
+                                      "chroma format %d, sample precision %d",
+                                      chroma_format, sample_precision);
+        return AVERROR_PATCHWELCOME;
+    }
     h->aspect_ratio = get_bits(&h->gb, 4);
     frame_rate_code = get_bits(&h->gb, 4);
     if (frame_rate_code == 0 || frame_rate_code > 13) {
@@ -1234,6 +1571,48 @@ static void cavs_flush(AVCodecContext * avctx)
     h->got_keyframe = 0;
 }
 
+#if HAVE_THREADS
+static int cavs_update_thread_context(AVCodecContext *dst,
+                                      const AVCodecContext *src)
+{
+    AVSContext *h = dst->priv_data;
+    const AVSContext *h1 = src->priv_data;
+    int ret;
+
+    if (dst == src)
+        return 0;
+
+    if (h1->top_qp && !h->top_qp) {
+        h->width     = h1->width;
+        h->height    = h1->height;
+        h->mb_width  = h1->mb_width;
+        h->mb_height = h1->mb_height;
+        if ((ret = ff_cavs_init_top_lines(h)) < 0)
+            return ret;
+    }
+    h->profile         = h1->profile;
+    h->level           = h1->level;
+    h->aspect_ratio    = h1->aspect_ratio;
+    h->low_delay       = h1->low_delay;
+    h->stream_revision = h1->stream_revision;
+    h->got_keyframe    = h1->got_keyframe;
+
+    /* the source thread defers its own update_refs() to its next picture */
+    if (h1->cur.f->buf[0] && h1->cur.f->pict_type != AV_PICTURE_TYPE_B) {
+        if ((ret = ff_cavs_replace_frame(h, &h->DPB[1], &h1->DPB[0])) < 0 ||
+            (ret = ff_cavs_replace_frame(h, &h->DPB[0], &h1->cur))    < 0)
+            return ret;
+    } else {
+        if ((ret = ff_cavs_replace_frame(h, &h->DPB[0], &h1->DPB[0])) < 0 ||
+            (ret = ff_cavs_replace_frame(h, &h->DPB[1], &h1->DPB[1])) < 0)
+            return ret;
+    }
+    ff_cavs_unref_frame(h, &h->cur);
+
+    return 0;
+}
+#endif
+
 static int cavs_decode_frame(AVCodecContext *avctx, AVFrame *rframe,
                              int *got_frame, AVPacket *avpkt)
 {
@@ -1246,10 +1625,16 @@ static int cavs_decode_frame(AVCodecContext *avctx, AVFrame *rframe,
     const uint8_t *buf_ptr;
     int frame_start = 0;
 
+    update_refs(h);
+
     if (buf_size == 0) {
         if (!h->low_delay && h->DPB[0].f->data[0]) {
             *got_frame = 1;
             av_frame_move_ref(rframe, h->DPB[0].f);
+            ret = export_side_data(h, rframe, &h->DPB[0]);
+            ff_cavs_unref_frame(h, &h->DPB[0]);
+            if (ret < 0)
+                return ret;
         }
         return 0;
     }
@@ -1273,8 +1658,8 @@ static int cavs_decode_frame(AVCodecContext *avctx, AVFrame *rframe,
             break;
         case PIC_I_START_CODE:
             if (!h->got_keyframe) {
-                av_frame_unref(h->DPB[0].f);
-                av_frame_unref(h->DPB[1].f);
+                ff_cavs_unref_frame(h, &h->DPB[0]);
+                ff_cavs_unref_frame(h, &h->DPB[1]);
                 h->got_keyframe = 1;
             }
         case PIC_PB_START_CODE:
@@ -1292,14 +1677,19 @@ static int cavs_decode_frame(AVCodecContext *avctx, AVFrame *rframe,
                 break;
             *got_frame = 1;
             if (h->cur.f->pict_type != AV_PICTURE_TYPE_B) {
-                if (h->DPB[!h->low_delay].f->data[0]) {
-                    if ((ret = av_frame_ref(rframe, h->DPB[!h->low_delay].f)) < 0)
+                /* cur becomes DPB[0] and DPB[0] becomes DPB[1] in update_refs() */
+                const AVSFrame *out = h->low_delay ? &h->cur : &h->DPB[0];
+                if (out->f->data[0]) {
+                    if ((ret = av_frame_ref(rframe, out->f)) < 0 ||
+                        (ret = export_side_data(h, rframe, out)) < 0)
                         return ret;
                 } else {
                     *got_frame = 0;
                 }
             } else {
-                av_frame_move_ref(rframe, h->cur.f);
+                if ((ret = av_frame_ref(rframe, h->cur.f)) < 0 ||
+                    (ret = export_side_data(h, rframe, &h->cur)) < 0)
+                    return ret;
             }
             break;
         case EXT_START_CODE:
@@ -1309,7 +1699,8 @@ static int cavs_decode_frame(AVCodecContext *avctx, AVFrame *rframe,
             //mpeg_decode_user_data(avctx, buf_ptr, input_size);
             break;
         default:
-            if (stc <= SLICE_MAX_START_CODE) {
+            /* the slices of skipped or broken pictures are ignored */
+            if (stc <= SLICE_MAX_START_CODE && h->cur.f->buf[0]) {
                 init_get_bits(&h->gb, buf_ptr, input_size);
                 decode_slice_header(h, &h->gb);
             }
@@ -1318,16 +1709,35 @@ static int cavs_decode_frame(AVCodecContext *avctx, AVFrame *rframe,
     }
 }
 
+#define OFFSET(x) offsetof(AVSContext, x)
+#define VD AV_OPT_FLAG_VIDEO_PARAM | AV_OPT_FLAG_DECODING_PARAM
+static const AVOption options[] = {
+    { "syntax_only", "Only parse the bitstream, e.g. to export side data; the picture content is unspecified",
+      OFFSET(syntax_only), AV_OPT_TYPE_BOOL, { .i64 = 0 }, 0, 1, VD },
+    { NULL },
+};
+
+static const AVClass cavs_class = {
+    .class_name = "cavs",
+    .item_name  = av_default_item_name,
+    .option     = options,
+    .version    = LIBAVUTIL_VERSION_INT,
+};
+
 const FFCodec ff_cavs_decoder = {
     .p.name         = "cavs",
     CODEC_LONG_NAME("Chinese AVS (Audio Video Standard) (AVS1-P2, JiZhun profile)"),
     .p.type         = AVMEDIA_TYPE_VIDEO,
     .p.id           = AV_CODEC_ID_CAVS,
     .priv_data_size = sizeof(AVSContext),
+    .p.priv_class   = &cavs_class,
     .init           = ff_cavs_init,
     .close          = ff_cavs_end,
     FF_CODEC_DECODE_CB(cavs_decode_frame),
-    .p.capabilities = AV_CODEC_CAP_DR1 | AV_CODEC_CAP_DELAY,
+    .p.capabilities = AV_CODEC_CAP_DR1 | AV_CODEC_CAP_DELAY |
+                      AV_CODEC_CAP_FRAME_THREADS | AV_CODEC_CAP_SLICE_THREADS,
     .flush          = cavs_flush,
-    .caps_internal  = FF_CODEC_CAP_INIT_CLEANUP,
+    UPDATE_THREAD_CONTEXT(cavs_update_thread_context),
+    .caps_internal  = FF_CODEC_CAP_INIT_CLEANUP |
+                      FF_CODEC_CAP_ALLOCATE_PROGRESS,
 };
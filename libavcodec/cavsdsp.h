@@ -39,6 +39,7 @@ typedef struct CAVSDSPContext {
 } CAVSDSPContext;
 
 void ff_cavsdsp_init(CAVSDSPContext* c);
+void ff_cavsdsp_init_aarch64(CAVSDSPContext *c);
 void ff_cavsdsp_init_x86(CAVSDSPContext* c);
 
 #endif /* AVCODEC_CAVSDSP_H */
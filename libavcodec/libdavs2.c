@@ -23,9 +23,12 @@
  */
 
 #include "libavutil/cpu.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/pixdesc.h"
 #include "avcodec.h"
 #include "codec_internal.h"
 #include "avs2.h"
+#include "decode.h"
 #include "davs2.h"
 
 typedef struct DAVS2Context {
@@ -65,9 +68,10 @@ static int davs2_dump_frames(AVCodecContext *avctx, davs2_picture_t *pic, int *g
                              davs2_seq_info_t *headerset, int ret_type, AVFrame *frame)
 {
     DAVS2Context *cad    = avctx->priv_data;
+    const AVPixFmtDescriptor *desc;
     int bytes_per_sample = pic->bytes_per_sample;
     int plane = 0;
-    int line  = 0;
+    int ret;
 
     if (!headerset) {
         *got_frame = 0;
@@ -112,28 +116,47 @@ static int davs2_dump_frames(AVCodecContext *avctx, davs2_picture_t *pic, int *g
         return AVERROR_EXTERNAL;
     }
 
-    for (plane = 0; plane < 3; ++plane) {
-        int size_line = pic->widths[plane] * bytes_per_sample;
-        frame->buf[plane]  = av_buffer_alloc(size_line * pic->lines[plane]);
+    if (avctx->width  != cad->headerset.width ||
+        avctx->height != cad->headerset.height) {
+        ret = ff_set_dimensions(avctx, cad->headerset.width, cad->headerset.height);
+        if (ret < 0)
+            return ret;
+    }
 
-        if (!frame->buf[plane]){
-            av_log(avctx, AV_LOG_ERROR, "Decoder error: allocation failure, can't dump frames.\n");
-            return AVERROR(ENOMEM);
-        }
+    /* davs2 keeps ownership of its pictures, so the output still has to be
+     * copied, but into a buffer from the user's get_buffer2() pool */
+    ret = ff_get_buffer(avctx, frame, 0);
+    if (ret < 0)
+        return ret;
+
+    /* the frame is sized from the sequence header, only copy what fits in it;
+     * davs2 planes may be padded */
+    desc = av_pix_fmt_desc_get(frame->format);
+    if (bytes_per_sample != (desc->comp[0].depth + 7) >> 3) {
+        av_log(avctx, AV_LOG_ERROR, "Decoder error: %d bytes per sample "
+               "for a %d-bit output\n", bytes_per_sample, desc->comp[0].depth);
+        return AVERROR_EXTERNAL;
+    }
 
-        frame->data[plane]     = frame->buf[plane]->data;
-        frame->linesize[plane] = size_line;
+    for (plane = 0; plane < 3; ++plane) {
+        int width  = plane ? AV_CEIL_RSHIFT(frame->width,  desc->log2_chroma_w)
+                           : frame->width;
+        int height = plane ? AV_CEIL_RSHIFT(frame->height, desc->log2_chroma_h)
+                           : frame->height;
+
+        if (pic->widths[plane] < width || pic->lines[plane] < height) {
+            av_log(avctx, AV_LOG_ERROR, "Decoder error: plane %d is %dx%d "
+                   "instead of %dx%d\n", plane, pic->widths[plane],
+                   pic->lines[plane], width, height);
+            return AVERROR_EXTERNAL;
+        }
 
-        for (line = 0; line < pic->lines[plane]; ++line)
-            memcpy(frame->data[plane] + line * size_line,
-                   pic->planes[plane] + line * pic->strides[plane],
-                   pic->widths[plane] * bytes_per_sample);
+        av_image_copy_plane(frame->data[plane], frame->linesize[plane],
+                            pic->planes[plane], pic->strides[plane],
+                            width * bytes_per_sample, height);
     }
 
-    frame->width     = cad->headerset.width;
-    frame->height    = cad->headerset.height;
     frame->pts       = cad->out_frame.pts;
-    frame->format    = avctx->pix_fmt;
 
     *got_frame = 1;
     return 0;
@@ -231,7 +254,8 @@ const FFCodec ff_libdavs2_decoder = {
     .close          = davs2_end,
     FF_CODEC_DECODE_CB(davs2_decode_frame),
     .flush          = davs2_flush,
-    .p.capabilities =  AV_CODEC_CAP_DELAY | AV_CODEC_CAP_OTHER_THREADS,
+    .p.capabilities =  AV_CODEC_CAP_DR1 | AV_CODEC_CAP_DELAY |
+                       AV_CODEC_CAP_OTHER_THREADS,
     .caps_internal  = FF_CODEC_CAP_NOT_INIT_THREADSAFE |
                       FF_CODEC_CAP_AUTO_THREADS,
     .p.pix_fmts     = (const enum AVPixelFormat[]) { AV_PIX_FMT_YUV420P,
@@ -31,6 +31,7 @@
 #include "avs3.h"
 #include "codec_internal.h"
 #include "decode.h"
+#include "startcode.h"
 #include "uavs3d.h"
 
 typedef struct uavs3d_context {
@@ -41,26 +42,27 @@ typedef struct uavs3d_context {
     uavs3d_io_frm_t  dec_frame;
 } uavs3d_context;
 
-#define UAVS3D_CHECK_START_CODE(data_ptr, PIC_START_CODE) \
-        (AV_RL32(data_ptr) != (PIC_START_CODE << 24) + AVS3_NAL_START_CODE)
 static int uavs3d_find_next_start_code(const unsigned char *bs_data, int bs_len, int *left)
 {
-    const unsigned char *data_ptr = bs_data + 4;
-    int count = bs_len - 4;
-
-    while (count >= 4 &&
-           UAVS3D_CHECK_START_CODE(data_ptr, AVS3_INTER_PIC_START_CODE) &&
-           UAVS3D_CHECK_START_CODE(data_ptr, AVS3_INTRA_PIC_START_CODE) &&
-           UAVS3D_CHECK_START_CODE(data_ptr, AVS3_SEQ_START_CODE) &&
-           UAVS3D_CHECK_START_CODE(data_ptr, AVS3_FIRST_SLICE_START_CODE) &&
-           UAVS3D_CHECK_START_CODE(data_ptr, AVS3_SEQ_END_CODE)) {
-        data_ptr++;
-        count--;
-    }
-
-    if (count >= 4) {
-        *left = count;
-        return 1;
+    const uint8_t *ptr = bs_data + 4, *end = bs_data + bs_len;
+    uint32_t state = -1;
+
+    if (bs_len <= 4)
+        return 0;
+
+    while (ptr < end) {
+        ptr = avpriv_find_start_code(ptr, end, &state);
+        if ((state & 0xFFFFFF00) == 0x100) {
+            switch (state & 0xFF) {
+            case AVS3_INTER_PIC_START_CODE:
+            case AVS3_INTRA_PIC_START_CODE:
+            case AVS3_SEQ_START_CODE:
+            case AVS3_FIRST_SLICE_START_CODE:
+            case AVS3_SEQ_END_CODE:
+                *left = end - ptr + 4;
+                return 1;
+            }
+        }
     }
 
     return 0;
@@ -102,6 +104,10 @@ FF_ENABLE_DEPRECATION_WARNINGS
             frm->flags &= ~AV_FRAME_FLAG_KEY;
     }
 
+    /* The planes of dec_frame belong to a picture of the decoder's DPB which
+     * is recycled as soon as it is no longer referenced; libuavs3d offers no
+     * way to keep it alive, so it cannot be exported by reference. It may
+     * also be stored at a different sample size than the output format. */
     for (i = 0; i < 3; i++) {
         frm_out.width [i] = dec_frame->width[i];
         frm_out.height[i] = dec_frame->height[i];
@@ -989,7 +989,27 @@ const uint8_t *avpriv_find_start_code(const uint8_t *av_restrict p,
     }
 
     while (p < end) {
-        if      (p[-1] > 1      ) p += 3;
+        if (p[-1] > 1) {
+            p += 3;
+#if HAVE_FAST_UNALIGNED
+            /* No start code can begin in a run of non-zero bytes, so skip
+             * such runs a word at a time. There must be a zero byte among
+             * p[-3] and the following bytes of the word to stop. */
+#if HAVE_FAST_64BIT
+            while (end - p > 4 &&
+                   !((~AV_RN64(p - 3) &
+                      (AV_RN64(p - 3) - 0x0101010101010101ULL)) &
+                     0x8080808080808080ULL))
+                p += 8;
+#else
+            while (end - p > 0 &&
+                   !((~AV_RN32(p - 3) &
+                      (AV_RN32(p - 3) - 0x01010101U)) &
+                     0x80808080U))
+                p += 4;
+#endif
+#endif
+        }
         else if (p[-2]          ) p += 2;
         else if (p[-3]|(p[-1]-1)) p++;
         else {
@@ -0,0 +1,384 @@
+;******************************************************************************
+;* SIMD-optimized Chinese AVS video (AVS1-P2) deblocking filter
+;*
+;* This file is part of FFmpeg.
+;*
+;* FFmpeg is free software; you can redistribute it and/or
+;* modify it under the terms of the GNU Lesser General Public
+;* License as published by the Free Software Foundation; either
+;* version 2.1 of the License, or (at your option) any later version.
+;*
+;* FFmpeg is distributed in the hope that it will be useful,
+;* but WITHOUT ANY WARRANTY; without even the implied warranty of
+;* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+;* Lesser General Public License for more details.
+;*
+;* You should have received a copy of the GNU Lesser General Public
+;* License along with FFmpeg; if not, write to the Free Software
+;* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+;******************************************************************************
+
+%include "libavutil/x86/x86util.asm"
+
+cextern pw_2
+cextern pw_4
+cextern pw_255
+
+SECTION .text
+
+; All filtering is done on 8 edge positions at a time, widened to words:
+; m0-m5 hold p2, p1, p0, q0, q1, q2, m6 is the mask of positions to filter,
+; m8 = alpha, m9 = beta, m10 = tc, m11 = (alpha >> 2) + 2, m12 = -tc and
+; m15 = 0.
+
+%macro ABSDIFFW 4 ; dst, a, b, tmp
+    mova            %1, %2
+    psubw           %1, %3
+    mova            %4, %3
+    psubw           %4, %2
+    pmaxsw          %1, %4
+%endmacro
+
+; dst = mask ? src : dst
+%macro BLENDW 4 ; dst, src, mask, tmp
+    mova            %4, %1
+    pxor            %4, %2
+    pand            %4, %3
+    pxor            %1, %4
+%endmacro
+
+%macro LOAD_PARAMS 0
+    movd            m8, alphad
+    movd            m9, betad
+    movd           m10, tcd
+    SPLATW          m8, m8
+    SPLATW          m9, m9
+    SPLATW         m10, m10
+    mova           m11, m8
+    psraw          m11, 2
+    paddw          m11, [pw_2]
+    pxor           m12, m12
+    psubw          m12, m10
+    pcmpeqw         m6, m6
+%endmacro
+
+; mask of the positions covered by bs1 (0-3) and bs2 (4-7), chroma only
+%macro LOAD_BS_MASK 0
+    movd            m6, bs1d
+    movd            m7, bs2d
+    punpcklqdq      m6, m7
+    pshuflw         m6, m6, 0
+    pshufhw         m6, m6, 0
+    pcmpgtw         m6, m15
+%endmacro
+
+; horizontal edge: 8 pixels of the 6 rows around pix
+%macro LOAD_H 0
+    mov           tmpq, pixq
+    sub           tmpq, stride3q
+    movq            m0, [tmpq]
+    movq            m1, [tmpq+strideq]
+    movq            m2, [tmpq+strideq*2]
+    movq            m3, [pixq]
+    movq            m4, [pixq+strideq]
+    movq            m5, [pixq+strideq*2]
+    punpcklbw       m0, m15
+    punpcklbw       m1, m15
+    punpcklbw       m2, m15
+    punpcklbw       m3, m15
+    punpcklbw       m4, m15
+    punpcklbw       m5, m15
+%endmacro
+
+%macro STORE_H 1 ; luma
+    mov           tmpq, pixq
+    sub           tmpq, strideq
+    packuswb        m2, m2
+    packuswb        m3, m3
+    movq        [tmpq], m2
+    movq        [pixq], m3
+%if %1
+    sub           tmpq, strideq
+    packuswb        m1, m1
+    packuswb        m4, m4
+    movq        [tmpq], m1
+    movq [pixq+strideq], m4
+%endif
+%endmacro
+
+; vertical edge: 8 rows of the 8 pixels starting at pix - 4, transposed
+%macro LOAD_V 0
+    lea           tmpq, [pixq-4]
+    movq            m0, [tmpq]
+    movq            m1, [tmpq+strideq]
+    movq            m2, [tmpq+strideq*2]
+    movq            m3, [tmpq+stride3q]
+    lea           tmpq, [tmpq+strideq*4]
+    movq            m4, [tmpq]
+    movq            m5, [tmpq+strideq]
+    movq            m6, [tmpq+strideq*2]
+    movq            m7, [tmpq+stride3q]
+    punpcklbw       m0, m1
+    punpcklbw       m2, m3
+    punpcklbw       m4, m5
+    punpcklbw       m6, m7
+    mova            m1, m0
+    punpcklwd       m0, m2
+    punpckhwd       m1, m2
+    mova            m3, m4
+    punpcklwd       m4, m6
+    punpckhwd       m3, m6
+    mova            m2, m0
+    punpckldq       m0, m4          ; columns 0 and 1
+    punpckhdq       m2, m4          ; columns 2 and 3
+    mova            m5, m1
+    punpckldq       m1, m3          ; columns 4 and 5
+    punpckhdq       m5, m3          ; columns 6 and 7
+    punpckhbw       m0, m15
+    mova            m3, m1
+    mova            m4, m1
+    punpcklbw       m3, m15
+    punpckhbw       m4, m15
+    mova            m1, m2
+    punpcklbw       m1, m15
+    punpckhbw       m2, m15
+    punpcklbw       m5, m15
+%endmacro
+
+; p1, p0, q0 and q1 are always written back, unfiltered values are unchanged
+%macro STORE_V 1 ; luma (unused)
+    packuswb        m1, m3
+    packuswb        m2, m4
+    mova            m3, m1
+    punpcklbw       m1, m2
+    punpckhbw       m3, m2
+    mova            m2, m1
+    punpcklwd       m1, m3
+    punpckhwd       m2, m3
+    lea           tmpq, [pixq-2]
+    movd        [tmpq], m1
+    psrldq          m1, 4
+    movd [tmpq+strideq], m1
+    psrldq          m1, 4
+    movd [tmpq+strideq*2], m1
+    psrldq          m1, 4
+    movd [tmpq+stride3q], m1
+    lea           tmpq, [tmpq+strideq*4]
+    movd        [tmpq], m2
+    psrldq          m2, 4
+    movd [tmpq+strideq], m2
+    psrldq          m2, 4
+    movd [tmpq+strideq*2], m2
+    psrldq          m2, 4
+    movd [tmpq+stride3q], m2
+%endmacro
+
+; bS == 2
+%macro FILTER_STRONG 1 ; luma
+    ABSDIFFW        m7, m2, m3, m13
+    mova           m14, m8
+    pcmpgtw        m14, m7
+    pand            m6, m14         ; |p0 - q0| < alpha
+    mova           m14, m11
+    pcmpgtw        m14, m7          ; |p0 - q0| < (alpha >> 2) + 2
+    ABSDIFFW        m7, m1, m2, m13
+    mova           m13, m9
+    pcmpgtw        m13, m7
+    pand            m6, m13         ; |p1 - p0| < beta
+    ABSDIFFW        m7, m4, m3, m13
+    mova           m13, m9
+    pcmpgtw        m13, m7
+    pand            m6, m13         ; |q1 - q0| < beta
+    ABSDIFFW        m7, m0, m2, m13
+    mova           m13, m9
+    pcmpgtw        m13, m7
+    pand           m13, m14
+    pand           m13, m6          ; strong p side
+    ABSDIFFW        m7, m5, m3, m0
+    mova            m0, m9
+    pcmpgtw         m0, m7
+    pand            m0, m14
+    pand            m0, m6          ; strong q side
+    mova            m5, m2
+    paddw           m5, m3
+    paddw           m5, [pw_2]      ; p0 + q0 + 2
+
+    mova            m7, m1
+    paddw           m7, m7
+    paddw           m7, m5
+    psrlw           m7, 2           ; (2 * p1 + s) >> 2
+    mova           m14, m1
+    paddw          m14, m2
+    paddw          m14, m5
+    psrlw          m14, 2           ; (p1 + p0 + s) >> 2
+%if %1
+    BLENDW          m1, m7, m13, m10
+%endif
+    BLENDW          m7, m14, m13, m10
+    BLENDW          m2, m7, m6, m10
+
+    mova            m7, m4
+    paddw           m7, m7
+    paddw           m7, m5
+    psrlw           m7, 2           ; (2 * q1 + s) >> 2
+    mova           m14, m4
+    paddw          m14, m3
+    paddw          m14, m5
+    psrlw          m14, 2           ; (q1 + q0 + s) >> 2
+%if %1
+    BLENDW          m4, m7, m0, m10
+%endif
+    BLENDW          m7, m14, m0, m10
+    BLENDW          m3, m7, m6, m10
+%endmacro
+
+; bS == 1
+%macro FILTER_WEAK 1 ; luma
+    ABSDIFFW        m7, m2, m3, m13
+    mova           m13, m8
+    pcmpgtw        m13, m7
+    pand            m6, m13         ; |p0 - q0| < alpha
+    ABSDIFFW        m7, m1, m2, m13
+    mova           m13, m9
+    pcmpgtw        m13, m7
+    pand            m6, m13         ; |p1 - p0| < beta
+    ABSDIFFW        m7, m4, m3, m13
+    mova           m13, m9
+    pcmpgtw        m13, m7
+    pand            m6, m13         ; |q1 - q0| < beta
+%if %1
+    ABSDIFFW        m7, m0, m2, m13
+    mova           m14, m9
+    pcmpgtw        m14, m7
+    pand           m14, m6          ; |p2 - p0| < beta
+    ABSDIFFW        m7, m5, m3, m13
+    mova           m11, m9
+    pcmpgtw        m11, m7
+    pand           m11, m6          ; |q2 - q0| < beta
+%endif
+    mova            m7, m3
+    psubw           m7, m2
+    mova           m13, m7
+    paddw           m7, m7
+    paddw           m7, m13
+    paddw           m7, m1
+    psubw           m7, m4
+    paddw           m7, [pw_4]
+    psraw           m7, 3
+    CLIPW           m7, m12, m10    ; delta
+    mova           m13, m2
+    paddw          m13, m7
+    CLIPW          m13, m15, [pw_255] ; new p0
+    mova            m8, m3
+    psubw           m8, m7
+    CLIPW           m8, m15, [pw_255] ; new q0
+%if %1
+    mova            m7, m13
+    psubw           m7, m1
+    mova            m9, m7
+    paddw           m7, m7
+    paddw           m7, m9
+    paddw           m7, m0
+    psubw           m7, m8
+    paddw           m7, [pw_4]
+    psraw           m7, 3
+    CLIPW           m7, m12, m10
+    paddw           m7, m1
+    CLIPW           m7, m15, [pw_255]
+    BLENDW          m1, m7, m14, m9
+
+    mova            m7, m4
+    psubw           m7, m8
+    mova            m9, m7
+    paddw           m7, m7
+    paddw           m7, m9
+    paddw           m7, m13
+    psubw           m7, m5
+    paddw           m7, [pw_4]
+    psraw           m7, 3
+    CLIPW           m7, m12, m10
+    mova            m9, m4
+    psubw           m9, m7
+    CLIPW           m9, m15, [pw_255]
+    BLENDW          m4, m9, m11, m7
+%endif
+    BLENDW          m2, m13, m6, m7
+    BLENDW          m3, m8, m6, m7
+%endmacro
+
+%macro NEXT_H 0
+    add           pixq, 8
+%endmacro
+
+%macro NEXT_V 0
+    lea           pixq, [pixq+strideq*8]
+%endmacro
+
+;-----------------------------------------------------------------------------
+; void ff_cavs_filter_l[hv](uint8_t *pix, ptrdiff_t stride, int alpha,
+;                           int beta, int tc, int bs1, int bs2)
+;-----------------------------------------------------------------------------
+%macro CAVS_FILTER_LUMA 2 ; h/v, H/V
+cglobal cavs_filter_l%1, 7, 9, 16, pix, stride, alpha, beta, tc, bs1, bs2, stride3, tmp
+    lea       stride3q, [strideq*3]
+    pxor           m15, m15
+    cmp           bs1d, 2
+    je .strong
+    test          bs1d, bs1d
+    jz .second
+    LOAD_%2
+    LOAD_PARAMS
+    FILTER_WEAK      1
+    STORE_%2          1
+.second:
+    test          bs2d, bs2d
+    jz .end
+    NEXT_%2
+    LOAD_%2
+    LOAD_PARAMS
+    FILTER_WEAK      1
+    STORE_%2          1
+.end:
+    RET
+.strong:
+    LOAD_%2
+    LOAD_PARAMS
+    FILTER_STRONG    1
+    STORE_%2          1
+    NEXT_%2
+    LOAD_%2
+    LOAD_PARAMS
+    FILTER_STRONG    1
+    STORE_%2          1
+    RET
+%endmacro
+
+;-----------------------------------------------------------------------------
+; void ff_cavs_filter_c[hv](uint8_t *pix, ptrdiff_t stride, int alpha,
+;                           int beta, int tc, int bs1, int bs2)
+;-----------------------------------------------------------------------------
+%macro CAVS_FILTER_CHROMA 2 ; h/v, H/V
+cglobal cavs_filter_c%1, 7, 9, 16, pix, stride, alpha, beta, tc, bs1, bs2, stride3, tmp
+    lea       stride3q, [strideq*3]
+    pxor           m15, m15
+    LOAD_%2
+    LOAD_PARAMS
+    cmp           bs1d, 2
+    jne .weak
+    FILTER_STRONG    0
+    jmp .store
+.weak:
+    LOAD_BS_MASK
+    FILTER_WEAK      0
+.store:
+    STORE_%2          0
+    RET
+%endmacro
+
+%if ARCH_X86_64
+INIT_XMM sse2
+CAVS_FILTER_LUMA   h, H
+CAVS_FILTER_LUMA   v, V
+CAVS_FILTER_CHROMA h, H
+CAVS_FILTER_CHROMA v, V
+%endif
@@ -40,6 +40,14 @@
 
 void ff_cavs_idct8_sse2(int16_t *out, const int16_t *in);
 
+#define CAVS_FILTER(dir) \
+void ff_cavs_filter_ ## dir ## _sse2(uint8_t *pix, ptrdiff_t stride, int alpha, \
+                                     int beta, int tc, int bs1, int bs2)
+CAVS_FILTER(lv);
+CAVS_FILTER(lh);
+CAVS_FILTER(cv);
+CAVS_FILTER(ch);
+
 static void cavs_idct8_add_sse2(uint8_t *dst, int16_t *block, ptrdiff_t stride)
 {
     LOCAL_ALIGNED(16, int16_t, b2, [64]);
@@ -57,6 +65,12 @@ static void cavs_idct8_add_sse2(uint8_t *dst, int16_t *block, ptrdiff_t stride)
  *
  ****************************************************************************/
 
+/* The sum of the 1/4 and 3/4 vertical filters ranges from -10 * 255 to
+ * 138 * 255, which does not fit a signed word. Offset it by 20 * 128 so it
+ * is never negative, shift it as unsigned and remove the offset again. */
+DECLARE_ASM_CONST(8, uint64_t, pw_2624) = 0x0A400A400A400A40ULL; /* 64 + 20 * 128 */
+DECLARE_ASM_CONST(8, uint64_t, pw_20)   = 0x0014001400140014ULL;
+
 /* vertical filter [-1 -2 96 42 -7  0]  */
 #define QPEL_CAVSV1(A,B,C,D,E,F,OP,ADD, MUL1, MUL2) \
         "movd (%0), "#F"            \n\t"\
@@ -77,7 +91,8 @@ static void cavs_idct8_add_sse2(uint8_t *dst, int16_t *block, ptrdiff_t stride)
         "psraw $1, "#B"             \n\t"\
         "psubw "#A", %%mm6          \n\t"\
         "paddw "MANGLE(ADD)", %%mm6 \n\t"\
-        "psraw $7, %%mm6            \n\t"\
+        "psrlw $7, %%mm6            \n\t"\
+        "psubw "MANGLE(pw_20)", %%mm6\n\t"\
         "packuswb %%mm6, %%mm6      \n\t"\
         OP(%%mm6, (%1), A, d)            \
         "add %3, %1                 \n\t"
@@ -118,7 +133,8 @@ static void cavs_idct8_add_sse2(uint8_t *dst, int16_t *block, ptrdiff_t stride)
         "psraw $1, "#E"             \n\t"\
         "psubw "#F", %%mm6          \n\t"\
         "paddw "MANGLE(ADD)", %%mm6 \n\t"\
-        "psraw $7, %%mm6            \n\t"\
+        "psrlw $7, %%mm6            \n\t"\
+        "psubw "MANGLE(pw_20)", %%mm6\n\t"\
         "packuswb %%mm6, %%mm6      \n\t"\
         OP(%%mm6, (%1), A, d)            \
         "add %3, %1                 \n\t"
@@ -157,7 +173,7 @@ static void cavs_idct8_add_sse2(uint8_t *dst, int16_t *block, ptrdiff_t stride)
         \
         : "+a"(src), "+c"(dst)\
         : "S"((x86_reg)srcStride), "r"((x86_reg)dstStride)\
-          NAMED_CONSTRAINTS_ADD(ADD,MUL1,MUL2)\
+          NAMED_CONSTRAINTS_ADD(ADD,MUL1,MUL2,pw_20)\
         : "memory"\
      );\
      if(h==16){\
@@ -173,7 +189,7 @@ static void cavs_idct8_add_sse2(uint8_t *dst, int16_t *block, ptrdiff_t stride)
             \
            : "+a"(src), "+c"(dst)\
            : "S"((x86_reg)srcStride), "r"((x86_reg)dstStride)\
-             NAMED_CONSTRAINTS_ADD(ADD,MUL1,MUL2)\
+             NAMED_CONSTRAINTS_ADD(ADD,MUL1,MUL2,pw_20)\
            : "memory"\
         );\
      }\
@@ -233,7 +249,7 @@ static void OPNAME ## cavs_qpel8_h_ ## MMX(uint8_t *dst, const uint8_t *src, ptr
 \
 static inline void OPNAME ## cavs_qpel8or16_v1_ ## MMX(uint8_t *dst, const uint8_t *src, ptrdiff_t dstStride, ptrdiff_t srcStride, int h)\
 {                                                                       \
-  QPEL_CAVSVNUM(QPEL_CAVSV1,OP,ff_pw_64,ff_pw_96,ff_pw_42)      \
+  QPEL_CAVSVNUM(QPEL_CAVSV1,OP,pw_2624,ff_pw_96,ff_pw_42)      \
 }\
 \
 static inline void OPNAME ## cavs_qpel8or16_v2_ ## MMX(uint8_t *dst, const uint8_t *src, ptrdiff_t dstStride, ptrdiff_t srcStride, int h)\
@@ -243,7 +259,7 @@ static inline void OPNAME ## cavs_qpel8or16_v2_ ## MMX(uint8_t *dst, const uint8
 \
 static inline void OPNAME ## cavs_qpel8or16_v3_ ## MMX(uint8_t *dst, const uint8_t *src, ptrdiff_t dstStride, ptrdiff_t srcStride, int h)\
 {                                                                       \
-  QPEL_CAVSVNUM(QPEL_CAVSV3,OP,ff_pw_64,ff_pw_96,ff_pw_42)      \
+  QPEL_CAVSVNUM(QPEL_CAVSV3,OP,pw_2624,ff_pw_96,ff_pw_42)      \
 }\
 \
 static void OPNAME ## cavs_qpel8_v1_ ## MMX(uint8_t *dst, const uint8_t *src, ptrdiff_t dstStride, ptrdiff_t srcStride)\
@@ -392,5 +408,11 @@ av_cold void ff_cavsdsp_init_x86(CAVSDSPContext *c)
         c->cavs_idct8_add = cavs_idct8_add_sse2;
         c->idct_perm      = FF_IDCT_PERM_TRANSPOSE;
     }
+    if (ARCH_X86_64 && EXTERNAL_SSE2(cpu_flags)) {
+        c->cavs_filter_lv = ff_cavs_filter_lv_sse2;
+        c->cavs_filter_lh = ff_cavs_filter_lh_sse2;
+        c->cavs_filter_cv = ff_cavs_filter_cv_sse2;
+        c->cavs_filter_ch = ff_cavs_filter_ch_sse2;
+    }
 #endif
 }
@@ -368,6 +368,7 @@ extern const AVFilter ff_vf_morpho;
 extern const AVFilter ff_vf_mpdecimate;
 extern const AVFilter ff_vf_msad;
 extern const AVFilter ff_vf_multiply;
+extern const AVFilter ff_vf_multiscale;
 extern const AVFilter ff_vf_negate;
 extern const AVFilter ff_vf_nlmeans;
 extern const AVFilter ff_vf_nlmeans_opencl;
@@ -395,6 +396,7 @@ extern const AVFilter ff_vf_perms;
 extern const AVFilter ff_vf_perspective;
 extern const AVFilter ff_vf_phase;
 extern const AVFilter ff_vf_photosensitivity;
+extern const AVFilter ff_vf_pipeline;
 extern const AVFilter ff_vf_pixdesctest;
 extern const AVFilter ff_vf_pixelize;
 extern const AVFilter ff_vf_pixscope;
@@ -215,7 +215,34 @@ static void update_link_current_pts(AVFilterLink *link, int64_t pts)
 
 void ff_filter_set_ready(AVFilterContext *filter, unsigned priority)
 {
-    filter->ready = FFMAX(filter->ready, priority);
+    if (priority <= filter->ready)
+        return;
+    filter->ready = priority;
+    if (filter->graph)
+        ff_filter_graph_update_ready(filter->graph, filter);
+}
+
+void ff_filter_graph_wake(AVFilterGraph *graph, AVFilterContext *filter)
+{
+    AVFilterGraphInternal *fgi = graph->internal;
+
+    ff_mutex_lock(&fgi->wake_lock);
+    if (filter->graph == graph && !filter->internal->woken) {
+        filter->internal->woken = 1;
+        atomic_fetch_add_explicit(&fgi->nb_woken, 1, memory_order_relaxed);
+        ff_cond_signal(&fgi->wake_cond);
+    }
+    ff_mutex_unlock(&fgi->wake_lock);
+}
+
+void ff_filter_set_waiting(AVFilterContext *filter, int waiting)
+{
+    waiting = !!waiting;
+    if (filter->internal->waiting == waiting)
+        return;
+    filter->internal->waiting = waiting;
+    if (filter->graph)
+        filter->graph->internal->nb_waiting += waiting ? 1 : -1;
 }
 
 /**
@@ -678,6 +705,7 @@ AVFilterContext *ff_filter_alloc(const AVFilter *filter, const char *inst_name)
     if (!ret->internal)
         goto err;
     ret->internal->execute = default_execute;
+    ret->internal->ready_index = -1;
 
     ret->nb_inputs  = filter->nb_inputs;
     if (ret->nb_inputs ) {
@@ -1327,6 +1355,8 @@ int ff_filter_activate(AVFilterContext *filter)
     av_assert1(!(filter->filter->flags & AVFILTER_FLAG_SUPPORT_TIMELINE_GENERIC &&
                  filter->filter->activate));
     filter->ready = 0;
+    if (filter->graph)
+        ff_filter_graph_update_ready(filter->graph, filter);
     ret = filter->filter->activate ? filter->filter->activate(filter) :
           ff_filter_activate_default(filter);
     if (ret == FFERROR_NOT_READY)
@@ -36,6 +36,7 @@
 
 #include "avfilter.h"
 #include "buffersink.h"
+#include "filters.h"
 #include "formats.h"
 #include "internal.h"
 #include "thread.h"
@@ -91,6 +92,19 @@ AVFilterGraph *avfilter_graph_alloc(void)
         return NULL;
     }
 
+    if (ff_mutex_init(&ret->internal->wake_lock, NULL)) {
+        av_freep(&ret->internal);
+        av_freep(&ret);
+        return NULL;
+    }
+    if (ff_cond_init(&ret->internal->wake_cond, NULL)) {
+        ff_mutex_destroy(&ret->internal->wake_lock);
+        av_freep(&ret->internal);
+        av_freep(&ret);
+        return NULL;
+    }
+    atomic_init(&ret->internal->nb_woken, 0);
+
     ret->av_class = &filtergraph_class;
     av_opt_set_defaults(ret);
     ff_framequeue_global_init(&ret->internal->frame_queues);
@@ -98,15 +112,113 @@ AVFilterGraph *avfilter_graph_alloc(void)
     return ret;
 }
 
+static int ready_before(const AVFilterContext *a, const AVFilterContext *b)
+{
+    return a->ready > b->ready ||
+           a->ready == b->ready &&
+           a->internal->graph_index < b->internal->graph_index;
+}
+
+static void ready_heap_bubble_up(AVFilterGraph *graph,
+                                 AVFilterContext *filter, int index)
+{
+    AVFilterContext **heap = graph->internal->ready_heap;
+
+    av_assert0(index >= 0);
+
+    while (index) {
+        int parent = (index - 1) >> 1;
+        if (!ready_before(filter, heap[parent]))
+            break;
+        heap[index] = heap[parent];
+        heap[index]->internal->ready_index = index;
+        index = parent;
+    }
+    heap[index] = filter;
+    filter->internal->ready_index = index;
+}
+
+static void ready_heap_bubble_down(AVFilterGraph *graph,
+                                   AVFilterContext *filter, int index)
+{
+    AVFilterContext **heap = graph->internal->ready_heap;
+    int nb_ready = graph->internal->nb_ready;
+
+    av_assert0(index >= 0);
+
+    while (1) {
+        int child = 2 * index + 1;
+        if (child >= nb_ready)
+            break;
+        if (child + 1 < nb_ready &&
+            ready_before(heap[child + 1], heap[child]))
+            child++;
+        if (!ready_before(heap[child], filter))
+            break;
+        heap[index] = heap[child];
+        heap[index]->internal->ready_index = index;
+        index = child;
+    }
+    heap[index] = filter;
+    filter->internal->ready_index = index;
+}
+
+static void ready_heap_remove(AVFilterGraph *graph, AVFilterContext *filter)
+{
+    AVFilterGraphInternal *fgi = graph->internal;
+    int index = filter->internal->ready_index;
+    AVFilterContext *last = fgi->ready_heap[--fgi->nb_ready];
+
+    filter->internal->ready_index = -1;
+    if (last == filter)
+        return;
+    ready_heap_bubble_up  (graph, last, index);
+    ready_heap_bubble_down(graph, last, last->internal->ready_index);
+}
+
+void ff_filter_graph_update_ready(AVFilterGraph *graph, AVFilterContext *filter)
+{
+    AVFilterGraphInternal *fgi = graph->internal;
+    int index = filter->internal->ready_index;
+
+    if (!filter->ready) {
+        if (index >= 0)
+            ready_heap_remove(graph, filter);
+        return;
+    }
+    /* the ready status only ever increases while the filter is in the heap */
+    if (index < 0)
+        index = fgi->nb_ready++;
+    ready_heap_bubble_up(graph, filter, index);
+}
+
 void ff_filter_graph_remove_filter(AVFilterGraph *graph, AVFilterContext *filter)
 {
+    AVFilterGraphInternal *fgi = graph->internal;
     int i, j;
     for (i = 0; i < graph->nb_filters; i++) {
         if (graph->filters[i] == filter) {
+            if (filter->internal->ready_index >= 0)
+                ready_heap_remove(graph, filter);
+            if (filter->internal->waiting)
+                fgi->nb_waiting--;
             FFSWAP(AVFilterContext*, graph->filters[i],
                    graph->filters[graph->nb_filters - 1]);
             graph->nb_filters--;
+            if (i < graph->nb_filters) {
+                AVFilterContext *moved = graph->filters[i];
+                moved->internal->graph_index = i;
+                if (moved->internal->ready_index >= 0)
+                    ready_heap_bubble_up(graph, moved, moved->internal->ready_index);
+            }
+            /* the filter threads may still try to wake it up */
+            ff_mutex_lock(&fgi->wake_lock);
+            if (filter->internal->woken) {
+                filter->internal->woken = 0;
+                atomic_fetch_sub_explicit(&fgi->nb_woken, 1, memory_order_relaxed);
+            }
             filter->graph = NULL;
+            ff_mutex_unlock(&fgi->wake_lock);
             for (j = 0; j<filter->nb_outputs; j++)
                 if (filter->outputs[j])
                     filter->outputs[j]->graph = NULL;
@@ -131,6 +243,9 @@ void avfilter_graph_free(AVFilterGraph **graph)
     av_opt_free(*graph);
 
     av_freep(&(*graph)->filters);
+    av_freep(&(*graph)->internal->ready_heap);
+    ff_cond_destroy(&(*graph)->internal->wake_cond);
+    ff_mutex_destroy(&(*graph)->internal->wake_lock);
     av_freep(&(*graph)->internal);
     av_freep(graph);
 }
@@ -185,10 +300,17 @@ AVFilterContext *avfilter_graph_alloc_filter(AVFilterGraph *graph,
         return NULL;
     graph->filters = filters;
 
+    filters = av_realloc_array(graph->internal->ready_heap, graph->nb_filters + 1,
+                               sizeof(*filters));
+    if (!filters)
+        return NULL;
+    graph->internal->ready_heap = filters;
+
     s = ff_filter_alloc(filter, name);
     if (!s)
         return NULL;
 
+    s->internal->graph_index = graph->nb_filters;
     graph->filters[graph->nb_filters++] = s;
 
     s->graph = graph;
@@ -1338,17 +1460,37 @@ int avfilter_graph_request_oldest(AVFilterGraph *graph)
     return 0;
 }
 
+/* Schedule the filters woken up by other threads, waiting for a wakeup if
+ * nothing else can run. */
+static void process_wakeups(AVFilterGraph *graph)
+{
+    AVFilterGraphInternal *fgi = graph->internal;
+
+    ff_mutex_lock(&fgi->wake_lock);
+    while (!atomic_load_explicit(&fgi->nb_woken, memory_order_relaxed) &&
+           !fgi->nb_ready && fgi->nb_waiting)
+        ff_cond_wait(&fgi->wake_cond, &fgi->wake_lock);
+    for (unsigned i = 0; i < graph->nb_filters &&
+                         atomic_load_explicit(&fgi->nb_woken, memory_order_relaxed); i++) {
+        AVFilterContext *filter = graph->filters[i];
+        if (filter->internal->woken) {
+            filter->internal->woken = 0;
+            atomic_fetch_sub_explicit(&fgi->nb_woken, 1, memory_order_relaxed);
+            ff_filter_set_ready(filter, 100);
+        }
+    }
+    ff_mutex_unlock(&fgi->wake_lock);
+}
+
 int ff_filter_graph_run_once(AVFilterGraph *graph)
 {
-    AVFilterContext *filter;
-    unsigned i;
+    AVFilterGraphInternal *fgi = graph->internal;
 
     av_assert0(graph->nb_filters);
-    filter = graph->filters[0];
-    for (i = 1; i < graph->nb_filters; i++)
-        if (graph->filters[i]->ready > filter->ready)
-            filter = graph->filters[i];
-    if (!filter->ready)
+    if (atomic_load_explicit(&fgi->nb_woken, memory_order_relaxed) ||
+        (!fgi->nb_ready && fgi->nb_waiting))
+        process_wakeups(graph);
+    if (!fgi->nb_ready)
         return AVERROR(EAGAIN);
-    return ff_filter_activate(filter);
+    return ff_filter_activate(fgi->ready_heap[0]);
 }
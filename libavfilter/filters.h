@@ -45,6 +45,24 @@
  */
 void ff_filter_set_ready(AVFilterContext *filter, unsigned priority);
 
+/**
+ * Mark a filter ready from a thread other than the one running the graph,
+ * typically a worker thread of the filter itself.
+ *
+ * @param graph the graph the filter was in when the thread was started;
+ *              the wakeup is ignored if the filter was removed from it since
+ */
+void ff_filter_graph_wake(AVFilterGraph *graph, AVFilterContext *filter);
+
+/**
+ * Declare whether the filter cannot make progress until it is woken up with
+ * ff_filter_graph_wake(), whatever happens to its links.
+ *
+ * When no filter is ready, running the graph then waits for a wakeup instead
+ * of returning AVERROR(EAGAIN). Must be called from the activate callback.
+ */
+void ff_filter_set_waiting(AVFilterContext *filter, int waiting);
+
 /**
  * Process the commands queued in the link up to the time of the frame.
  * Commands will trigger the process_command() callback.
@@ -24,7 +24,10 @@
  * internal API functions
  */
 
+#include <stdatomic.h>
+
 #include "libavutil/internal.h"
+#include "libavutil/thread.h"
 #include "avfilter.h"
 #include "framequeue.h"
 
@@ -131,6 +134,27 @@ struct AVFilterGraphInternal {
     void *thread;
     avfilter_execute_func *thread_execute;
     FFFrameQueueGlobal frame_queues;
+
+    /**
+     * Filters with a non-zero ready status, as a binary heap ordered by
+     * decreasing ready status, then by increasing index in graph->filters.
+     * Sized to hold every filter of the graph.
+     */
+    AVFilterContext **ready_heap;
+    unsigned nb_ready;
+
+    /**
+     * Wakeups sent from other threads with ff_filter_graph_wake().
+     * nb_woken and the woken field of the filters are protected by
+     * wake_lock, nb_woken may be read without it.
+     */
+    AVMutex wake_lock;
+    AVCond  wake_cond;
+    atomic_uint nb_woken;
+    /**
+     * Number of filters waiting for a wakeup, see ff_filter_set_waiting().
+     */
+    unsigned nb_waiting;
 };
 
 struct AVFilterInternal {
@@ -139,6 +163,26 @@ struct AVFilterInternal {
     // 1 when avfilter_init_*() was successfully called on this filter
     // 0 otherwise
     int initialized;
+
+    /**
+     * Index of the filter in graph->filters.
+     */
+    unsigned graph_index;
+
+    /**
+     * Index of the filter in graph->internal->ready_heap, -1 if not ready.
+     */
+    int ready_index;
+
+    /**
+     * The filter was woken up by ff_filter_graph_wake() since it was last
+     * activated.
+     */
+    int woken;
+    /**
+     * The filter waits for ff_filter_graph_wake() to make progress.
+     */
+    int waiting;
 };
 
 static av_always_inline int ff_filter_execute(AVFilterContext *ctx, avfilter_action_func *func,
@@ -357,6 +401,12 @@ int ff_filter_activate(AVFilterContext *filter);
  */
 void ff_filter_graph_remove_filter(AVFilterGraph *graph, AVFilterContext *filter);
 
+/**
+ * Update the position of a filter in the ready heap after its ready
+ * status changed.
+ */
+void ff_filter_graph_update_ready(AVFilterGraph *graph, AVFilterContext *filter);
+
 /**
  * The filter is aware of hardware frames, and any hardware frame context
  * should not be automatically propagated through it.
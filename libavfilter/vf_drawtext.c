@@ -76,6 +76,9 @@
 #include <hb.h>
 #include <hb-ft.h>
 
+// Minimum height of a blending slice
+#define MIN_SLICE_ROWS 32
+
 // Ceiling operation for positive integers division
 #define POS_CEIL(x, y) ((x)/(y) + ((x)%(y) != 0))
 
@@ -331,6 +334,15 @@ typedef struct DrawTextContext {
     int tab_count;                  ///< the number of tab characters
     int blank_advance64;            ///< the size of the space character
     int tab_warning_printed;        ///< ensure the tab warning to be printed only once
+
+    char *run_text;                 ///< expanded text the current lines were shaped from
+    unsigned int run_fontsize;      ///< font size the current lines were shaped with
+    TextMetrics run_metrics;        ///< metrics of the current lines
+    int run_x64, run_y64;           ///< origin the current glyph positions were computed for
+    int run_positioned;             ///< tells if the glyph positions of the lines are valid
+
+    int nb_threads;
+    int *slice_ret;                 ///< return values of the blending slices
 } DrawTextContext;
 
 #define OFFSET(x) offsetof(DrawTextContext, x)
@@ -1032,10 +1044,41 @@ static int glyph_enu_free(void *opaque, void *elem)
     return 0;
 }
 
+static void hb_destroy(HarfbuzzData *hb)
+{
+    hb_buffer_destroy(hb->buf);
+    hb_font_destroy(hb->font);
+    hb->buf = NULL;
+    hb->font = NULL;
+    hb->glyph_info = NULL;
+    hb->glyph_pos = NULL;
+}
+
+/**
+ * Release the shaped text lines, forcing the next frame to measure and lay
+ * out its text again.
+ */
+static void free_text_lines(DrawTextContext *s)
+{
+    for (int l = 0; s->lines && l < s->line_count; ++l) {
+        TextLine *line = &s->lines[l];
+        av_freep(&line->glyphs);
+        hb_destroy(&line->hb_data);
+    }
+    av_freep(&s->lines);
+    av_freep(&s->tab_clusters);
+    av_freep(&s->run_text);
+    s->line_count = 0;
+    s->run_positioned = 0;
+}
+
 static av_cold void uninit(AVFilterContext *ctx)
 {
     DrawTextContext *s = ctx->priv;
 
+    free_text_lines(s);
+    av_freep(&s->slice_ret);
+
     av_expr_free(s->x_pexpr);
     av_expr_free(s->y_pexpr);
     av_expr_free(s->a_pexpr);
@@ -1080,6 +1123,12 @@ static int config_input(AVFilterLink *inlink)
 
     av_lfg_init(&s->prng, av_get_random_seed());
 
+    s->nb_threads = ff_filter_get_nb_threads(ctx);
+    av_freep(&s->slice_ret);
+    s->slice_ret = av_calloc(s->nb_threads, sizeof(*s->slice_ret));
+    if (!s->slice_ret)
+        return AVERROR(ENOMEM);
+
     av_expr_free(s->x_pexpr);
     av_expr_free(s->y_pexpr);
     av_expr_free(s->a_pexpr);
@@ -1132,6 +1181,7 @@ static int command(AVFilterContext *ctx, const char *cmd, const char *arg, char
 
         ctx->priv = old;
         uninit(ctx);
+        av_opt_free(old);
         av_freep(&old);
 
         ctx->priv = new;
@@ -1141,6 +1191,7 @@ static int command(AVFilterContext *ctx, const char *cmd, const char *arg, char
         if ((ret = ff_filter_process_command(ctx, cmd, arg, res, res_len, flags)) < 0) {
             return ret;
         }
+        free_text_lines(old);
         if (old->borderw != old_borderw) {
             FT_Stroker_Set(old->stroker, old->borderw << 6, FT_STROKER_LINECAP_ROUND,
                         FT_STROKER_LINEJOIN_ROUND, 0);
@@ -1156,6 +1207,8 @@ static int command(AVFilterContext *ctx, const char *cmd, const char *arg, char
 
 fail:
     av_log(ctx, AV_LOG_ERROR, "Failed to process command. Continuing with existing parameters.\n");
+    if (new)
+        av_opt_free(new);
     av_freep(&new);
     return ret;
 }
@@ -1546,7 +1599,8 @@ static void update_alpha(DrawTextContext *s)
 static int draw_glyphs(DrawTextContext *s, AVFrame *frame,
                        FFDrawColor *color,
                        TextMetrics *metrics,
-                       int x, int y, int borderw)
+                       int x, int y, int borderw,
+                       int slice_start, int slice_end)
 {
     int g, l, x1, y1, w1, h1, idx;
     int dx = 0, dy = 0, pdx = 0;
@@ -1569,11 +1623,6 @@ static int draw_glyphs(DrawTextContext *s, AVFrame *frame,
         offset_y = s->box_height - metrics->height;
     }
 
-    if ((!j_left || j_right) && !s->tab_warning_printed && s->tab_count > 0) {
-        s->tab_warning_printed = 1;
-        av_log(s, AV_LOG_WARNING, "Tab characters are only supported with left horizontal alignment\n");
-    }
-
     clip_x = FFMIN(metrics->rect_x + s->box_width + s->bb_right, frame->width);
     clip_y = FFMIN(metrics->rect_y + s->box_height + s->bb_bottom, frame->height);
 
@@ -1623,6 +1672,16 @@ static int draw_glyphs(DrawTextContext *s, AVFrame *frame,
             w1 = FFMIN(clip_x - x1, w1 - dx);
             h1 = FFMIN(clip_y - y1, h1 - dy);
 
+            // restrict the glyph to the rows of the current slice
+            if (y1 < slice_start) {
+                pdx += (slice_start - y1) * bitmap.pitch;
+                h1  -= slice_start - y1;
+                y1   = slice_start;
+            }
+            h1 = FFMIN(h1, slice_end - y1);
+            if (h1 <= 0)
+                continue;
+
             ff_blend_mask(&s->dc, color, frame->data, frame->linesize, clip_x, clip_y,
                 bitmap.buffer + pdx, bitmap.pitch, w1, h1, 3, 0, x1, y1);
         }
@@ -1655,16 +1714,6 @@ static int shape_text_hb(DrawTextContext *s, HarfbuzzData* hb, const char* text,
     return 0;
 }
 
-static void hb_destroy(HarfbuzzData *hb)
-{
-    hb_buffer_destroy(hb->buf);
-    hb_font_destroy(hb->font);
-    hb->buf = NULL;
-    hb->font = NULL;
-    hb->glyph_info = NULL;
-    hb->glyph_pos = NULL;
-}
-
 static int measure_text(AVFilterContext *ctx, TextMetrics *metrics)
 {
     DrawTextContext *s = ctx->priv;
@@ -1817,6 +1866,60 @@ done:
     return ret;
 }
 
+typedef struct ThreadData {
+    AVFrame *frame;
+    TextMetrics *metrics;
+    FFDrawColor *fontcolor, *shadowcolor, *bordercolor, *boxcolor;
+    int rec_x, rec_y, rec_width, rec_height;
+    int y_start, y_end;
+} ThreadData;
+
+/* Blend the box and the glyphs on a band of rows of the text area. Band limits
+ * are aligned on the chroma subsampling so that each chroma row is blended by
+ * exactly one slice, as it would be by a single call over the whole area. */
+static int draw_text_slice(AVFilterContext *ctx, void *arg, int jobnr, int nb_jobs)
+{
+    DrawTextContext *s = ctx->priv;
+    ThreadData *td = arg;
+    AVFrame *frame = td->frame;
+    const int align = (1 << s->dc.vsub_max) - 1;
+    const int h = td->y_end - td->y_start;
+    const int slice_start = td->y_start + ((h *  jobnr   ) / nb_jobs & ~align);
+    const int slice_end   = jobnr == nb_jobs - 1 ? td->y_end
+                          : td->y_start + ((h * (jobnr+1)) / nb_jobs & ~align);
+    int ret;
+
+    if (slice_start >= slice_end)
+        return 0;
+
+    if (s->draw_box) {
+        const int rec_y = FFMAX(td->rec_y, slice_start);
+        const int rec_h = FFMIN(td->rec_y + td->rec_height, slice_end) - rec_y;
+
+        if (rec_h > 0)
+            ff_blend_rectangle(&s->dc, td->boxcolor,
+                frame->data, frame->linesize, frame->width, frame->height,
+                td->rec_x, rec_y, td->rec_width, rec_h);
+    }
+
+    if (s->shadowx || s->shadowy) {
+        if ((ret = draw_glyphs(s, frame, td->shadowcolor, td->metrics,
+                s->shadowx, s->shadowy, s->borderw, slice_start, slice_end)) < 0) {
+            return ret;
+        }
+    }
+
+    if (s->borderw) {
+        if ((ret = draw_glyphs(s, frame, td->bordercolor, td->metrics,
+                0, 0, s->borderw, slice_start, slice_end)) < 0) {
+            return ret;
+        }
+    }
+
+    return draw_glyphs(s, frame, td->fontcolor, td->metrics, 0,
+                       0, 0, slice_start, slice_end);
+}
+
 static int draw_text(AVFilterContext *ctx, AVFrame *frame)
 {
     DrawTextContext *s = ctx->priv;
@@ -1890,9 +1993,22 @@ static int draw_text(AVFilterContext *ctx, AVFrame *frame)
         return ret;
     }
 
-    if ((ret = measure_text(ctx, &metrics)) < 0) {
-        return ret;
+    /* shape and measure the text only when it changed since the last frame */
+    if (!s->run_text || s->run_fontsize != s->fontsize ||
+        strcmp(s->run_text, bp->str)) {
+        free_text_lines(s);
+        if ((ret = measure_text(ctx, &s->run_metrics)) < 0) {
+            free_text_lines(s);
+            return ret;
+        }
+        s->run_text = av_strdup(bp->str);
+        if (!s->run_text) {
+            free_text_lines(s);
+            return AVERROR(ENOMEM);
+        }
+        s->run_fontsize = s->fontsize;
     }
+    metrics = s->run_metrics;
 
     s->max_glyph_h = POS_CEIL(metrics.max_y64 - metrics.min_y64, 64);
     s->max_glyph_w = POS_CEIL(metrics.max_x64 - metrics.min_x64, 64);
@@ -1983,45 +2099,55 @@ static int draw_text(AVFilterContext *ctx, AVFrame *frame)
         y64 = (int)(s->y * 64. + metrics.offset_top64);
     }
 
-    for (int l = 0; l < s->line_count; ++l) {
-        TextLine *line = &s->lines[l];
-        HarfbuzzData *hb = &line->hb_data;
-        line->glyphs = av_mallocz(hb->glyph_count * sizeof(GlyphInfo));
-
-        for (int t = 0; t < hb->glyph_count; ++t) {
-            GlyphInfo *g_info = &line->glyphs[t];
-            uint8_t is_tab = last_tab_idx < s->tab_count &&
-                hb->glyph_info[t].cluster == s->tab_clusters[last_tab_idx] - line->cluster_offset;
-            int true_x, true_y;
-            if (is_tab) {
-                ++last_tab_idx;
-            }
-            true_x = x + hb->glyph_pos[t].x_offset;
-            true_y = y + hb->glyph_pos[t].y_offset;
-            shift_x64 = (((x64 + true_x) >> 4) & 0b0011) << 4;
-            shift_y64 = ((4 - (((y64 + true_y) >> 4) & 0b0011)) & 0b0011) << 4;
+    /* the glyph positions only depend on the text and its origin */
+    if (!s->run_positioned || s->run_x64 != x64 || s->run_y64 != y64) {
+        for (int l = 0; l < s->line_count; ++l) {
+            TextLine *line = &s->lines[l];
+            HarfbuzzData *hb = &line->hb_data;
+            if (!line->glyphs)
+                line->glyphs = av_mallocz(hb->glyph_count * sizeof(GlyphInfo));
+            if (!line->glyphs)
+                return AVERROR(ENOMEM);
 
-            ret = load_glyph(ctx, &glyph, hb->glyph_info[t].codepoint, shift_x64, shift_y64);
-            if (ret != 0) {
-                return ret;
-            }
-            g_info->code = hb->glyph_info[t].codepoint;
-            g_info->x = (x64 + true_x) >> 6;
-            g_info->y = ((y64 + true_y) >> 6) + (shift_y64 > 0 ? 1 : 0);
-            g_info->shift_x64 = shift_x64;
-            g_info->shift_y64 = shift_y64;
-
-            if (!is_tab) {
-                x += hb->glyph_pos[t].x_advance;
-            } else {
-                int size = s->blank_advance64 * s->tabsize;
-                x = (x / size + 1) * size;
+            for (int t = 0; t < hb->glyph_count; ++t) {
+                GlyphInfo *g_info = &line->glyphs[t];
+                uint8_t is_tab = last_tab_idx < s->tab_count &&
+                    hb->glyph_info[t].cluster == s->tab_clusters[last_tab_idx] - line->cluster_offset;
+                int true_x, true_y;
+                if (is_tab) {
+                    ++last_tab_idx;
+                }
+                true_x = x + hb->glyph_pos[t].x_offset;
+                true_y = y + hb->glyph_pos[t].y_offset;
+                shift_x64 = (((x64 + true_x) >> 4) & 0b0011) << 4;
+                shift_y64 = ((4 - (((y64 + true_y) >> 4) & 0b0011)) & 0b0011) << 4;
+
+                ret = load_glyph(ctx, &glyph, hb->glyph_info[t].codepoint, shift_x64, shift_y64);
+                if (ret != 0) {
+                    s->run_positioned = 0;
+                    return ret;
+                }
+                g_info->code = hb->glyph_info[t].codepoint;
+                g_info->x = (x64 + true_x) >> 6;
+                g_info->y = ((y64 + true_y) >> 6) + (shift_y64 > 0 ? 1 : 0);
+                g_info->shift_x64 = shift_x64;
+                g_info->shift_y64 = shift_y64;
+
+                if (!is_tab) {
+                    x += hb->glyph_pos[t].x_advance;
+                } else {
+                    int size = s->blank_advance64 * s->tabsize;
+                    x = (x / size + 1) * size;
+                }
+                y += hb->glyph_pos[t].y_advance;
             }
-            y += hb->glyph_pos[t].y_advance;
-        }
 
-        y += metrics.line_height64 + s->line_spacing * 64;
-        x = 0;
+            y += metrics.line_height64 + s->line_spacing * 64;
+            x = 0;
+        }
+        s->run_x64 = x64;
+        s->run_y64 = y64;
+        s->run_positioned = 1;
     }
 
     metrics.rect_x = s->x;
@@ -2051,45 +2177,44 @@ static int draw_text(AVFilterContext *ctx, AVFrame *frame)
                     metrics.rect_y + s->box_height + s->bb_bottom <= 0;
 
     if (!is_outside) {
-        /* draw box */
+        const int align = (1 << s->dc.vsub_max) - 1;
+        ThreadData td = {
+            .frame       = frame,
+            .metrics     = &metrics,
+            .fontcolor   = &fontcolor,
+            .shadowcolor = &shadowcolor,
+            .bordercolor = &bordercolor,
+            .boxcolor    = &boxcolor,
+        };
+        int nb_jobs;
+
+        if ((!(s->text_align & TA_LEFT) || (s->text_align & TA_RIGHT)) &&
+            !s->tab_warning_printed && s->tab_count > 0) {
+            s->tab_warning_printed = 1;
+            av_log(s, AV_LOG_WARNING, "Tab characters are only supported with left horizontal alignment\n");
+        }
+
         if (s->draw_box) {
             rec_x = metrics.rect_x - s->bb_left;
             rec_y = metrics.rect_y - s->bb_top;
             rec_width = s->box_width + s->bb_right + s->bb_left;
             rec_height = s->box_height + s->bb_bottom + s->bb_top;
-            ff_blend_rectangle(&s->dc, &boxcolor,
-                frame->data, frame->linesize, width, height,
-                rec_x, rec_y, rec_width, rec_height);
         }
+        td.rec_x      = rec_x;
+        td.rec_y      = rec_y;
+        td.rec_width  = rec_width;
+        td.rec_height = rec_height;
 
-        if (s->shadowx || s->shadowy) {
-            if ((ret = draw_glyphs(s, frame, &shadowcolor, &metrics,
-                    s->shadowx, s->shadowy, s->borderw)) < 0) {
-                return ret;
-            }
-        }
+        /* everything is drawn within the rows of the clipping region */
+        td.y_start = FFMAX(metrics.rect_y - s->bb_top, 0) & ~align;
+        td.y_end   = FFMIN(metrics.rect_y + s->box_height + s->bb_bottom, height);
+        nb_jobs = av_clip((td.y_end - td.y_start) / MIN_SLICE_ROWS, 1, s->nb_threads);
 
-        if (s->borderw) {
-            if ((ret = draw_glyphs(s, frame, &bordercolor, &metrics,
-                    0, 0, s->borderw)) < 0) {
-                return ret;
-            }
-        }
-
-        if ((ret = draw_glyphs(s, frame, &fontcolor, &metrics, 0,
-                0, 0)) < 0) {
-            return ret;
-        }
-    }
-
-    // FREE data structures
-    for (int l = 0; l < s->line_count; ++l) {
-        TextLine *line = &s->lines[l];
-        av_freep(&line->glyphs);
-        hb_destroy(&line->hb_data);
+        ff_filter_execute(ctx, draw_text_slice, &td, s->slice_ret, nb_jobs);
+        for (int i = 0; i < nb_jobs; i++)
+            if (s->slice_ret[i] < 0)
+                return s->slice_ret[i];
     }
-    av_freep(&s->lines);
-    av_freep(&s->tab_clusters);
 
     return 0;
 }
@@ -2192,5 +2317,5 @@ const AVFilter ff_vf_drawtext = {
     FILTER_OUTPUTS(ff_video_default_filterpad),
     FILTER_QUERY_FUNC(query_formats),
     .process_command = command,
-    .flags         = AVFILTER_FLAG_SUPPORT_TIMELINE_GENERIC,
+    .flags         = AVFILTER_FLAG_SUPPORT_TIMELINE_GENERIC | AVFILTER_FLAG_SLICE_THREADS,
 };
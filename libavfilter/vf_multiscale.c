@@ -0,0 +1,381 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * scale a video to several sizes at once
+ *
+ * Instead of scaling the whole input frame once per output like split
+ * followed by several scale filters, the input is fed to all the scalers
+ * strip by strip, so that each strip is read from memory only once while it
+ * is still in the cache.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "libavutil/avstring.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/internal.h"
+#include "libavutil/mem.h"
+#include "libavutil/opt.h"
+#include "libavutil/parseutils.h"
+#include "libavutil/pixdesc.h"
+#include "libswscale/swscale.h"
+
+#include "avfilter.h"
+#include "filters.h"
+#include "formats.h"
+#include "internal.h"
+#include "scale_eval.h"
+#include "video.h"
+
+/* above this ratio, libswscale may cascade several scalers, which only works
+ * with whole frames */
+#define MAX_STRIP_RATIO 8
+
+typedef struct ScaleOutput {
+    int w, h;                   ///< requested size, as for the scale filter
+    struct SwsContext *sws;
+    int whole_frame;            ///< scale the whole frame at once
+} ScaleOutput;
+
+typedef struct MultiScaleContext {
+    const AVClass *class;
+
+    char *sizes_str;
+    char *flags_str;
+    int strip_height;
+
+    ScaleOutput *outs;
+    int nb_outs;
+    int vsub;
+} MultiScaleContext;
+
+static int config_output(AVFilterLink *outlink);
+
+static av_cold int init(AVFilterContext *ctx)
+{
+    MultiScaleContext *s = ctx->priv;
+    char *sizes, *size, *saveptr = NULL;
+    int ret = 0;
+
+    if (!s->sizes_str || !*s->sizes_str) {
+        av_log(ctx, AV_LOG_ERROR, "No output sizes specified.\n");
+        return AVERROR(EINVAL);
+    }
+
+    sizes = av_strdup(s->sizes_str);
+    if (!sizes)
+        return AVERROR(ENOMEM);
+
+    for (size = av_strtok(sizes, "|", &saveptr); size;
+         size = av_strtok(NULL, "|", &saveptr)) {
+        ScaleOutput *out;
+        AVFilterPad pad = { 0 };
+        int w, h;
+        char dummy;
+
+        /* negative values keep the aspect ratio, as with scale */
+        if (sscanf(size, "%dx%d%c", &w, &h, &dummy) != 2 &&
+            av_parse_video_size(&w, &h, size) < 0) {
+            av_log(ctx, AV_LOG_ERROR, "Invalid size '%s'\n", size);
+            ret = AVERROR(EINVAL);
+            break;
+        }
+
+        out = av_dynarray2_add((void **)&s->outs, &s->nb_outs, sizeof(*s->outs), NULL);
+        if (!out) {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        memset(out, 0, sizeof(*out));
+        out->w = w;
+        out->h = h;
+
+        pad.type         = AVMEDIA_TYPE_VIDEO;
+        pad.config_props = config_output;
+        pad.name         = av_asprintf("output%d", s->nb_outs - 1);
+        if (!pad.name) {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        if ((ret = ff_append_outpad_free_name(ctx, &pad)) < 0)
+            break;
+    }
+
+    av_free(sizes);
+    return ret;
+}
+
+static av_cold void uninit(AVFilterContext *ctx)
+{
+    MultiScaleContext *s = ctx->priv;
+
+    for (int i = 0; i < s->nb_outs; i++)
+        sws_freeContext(s->outs[i].sws);
+    av_freep(&s->outs);
+    s->nb_outs = 0;
+}
+
+static int query_formats(AVFilterContext *ctx)
+{
+    AVFilterFormats *formats = NULL;
+    const AVPixFmtDescriptor *desc = NULL;
+    int ret;
+
+    /* all outputs have the format of the input, so that only the size changes
+     * and every scaler takes the same strips */
+    while ((desc = av_pix_fmt_desc_next(desc))) {
+        enum AVPixelFormat pix_fmt = av_pix_fmt_desc_get_id(desc);
+
+        if (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL |
+                           AV_PIX_FMT_FLAG_BITSTREAM))
+            continue;
+        if (sws_isSupportedInput(pix_fmt) && sws_isSupportedOutput(pix_fmt) &&
+            (ret = ff_add_format(&formats, pix_fmt)) < 0)
+            return ret;
+    }
+
+    return ff_set_common_formats(ctx, formats);
+}
+
+static int config_output(AVFilterLink *outlink)
+{
+    AVFilterContext *ctx = outlink->src;
+    AVFilterLink *inlink = ctx->inputs[0];
+    MultiScaleContext *s = ctx->priv;
+    int idx = FF_OUTLINK_IDX(outlink);
+    ScaleOutput *out = &s->outs[idx];
+    int w = out->w, h = out->h;
+    int v_chr_pos = -513;
+    int ret;
+
+    if (!w)
+        w = inlink->w;
+    if (!h)
+        h = inlink->h;
+    ff_scale_adjust_dimensions(inlink, &w, &h, 0, 1);
+    if (w <= 0 || h <= 0 ||
+        (int64_t)w * inlink->h > INT_MAX || (int64_t)h * inlink->w > INT_MAX) {
+        av_log(ctx, AV_LOG_ERROR, "Invalid size %dx%d for output %d\n", w, h, idx);
+        return AVERROR(EINVAL);
+    }
+    outlink->w = w;
+    outlink->h = h;
+
+    if (inlink->sample_aspect_ratio.num)
+        outlink->sample_aspect_ratio = av_mul_q((AVRational){ h * inlink->w, w * inlink->h },
+                                                inlink->sample_aspect_ratio);
+    else
+        outlink->sample_aspect_ratio = inlink->sample_aspect_ratio;
+
+    s->vsub = av_pix_fmt_desc_get(inlink->format)->log2_chroma_h;
+
+    sws_freeContext(out->sws);
+    out->sws = sws_alloc_context();
+    if (!out->sws)
+        return AVERROR(ENOMEM);
+
+    /* same chroma positions as the scale filter, so that the output matches
+     * split followed by scale */
+    if (inlink->format == AV_PIX_FMT_YUV420P)
+        v_chr_pos = 128;
+
+    av_opt_set_int(out->sws, "srcw",       inlink->w,      0);
+    av_opt_set_int(out->sws, "srch",       inlink->h,      0);
+    av_opt_set_int(out->sws, "src_format", inlink->format, 0);
+    av_opt_set_int(out->sws, "dstw",       w,              0);
+    av_opt_set_int(out->sws, "dsth",       h,              0);
+    av_opt_set_int(out->sws, "dst_format", inlink->format, 0);
+    av_opt_set_int(out->sws, "src_v_chr_pos", v_chr_pos,   0);
+    av_opt_set_int(out->sws, "dst_v_chr_pos", v_chr_pos,   0);
+    if (s->flags_str && *s->flags_str) {
+        ret = av_opt_set(out->sws, "sws_flags", s->flags_str, 0);
+        if (ret < 0)
+            return ret;
+    }
+
+    ret = sws_init_context(out->sws, NULL, NULL);
+    if (ret < 0)
+        return ret;
+
+    out->whole_frame = inlink->w > (int64_t)w * MAX_STRIP_RATIO ||
+                       inlink->h > (int64_t)h * MAX_STRIP_RATIO;
+
+    av_log(ctx, AV_LOG_VERBOSE, "output%d: w:%d h:%d -> w:%d h:%d fmt:%s%s\n",
+           idx, inlink->w, inlink->h, w, h, av_get_pix_fmt_name(inlink->format),
+           out->whole_frame ? " (whole frame)" : "");
+
+    return 0;
+}
+
+static int scale_frame(AVFilterContext *ctx, AVFrame *in)
+{
+    MultiScaleContext *s = ctx->priv;
+    AVFilterLink *inlink = ctx->inputs[0];
+    AVFrame **outs;
+    int strip = FFALIGN(s->strip_height, 1 << s->vsub);
+    int ret = 0;
+
+    outs = av_calloc(s->nb_outs, sizeof(*outs));
+    if (!outs) {
+        av_frame_free(&in);
+        return AVERROR(ENOMEM);
+    }
+
+    for (int i = 0; i < s->nb_outs; i++) {
+        AVFilterLink *outlink = ctx->outputs[i];
+
+        if (ff_outlink_get_status(outlink))
+            continue;
+
+        outs[i] = ff_get_video_buffer(outlink, outlink->w, outlink->h);
+        if (!outs[i]) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        av_frame_copy_props(outs[i], in);
+        outs[i]->width  = outlink->w;
+        outs[i]->height = outlink->h;
+        av_reduce(&outs[i]->sample_aspect_ratio.num, &outs[i]->sample_aspect_ratio.den,
+                  (int64_t)in->sample_aspect_ratio.num * outlink->h * inlink->w,
+                  (int64_t)in->sample_aspect_ratio.den * outlink->w * inlink->h,
+                  INT_MAX);
+
+        if (s->outs[i].whole_frame) {
+            ret = sws_scale_frame(s->outs[i].sws, outs[i], in);
+            if (ret < 0)
+                goto fail;
+        }
+    }
+
+    /* feed the same strip to every scaler before moving to the next one;
+     * each scaler keeps the source lines its vertical filter still needs */
+    for (int y = 0; y < in->height; y += strip) {
+        int h = FFMIN(strip, in->height - y);
+        const uint8_t *src[4] = { NULL };
+
+        for (int p = 0; p < FF_ARRAY_ELEMS(src) && in->data[p]; p++) {
+            int shift = (p == 1 || p == 2) ? s->vsub : 0;
+            src[p] = in->data[p] + (y >> shift) * in->linesize[p];
+        }
+
+        for (int i = 0; i < s->nb_outs; i++) {
+            if (!outs[i] || s->outs[i].whole_frame)
+                continue;
+
+            ret = sws_scale(s->outs[i].sws, src, in->linesize, y, h,
+                            outs[i]->data, outs[i]->linesize);
+            if (ret < 0)
+                goto fail;
+        }
+    }
+
+    for (int i = 0; i < s->nb_outs; i++) {
+        if (!outs[i])
+            continue;
+        ret = ff_filter_frame(ctx->outputs[i], outs[i]);
+        outs[i] = NULL;
+        if (ret < 0)
+            break;
+    }
+
+fail:
+    for (int i = 0; i < s->nb_outs; i++)
+        av_frame_free(&outs[i]);
+    av_freep(&outs);
+    av_frame_free(&in);
+    return ret;
+}
+
+static int activate(AVFilterContext *ctx)
+{
+    AVFilterLink *inlink = ctx->inputs[0];
+    AVFrame *in;
+    int status, ret, nb_eofs = 0;
+    int64_t pts;
+
+    for (int i = 0; i < ctx->nb_outputs; i++)
+        nb_eofs += ff_outlink_get_status(ctx->outputs[i]) == AVERROR_EOF;
+
+    if (nb_eofs == ctx->nb_outputs) {
+        ff_inlink_set_status(inlink, AVERROR_EOF);
+        return 0;
+    }
+
+    ret = ff_inlink_consume_frame(inlink, &in);
+    if (ret < 0)
+        return ret;
+    if (ret > 0)
+        return scale_frame(ctx, in);
+
+    if (ff_inlink_acknowledge_status(inlink, &status, &pts)) {
+        for (int i = 0; i < ctx->nb_outputs; i++) {
+            if (ff_outlink_get_status(ctx->outputs[i]))
+                continue;
+            ff_outlink_set_status(ctx->outputs[i], status, pts);
+        }
+        return 0;
+    }
+
+    for (int i = 0; i < ctx->nb_outputs; i++) {
+        if (ff_outlink_get_status(ctx->outputs[i]))
+            continue;
+
+        if (ff_outlink_frame_wanted(ctx->outputs[i])) {
+            ff_inlink_request_frame(inlink);
+            return 0;
+        }
+    }
+
+    return FFERROR_NOT_READY;
+}
+
+#define OFFSET(x) offsetof(MultiScaleContext, x)
+#define FLAGS AV_OPT_FLAG_VIDEO_PARAM|AV_OPT_FLAG_FILTERING_PARAM
+
+static const AVOption multiscale_options[] = {
+    { "sizes", "set the '|'-separated list of output sizes", OFFSET(sizes_str),    AV_OPT_TYPE_STRING, { .str = NULL }, .flags = FLAGS },
+    { "flags", "Flags to pass to libswscale",                OFFSET(flags_str),    AV_OPT_TYPE_STRING, { .str = "" },   .flags = FLAGS },
+    { "strip", "set the height of the strips of input lines", OFFSET(strip_height), AV_OPT_TYPE_INT,    { .i64 = 16 }, 1, 4096, FLAGS },
+    { NULL }
+};
+
+AVFILTER_DEFINE_CLASS(multiscale);
+
+static const AVFilterPad multiscale_inputs[] = {
+    {
+        .name = "default",
+        .type = AVMEDIA_TYPE_VIDEO,
+    },
+};
+
+const AVFilter ff_vf_multiscale = {
+    .name          = "multiscale",
+    .description   = NULL_IF_CONFIG_SMALL("Scale the input video to several sizes at once."),
+    .priv_size     = sizeof(MultiScaleContext),
+    .priv_class    = &multiscale_class,
+    .init          = init,
+    .uninit        = uninit,
+    .activate      = activate,
+    FILTER_INPUTS(multiscale_inputs),
+    .outputs       = NULL,
+    FILTER_QUERY_FUNC(query_formats),
+    .flags         = AVFILTER_FLAG_DYNAMIC_OUTPUTS,
+};
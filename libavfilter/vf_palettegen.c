@@ -82,6 +82,10 @@ typedef struct PaletteGenContext {
     int nb_boxes;                           // number of boxes (increase will segmenting them)
     int palette_pushed;                     // if the palette frame is pushed into the outlink or not
     uint8_t transparency_color[4];          // background color for transparency
+
+    int nb_threads;
+    struct hist_node *slice_hists;          // per-slice histograms, merged into histogram after each frame
+    int *slice_ret;                         // per-slice number of new colors or error
 } PaletteGenContext;
 
 #define OFFSET(x) offsetof(PaletteGenContext, x)
@@ -419,11 +423,12 @@ static int color_inc(struct hist_node *hist, uint32_t color)
  * Update histogram when pixels differ from previous frame.
  */
 static int update_histogram_diff(struct hist_node *hist,
-                                 const AVFrame *f1, const AVFrame *f2)
+                                 const AVFrame *f1, const AVFrame *f2,
+                                 int slice_start, int slice_end)
 {
     int x, y, ret, nb_diff_colors = 0;
 
-    for (y = 0; y < f1->height; y++) {
+    for (y = slice_start; y < slice_end; y++) {
         const uint32_t *p = (const uint32_t *)(f1->data[0] + y*f1->linesize[0]);
         const uint32_t *q = (const uint32_t *)(f2->data[0] + y*f2->linesize[0]);
 
@@ -442,11 +447,12 @@ static int update_histogram_diff(struct hist_node *hist,
 /**
  * Simple histogram of the frame.
  */
-static int update_histogram_frame(struct hist_node *hist, const AVFrame *f)
+static int update_histogram_frame(struct hist_node *hist, const AVFrame *f,
+                                  int slice_start, int slice_end)
 {
     int x, y, ret, nb_diff_colors = 0;
 
-    for (y = 0; y < f->height; y++) {
+    for (y = slice_start; y < slice_end; y++) {
         const uint32_t *p = (const uint32_t *)(f->data[0] + y*f->linesize[0]);
 
         for (x = 0; x < f->width; x++) {
@@ -459,6 +465,83 @@ static int update_histogram_frame(struct hist_node *hist, const AVFrame *f)
     return nb_diff_colors;
 }
 
+typedef struct ThreadData {
+    const AVFrame *prev, *in;
+} ThreadData;
+
+static int update_histogram_slice(AVFilterContext *ctx, void *arg, int jobnr, int nb_jobs)
+{
+    PaletteGenContext *s = ctx->priv;
+    const ThreadData *td = arg;
+    const int slice_start = (td->in->height *  jobnr   ) / nb_jobs;
+    const int slice_end   = (td->in->height * (jobnr+1)) / nb_jobs;
+    struct hist_node *hist = nb_jobs > 1 ? s->slice_hists + jobnr * HIST_SIZE
+                                         : s->histogram;
+
+    return td->prev ? update_histogram_diff(hist, td->prev, td->in, slice_start, slice_end)
+                    : update_histogram_frame(hist, td->in, slice_start, slice_end);
+}
+
+/**
+ * Merge the per-slice histograms into the main one and reset them.
+ *
+ * Slices are merged in order so that every bucket lists its colors in the
+ * same order as a single threaded scan would have inserted them.
+ */
+static int merge_slice_histograms(PaletteGenContext *s, int nb_jobs)
+{
+    int nb_diff_colors = 0;
+
+    for (int j = 0; j < HIST_SIZE; j++) {
+        struct hist_node *node = &s->histogram[j];
+
+        for (int n = 0; n < nb_jobs; n++) {
+            struct hist_node *snode = &s->slice_hists[n * HIST_SIZE + j];
+
+            for (int i = 0; i < snode->nb_entries; i++) {
+                const struct color_ref *se = &snode->entries[i];
+                struct color_ref *e = NULL;
+
+                for (int k = 0; k < node->nb_entries; k++) {
+                    if (node->entries[k].color == se->color) {
+                        e = &node->entries[k];
+                        break;
+                    }
+                }
+                if (e) {
+                    e->count += se->count;
+                    continue;
+                }
+                e = av_dynarray2_add((void**)&node->entries, &node->nb_entries,
+                                     sizeof(*node->entries), (const uint8_t *)se);
+                if (!e)
+                    return AVERROR(ENOMEM);
+                nb_diff_colors++;
+            }
+            snode->nb_entries = 0;
+        }
+    }
+    return nb_diff_colors;
+}
+
+static int update_histogram(AVFilterContext *ctx, const AVFrame *prev, const AVFrame *in)
+{
+    PaletteGenContext *s = ctx->priv;
+    const int nb_jobs = FFMIN(s->nb_threads, in->height);
+    ThreadData td = { .prev = prev, .in = in };
+    int ret;
+
+    ff_filter_execute(ctx, update_histogram_slice, &td, s->slice_ret, nb_jobs);
+    if (nb_jobs == 1)
+        return s->slice_ret[0];
+
+    ret = merge_slice_histograms(s, nb_jobs);
+    for (int n = 0; n < nb_jobs; n++)
+        if (s->slice_ret[n] < 0)
+            return s->slice_ret[n];
+    return ret;
+}
+
 /**
  * Update the histogram for each passing frame. No frame will be pushed here.
  */
@@ -471,8 +554,7 @@ static int filter_frame(AVFilterLink *inlink, AVFrame *in)
     if (in->color_trc != AVCOL_TRC_UNSPECIFIED && in->color_trc != AVCOL_TRC_IEC61966_2_1)
         av_log(ctx, AV_LOG_WARNING, "The input frame is not in sRGB, colors may be off\n");
 
-    ret = s->prev_frame ? update_histogram_diff(s->histogram, s->prev_frame, in)
-                        : update_histogram_frame(s->histogram, in);
+    ret = update_histogram(ctx, s->prev_frame, in);
     if (ret > 0)
         s->nb_refs += ret;
 
@@ -520,6 +602,23 @@ static int request_frame(AVFilterLink *outlink)
     return r;
 }
 
+static int config_input(AVFilterLink *inlink)
+{
+    AVFilterContext *ctx = inlink->dst;
+    PaletteGenContext *s = ctx->priv;
+
+    s->nb_threads = FFMAX(1, FFMIN(ff_filter_get_nb_threads(ctx), inlink->h));
+    s->slice_ret = av_calloc(s->nb_threads, sizeof(*s->slice_ret));
+    if (!s->slice_ret)
+        return AVERROR(ENOMEM);
+    if (s->nb_threads > 1) {
+        s->slice_hists = av_calloc(s->nb_threads, HIST_SIZE * sizeof(*s->slice_hists));
+        if (!s->slice_hists)
+            return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
 /**
  * The output is one simple 16x16 squared-pixels palette.
  */
@@ -549,6 +648,12 @@ static av_cold void uninit(AVFilterContext *ctx)
 
     for (i = 0; i < HIST_SIZE; i++)
         av_freep(&s->histogram[i].entries);
+    if (s->slice_hists) {
+        for (i = 0; i < s->nb_threads * HIST_SIZE; i++)
+            av_freep(&s->slice_hists[i].entries);
+        av_freep(&s->slice_hists);
+    }
+    av_freep(&s->slice_ret);
     av_freep(&s->refs);
     av_frame_free(&s->prev_frame);
 }
@@ -557,6 +662,7 @@ static const AVFilterPad palettegen_inputs[] = {
     {
         .name         = "default",
         .type         = AVMEDIA_TYPE_VIDEO,
+        .config_props = config_input,
         .filter_frame = filter_frame,
     },
 };
@@ -580,4 +686,5 @@ const AVFilter ff_vf_palettegen = {
     FILTER_OUTPUTS(palettegen_outputs),
     FILTER_QUERY_FUNC(query_formats),
     .priv_class    = &palettegen_class,
+    .flags         = AVFILTER_FLAG_SLICE_THREADS,
 };
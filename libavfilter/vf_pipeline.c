@@ -0,0 +1,405 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Run a filter chain on a separate thread, so that consecutive chain
+ * segments process different frames at the same time.
+ */
+
+#include "libavutil/avassert.h"
+#include "libavutil/fifo.h"
+#include "libavutil/internal.h"
+#include "libavutil/opt.h"
+#include "libavutil/thread.h"
+
+#include "avfilter.h"
+#include "buffersink.h"
+#include "buffersrc.h"
+#include "filters.h"
+#include "formats.h"
+#include "internal.h"
+#include "video.h"
+
+typedef struct PipelineContext {
+    const AVClass *class;
+
+    char *filters_str;
+    int queue_size;
+
+    AVFilterGraph *graph;
+    AVFilterContext *src;
+    AVFilterContext *sink;
+
+    AVFilterContext *ctx;
+    AVFilterGraph *parent_graph;    ///< the graph the worker wakes ctx up in
+    pthread_t thread;
+    int thread_started;
+
+    /* everything below is protected by lock */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    AVFifo *in_fifo;            ///< frames waiting for the worker
+    AVFifo *out_fifo;           ///< frames filtered by the worker
+    int in_eof;                 ///< no more frames will be added to in_fifo
+    int64_t in_eof_pts;
+    int worker_done;            ///< the worker thread has nothing more to output
+    int worker_err;             ///< error that stopped the worker, or AVERROR_EOF
+    int quit;                   ///< uninit asked the worker to stop
+} PipelineContext;
+
+#define OFFSET(x) offsetof(PipelineContext, x)
+#define FLAGS AV_OPT_FLAG_VIDEO_PARAM | AV_OPT_FLAG_FILTERING_PARAM
+
+static const AVOption pipeline_options[] = {
+    { "filters",    "filter chain to run on the worker thread", OFFSET(filters_str), AV_OPT_TYPE_STRING, { .str = NULL }, 0, 0,   FLAGS },
+    { "f",          "filter chain to run on the worker thread", OFFSET(filters_str), AV_OPT_TYPE_STRING, { .str = NULL }, 0, 0,   FLAGS },
+    { "queue_size", "number of frames queued in each direction", OFFSET(queue_size), AV_OPT_TYPE_INT,    { .i64 = 4 },    1, 256, FLAGS },
+    { NULL }
+};
+
+AVFILTER_DEFINE_CLASS(pipeline);
+
+static av_cold int init(AVFilterContext *ctx)
+{
+    PipelineContext *s = ctx->priv;
+    int ret;
+
+    if (!s->filters_str) {
+        av_log(ctx, AV_LOG_ERROR, "No filter chain specified.\n");
+        return AVERROR(EINVAL);
+    }
+
+    s->in_fifo  = av_fifo_alloc2(s->queue_size, sizeof(AVFrame*), 0);
+    s->out_fifo = av_fifo_alloc2(s->queue_size, sizeof(AVFrame*), 0);
+    if (!s->in_fifo || !s->out_fifo)
+        return AVERROR(ENOMEM);
+
+    if ((ret = pthread_mutex_init(&s->lock, NULL)))
+        return AVERROR(ret);
+    if ((ret = pthread_cond_init(&s->cond, NULL))) {
+        pthread_mutex_destroy(&s->lock);
+        return AVERROR(ret);
+    }
+    s->in_eof_pts = AV_NOPTS_VALUE;
+
+    return 0;
+}
+
+static void free_fifo(AVFifo **fifo)
+{
+    AVFrame *frame;
+
+    if (!*fifo)
+        return;
+    while (av_fifo_read(*fifo, &frame, 1) >= 0)
+        av_frame_free(&frame);
+    av_fifo_freep2(fifo);
+}
+
+static av_cold void uninit(AVFilterContext *ctx)
+{
+    PipelineContext *s = ctx->priv;
+
+    if (s->thread_started) {
+        pthread_mutex_lock(&s->lock);
+        s->quit = 1;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+        pthread_join(s->thread, NULL);
+    }
+    if (s->in_fifo) {
+        pthread_cond_destroy(&s->cond);
+        pthread_mutex_destroy(&s->lock);
+    }
+
+    free_fifo(&s->in_fifo);
+    free_fifo(&s->out_fifo);
+    avfilter_graph_free(&s->graph);
+}
+
+static int query_formats(AVFilterContext *ctx)
+{
+    /* The chain converts back to the input format if it changes it, so a
+     * single list is shared by both links, as with the null filter. */
+    return ff_set_common_formats(ctx, ff_all_formats(AVMEDIA_TYPE_VIDEO));
+}
+
+/**
+ * Pass one frame, or EOF if frame is NULL, through the chain and queue
+ * everything it outputs. Called on the worker thread without the lock.
+ */
+static int worker_filter(PipelineContext *s, AVFrame *frame, int64_t eof_pts)
+{
+    int ret;
+
+    if (frame)
+        ret = av_buffersrc_add_frame_flags(s->src, frame, AV_BUFFERSRC_FLAG_PUSH);
+    else
+        ret = av_buffersrc_close(s->src, eof_pts, AV_BUFFERSRC_FLAG_PUSH);
+    av_frame_free(&frame);
+    if (ret < 0)
+        return ret;
+
+    while (1) {
+        AVFrame *out = av_frame_alloc();
+        if (!out)
+            return AVERROR(ENOMEM);
+
+        ret = av_buffersink_get_frame_flags(s->sink, out, 0);
+        if (ret < 0) {
+            av_frame_free(&out);
+            return ret == AVERROR(EAGAIN) ? 0 : ret;
+        }
+
+        pthread_mutex_lock(&s->lock);
+        while (!av_fifo_can_write(s->out_fifo) && !s->quit)
+            pthread_cond_wait(&s->cond, &s->lock);
+        if (s->quit) {
+            pthread_mutex_unlock(&s->lock);
+            av_frame_free(&out);
+            return AVERROR_EXIT;
+        }
+        av_fifo_write(s->out_fifo, &out, 1);
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+
+        ff_filter_graph_wake(s->parent_graph, s->ctx);
+    }
+}
+
+static void *worker_thread(void *arg)
+{
+    PipelineContext *s = arg;
+    int ret = 0;
+
+    while (ret >= 0) {
+        AVFrame *frame = NULL;
+        int64_t eof_pts;
+
+        pthread_mutex_lock(&s->lock);
+        while (!av_fifo_can_read(s->in_fifo) && !s->in_eof && !s->quit)
+            pthread_cond_wait(&s->cond, &s->lock);
+        if (s->quit) {
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+        if (av_fifo_read(s->in_fifo, &frame, 1) >= 0)
+            pthread_cond_broadcast(&s->cond);
+        eof_pts = s->in_eof_pts;
+        pthread_mutex_unlock(&s->lock);
+
+        // there is room for another input frame
+        if (frame)
+            ff_filter_graph_wake(s->parent_graph, s->ctx);
+
+        ret = worker_filter(s, frame, eof_pts);
+        if (!frame && ret >= 0)
+            ret = AVERROR_EOF;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->worker_done = 1;
+    s->worker_err  = ret < 0 ? ret : AVERROR_EOF;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+
+    ff_filter_graph_wake(s->parent_graph, s->ctx);
+
+    return NULL;
+}
+
+static int config_output(AVFilterLink *outlink)
+{
+    AVFilterContext *ctx = outlink->src;
+    PipelineContext *s = ctx->priv;
+    AVFilterLink *inlink = ctx->inputs[0];
+    AVBufferSrcParameters *par;
+    AVFilterInOut *inputs = NULL, *outputs = NULL;
+    int ret;
+
+    s->graph = avfilter_graph_alloc();
+    if (!s->graph)
+        return AVERROR(ENOMEM);
+    s->graph->nb_threads = ctx->graph->nb_threads;
+    s->graph->thread_type = ctx->graph->thread_type;
+
+    s->src = avfilter_graph_alloc_filter(s->graph, avfilter_get_by_name("buffer"), "in");
+    if (!s->src)
+        return AVERROR(ENOMEM);
+    par = av_buffersrc_parameters_alloc();
+    if (!par)
+        return AVERROR(ENOMEM);
+    par->format              = inlink->format;
+    par->time_base           = inlink->time_base;
+    par->frame_rate          = inlink->frame_rate;
+    par->width               = inlink->w;
+    par->height              = inlink->h;
+    par->sample_aspect_ratio = inlink->sample_aspect_ratio;
+    par->hw_frames_ctx       = inlink->hw_frames_ctx;
+    ret = av_buffersrc_parameters_set(s->src, par);
+    av_freep(&par);
+    if (ret < 0)
+        return ret;
+    if ((ret = avfilter_init_dict(s->src, NULL)) < 0)
+        return ret;
+
+    s->sink = avfilter_graph_alloc_filter(s->graph, avfilter_get_by_name("buffersink"), "out");
+    if (!s->sink)
+        return AVERROR(ENOMEM);
+    ret = av_opt_set_bin(s->sink, "pix_fmts", (const uint8_t*)&outlink->format,
+                         sizeof(outlink->format), AV_OPT_SEARCH_CHILDREN);
+    if (ret < 0)
+        return ret;
+    if ((ret = avfilter_init_dict(s->sink, NULL)) < 0)
+        return ret;
+
+    outputs = avfilter_inout_alloc();
+    inputs  = avfilter_inout_alloc();
+    if (!outputs || !inputs) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    outputs->name       = av_strdup("in");
+    outputs->filter_ctx = s->src;
+    inputs->name        = av_strdup("out");
+    inputs->filter_ctx  = s->sink;
+    if (!outputs->name || !inputs->name) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    ret = avfilter_graph_parse_ptr(s->graph, s->filters_str, &inputs, &outputs, ctx);
+    if (ret < 0)
+        goto fail;
+    if ((ret = avfilter_graph_config(s->graph, ctx)) < 0)
+        goto fail;
+
+    outlink->w                   = av_buffersink_get_w(s->sink);
+    outlink->h                   = av_buffersink_get_h(s->sink);
+    outlink->time_base           = av_buffersink_get_time_base(s->sink);
+    outlink->frame_rate          = av_buffersink_get_frame_rate(s->sink);
+    outlink->sample_aspect_ratio = av_buffersink_get_sample_aspect_ratio(s->sink);
+    if (av_buffersink_get_hw_frames_ctx(s->sink)) {
+        outlink->hw_frames_ctx = av_buffer_ref(av_buffersink_get_hw_frames_ctx(s->sink));
+        if (!outlink->hw_frames_ctx) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+    }
+
+    s->ctx          = ctx;
+    s->parent_graph = ctx->graph;
+    if ((ret = pthread_create(&s->thread, NULL, worker_thread, s))) {
+        ret = AVERROR(ret);
+        goto fail;
+    }
+    s->thread_started = 1;
+
+fail:
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    return ret;
+}
+
+static int activate(AVFilterContext *ctx)
+{
+    PipelineContext *s = ctx->priv;
+    AVFilterLink *inlink  = ctx->inputs[0];
+    AVFilterLink *outlink = ctx->outputs[0];
+    AVFrame *frame = NULL;
+    int64_t pts;
+    int status, ret;
+
+    ff_filter_set_waiting(ctx, 0);
+
+    FF_FILTER_FORWARD_STATUS_BACK(outlink, inlink);
+
+    pthread_mutex_lock(&s->lock);
+    if (av_fifo_read(s->out_fifo, &frame, 1) >= 0) {
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+        ret = ff_filter_frame(outlink, frame);
+        ff_filter_set_ready(ctx, 100);
+        return ret;
+    }
+    if (s->worker_done) {
+        pthread_mutex_unlock(&s->lock);
+        if (s->worker_err != AVERROR_EOF)
+            return s->worker_err;
+        pts = s->in_eof_pts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE :
+              av_rescale_q(s->in_eof_pts, inlink->time_base, outlink->time_base);
+        ff_outlink_set_status(outlink, AVERROR_EOF, pts);
+        return 0;
+    }
+    /* Once the input is finished, or the worker has all the frames it
+     * may hold, the only way forward is the worker waking us up. */
+    if (s->in_eof || !av_fifo_can_write(s->in_fifo)) {
+        pthread_mutex_unlock(&s->lock);
+        ff_filter_set_waiting(ctx, 1);
+        return FFERROR_NOT_READY;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    ret = ff_inlink_consume_frame(inlink, &frame);
+    if (ret < 0)
+        return ret;
+    if (ret > 0) {
+        pthread_mutex_lock(&s->lock);
+        av_fifo_write(s->in_fifo, &frame, 1);
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+        ff_filter_set_ready(ctx, 100);
+        return 0;
+    }
+
+    if (ff_inlink_acknowledge_status(inlink, &status, &pts)) {
+        pthread_mutex_lock(&s->lock);
+        s->in_eof     = 1;
+        s->in_eof_pts = pts;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+        ff_filter_set_ready(ctx, 100);
+        return 0;
+    }
+
+    FF_FILTER_FORWARD_WANTED(outlink, inlink);
+
+    return FFERROR_NOT_READY;
+}
+
+static const AVFilterPad pipeline_outputs[] = {
+    {
+        .name          = "default",
+        .type          = AVMEDIA_TYPE_VIDEO,
+        .config_props  = config_output,
+    },
+};
+
+const AVFilter ff_vf_pipeline = {
+    .name          = "pipeline",
+    .description   = NULL_IF_CONFIG_SMALL("Run a filter chain on a separate thread."),
+    .priv_size     = sizeof(PipelineContext),
+    .priv_class    = &pipeline_class,
+    .init          = init,
+    .uninit        = uninit,
+    .activate      = activate,
+    FILTER_INPUTS(ff_video_default_filterpad),
+    FILTER_OUTPUTS(pipeline_outputs),
+    FILTER_QUERY_FUNC(query_formats),
+};
@@ -1243,6 +1243,7 @@ typedef struct AVFormatContext {
 #define AVFMT_FLAG_FAST_SEEK   0x80000 ///< Enable fast, but inaccurate seeks for some formats
 #define AVFMT_FLAG_SHORTEST   0x100000 ///< Stop muxing when the shortest stream stops.
 #define AVFMT_FLAG_AUTO_BSF   0x200000 ///< Add bitstream filters as requested by the muxer
+#define AVFMT_FLAG_FAST_PROBE 0x400000 ///< Stop analyzing the streams as soon as their parameters are known, see avformat_find_stream_info()
 
     /**
      * Maximum number of bytes read from input in order to determine stream
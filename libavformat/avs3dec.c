@@ -24,8 +24,14 @@
 #include "libavcodec/avs3.h"
 #include "libavcodec/startcode.h"
 #include "avformat.h"
+#include "internal.h"
 #include "rawdec.h"
 
+typedef struct AVS3DemuxContext {
+    FFRawVideoDemuxerContext raw;   ///< must be first, shares the raw video options
+    int64_t next_pos;               ///< position following the last read, -1 if none
+} AVS3DemuxContext;
+
 static int avs3video_probe(const AVProbeData *p)
 {
     const uint8_t *ptr = p->buf, *end = p->buf + p->buf_size;
@@ -65,4 +71,70 @@ static int avs3video_probe(const AVProbeData *p)
     return ret;
 }
 
-FF_DEF_RAWVIDEO_DEMUXER(avs3, "raw AVS3-P2/IEEE1857.10", avs3video_probe, "avs3", AV_CODEC_ID_AVS3)
+static int avs3video_read_header(AVFormatContext *s)
+{
+    AVS3DemuxContext *ctx = s->priv_data;
+
+    ctx->next_pos = -1;
+    return ff_raw_video_read_header(s);
+}
+
+/**
+ * Find the index entry that starts exactly at pos. The entries of the
+ * generic index are sorted by timestamp, which increases with the
+ * position for keyframes, so a binary search on the position works.
+ */
+static const AVIndexEntry *find_index_entry(AVStream *st, int64_t pos)
+{
+    int lo = 0, hi = avformat_index_get_entries_count(st) - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) >> 1;
+        const AVIndexEntry *e = avformat_index_get_entry(st, mid);
+
+        if (e->pos == pos)
+            return e;
+        if (e->pos < pos)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return NULL;
+}
+
+/**
+ * The timestamps are derived by the parser, which is reset on every seek.
+ * When reading restarts at a known keyframe, pass its timestamp along so
+ * that the parser continues from it instead of starting over at 0.
+ */
+static int avs3video_read_packet(AVFormatContext *s, AVPacket *pkt)
+{
+    AVS3DemuxContext *ctx = s->priv_data;
+    const AVIndexEntry *e;
+    int ret;
+
+    ret = ff_raw_read_partial_packet(s, pkt);
+    if (ret < 0)
+        return ret;
+
+    if (ctx->next_pos >= 0 && pkt->pos != ctx->next_pos &&
+        (e = find_index_entry(s->streams[0], pkt->pos))) {
+        pkt->dts = e->timestamp;
+    }
+    ctx->next_pos = pkt->pos + pkt->size;
+
+    return ret;
+}
+
+const AVInputFormat ff_avs3_demuxer = {
+    .name           = "avs3",
+    .long_name      = NULL_IF_CONFIG_SMALL("raw AVS3-P2/IEEE1857.10"),
+    .read_probe     = avs3video_probe,
+    .read_header    = avs3video_read_header,
+    .read_packet    = avs3video_read_packet,
+    .extensions     = "avs3",
+    .flags          = AVFMT_GENERIC_INDEX | AVFMT_NOTIMESTAMPS,
+    .raw_codec_id   = AV_CODEC_ID_AVS3,
+    .priv_data_size = sizeof(AVS3DemuxContext),
+    .priv_class     = &ff_rawvideo_demuxer_class,
+};
@@ -2573,6 +2573,10 @@ int avformat_find_stream_info(AVFormatContext *ic, AVDictionary **options)
                 fps_analyze_framecount = ic->fps_probe_size;
             if (st->disposition & AV_DISPOSITION_ATTACHED_PIC)
                 fps_analyze_framecount = 0;
+            /* trust any frame rate the demuxer exported */
+            if ((ic->flags & AVFMT_FLAG_FAST_PROBE) &&
+                (st->r_frame_rate.num || st->avg_frame_rate.num))
+                fps_analyze_framecount = 0;
             /* variable fps and no guess at the real fps */
             count = (ic->iformat->flags & AVFMT_NOTIMESTAMPS) ?
                        sti->info->codec_info_duration_fields/2 :
@@ -2602,8 +2606,10 @@ int avformat_find_stream_info(AVFormatContext *ic, AVDictionary **options)
             if (i == ic->nb_streams) {
                 analyzed_all_streams = 1;
                 /* NOTE: If the format has no header, then we need to read some
-                 * packets to get most of the streams, so we cannot stop here. */
-                if (!(ic->ctx_flags & AVFMTCTX_NOHEADER)) {
+                 * packets to get most of the streams, so we cannot stop here,
+                 * unless the caller does not want to wait for them. */
+                if (!(ic->ctx_flags & AVFMTCTX_NOHEADER) ||
+                    ((ic->flags & AVFMT_FLAG_FAST_PROBE) && ic->nb_streams)) {
                     /* If we found the info for all the codecs, we can stop. */
                     ret = count;
                     av_log(ic, AV_LOG_DEBUG, "All info found\n");
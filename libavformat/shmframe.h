@@ -0,0 +1,117 @@
+/*
+ * Shared memory frame ring
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef AVFORMAT_SHMFRAME_H
+#define AVFORMAT_SHMFRAME_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*
+ * A shmframe file is a ring of packets of a single stream, shared through
+ * a memory mapping between one writing process and any number of reading
+ * processes. It is meant for raw frames, so that the readers can use them
+ * without decoding them again.
+ *
+ * The file starts with a ShmFrameHeader, followed by nb_slots ShmFrameSlot,
+ * followed by the data of the slots at data_offset, each of them slot_size
+ * bytes long. Packet n (counting from 1) is stored in slot n % nb_slots.
+ *
+ * Readers take a lease on a slot while they use its data, the writer does
+ * not overwrite a slot while it has leases. The leases field holds the
+ * generation of the slot in its upper 16 bits and the number of leases in
+ * its lower 16 bits:
+ * - the writer marks the slot invalid by setting seq to 0, waits for the
+ *   number of leases to drop to 0 and atomically bumps the generation, writes
+ *   the packet, then sets seq and write_seq to n; if the slot is still leased
+ *   after a timeout, packet n is not written to it and the writer tries again
+ *   with n + 1 in the next slot;
+ * - a reader increments leases, then checks that seq is n; if it is not,
+ *   the slot is being or has been overwritten, or was skipped, and the lease
+ *   is dropped. A lease is only dropped if the generation it was taken in is
+ *   still current.
+ */
+
+#define SHMFRAME_MAGIC   0x4d485346 // "FSHM"
+#define SHMFRAME_VERSION 1
+
+#define SHMFRAME_ALIGN   64
+
+#define SHMFRAME_LEASES_MASK 0xffffu
+#define SHMFRAME_GEN_MASK    (~SHMFRAME_LEASES_MASK)
+#define SHMFRAME_GEN_ONE     (SHMFRAME_LEASES_MASK + 1)
+
+typedef struct ShmFrameSlot {
+    atomic_uint seq;
+    atomic_uint leases;
+    int32_t     size;
+    int32_t     flags;
+    int64_t     pts;
+    int64_t     dts;
+    int64_t     duration;
+} ShmFrameSlot;
+
+typedef struct ShmFrameHeader {
+    /* only set once the rest of the file is initialized */
+    atomic_uint magic;
+    uint32_t    version;
+
+    uint32_t    nb_slots;
+    uint32_t    slot_size;
+    uint64_t    data_offset;
+    uint64_t    file_size;
+
+    /* parameters of the stream */
+    int32_t     codec_type;
+    int32_t     codec_id;
+    int32_t     format;
+    int32_t     width;
+    int32_t     height;
+    int32_t     sample_rate;
+    int32_t     nb_channels;
+    int32_t     block_align;
+    int32_t     bits_per_coded_sample;
+    int32_t     time_base_num;
+    int32_t     time_base_den;
+    int32_t     frame_rate_num;
+    int32_t     frame_rate_den;
+    int32_t     sar_num;
+    int32_t     sar_den;
+    /* 0 when the channel layout is not a native one */
+    uint64_t    channel_mask;
+
+    /* sequence number of the last packet written, 0 if none */
+    atomic_uint write_seq;
+    atomic_uint eof;
+} ShmFrameHeader;
+
+static inline ShmFrameSlot *ff_shmframe_slot(ShmFrameHeader *hdr, unsigned seq)
+{
+    ShmFrameSlot *slots = (ShmFrameSlot*)(hdr + 1);
+    return &slots[seq % hdr->nb_slots];
+}
+
+static inline uint8_t *ff_shmframe_slot_data(ShmFrameHeader *hdr, unsigned seq)
+{
+    return (uint8_t*)hdr + hdr->data_offset +
+           (uint64_t)(seq % hdr->nb_slots) * hdr->slot_size;
+}
+
+#endif /* AVFORMAT_SHMFRAME_H */
@@ -0,0 +1,337 @@
+/*
+ * Shared memory frame ring demuxer
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libavutil/file_open.h"
+#include "libavutil/mem.h"
+#include "libavutil/opt.h"
+#include "libavutil/time.h"
+#include "libavcodec/packet.h"
+#include "avformat.h"
+#include "internal.h"
+#include "shmframe.h"
+#include "url.h"
+
+typedef struct ShmFrameDemuxContext {
+    const AVClass *class;
+
+    int zero_copy;
+    int start;
+
+    /* owns the mapping, which packets returned without copying reference */
+    AVBufferRef    *map;
+    ShmFrameHeader *hdr;
+    unsigned        next;
+} ShmFrameDemuxContext;
+
+enum ShmFrameStart {
+    SHMFRAME_START_LATEST,
+    SHMFRAME_START_OLDEST,
+};
+
+typedef struct ShmFrameLease {
+    AVBufferRef *map;
+    atomic_uint *leases;
+    unsigned     gen;
+} ShmFrameLease;
+
+static void map_free(void *opaque, uint8_t *data)
+{
+    munmap(data, (size_t)(uintptr_t)opaque);
+}
+
+static void lease_release(atomic_uint *leases, unsigned gen)
+{
+    unsigned int cur = atomic_load(leases);
+
+    // leases taken in an older generation of the slot are gone already
+    while ((cur & SHMFRAME_GEN_MASK) == gen && (cur & SHMFRAME_LEASES_MASK) &&
+           !atomic_compare_exchange_weak(leases, &cur, cur - 1))
+        ;
+}
+
+static void lease_free(void *opaque, uint8_t *data)
+{
+    ShmFrameLease *l = opaque;
+
+    lease_release(l->leases, l->gen);
+    av_buffer_unref(&l->map);
+    av_free(l);
+}
+
+static unsigned seq_next(unsigned seq)
+{
+    // 0 marks slots being written and is skipped
+    return seq + 1 ? seq + 1 : 1;
+}
+
+static int shmframe_read_header(AVFormatContext *s)
+{
+    ShmFrameDemuxContext *c = s->priv_data;
+    ShmFrameHeader *hdr;
+    AVCodecParameters *par;
+    AVStream *st;
+    struct stat sb;
+    void *map;
+    int fd, ret;
+
+    fd = avpriv_open(s->url, O_RDWR);
+    if (fd < 0) {
+        ret = AVERROR(errno);
+        av_log(s, AV_LOG_ERROR, "Cannot open '%s': %s\n", s->url, av_err2str(ret));
+        return ret;
+    }
+
+    if (fstat(fd, &sb) < 0) {
+        ret = AVERROR(errno);
+        close(fd);
+        return ret;
+    }
+    if (sb.st_size < sizeof(*hdr)) {
+        close(fd);
+        return AVERROR_INVALIDDATA;
+    }
+
+    map = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return AVERROR(errno);
+
+    c->map = av_buffer_create(map, sb.st_size, map_free,
+                              (void*)(uintptr_t)sb.st_size, 0);
+    if (!c->map) {
+        munmap(map, sb.st_size);
+        return AVERROR(ENOMEM);
+    }
+    c->hdr = hdr = map;
+
+    if (atomic_load(&hdr->magic) != SHMFRAME_MAGIC) {
+        av_log(s, AV_LOG_ERROR, "Not a shmframe file, or not initialized yet\n");
+        return AVERROR_INVALIDDATA;
+    }
+    if (hdr->version != SHMFRAME_VERSION) {
+        av_log(s, AV_LOG_ERROR, "Unsupported version %"PRIu32"\n", hdr->version);
+        return AVERROR_PATCHWELCOME;
+    }
+    if (hdr->file_size != sb.st_size || !hdr->nb_slots ||
+        hdr->slot_size < AV_INPUT_BUFFER_PADDING_SIZE ||
+        hdr->data_offset < sizeof(*hdr) + hdr->nb_slots * sizeof(ShmFrameSlot) ||
+        hdr->data_offset + (uint64_t)hdr->nb_slots * hdr->slot_size > sb.st_size ||
+        hdr->time_base_num <= 0 || hdr->time_base_den <= 0)
+        return AVERROR_INVALIDDATA;
+
+    st = avformat_new_stream(s, NULL);
+    if (!st)
+        return AVERROR(ENOMEM);
+    par = st->codecpar;
+
+    par->codec_type            = hdr->codec_type;
+    par->codec_id              = hdr->codec_id;
+    par->format                = hdr->format;
+    par->width                 = hdr->width;
+    par->height                = hdr->height;
+    par->sample_rate           = hdr->sample_rate;
+    par->block_align           = hdr->block_align;
+    par->bits_per_coded_sample = hdr->bits_per_coded_sample;
+    par->sample_aspect_ratio   = (AVRational){ hdr->sar_num, hdr->sar_den };
+
+    if (hdr->nb_channels > 0) {
+        if (hdr->channel_mask &&
+            av_popcount64(hdr->channel_mask) == hdr->nb_channels)
+            ret = av_channel_layout_from_mask(&par->ch_layout, hdr->channel_mask);
+        else {
+            av_channel_layout_default(&par->ch_layout, hdr->nb_channels);
+            ret = 0;
+        }
+        if (ret < 0)
+            return ret;
+    }
+
+    avpriv_set_pts_info(st, 64, hdr->time_base_num, hdr->time_base_den);
+    if (hdr->frame_rate_num > 0 && hdr->frame_rate_den > 0) {
+        st->avg_frame_rate =
+        st->r_frame_rate   = (AVRational){ hdr->frame_rate_num, hdr->frame_rate_den };
+    }
+
+    c->next = atomic_load(&hdr->write_seq);
+    // the slots of the packets that were overwritten since are skipped
+    if (c->start == SHMFRAME_START_OLDEST && c->next)
+        c->next -= FFMIN(c->next - 1, hdr->nb_slots - 1);
+    if (!c->next)
+        c->next = 1;
+
+    return 0;
+}
+
+/* Take a lease on the slot of the next packet and export it. Returns 0 if
+ * the slot was overwritten in the meantime, or skipped by the writer. */
+static int read_slot(AVFormatContext *s, AVPacket *pkt)
+{
+    ShmFrameDemuxContext *c = s->priv_data;
+    ShmFrameHeader     *hdr = c->hdr;
+    ShmFrameSlot      *slot = ff_shmframe_slot(hdr, c->next);
+    const uint8_t     *data = ff_shmframe_slot_data(hdr, c->next);
+    unsigned gen;
+    int ret;
+
+    gen = atomic_fetch_add(&slot->leases, 1) & SHMFRAME_GEN_MASK;
+    if (atomic_load(&slot->seq) != c->next) {
+        lease_release(&slot->leases, gen);
+        return 0;
+    }
+
+    if (slot->size < 0 || slot->size > hdr->slot_size - AV_INPUT_BUFFER_PADDING_SIZE) {
+        lease_release(&slot->leases, gen);
+        return AVERROR_INVALIDDATA;
+    }
+
+    if (c->zero_copy) {
+        ShmFrameLease *l = av_mallocz(sizeof(*l));
+        if (!l) {
+            lease_release(&slot->leases, gen);
+            return AVERROR(ENOMEM);
+        }
+        l->leases = &slot->leases;
+        l->gen    = gen;
+        l->map    = av_buffer_ref(c->map);
+        if (!l->map) {
+            av_free(l);
+            lease_release(&slot->leases, gen);
+            return AVERROR(ENOMEM);
+        }
+
+        // the slots are followed by zeroed padding
+        pkt->buf = av_buffer_create((uint8_t*)data,
+                                    slot->size + AV_INPUT_BUFFER_PADDING_SIZE,
+                                    lease_free, l, AV_BUFFER_FLAG_READONLY);
+        if (!pkt->buf) {
+            lease_free(l, NULL);
+            return AVERROR(ENOMEM);
+        }
+        pkt->data = pkt->buf->data;
+        pkt->size = slot->size;
+    } else {
+        ret = av_new_packet(pkt, slot->size);
+        if (ret < 0) {
+            lease_release(&slot->leases, gen);
+            return ret;
+        }
+        memcpy(pkt->data, data, slot->size);
+    }
+
+    pkt->pts          = slot->pts;
+    pkt->dts          = slot->dts;
+    pkt->duration     = slot->duration;
+    pkt->flags        = slot->flags & (AV_PKT_FLAG_KEY | AV_PKT_FLAG_DISCARD);
+    pkt->stream_index = 0;
+    pkt->pos          = -1;
+
+    if (!c->zero_copy)
+        lease_release(&slot->leases, gen);
+
+    return 1;
+}
+
+static int shmframe_read_packet(AVFormatContext *s, AVPacket *pkt)
+{
+    ShmFrameDemuxContext *c = s->priv_data;
+    ShmFrameHeader     *hdr = c->hdr;
+    int ret;
+
+    while (1) {
+        // load eof first, so that no packet written before it is missed
+        unsigned eof   = atomic_load(&hdr->eof);
+        unsigned write = atomic_load(&hdr->write_seq);
+
+        if (write && (int)(write - c->next) >= 0) {
+            if (write - c->next >= hdr->nb_slots) {
+                av_log(s, AV_LOG_WARNING, "Reading too slowly, skipped %u packets\n",
+                       write - c->next);
+                c->next = write;
+            }
+
+            ret = read_slot(s, pkt);
+            if (ret < 0)
+                return ret;
+            c->next = seq_next(c->next);
+            if (ret)
+                return 0;
+
+            // the packet was published before, so it is lost, go on with the
+            // next one
+            continue;
+        }
+
+        if (eof)
+            return AVERROR_EOF;
+        if (s->flags & AVFMT_FLAG_NONBLOCK)
+            return AVERROR(EAGAIN);
+        if (ff_check_interrupt(&s->interrupt_callback))
+            return AVERROR_EXIT;
+
+        av_usleep(1000);
+    }
+}
+
+static int shmframe_read_close(AVFormatContext *s)
+{
+    ShmFrameDemuxContext *c = s->priv_data;
+
+    // the mapping is only unmapped once all the packets are freed
+    av_buffer_unref(&c->map);
+    c->hdr = NULL;
+
+    return 0;
+}
+
+#define OFFSET(x) offsetof(ShmFrameDemuxContext, x)
+#define D AV_OPT_FLAG_DECODING_PARAM
+static const AVOption options[] = {
+    { "zero_copy", "return packets that point into the shared memory, leasing their slot until they are freed",
+      OFFSET(zero_copy), AV_OPT_TYPE_BOOL, { .i64 = 1 }, 0, 1, D },
+    { "start", "packet to start reading from", OFFSET(start), AV_OPT_TYPE_INT, { .i64 = SHMFRAME_START_LATEST }, 0, SHMFRAME_START_OLDEST, D, "start" },
+        { "latest", "the most recent packet",             0, AV_OPT_TYPE_CONST, { .i64 = SHMFRAME_START_LATEST }, 0, 0, D, "start" },
+        { "oldest", "the oldest packet still in the ring", 0, AV_OPT_TYPE_CONST, { .i64 = SHMFRAME_START_OLDEST }, 0, 0, D, "start" },
+    { NULL },
+};
+
+static const AVClass shmframe_demuxer_class = {
+    .class_name = "shmframe demuxer",
+    .item_name  = av_default_item_name,
+    .option     = options,
+    .version    = LIBAVUTIL_VERSION_INT,
+};
+
+const AVInputFormat ff_shmframe_demuxer = {
+    .name           = "shmframe",
+    .long_name      = NULL_IF_CONFIG_SMALL("Shared memory frame ring"),
+    .priv_data_size = sizeof(ShmFrameDemuxContext),
+    .flags_internal = FF_FMT_INIT_CLEANUP,
+    .read_header    = shmframe_read_header,
+    .read_packet    = shmframe_read_packet,
+    .read_close     = shmframe_read_close,
+    .flags          = AVFMT_NOFILE | AVFMT_NOBINSEARCH | AVFMT_NOGENSEARCH | AVFMT_NO_BYTE_SEEK,
+    .priv_class     = &shmframe_demuxer_class,
+};
@@ -0,0 +1,317 @@
+/*
+ * Shared memory frame ring muxer
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "libavutil/file_open.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/mem.h"
+#include "libavutil/opt.h"
+#include "libavutil/time.h"
+#include "libavcodec/defs.h"
+#include "avformat.h"
+#include "mux.h"
+#include "shmframe.h"
+#include "url.h"
+
+typedef struct ShmFrameMuxContext {
+    const AVClass *class;
+
+    int     nb_slots;
+    int     slot_size;
+    int64_t lease_timeout;
+    int     unlink;
+
+    ShmFrameHeader *hdr;
+    size_t          map_size;
+    unsigned        seq;
+    /* slots skipped because they were still leased after the timeout */
+    uint8_t        *stale;
+} ShmFrameMuxContext;
+
+static int shmframe_init(AVFormatContext *s)
+{
+    AVCodecParameters *par;
+
+    if (s->nb_streams != 1) {
+        av_log(s, AV_LOG_ERROR, "Exactly one stream is supported\n");
+        return AVERROR(EINVAL);
+    }
+    par = s->streams[0]->codecpar;
+
+    if (par->codec_id == AV_CODEC_ID_WRAPPED_AVFRAME) {
+        av_log(s, AV_LOG_ERROR, "Wrapped AVFrames cannot be shared between "
+               "processes, use a raw codec instead\n");
+        return AVERROR(EINVAL);
+    }
+    if (par->extradata_size) {
+        av_log(s, AV_LOG_ERROR, "Codecs with extradata are not supported\n");
+        return AVERROR_PATCHWELCOME;
+    }
+
+    return 0;
+}
+
+static int shmframe_write_header(AVFormatContext *s)
+{
+    ShmFrameMuxContext *c = s->priv_data;
+    AVStream          *st = s->streams[0];
+    AVCodecParameters *par = st->codecpar;
+    ShmFrameHeader  *hdr;
+    size_t data_offset;
+    int64_t slot_size = c->slot_size;
+    void *map;
+    int fd, ret;
+
+    if (!slot_size) {
+        if (par->codec_type == AVMEDIA_TYPE_VIDEO &&
+            par->codec_id   == AV_CODEC_ID_RAWVIDEO) {
+            slot_size = av_image_get_buffer_size(par->format, par->width,
+                                                 par->height, 1);
+            if (slot_size < 0)
+                return slot_size;
+        } else
+            slot_size = 1 << 20;
+    }
+    // packets are followed by zeroed padding, so that they can be used in place
+    slot_size = FFALIGN(slot_size + AV_INPUT_BUFFER_PADDING_SIZE, SHMFRAME_ALIGN);
+    if (slot_size > UINT32_MAX)
+        return AVERROR(EINVAL);
+
+    data_offset = FFALIGN(sizeof(*hdr) + c->nb_slots * sizeof(ShmFrameSlot),
+                          SHMFRAME_ALIGN);
+    c->map_size = data_offset + c->nb_slots * slot_size;
+
+    c->stale = av_calloc(c->nb_slots, sizeof(*c->stale));
+    if (!c->stale)
+        return AVERROR(ENOMEM);
+
+    // replace any previous ring, readers still using it keep their mapping
+    if (unlink(s->url) < 0 && errno != ENOENT) {
+        ret = AVERROR(errno);
+        av_log(s, AV_LOG_ERROR, "Cannot remove '%s': %s\n", s->url, av_err2str(ret));
+        return ret;
+    }
+
+    fd = avpriv_open(s->url, O_RDWR | O_CREAT | O_EXCL, 0666);
+    if (fd < 0) {
+        ret = AVERROR(errno);
+        av_log(s, AV_LOG_ERROR, "Cannot create '%s': %s\n", s->url, av_err2str(ret));
+        return ret;
+    }
+
+    if (ftruncate(fd, c->map_size) < 0) {
+        ret = AVERROR(errno);
+        close(fd);
+        return ret;
+    }
+
+    map = mmap(NULL, c->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return AVERROR(errno);
+    c->hdr = hdr = map;
+
+    hdr->version               = SHMFRAME_VERSION;
+    hdr->nb_slots              = c->nb_slots;
+    hdr->slot_size             = slot_size;
+    hdr->data_offset           = data_offset;
+    hdr->file_size             = c->map_size;
+    hdr->codec_type            = par->codec_type;
+    hdr->codec_id              = par->codec_id;
+    hdr->format                = par->format;
+    hdr->width                 = par->width;
+    hdr->height                = par->height;
+    hdr->sample_rate           = par->sample_rate;
+    hdr->nb_channels           = par->ch_layout.nb_channels;
+    hdr->block_align           = par->block_align;
+    hdr->bits_per_coded_sample = par->bits_per_coded_sample;
+    hdr->time_base_num         = st->time_base.num;
+    hdr->time_base_den         = st->time_base.den;
+    hdr->frame_rate_num        = st->avg_frame_rate.num;
+    hdr->frame_rate_den        = st->avg_frame_rate.den;
+    hdr->sar_num               = par->sample_aspect_ratio.num;
+    hdr->sar_den               = par->sample_aspect_ratio.den;
+    hdr->channel_mask          = par->ch_layout.order == AV_CHANNEL_ORDER_NATIVE ?
+                                 par->ch_layout.u.mask : 0;
+    atomic_init(&hdr->write_seq, 0);
+    atomic_init(&hdr->eof,       0);
+
+    atomic_store(&hdr->magic, SHMFRAME_MAGIC);
+
+    return 0;
+}
+
+/* Wait for the readers to release a slot and claim it by starting a new
+ * generation. Returns 0 if the slot is still leased after the timeout, or
+ * right away if it was already skipped for that and is still leased. */
+static int claim_slot(AVFormatContext *s, ShmFrameSlot *slot, uint8_t *stale)
+{
+    ShmFrameMuxContext *c = s->priv_data;
+    int64_t start = av_gettime_relative();
+    unsigned cur  = atomic_load(&slot->leases);
+
+    while (1) {
+        if (!(cur & SHMFRAME_LEASES_MASK)) {
+            if (atomic_compare_exchange_weak(&slot->leases, &cur,
+                                             (cur & SHMFRAME_GEN_MASK) + SHMFRAME_GEN_ONE)) {
+                *stale = 0;
+                return 1;
+            }
+            continue;
+        }
+
+        // only the writer starts new generations, so the leases that made
+        // it skip the slot are the ones still held
+        if (*stale)
+            return 0;
+
+        if (ff_check_interrupt(&s->interrupt_callback))
+            return AVERROR_EXIT;
+
+        if (c->lease_timeout >= 0 &&
+            av_gettime_relative() - start > c->lease_timeout) {
+            *stale = 1;
+            // most likely a reader that terminated without releasing it; the
+            // data must stay valid for it, so leave the slot to it
+            av_log(s, AV_LOG_WARNING, "Slot still leased after the timeout, "
+                   "skipping it until it is released\n");
+            return 0;
+        }
+
+        av_usleep(100);
+        cur = atomic_load(&slot->leases);
+    }
+}
+
+static int shmframe_write_packet(AVFormatContext *s, AVPacket *pkt)
+{
+    ShmFrameMuxContext *c = s->priv_data;
+    ShmFrameHeader   *hdr = c->hdr;
+    ShmFrameSlot    *slot;
+    uint8_t         *data;
+    unsigned nb_skipped = 0;
+    int ret;
+
+    if (pkt->size > hdr->slot_size - AV_INPUT_BUFFER_PADDING_SIZE) {
+        av_log(s, AV_LOG_ERROR, "Packet of %d bytes larger than the slots "
+               "of %"PRIu32" bytes, increase slot_size\n", pkt->size,
+               hdr->slot_size - AV_INPUT_BUFFER_PADDING_SIZE);
+        return AVERROR(EINVAL);
+    }
+
+    while (1) {
+        // 0 marks slots being written
+        if (!++c->seq)
+            c->seq = 1;
+        slot = ff_shmframe_slot(hdr, c->seq);
+
+        atomic_store(&slot->seq, 0);
+        ret = claim_slot(s, slot, &c->stale[c->seq % hdr->nb_slots]);
+        if (ret < 0)
+            return ret;
+        if (ret)
+            break;
+
+        if (++nb_skipped == hdr->nb_slots) {
+            av_log(s, AV_LOG_ERROR, "All the slots are still leased\n");
+            return AVERROR(EBUSY);
+        }
+    }
+
+    data = ff_shmframe_slot_data(hdr, c->seq);
+    memcpy(data, pkt->data, pkt->size);
+    memset(data + pkt->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    slot->size     = pkt->size;
+    slot->flags    = pkt->flags;
+    slot->pts      = pkt->pts;
+    slot->dts      = pkt->dts;
+    slot->duration = pkt->duration;
+
+    atomic_store(&slot->seq,      c->seq);
+    atomic_store(&hdr->write_seq, c->seq);
+
+    return 0;
+}
+
+static int shmframe_write_trailer(AVFormatContext *s)
+{
+    ShmFrameMuxContext *c = s->priv_data;
+
+    atomic_store(&c->hdr->eof, 1);
+
+    return 0;
+}
+
+static void shmframe_deinit(AVFormatContext *s)
+{
+    ShmFrameMuxContext *c = s->priv_data;
+
+    av_freep(&c->stale);
+
+    if (!c->hdr)
+        return;
+
+    // also lets the readers terminate when muxing failed
+    atomic_store(&c->hdr->eof, 1);
+    munmap(c->hdr, c->map_size);
+    c->hdr = NULL;
+
+    if (c->unlink)
+        unlink(s->url);
+}
+
+#define OFFSET(x) offsetof(ShmFrameMuxContext, x)
+#define E AV_OPT_FLAG_ENCODING_PARAM
+static const AVOption options[] = {
+    { "slots",         "number of packets in the ring", OFFSET(nb_slots),      AV_OPT_TYPE_INT,      { .i64 = 16 },      2, 4096,      E },
+    { "slot_size",     "maximum size of a packet, 0 to derive it from the video parameters",
+                                                        OFFSET(slot_size),     AV_OPT_TYPE_INT,      { .i64 = 0 },       0, INT_MAX,   E },
+    { "lease_timeout", "time after which a slot still used by a reader is skipped, -1 to wait forever",
+                                                        OFFSET(lease_timeout), AV_OPT_TYPE_DURATION, { .i64 = 1000000 }, -1, INT64_MAX, E },
+    { "unlink",        "remove the file when done",     OFFSET(unlink),        AV_OPT_TYPE_BOOL,     { .i64 = 1 },       0, 1,         E },
+    { NULL },
+};
+
+static const AVClass shmframe_muxer_class = {
+    .class_name = "shmframe muxer",
+    .item_name  = av_default_item_name,
+    .option     = options,
+    .version    = LIBAVUTIL_VERSION_INT,
+};
+
+const FFOutputFormat ff_shmframe_muxer = {
+    .p.name           = "shmframe",
+    .p.long_name      = NULL_IF_CONFIG_SMALL("Shared memory frame ring"),
+    .p.audio_codec    = AV_NE(AV_CODEC_ID_PCM_S16BE, AV_CODEC_ID_PCM_S16LE),
+    .p.video_codec    = AV_CODEC_ID_RAWVIDEO,
+    .p.subtitle_codec = AV_CODEC_ID_NONE,
+    .p.flags          = AVFMT_NOFILE,
+    .p.priv_class     = &shmframe_muxer_class,
+    .priv_data_size   = sizeof(ShmFrameMuxContext),
+    .init             = shmframe_init,
+    .write_header     = shmframe_write_header,
+    .write_packet     = shmframe_write_packet,
+    .write_trailer    = shmframe_write_trailer,
+    .deinit           = shmframe_deinit,
+};
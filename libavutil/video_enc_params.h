@@ -63,6 +63,15 @@ enum AVVideoEncParamsType {
      * resulting quantizer for the block.
      */
     AV_VIDEO_ENC_PARAMS_MPEG2,
+
+    /**
+     * Chinese AVS (AVS1-P2) luma quantization parameter, in the range 0-63.
+     *
+     * Summing the frame-level qp with the per-block delta_qp gives the
+     * luma QP of the macroblock. The chroma QP is derived from it through
+     * the table of the specification, the chroma deltas are unused.
+     */
+    AV_VIDEO_ENC_PARAMS_CAVS,
 };
 
 /**
@@ -0,0 +1,182 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with FFmpeg; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <string.h>
+#include "checkasm.h"
+#include "libavcodec/cavsdsp.h"
+#include "libavcodec/idctdsp.h"
+#include "libavutil/common.h"
+#include "libavutil/internal.h"
+#include "libavutil/intreadwrite.h"
+#include "libavutil/mem_internal.h"
+
+#define BUF_SIZE (16 * (16 + 3 + 4))
+#define LF_STRIDE 32
+
+#define randomize_buffers()                        \
+    do {                                           \
+        int k;                                     \
+        for (k = 0; k < BUF_SIZE; k += 4) {        \
+            uint32_t r = rnd();                    \
+            AV_WN32A(buf0 + k, r);                 \
+            AV_WN32A(buf1 + k, r);                 \
+            r = rnd();                             \
+            AV_WN32A(dst0 + k, r);                 \
+            AV_WN32A(dst1 + k, r);                 \
+        }                                          \
+    } while (0)
+
+#define src0 (buf0 + 3 * 16) /* qpel functions read data from negative src pointer offsets */
+#define src1 (buf1 + 3 * 16)
+
+static void check_qpel(void)
+{
+    LOCAL_ALIGNED_16(uint8_t, buf0, [BUF_SIZE]);
+    LOCAL_ALIGNED_16(uint8_t, buf1, [BUF_SIZE]);
+    LOCAL_ALIGNED_16(uint8_t, dst0, [BUF_SIZE]);
+    LOCAL_ALIGNED_16(uint8_t, dst1, [BUF_SIZE]);
+    CAVSDSPContext c;
+    int op, i, j;
+    declare_func_emms(AV_CPU_FLAG_MMX | AV_CPU_FLAG_MMXEXT, void, uint8_t *dst, const uint8_t *src, ptrdiff_t stride);
+
+    ff_cavsdsp_init(&c);
+    for (op = 0; op < 2; op++) {
+        qpel_mc_func (*tab)[16] = op ? c.avg_cavs_qpel_pixels_tab : c.put_cavs_qpel_pixels_tab;
+        const char *op_name = op ? "avg" : "put";
+
+        for (i = 0; i < 2; i++) {
+            int size = 16 >> i;
+            for (j = 0; j < 16; j++)
+                if (check_func(tab[i][j], "%s_cavs_qpel_%d_mc%d%d", op_name, size, j & 3, j >> 2)) {
+                    randomize_buffers();
+                    call_ref(dst0, src0, size);
+                    call_new(dst1, src1, size);
+                    if (memcmp(buf0, buf1, BUF_SIZE) || memcmp(dst0, dst1, BUF_SIZE))
+                        fail();
+                    bench_new(dst1, src1, size);
+                }
+        }
+    }
+}
+
+static void check_idct(void)
+{
+    LOCAL_ALIGNED_16(int16_t, coef, [64]);
+    LOCAL_ALIGNED_16(int16_t, block0, [64]);
+    LOCAL_ALIGNED_16(int16_t, block1, [64]);
+    LOCAL_ALIGNED_16(uint8_t, dst0, [8 * 8]);
+    LOCAL_ALIGNED_16(uint8_t, dst1, [8 * 8]);
+    uint8_t perm[64];
+    CAVSDSPContext c;
+    int i;
+    declare_func(void, uint8_t *dst, int16_t *block, ptrdiff_t stride);
+
+    ff_cavsdsp_init(&c);
+    if (check_func(c.cavs_idct8_add, "cavs_idct8_add")) {
+        /* the reference is C, which takes its coefficients in natural order */
+        ff_init_scantable_permutation(perm, c.idct_perm);
+        for (i = 0; i < 64; i++) {
+            coef[i] = rnd() % 3 ? 0 : (int)(rnd() % 128) - 64;
+            dst0[i] = dst1[i] = rnd();
+        }
+        for (i = 0; i < 64; i++) {
+            block0[i]       = coef[i];
+            block1[perm[i]] = coef[i];
+        }
+        call_ref(dst0, block0, 8);
+        call_new(dst1, block1, 8);
+        if (memcmp(dst0, dst1, 8 * 8))
+            fail();
+        for (i = 0; i < 64; i++)
+            block1[perm[i]] = coef[i];
+        bench_new(dst1, block1, 8);
+    }
+}
+
+/* Fill the area around an edge at 8 * LF_STRIDE + 8 with samples that
+ * differ by a random step across it and a small amount of noise, so
+ * that all filter decisions are taken for some of the positions. */
+static void randomize_edge(uint8_t *buf, int vertical)
+{
+    int base  = rnd() & 0xff;
+    int step  = (int)(rnd() % 41) - 20;
+    int noise = 1 + rnd() % 24;
+    int x, y;
+
+    for (y = 0; y < LF_STRIDE; y++)
+        for (x = 0; x < LF_STRIDE; x++) {
+            int q = vertical ? x >= 8 : y >= 8;
+            buf[y * LF_STRIDE + x] = av_clip_uint8(base + q * step +
+                                                   (int)(rnd() % noise) - noise / 2);
+        }
+}
+
+static void check_loop_filter(void)
+{
+    LOCAL_ALIGNED_16(uint8_t, buf, [LF_STRIDE * LF_STRIDE]);
+    LOCAL_ALIGNED_16(uint8_t, buf0, [LF_STRIDE * LF_STRIDE]);
+    LOCAL_ALIGNED_16(uint8_t, buf1, [LF_STRIDE * LF_STRIDE]);
+    CAVSDSPContext c;
+    int bs, j;
+    declare_func(void, uint8_t *pix, ptrdiff_t stride, int alpha, int beta,
+                 int tc, int bs1, int bs2);
+
+    ff_cavsdsp_init(&c);
+
+#define CHECK_LOOP_FILTER(name, vertical)                                    \
+    do {                                                                     \
+        if (check_func(c.name, #name)) {                                     \
+            for (bs = 0; bs < 9; bs++) {                                     \
+                for (j = 0; j < 16; j++) {                                   \
+                    int alpha = rnd() % 65, beta = rnd() % 28, tc = rnd() % 10; \
+                    randomize_edge(buf, vertical);                           \
+                    memcpy(buf0, buf, LF_STRIDE * LF_STRIDE);                \
+                    memcpy(buf1, buf, LF_STRIDE * LF_STRIDE);                \
+                    call_ref(buf0 + 8 * LF_STRIDE + 8, LF_STRIDE,            \
+                             alpha, beta, tc, bs / 3, bs % 3);               \
+                    call_new(buf1 + 8 * LF_STRIDE + 8, LF_STRIDE,            \
+                             alpha, beta, tc, bs / 3, bs % 3);               \
+                    if (memcmp(buf0, buf1, LF_STRIDE * LF_STRIDE)) {         \
+                        fprintf(stderr, #name ": alpha:%d beta:%d tc:%d "    \
+                                "bs:%d,%d\n", alpha, beta, tc, bs / 3, bs % 3); \
+                        fail();                                              \
+                    }                                                        \
+                }                                                            \
+            }                                                                \
+            bench_new(buf1 + 8 * LF_STRIDE + 8, LF_STRIDE, 64, 27, 9, 1, 1); \
+        }                                                                    \
+    } while (0)
+
+    CHECK_LOOP_FILTER(cavs_filter_lv, 1);
+    CHECK_LOOP_FILTER(cavs_filter_lh, 0);
+    CHECK_LOOP_FILTER(cavs_filter_cv, 1);
+    CHECK_LOOP_FILTER(cavs_filter_ch, 0);
+#undef CHECK_LOOP_FILTER
+}
+
+void checkasm_check_cavsdsp(void)
+{
+    check_qpel();
+    report("qpel");
+
+    check_idct();
+    report("idct8");
+
+    check_loop_filter();
+    report("loop_filter");
+}
@@ -49,6 +49,7 @@ void checkasm_check_av_tx(void);
 void checkasm_check_blend(void);
 void checkasm_check_blockdsp(void);
 void checkasm_check_bswapdsp(void);
+void checkasm_check_cavsdsp(void);
 void checkasm_check_colorspace(void);
 void checkasm_check_exrdsp(void);
 void checkasm_check_fixed_dsp(void);
@@ -590,6 +590,41 @@ concat(){
     fi
 }
 
+# transcode srcfile both serially and in parallel segments, and print the
+# number of packets and frames of the streams of each output
+parallel_segments(){
+    srcfile=$1
+    enc_fmt=$2
+    enc_opt=$3
+    nb_segments=$4
+    tsrcfile=$(target_path $srcfile)
+    for mode in serial parallel; do
+        encfile="${outdir}/${test}.${mode}.${enc_fmt}"
+        test $keep -ge 1 || cleanfiles="$cleanfiles $encfile"
+        seg_opt=
+        test $mode = parallel && seg_opt="-parallel_segments $nb_segments"
+        echo $mode
+        ffmpeg $seg_opt -i $tsrcfile $enc_opt -bitexact \
+               -f $enc_fmt -y $(target_path $encfile) || return
+        run ffprobe${PROGSUF}${EXECSUF} -bitexact -count_packets -count_frames \
+            -show_entries stream=index,codec_type,nb_read_packets,nb_read_frames \
+            -of compact $(target_path $encfile) || return
+    done
+}
+
+# write to a shmframe ring that is kept once done, then read back the
+# packets still in it
+shmframe(){
+    src_opt=$1
+    enc_opt=$2
+    dec_opt=$3
+    encfile="${outdir}/${test}.shm"
+    test $keep -ge 1 || cleanfiles="$cleanfiles $encfile"
+    tencfile=$(target_path $encfile)
+    ffmpeg $src_opt $enc_opt -unlink 0 -f shmframe -y $tencfile || return
+    framecrc -f shmframe -start oldest $dec_opt -i $tencfile -c copy
+}
+
 venc_data(){
     file=$1
     stream=$2
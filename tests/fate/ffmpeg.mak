@@ -240,3 +240,39 @@ FATE_SAMPLES_FFMPEG-$(call FRAMECRC, MPEGVIDEO, MPEG2VIDEO) += fate-ffmpeg-input
 fate-ffmpeg-error-rate-fail: CMD = ffmpeg -i $(TARGET_SAMPLES)/mkv/h264_tta_undecodable.mkv -c:v copy -f null -; test $$? -eq 69
 fate-ffmpeg-error-rate-pass: CMD = ffmpeg -i $(TARGET_SAMPLES)/mkv/h264_tta_undecodable.mkv -c:v copy -f null - -max_error_rate 1
 FATE_SAMPLES_FFMPEG-$(call ENCDEC, PCM_S16LE TTA, NULL MATROSKA) += fate-ffmpeg-error-rate-fail fate-ffmpeg-error-rate-pass
+
+# the keyframes are 16 frames apart, i.e. 20 AC-3 frames, so that the
+# segments split the audio at frame boundaries like the serial encode does
+tests/data/parallel_segments.nut: TAG = GEN
+tests/data/parallel_segments.nut: ffmpeg$(PROGSSUF)$(EXESUF) | tests/data
+	$(M)$(TARGET_EXEC) $(TARGET_PATH)/$< -nostdin \
+        -f lavfi -i "testsrc=s=160x120:r=25:d=4" \
+        -f lavfi -i "sine=1000:r=48000:d=4" \
+        -fflags +bitexact -flags +bitexact -c:v mpeg4 -g 16 -threads 1 -c:a pcm_s16le \
+        -y $(TARGET_PATH)/tests/data/parallel_segments.nut 2>/dev/null
+
+FATE_FFMPEG_PARALLEL_SEGMENTS = fate-ffmpeg-parallel-segments \
+                                fate-ffmpeg-parallel-segments-bframes
+FATE_FFMPEG_FFPROBE-$(call ALLYES, LAVFI_INDEV TESTSRC_FILTER SINE_FILTER       \
+                                   MPEG4_ENCODER MPEG4_DECODER PCM_S16LE_ENCODER \
+                                   PCM_S16LE_DECODER AC3_FIXED_ENCODER           \
+                                   AC3_DECODER ARESAMPLE_FILTER NUT_MUXER        \
+                                   NUT_DEMUXER FILE_PROTOCOL)                    \
+                                   += $(FATE_FFMPEG_PARALLEL_SEGMENTS)
+$(FATE_FFMPEG_PARALLEL_SEGMENTS): tests/data/parallel_segments.nut
+fate-ffmpeg-parallel-segments: CMD = parallel_segments tests/data/parallel_segments.nut nut "-auto_conversion_filters -c:v mpeg4 -threads 1 -c:a ac3_fixed" 4
+fate-ffmpeg-parallel-segments-bframes: CMD = parallel_segments tests/data/parallel_segments.nut nut "-auto_conversion_filters -c:v mpeg4 -bf 2 -threads 1 -c:a ac3_fixed" 4
+
+# the video overflows the ring, so only its last 4 frames are read back
+FATE_SHMFRAME-$(call ALLYES, LAVFI_INDEV TESTSRC2_FILTER RAWVIDEO_ENCODER \
+                             RAWVIDEO_DECODER) += fate-shmframe-video
+fate-shmframe-video: CMD = shmframe "-f lavfi -i testsrc2=s=160x120:r=25:d=0.4" "-c:v rawvideo -slots 4"
+
+FATE_SHMFRAME-$(call ALLYES, LAVFI_INDEV SINE_FILTER PCM_S16LE_ENCODER \
+                             PCM_S16LE_DECODER) += fate-shmframe-audio
+fate-shmframe-audio: CMD = shmframe "-f lavfi -i sine=1000:r=48000:d=0.2" "-c:a pcm_s16le -slots 16" "-zero_copy 0"
+
+FATE_FFMPEG-$(call ALLYES, SHMFRAME_MUXER SHMFRAME_DEMUXER FRAMECRC_MUXER) += $(FATE_SHMFRAME-yes)
+fate-shmframe: $(FATE_SHMFRAME-yes)
+
+FATE_FFMPEG_FFPROBE += $(FATE_FFMPEG_FFPROBE-yes)
@@ -124,6 +124,16 @@ FATE_FILTER-$(call FILTERFRAMECRC, FRAMERATE TESTSRC2 FORMAT SCALE) += fate-filt
 fate-filter-framerate-12bit-up: CMD = framecrc -lavfi testsrc2=r=50:d=1,format=pix_fmts=yuv422p12le,scale,framerate=fps=60,scale -t 1 -pix_fmt yuv422p12le
 fate-filter-framerate-12bit-down: CMD = framecrc -lavfi testsrc2=r=60:d=1,format=pix_fmts=yuv422p12le,scale,framerate=fps=50,scale -t 1 -pix_fmt yuv422p12le
 
+# both must produce the same output; 64x48 is scaled from whole frames
+MULTISCALE_FLAGS = flags=bicubic+accurate_rnd+bitexact
+MULTISCALE_MAPS  = -map "[a]" -map "[b]" -map "[c]"
+FATE_FILTER-$(call FILTERFRAMECRC, MULTISCALE TESTSRC2 FORMAT) += fate-filter-multiscale
+fate-filter-multiscale: CMD = framecrc -lavfi "testsrc2=s=640x480:r=5:d=1,format=yuv420p,multiscale=sizes=320x240|176x144|64x48:$(MULTISCALE_FLAGS)[a][b][c]" $(MULTISCALE_MAPS)
+
+FATE_FILTER-$(call FILTERFRAMECRC, SPLIT SCALE TESTSRC2 FORMAT) += fate-filter-multiscale-split
+fate-filter-multiscale-split: CMD = framecrc -lavfi "testsrc2=s=640x480:r=5:d=1,format=yuv420p,split=3[x][y][z];[x]scale=320x240:$(MULTISCALE_FLAGS)[a];[y]scale=176x144:$(MULTISCALE_FLAGS)[b];[z]scale=64x48:$(MULTISCALE_FLAGS)[c]" $(MULTISCALE_MAPS)
+fate-filter-multiscale-split: REF = $(SRC_PATH)/tests/ref/fate/filter-multiscale
+
 FATE_FILTER-$(call FILTERFRAMECRC, MINTERPOLATE TESTSRC2) += fate-filter-minterpolate-up fate-filter-minterpolate-down
 fate-filter-minterpolate-up: CMD = framecrc -lavfi testsrc2=r=2:d=10,minterpolate=fps=10 -t 1
 fate-filter-minterpolate-down: CMD = framecrc -lavfi testsrc2=r=2:d=10,minterpolate=fps=1 -t 1